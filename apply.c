@@ -0,0 +1,812 @@
+/**
+ * @file apply.c
+ * @Brief  Apply a configuration of modes to the outputs of a card
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-24
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apply.h"
+#include "metrics.h"
+#include "trace.h"
+
+/* Time to wait for the completion of the previous commit */
+#define APPLY_WAIT_MS 1000
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Lookup table of the property names, indexed by apply_prop
+ */
+/* ---------------------------------------------------------------------------*/
+static const char *const apply_prop_names[APPLY_PROP_COUNT] = {
+    [APPLY_PROP_CONNECTOR_CRTC_ID] = "CRTC_ID",
+    [APPLY_PROP_CRTC_ACTIVE] = "ACTIVE",
+    [APPLY_PROP_CRTC_MODE_ID] = "MODE_ID",
+    [APPLY_PROP_PLANE_FB_ID] = "FB_ID",
+    [APPLY_PROP_PLANE_CRTC_ID] = "CRTC_ID",
+    [APPLY_PROP_PLANE_SRC_X] = "SRC_X",
+    [APPLY_PROP_PLANE_SRC_Y] = "SRC_Y",
+    [APPLY_PROP_PLANE_SRC_W] = "SRC_W",
+    [APPLY_PROP_PLANE_SRC_H] = "SRC_H",
+    [APPLY_PROP_PLANE_CRTC_X] = "CRTC_X",
+    [APPLY_PROP_PLANE_CRTC_Y] = "CRTC_Y",
+    [APPLY_PROP_PLANE_CRTC_W] = "CRTC_W",
+    [APPLY_PROP_PLANE_CRTC_H] = "CRTC_H",
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Per output plan of an apply
+ */
+/* ---------------------------------------------------------------------------*/
+struct output_plan {
+	struct drm_connector_obj *obj;
+	drmModeModeInfo mode;
+	int enable;
+	/* Index in res->crtcs, -1 if the output has no CRTC */
+	int crtc;
+	/* 1 if the CRTC is switched off, 0 if another output takes it */
+	int release_crtc;
+	/* Newly created buffer, fb_id 0 if the current one is reused */
+	struct scanout fb;
+	uint32_t blob_id;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the properties of an object and store the ids we use
+ *
+ * @Param state The apply state
+ * @Param obj_id The object
+ * @Param obj_type DRM_MODE_OBJECT_*
+ * @Param first First apply_prop of this object type
+ * @Param last Last apply_prop of this object type
+ * @Param plane_type Receives the value of the plane "type" property, may be
+ * NULL
+ */
+/* ---------------------------------------------------------------------------*/
+static void lookup_props(struct apply_state *state, uint32_t obj_id,
+			 uint32_t obj_type, int first, int last,
+			 uint64_t *plane_type)
+{
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	uint32_t i;
+	int j;
+
+	props = drmModeObjectGetProperties(state->dev->fd, obj_id, obj_type);
+	if (!props) return;
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(state->dev->fd, props->props[i]);
+		if (!prop) continue;
+		for (j = first; j <= last; j++) {
+			if (!strcmp(prop->name, apply_prop_names[j]))
+				state->props[j] = prop->prop_id;
+		}
+		if (plane_type && !strcmp(prop->name, "type"))
+			*plane_type = props->prop_values[i];
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Find the primary plane of every CRTC and the property ids
+ *
+ * @Param state The apply state
+ * @Param res The resources of the device
+ *
+ * @Returns   0 if the atomic path is usable, -1 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int init_atomic(struct apply_state *state, drmModeRes *res)
+{
+	drmModePlaneRes *planes;
+	drmModePlane *plane;
+	uint64_t type;
+	uint32_t i;
+	int j;
+
+	if (res->count_crtcs == 0 || res->count_connectors == 0) return -1;
+	lookup_props(state, res->connectors[0], DRM_MODE_OBJECT_CONNECTOR,
+		     APPLY_PROP_CONNECTOR_CRTC_ID,
+		     APPLY_PROP_CONNECTOR_CRTC_ID, NULL);
+	lookup_props(state, res->crtcs[0], DRM_MODE_OBJECT_CRTC,
+		     APPLY_PROP_CRTC_ACTIVE, APPLY_PROP_CRTC_MODE_ID, NULL);
+
+	planes = drmModeGetPlaneResources(state->dev->fd);
+	if (!planes) return -1;
+	for (i = 0; i < planes->count_planes; i++) {
+		plane = drmModeGetPlane(state->dev->fd, planes->planes[i]);
+		if (!plane) continue;
+		type = DRM_PLANE_TYPE_OVERLAY;
+		lookup_props(state, plane->plane_id, DRM_MODE_OBJECT_PLANE,
+			     APPLY_PROP_PLANE_FB_ID, APPLY_PROP_PLANE_CRTC_H,
+			     &type);
+		for (j = 0; type == DRM_PLANE_TYPE_PRIMARY &&
+			    j < res->count_crtcs && j < APPLY_MAX_CRTCS;
+		     j++) {
+			if (plane->possible_crtcs & (1u << j) &&
+			    !state->primary[j])
+				state->primary[j] = plane->plane_id;
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(planes);
+
+	for (j = 0; j < APPLY_PROP_COUNT; j++) {
+		if (!state->props[j]) {
+			log_warning("%s: no %s property",
+				    state->dev->device_name,
+				    apply_prop_names[j]);
+			return -1;
+		}
+	}
+	for (j = 0; j < res->count_crtcs && j < APPLY_MAX_CRTCS; j++) {
+		if (!state->primary[j]) {
+			log_warning("%s: no primary plane for crtc %u",
+				    state->dev->device_name,
+				    res->crtcs[j]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create the apply state of a device
+ * The planes and property ids are looked up once. Without atomic support,
+ * or when a property is missing, the legacy path is used.
+ *
+ * @Param dev The opened DRM device
+ *
+ * @Returns   A newly allocated state or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct apply_state *apply_create(struct drm_device *dev)
+{
+	struct apply_state *state;
+	drmModeRes *res;
+
+	res = drm_device_get_resources(dev);
+	if (!res) return NULL;
+	state = calloc(1, sizeof(*state));
+	if (!state) {
+		log_error("Failed to allocate apply state");
+		return NULL;
+	}
+	state->dev = dev;
+	state->atomic = dev->atomic && dev->universal_planes &&
+			init_atomic(state, res) == 0;
+	log_info("%s: applying modes through the %s API",
+		 dev->device_name,
+		 state->atomic ? "atomic" : "legacy");
+	return state;
+}
+
+static void scanout_destroy(int fd, struct scanout *fb)
+{
+	struct drm_mode_destroy_dumb destroy;
+
+	if (!fb->fb_id) return;
+	drmModeRmFB(fd, fb->fb_id);
+	memset(&destroy, 0, sizeof(destroy));
+	destroy.handle = fb->handle;
+	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	memset(fb, 0, sizeof(*fb));
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a black buffer to scan out
+ * The kernel clears dumb buffers, so it never has to be mapped.
+ *
+ * @Param fd The device fd
+ * @Param fb The buffer
+ * @Param width Width in pixels
+ * @Param height Height in pixels
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int scanout_create(int fd, struct scanout *fb, uint32_t width,
+			  uint32_t height)
+{
+	struct drm_mode_create_dumb create;
+	struct drm_mode_destroy_dumb destroy;
+
+	memset(&create, 0, sizeof(create));
+	memset(&destroy, 0, sizeof(destroy));
+	create.width = width;
+	create.height = height;
+	create.bpp = 32;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+		log_error("Failed to create a %ux%u dumb buffer", width, height);
+		return -1;
+	}
+	fb->handle = create.handle;
+	fb->width = width;
+	fb->height = height;
+	if (drmModeAddFB(fd, width, height, 24, 32, create.pitch, create.handle,
+			 &fb->fb_id) < 0) {
+		log_error("Failed to add a %ux%u framebuffer", width, height);
+		destroy.handle = create.handle;
+		drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+		memset(fb, 0, sizeof(*fb));
+		return -1;
+	}
+	return 0;
+}
+
+static void release_retired(struct apply_state *state)
+{
+	int i;
+	for (i = 0; i < state->nr_retired; i++)
+		scanout_destroy(state->dev->fd, &state->retired[i]);
+	state->nr_retired = 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Free the apply state and its buffers
+ * The outputs keep scanning out until the buffers are removed, this does
+ * not switch them off.
+ *
+ * @Param state The apply state
+ */
+/* ---------------------------------------------------------------------------*/
+void apply_destroy(struct apply_state *state)
+{
+	int i;
+
+	if (!state) return;
+	release_retired(state);
+	for (i = 0; i < APPLY_MAX_CRTCS; i++)
+		scanout_destroy(state->dev->fd, &state->fbs[i]);
+	free(state);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add an output to a configuration
+ *
+ * @Param cfg The configuration
+ * @Param connector_id The connector
+ * @Param mode The mode, MODE_HANDLE_NONE to switch the output off
+ *
+ * @Returns   0 if successfull, -1 if the configuration is full
+ */
+/* ---------------------------------------------------------------------------*/
+int apply_config_add(struct apply_config *cfg, uint32_t connector_id,
+		     mode_handle mode)
+{
+	if (cfg->nr_outputs == MAX_APPLY_OUTPUTS) return -1;
+	cfg->outputs[cfg->nr_outputs].connector_id = connector_id;
+	cfg->outputs[cfg->nr_outputs].mode = mode;
+	cfg->nr_outputs++;
+	return 0;
+}
+
+static void commit_done(int fd, unsigned int sequence, unsigned int tv_sec,
+			unsigned int tv_usec, void *data)
+{
+	struct apply_state *state = data;
+
+	if (state->pending_events > 0 && --state->pending_events == 0) {
+		release_retired(state);
+		trace(TRACE_APPLY_DONE, state->dev->minor, 0, 0, 0, 0);
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the completion events of the device fd
+ * Call when the device fd is readable. Buffers replaced by a commit are
+ * freed once all its CRTCs completed.
+ *
+ * @Param state The apply state
+ */
+/* ---------------------------------------------------------------------------*/
+void apply_handle_events(struct apply_state *state)
+{
+	drmEventContext ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.version = 2;
+	ctx.page_flip_handler = commit_done;
+	drmHandleEvent(state->dev->fd, &ctx);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Wait until the previous non-blocking commit completed
+ * A new commit on the same CRTCs would fail with EBUSY before that.
+ *
+ * @Param state The apply state
+ */
+/* ---------------------------------------------------------------------------*/
+static void wait_pending(struct apply_state *state)
+{
+	struct pollfd pfd = {.fd = state->dev->fd, .events = POLLIN};
+
+	while (state->pending_events > 0) {
+		if (poll(&pfd, 1, APPLY_WAIT_MS) <= 0) {
+			log_warning("%s: previous commit did not complete",
+				    state->dev->device_name);
+			state->pending_events = 0;
+			release_retired(state);
+			return;
+		}
+		apply_handle_events(state);
+	}
+}
+
+static int crtc_index(drmModeRes *res, uint32_t crtc_id)
+{
+	int i;
+	if (!crtc_id) return -1;
+	for (i = 0; i < res->count_crtcs && i < APPLY_MAX_CRTCS; i++) {
+		if (res->crtcs[i] == crtc_id) return i;
+	}
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Pick a free CRTC one of the encoders of a connector can drive
+ *
+ * @Param state The apply state
+ * @Param res The resources of the device
+ * @Param connector_id The connector
+ * @Param used Mask of the CRTC indexes that are taken
+ *
+ * @Returns   The CRTC index or -1 if none is free
+ */
+/* ---------------------------------------------------------------------------*/
+static int pick_crtc(struct apply_state *state, drmModeRes *res,
+		     uint32_t connector_id, uint32_t used)
+{
+	drmModeConnector *conn;
+	drmModeEncoder *enc;
+	uint32_t possible = 0;
+	int i;
+
+	conn = drmModeGetConnectorCurrent(state->dev->fd, connector_id);
+	metrics_inc(METRIC_IOCTL_GET_CONNECTOR_CURRENT);
+	if (!conn) return -1;
+	for (i = 0; i < conn->count_encoders; i++) {
+		enc = drmModeGetEncoder(state->dev->fd, conn->encoders[i]);
+		metrics_inc(METRIC_IOCTL_GET_ENCODER);
+		if (!enc) continue;
+		possible |= enc->possible_crtcs;
+		drmModeFreeEncoder(enc);
+	}
+	drmModeFreeConnector(conn);
+	for (i = 0; i < res->count_crtcs && i < APPLY_MAX_CRTCS; i++) {
+		if (possible & ~used & (1u << i)) return i;
+	}
+	return -1;
+}
+
+static int in_config(const struct apply_config *cfg, uint32_t connector_id)
+{
+	int i;
+	for (i = 0; i < cfg->nr_outputs; i++) {
+		if (cfg->outputs[i].connector_id == connector_id) return 1;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Resolve the connectors and assign a CRTC to every enabled output
+ *
+ * @Param state The apply state
+ * @Param res The resources of the device
+ * @Param reg The connector registry
+ * @Param cfg The configuration
+ * @Param plan Receives one entry per output of the configuration
+ *
+ * @Returns   0 if successfull, -1 if the configuration cannot be applied
+ */
+/* ---------------------------------------------------------------------------*/
+static int plan_outputs(struct apply_state *state, drmModeRes *res,
+			struct conn_registry *reg,
+			const struct apply_config *cfg,
+			struct output_plan *plan)
+{
+	struct drm_connector_obj *obj;
+	uint32_t used = 0;
+	int i, idx;
+
+	/* CRTCs of outputs that are not part of the configuration stay */
+	for (i = 0; i < REGISTRY_SIZE(reg); i++) {
+		obj = REGISTRY_AT(reg, i);
+		idx = crtc_index(res, obj->crtc_id);
+		if (idx >= 0 && obj->status == DRM_MODE_CONNECTED &&
+		    !in_config(cfg, obj->connector_id))
+			used |= 1u << idx;
+	}
+
+	/* Outputs keep their CRTC when it is still free */
+	for (i = 0; i < cfg->nr_outputs; i++) {
+		memset(&plan[i], 0, sizeof(plan[i]));
+		obj = registry_lookup(reg, cfg->outputs[i].connector_id);
+		if (!obj) {
+			log_warning("Unknown connector %u",
+				    cfg->outputs[i].connector_id);
+			return -1;
+		}
+		plan[i].obj = obj;
+		plan[i].enable = cfg->outputs[i].mode != MODE_HANDLE_NONE;
+		plan[i].crtc = crtc_index(res, obj->crtc_id);
+		if (!plan[i].enable) continue;
+		if (obj->status != DRM_MODE_CONNECTED) {
+			log_warning("%s is not connected", obj->name);
+			return -1;
+		}
+		plan[i].mode = *mode_pool_get(cfg->outputs[i].mode);
+		if (plan[i].crtc >= 0 && !(used & (1u << plan[i].crtc)))
+			used |= 1u << plan[i].crtc;
+		else
+			plan[i].crtc = -1;
+	}
+
+	/* The others take a free CRTC their encoders can drive */
+	for (i = 0; i < cfg->nr_outputs; i++) {
+		if (!plan[i].enable || plan[i].crtc >= 0) continue;
+		plan[i].crtc = pick_crtc(state, res, plan[i].obj->connector_id,
+					 used);
+		if (plan[i].crtc < 0) {
+			log_warning("No free crtc for %s", plan[i].obj->name);
+			return -1;
+		}
+		used |= 1u << plan[i].crtc;
+	}
+
+	/* A disabled output only switches its CRTC off if nobody takes it */
+	for (i = 0; i < cfg->nr_outputs; i++) {
+		if (!plan[i].enable && plan[i].crtc >= 0)
+			plan[i].release_crtc = !(used & (1u << plan[i].crtc));
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create the buffers of the enabled outputs that need a larger one
+ *
+ * @Param state The apply state
+ * @Param plan The output plans
+ * @Param nr_outputs Number of outputs
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int create_buffers(struct apply_state *state, struct output_plan *plan,
+			  int nr_outputs)
+{
+	struct scanout *cur;
+	int i;
+
+	for (i = 0; i < nr_outputs; i++) {
+		if (!plan[i].enable) continue;
+		cur = &state->fbs[plan[i].crtc];
+		if (cur->fb_id && cur->width >= plan[i].mode.hdisplay &&
+		    cur->height >= plan[i].mode.vdisplay)
+			continue;
+		if (scanout_create(state->dev->fd, &plan[i].fb,
+				   plan[i].mode.hdisplay,
+				   plan[i].mode.vdisplay) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static uint32_t plan_fb_id(struct apply_state *state, struct output_plan *p)
+{
+	return p->fb.fb_id ? p->fb.fb_id : state->fbs[p->crtc].fb_id;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add the properties of every output to an atomic request
+ *
+ * @Param state The apply state
+ * @Param res The resources of the device
+ * @Param req The request
+ * @Param plan The output plans
+ * @Param nr_outputs Number of outputs
+ *
+ * @Returns   Number of CRTCs in the request, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int build_atomic(struct apply_state *state, drmModeRes *res,
+			drmModeAtomicReq *req, struct output_plan *plan,
+			int nr_outputs)
+{
+	uint32_t *props = state->props, crtc_id, plane_id, w, h;
+	int i, nr_crtcs = 0;
+
+	for (i = 0; i < nr_outputs; i++) {
+		crtc_id = plan[i].crtc >= 0 ? res->crtcs[plan[i].crtc] : 0;
+		plane_id = plan[i].crtc >= 0 ? state->primary[plan[i].crtc] : 0;
+		if (!plan[i].enable) {
+			drmModeAtomicAddProperty(req,
+						 plan[i].obj->connector_id,
+						 props[APPLY_PROP_CONNECTOR_CRTC_ID],
+						 0);
+			if (!plan[i].release_crtc) continue;
+			drmModeAtomicAddProperty(req, crtc_id,
+						 props[APPLY_PROP_CRTC_ACTIVE], 0);
+			drmModeAtomicAddProperty(req, crtc_id,
+						 props[APPLY_PROP_CRTC_MODE_ID], 0);
+			drmModeAtomicAddProperty(req, plane_id,
+						 props[APPLY_PROP_PLANE_FB_ID], 0);
+			drmModeAtomicAddProperty(req, plane_id,
+						 props[APPLY_PROP_PLANE_CRTC_ID], 0);
+			nr_crtcs++;
+			continue;
+		}
+
+		if (drmModeCreatePropertyBlob(state->dev->fd, &plan[i].mode,
+					      sizeof(plan[i].mode),
+					      &plan[i].blob_id) < 0) {
+			log_error("Failed to create mode blob");
+			return -1;
+		}
+		w = plan[i].mode.hdisplay;
+		h = plan[i].mode.vdisplay;
+		drmModeAtomicAddProperty(req, plan[i].obj->connector_id,
+					 props[APPLY_PROP_CONNECTOR_CRTC_ID],
+					 crtc_id);
+		drmModeAtomicAddProperty(req, crtc_id,
+					 props[APPLY_PROP_CRTC_MODE_ID],
+					 plan[i].blob_id);
+		drmModeAtomicAddProperty(req, crtc_id,
+					 props[APPLY_PROP_CRTC_ACTIVE], 1);
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_FB_ID],
+					 plan_fb_id(state, &plan[i]));
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_CRTC_ID],
+					 crtc_id);
+		/* Source coordinates are 16.16 fixed point */
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_SRC_X], 0);
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_SRC_Y], 0);
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_SRC_W],
+					 (uint64_t)w << 16);
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_SRC_H],
+					 (uint64_t)h << 16);
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_CRTC_X], 0);
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_CRTC_Y], 0);
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_CRTC_W], w);
+		drmModeAtomicAddProperty(req, plane_id,
+					 props[APPLY_PROP_PLANE_CRTC_H], h);
+		nr_crtcs++;
+	}
+	return nr_crtcs;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Validate and apply the plans in one non-blocking atomic commit
+ *
+ * @Param state The apply state
+ * @Param res The resources of the device
+ * @Param plan The output plans
+ * @Param nr_outputs Number of outputs
+ *
+ * @Returns   0 if successfull, -errno if rejected or failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int commit_atomic(struct apply_state *state, drmModeRes *res,
+			 struct output_plan *plan, int nr_outputs)
+{
+	drmModeAtomicReq *req;
+	uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	int i, nr_crtcs, ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req) return -ENOMEM;
+	nr_crtcs = build_atomic(state, res, req, plan, nr_outputs);
+	if (nr_crtcs < 0) {
+		ret = -ENOMEM;
+		goto end;
+	}
+	ret = drmModeAtomicCommit(state->dev->fd, req,
+				  flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	if (ret < 0) {
+		ret = -errno;
+		state->test_failures++;
+		metrics_inc(METRIC_APPLY_TEST_FAILURES);
+		log_warning("%s: configuration rejected by the driver: %s",
+			    state->dev->device_name,
+			    strerror(-ret));
+		goto end;
+	}
+	/* Only request events when a CRTC is part of the commit */
+	if (nr_crtcs)
+		flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	ret = drmModeAtomicCommit(state->dev->fd, req, flags, state);
+	if (ret < 0) {
+		ret = -errno;
+		log_error("%s: atomic commit failed: %s",
+			  state->dev->device_name,
+			  strerror(-ret));
+		goto end;
+	}
+	state->pending_events = nr_crtcs;
+end:
+	/* The commit holds its own reference to the mode blobs */
+	for (i = 0; i < nr_outputs; i++) {
+		if (plan[i].blob_id)
+			drmModeDestroyPropertyBlob(state->dev->fd,
+						   plan[i].blob_id);
+	}
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Apply the plans with one drmModeSetCrtc call per output
+ * Each call blocks until the output runs the new mode.
+ *
+ * @Param state The apply state
+ * @Param res The resources of the device
+ * @Param plan The output plans
+ * @Param nr_outputs Number of outputs
+ *
+ * @Returns   0 if successfull, -errno if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int commit_legacy(struct apply_state *state, drmModeRes *res,
+			 struct output_plan *plan, int nr_outputs)
+{
+	int fd = state->dev->fd, i;
+	uint32_t conn_id;
+
+	/* Switch off first, a CRTC can move to another output */
+	for (i = 0; i < nr_outputs; i++) {
+		if (!plan[i].release_crtc) continue;
+		if (drmModeSetCrtc(fd, res->crtcs[plan[i].crtc], 0, 0, 0, NULL,
+				   0, NULL) < 0) {
+			log_error("Failed to switch off %s", plan[i].obj->name);
+			return -errno;
+		}
+	}
+	for (i = 0; i < nr_outputs; i++) {
+		if (!plan[i].enable) continue;
+		conn_id = plan[i].obj->connector_id;
+		if (drmModeSetCrtc(fd, res->crtcs[plan[i].crtc],
+				   plan_fb_id(state, &plan[i]), 0, 0, &conn_id,
+				   1, &plan[i].mode) < 0) {
+			log_error("Failed to set %s on %s",
+				  plan[i].mode.name,
+				  plan[i].obj->name);
+			return -errno;
+		}
+	}
+	return 0;
+}
+
+static void retire(struct apply_state *state, struct scanout *fb)
+{
+	if (!fb->fb_id) return;
+	state->retired[state->nr_retired++] = *fb;
+	memset(fb, 0, sizeof(*fb));
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Record an applied configuration in the registry and swap the
+ * buffers
+ *
+ * @Param state The apply state
+ * @Param res The resources of the device
+ * @Param cfg The configuration
+ * @Param plan The output plans
+ */
+/* ---------------------------------------------------------------------------*/
+static void commit_applied(struct apply_state *state, drmModeRes *res,
+			   const struct apply_config *cfg,
+			   struct output_plan *plan)
+{
+	struct drm_connector_obj *obj;
+	uint32_t crtc_id;
+	int i;
+
+	for (i = 0; i < cfg->nr_outputs; i++) {
+		obj = plan[i].obj;
+		if (plan[i].release_crtc) retire(state, &state->fbs[plan[i].crtc]);
+		if (plan[i].fb.fb_id) {
+			retire(state, &state->fbs[plan[i].crtc]);
+			state->fbs[plan[i].crtc] = plan[i].fb;
+		}
+		crtc_id = plan[i].enable ? res->crtcs[plan[i].crtc] : 0;
+		if (obj->crtc_id != crtc_id) obj->changed |= CONN_CHANGED_CRTC;
+		obj->crtc_id = crtc_id;
+		/* A disconnected output keeps its last mode */
+		if (obj->status == DRM_MODE_CONNECTED) {
+			if (obj->current_mode != cfg->outputs[i].mode)
+				obj->changed |= CONN_CHANGED_CURRENT_MODE;
+			mode_pool_ref(cfg->outputs[i].mode);
+			mode_pool_unref(obj->current_mode);
+			obj->current_mode = cfg->outputs[i].mode;
+		}
+		log_info("%s: %s",
+			 obj->name,
+			 plan[i].enable ? plan[i].mode.name : "off");
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Apply a configuration in one commit
+ * CRTCs are kept where possible and otherwise picked from the CRTCs the
+ * encoders of the connector can drive. On success the crtc_id and
+ * current_mode of the connectors in the registry are updated. On failure
+ * nothing changed, except for a legacy apply that failed halfway.
+ *
+ * @Param state The apply state
+ * @Param reg The connector registry of the card
+ * @Param cfg The configuration
+ *
+ * @Returns   0 if successfull, -1 if rejected or failed
+ */
+/* ---------------------------------------------------------------------------*/
+int apply_config(struct apply_state *state, struct conn_registry *reg,
+		 const struct apply_config *cfg)
+{
+	struct output_plan plan[MAX_APPLY_OUTPUTS];
+	drmModeRes *res;
+	uint64_t start_us = metrics_now_us();
+	int i, ret = -EINVAL;
+
+	if (cfg->nr_outputs == 0) return 0;
+	res = drm_device_get_resources(state->dev);
+	if (!res) return -1;
+	wait_pending(state);
+
+	memset(plan, 0, sizeof(plan));
+	if (plan_outputs(state, res, reg, cfg, plan) < 0) goto err;
+	ret = -ENOMEM;
+	if (create_buffers(state, plan, cfg->nr_outputs) < 0) goto err;
+
+	if (state->atomic)
+		ret = commit_atomic(state, res, plan, cfg->nr_outputs);
+	else
+		ret = commit_legacy(state, res, plan, cfg->nr_outputs);
+	if (ret < 0) goto err;
+
+	commit_applied(state, res, cfg, plan);
+	/* Legacy calls completed, nothing scans out the old buffers */
+	if (!state->pending_events) release_retired(state);
+	state->commits++;
+	metrics_inc(state->atomic ? METRIC_APPLY_ATOMIC : METRIC_APPLY_LEGACY);
+	metrics_observe(METRIC_APPLY_DURATION, metrics_now_us() - start_us);
+	trace(TRACE_APPLY, state->dev->minor, 0, cfg->nr_outputs,
+	      state->atomic, 0);
+	return 0;
+err:
+	for (i = 0; i < cfg->nr_outputs; i++)
+		scanout_destroy(state->dev->fd, &plan[i].fb);
+	trace(TRACE_APPLY, state->dev->minor, 0, cfg->nr_outputs,
+	      state->atomic, -ret);
+	return -1;
+}
@@ -0,0 +1,181 @@
+/**
+ * @file apply.h
+ * @Brief  Apply a configuration of modes to the outputs of a card
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-24
+ *
+ * All outputs of a configuration go into a single atomic commit. The
+ * commit is first validated with DRM_MODE_ATOMIC_TEST_ONLY, so a
+ * configuration the driver rejects never reaches the screen, and then
+ * applied without blocking. Drivers without atomic support fall back to
+ * one legacy drmModeSetCrtc call per output.
+ *
+ * The daemon does not render, every active CRTC scans out a black dumb
+ * buffer. A buffer is kept as long as it is large enough for the mode.
+ */
+
+#ifndef _APPLY_H_
+#define _APPLY_H_
+
+#include <stdint.h>
+
+#include "drm_device.h"
+#include "modepool.h"
+#include "registry.h"
+
+/* Maximum number of outputs in one configuration */
+#define MAX_APPLY_OUTPUTS 16
+
+/* DRM encodes possible_crtcs as a 32 bit mask */
+#define APPLY_MAX_CRTCS 32
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Requested state of one output
+ */
+/* ---------------------------------------------------------------------------*/
+struct output_config {
+	uint32_t connector_id;
+	/* The mode to set, MODE_HANDLE_NONE switches the output off */
+	mode_handle mode;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Configuration applied in one commit
+ * Outputs that are not listed keep their current state.
+ */
+/* ---------------------------------------------------------------------------*/
+struct apply_config {
+	struct output_config outputs[MAX_APPLY_OUTPUTS];
+	int nr_outputs;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Index of the property ids used in an atomic commit
+ */
+/* ---------------------------------------------------------------------------*/
+enum apply_prop {
+	APPLY_PROP_CONNECTOR_CRTC_ID,
+	APPLY_PROP_CRTC_ACTIVE,
+	APPLY_PROP_CRTC_MODE_ID,
+	APPLY_PROP_PLANE_FB_ID,
+	APPLY_PROP_PLANE_CRTC_ID,
+	APPLY_PROP_PLANE_SRC_X,
+	APPLY_PROP_PLANE_SRC_Y,
+	APPLY_PROP_PLANE_SRC_W,
+	APPLY_PROP_PLANE_SRC_H,
+	APPLY_PROP_PLANE_CRTC_X,
+	APPLY_PROP_PLANE_CRTC_Y,
+	APPLY_PROP_PLANE_CRTC_W,
+	APPLY_PROP_PLANE_CRTC_H,
+	APPLY_PROP_COUNT,
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Dumb buffer scanned out by a CRTC
+ */
+/* ---------------------------------------------------------------------------*/
+struct scanout {
+	uint32_t fb_id;
+	uint32_t handle;
+	uint32_t width;
+	uint32_t height;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Apply state of a card
+ */
+/* ---------------------------------------------------------------------------*/
+struct apply_state {
+	struct drm_device *dev;
+	/* 1 if the atomic path is usable, 0 for the legacy path */
+	int atomic;
+	/* Property ids, looked up once */
+	uint32_t props[APPLY_PROP_COUNT];
+	/* Primary plane of every CRTC, indexed like res->crtcs */
+	uint32_t primary[APPLY_MAX_CRTCS];
+	/* Buffer scanned out by every CRTC, indexed like res->crtcs */
+	struct scanout fbs[APPLY_MAX_CRTCS];
+	/* Buffers replaced by a commit that did not complete yet */
+	struct scanout retired[APPLY_MAX_CRTCS];
+	int nr_retired;
+	/* Completion events still expected for the last commit */
+	int pending_events;
+	/* Counters */
+	unsigned long commits;
+	unsigned long test_failures;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create the apply state of a device
+ * The planes and property ids are looked up once. Without atomic support,
+ * or when a property is missing, the legacy path is used.
+ *
+ * @Param dev The opened DRM device
+ *
+ * @Returns   A newly allocated state or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct apply_state *apply_create(struct drm_device *dev);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Free the apply state and its buffers
+ * The outputs keep scanning out until the buffers are removed, this does
+ * not switch them off.
+ *
+ * @Param state The apply state
+ */
+/* ---------------------------------------------------------------------------*/
+void apply_destroy(struct apply_state *state);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add an output to a configuration
+ *
+ * @Param cfg The configuration
+ * @Param connector_id The connector
+ * @Param mode The mode, MODE_HANDLE_NONE to switch the output off
+ *
+ * @Returns   0 if successfull, -1 if the configuration is full
+ */
+/* ---------------------------------------------------------------------------*/
+int apply_config_add(struct apply_config *cfg, uint32_t connector_id,
+		     mode_handle mode);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Apply a configuration in one commit
+ * CRTCs are kept where possible and otherwise picked from the CRTCs the
+ * encoders of the connector can drive. On success the crtc_id and
+ * current_mode of the connectors in the registry are updated. On failure
+ * nothing changed, except for a legacy apply that failed halfway.
+ *
+ * @Param state The apply state
+ * @Param reg The connector registry of the card
+ * @Param cfg The configuration
+ *
+ * @Returns   0 if successfull, -1 if rejected or failed
+ */
+/* ---------------------------------------------------------------------------*/
+int apply_config(struct apply_state *state, struct conn_registry *reg,
+		 const struct apply_config *cfg);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the completion events of the device fd
+ * Call when the device fd is readable. Buffers replaced by a commit are
+ * freed once all its CRTCs completed.
+ *
+ * @Param state The apply state
+ */
+/* ---------------------------------------------------------------------------*/
+void apply_handle_events(struct apply_state *state);
+
+#endif
@@ -0,0 +1,1195 @@
+/**
+ * @file drmbench.c
+ * @Brief  Benchmark of the connector scans against the fake libdrm
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-03
+ *
+ * Usage: drmbench [iterations]
+ * For every topology the full populate, a full rescan without changes, a
+ * full rescan after a hotplug and a targeted connector update are timed.
+ * A mode change on a wall of four displays is timed through the atomic
+ * and the legacy path, and matching its displays against a large rules
+ * file. Unplugging and replugging a monitor on a dock is timed with and
+ * without the EDID cache. A start is timed cold and from a snapshot, until
+ * the first state and until the state matches the hardware. Reader
+ * processes copy the shared state page while it is being updated. A
+ * thousand subscribers follow the event stream through a hotplug storm.
+ * The uevent ring is compared with the dlist queue it replaced.
+ * The cost of an info message that is not logged is timed. An idle event
+ * loop is checked for wakeups. The run fails if a scan
+ * reads a CRTC more than once or if the idle loop wakes up.
+ * Allocations are counted by wrapping malloc, calloc and realloc at link
+ * time (see the bench target in the Makefile).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "apply.h"
+#include "card.h"
+#include "edid_cache.h"
+#include "event_loop.h"
+#include "event_stream.h"
+#include "list.h"
+#include "mock_drm.h"
+#include "modeset.h"
+#include "policy.h"
+#include "registry.h"
+#include "ring.h"
+#include "snapshot.h"
+#include "state_page.h"
+
+#define DEFAULT_ITERATIONS 200
+/* Mode changes are slow, every one waits for the fake modeset */
+#define APPLY_ITERATIONS 20
+/* Rules in the generated rules file, one per known monitor */
+#define POLICY_RULES 1000
+#define POLICY_ITERATIONS 100000
+/* Replug cycles, every probe reads the EDID over DDC */
+#define RECONNECT_ITERATIONS 20
+/* Time the readers copy the state page, it is updated every 1 ms */
+#define STATE_READ_MS 500
+#define STATE_UPDATE_US 1000
+/* Event stream subscribers, every STREAM_SLOW_EVERY-th rarely reads */
+#define STREAM_CLIENTS 1000
+#define STREAM_SLOW_EVERY 10
+#define STREAM_HOTPLUGS 1000
+#define STREAM_HOTPLUG_US 1000
+/* Uevents carried by the queues, drained in bursts like the event loop */
+#define QUEUE_EVENTS 1000000
+#define QUEUE_BURST 64
+/* Capacity of the uevent ring of the daemon */
+#define QUEUE_RING_SIZE 256
+/* Time the event loop idles without uevents and with the timer disarmed */
+#define IDLE_MS 1000
+/* Info messages logged while only errors are enabled */
+#define LOG_CALLS 10000000
+
+static unsigned long _allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_fetch_add(&_allocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&_allocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&_allocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Topologies to benchmark, from a single display to a large MST
+ * setup, a 1024 connector setup that shows how the scans scale and a
+ * setup with slow DDC probes
+ */
+/* ---------------------------------------------------------------------------*/
+static const struct mock_topology topologies[] = {
+    {1, 1, 8, 0},
+    {4, 2, 16, 0},
+    {16, 4, 32, 0},
+    {64, 8, 32, 0},
+    {1024, 16, 32, 0},
+    {16, 4, 32, 2000},
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A wall of four identical displays, a modeset takes one frame
+ */
+/* ---------------------------------------------------------------------------*/
+static const struct mock_topology wall = {4, 4, 16, 0, 16667};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A dock with two monitors, a probe reads the EDID over DDC
+ */
+/* ---------------------------------------------------------------------------*/
+static const struct mock_topology dock = {4, 2, 32, 20000, 0};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A desk at boot, every monitor is probed over DDC
+ */
+/* ---------------------------------------------------------------------------*/
+static const struct mock_topology desk = {8, 4, 32, 20000, 0};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Measurement of a single operation
+ */
+/* ---------------------------------------------------------------------------*/
+struct bench_sample {
+	struct timespec start;
+	unsigned long allocs;
+};
+
+static FILE *_out;
+/* Checks that failed, the exit status of the run */
+static int _failures;
+
+static void sample_start(struct bench_sample *s)
+{
+	mock_drm_reset_counters();
+	s->allocs = _allocs;
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Print the averages of an operation that ran n times
+ *
+ * @Param s The sample started before the runs
+ * @Param name The operation
+ * @Param n Number of runs
+ */
+/* ---------------------------------------------------------------------------*/
+static void sample_report(struct bench_sample *s, const char *name, int n)
+{
+	struct timespec end;
+	double us;
+	unsigned long ioctls;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	us = (end.tv_sec - s->start.tv_sec) * 1e6 +
+	     (end.tv_nsec - s->start.tv_nsec) / 1e3;
+	ioctls = mock_drm_calls.get_resources + mock_drm_calls.get_connector +
+		 mock_drm_calls.get_connector_current +
+		 mock_drm_calls.get_encoder + mock_drm_calls.get_crtc +
+		 mock_drm_calls.get_property_blob;
+	fprintf(_out,
+		"  %-18s %10.1f us %8.1f ioctls %8.1f allocs"
+		"  (res %.1f conn %.1f cur %.1f enc %.1f crtc %.1f blob %.1f)\n",
+		name,
+		us / n,
+		(double)ioctls / n,
+		(double)(_allocs - s->allocs) / n,
+		(double)mock_drm_calls.get_resources / n,
+		(double)mock_drm_calls.get_connector / n,
+		(double)mock_drm_calls.get_connector_current / n,
+		(double)mock_drm_calls.get_encoder / n,
+		(double)mock_drm_calls.get_crtc / n,
+		(double)mock_drm_calls.get_property_blob / n);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Fail the run if a scan read a CRTC more than once
+ *
+ * @Param topo The topology that was scanned
+ * @Param name The scan
+ * @Param most The most GetCrtc calls of one scan
+ */
+/* ---------------------------------------------------------------------------*/
+static void check_crtc_reads(const struct mock_topology *topo,
+			     const char *name, unsigned long most)
+{
+	if (most <= topo->nr_crtcs) return;
+	fprintf(_out, "  FAIL %s: %lu GetCrtc for %d crtc(s) in one scan\n",
+		name,
+		most,
+		topo->nr_crtcs);
+	_failures++;
+}
+
+static void run_topology(const struct mock_topology *topo, int iterations)
+{
+	struct bench_sample s;
+	struct conn_registry *reg;
+	struct drm_device *dev;
+	unsigned long before, most;
+	int i;
+
+	/* Slow probes would make the run take minutes */
+	if (topo->probe_delay_us) iterations = iterations / 50 + 1;
+
+	fprintf(_out,
+		"%d connector(s), %d crtc(s), %d mode(s), probe %d us, "
+		"%d iteration(s)\n",
+		topo->nr_connectors,
+		topo->nr_crtcs,
+		topo->modes_per_connector,
+		topo->probe_delay_us,
+		iterations);
+	if (mock_drm_setup(topo) < 0) return;
+	/* Any openable node does, the fake ignores the fd */
+	dev = drm_device_open("/dev/null");
+	if (!dev) return;
+
+	sample_start(&s);
+	for (i = 0, most = 0; i < iterations; i++) {
+		/* Drop the resource cache so every populate starts cold */
+		drmModeFreeResources(dev->res);
+		dev->res = NULL;
+		before = mock_drm_calls.get_crtc;
+		reg = populate_drm_conn_list(dev);
+		if (mock_drm_calls.get_crtc - before > most)
+			most = mock_drm_calls.get_crtc - before;
+		registry_destroy(reg);
+	}
+	sample_report(&s, "populate", iterations);
+	check_crtc_reads(topo, "populate", most);
+
+	reg = populate_drm_conn_list(dev);
+	sample_start(&s);
+	for (i = 0, most = 0; i < iterations; i++) {
+		before = mock_drm_calls.get_crtc;
+		update_drm_conn_list(reg, dev);
+		if (mock_drm_calls.get_crtc - before > most)
+			most = mock_drm_calls.get_crtc - before;
+	}
+	sample_report(&s, "rescan-unchanged", iterations);
+	check_crtc_reads(topo, "rescan-unchanged", most);
+
+	sample_start(&s);
+	for (i = 0, most = 0; i < iterations; i++) {
+		mock_drm_set_connection(0, i & 1 ? DRM_MODE_CONNECTED
+						 : DRM_MODE_DISCONNECTED);
+		before = mock_drm_calls.get_crtc;
+		update_drm_conn_list(reg, dev);
+		if (mock_drm_calls.get_crtc - before > most)
+			most = mock_drm_calls.get_crtc - before;
+	}
+	sample_report(&s, "rescan-hotplug", iterations);
+	check_crtc_reads(topo, "rescan-hotplug", most);
+
+	sample_start(&s);
+	for (i = 0; i < iterations; i++) {
+		mock_drm_set_connection(0, i & 1 ? DRM_MODE_DISCONNECTED
+						 : DRM_MODE_CONNECTED);
+		update_drm_connector(reg, dev, mock_drm_connector_id(0), 1);
+	}
+	sample_report(&s, "targeted-hotplug", iterations);
+
+	registry_destroy(reg);
+	drm_device_close(dev);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Time switching every display of the wall between two modes
+ * An apply is done once the displays run the new mode.
+ *
+ * @Param atomic 1 for the atomic path, 0 for the legacy path
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_apply(int atomic)
+{
+	struct bench_sample s;
+	struct conn_registry *reg;
+	struct drm_device *dev;
+	struct apply_state *state;
+	struct apply_config cfg;
+	struct drm_connector_obj *obj;
+	struct timespec end;
+	double us;
+	int i, j;
+
+	mock_drm_disable_atomic(!atomic);
+	if (mock_drm_setup(&wall) < 0) return;
+	dev = drm_device_open("/dev/null");
+	if (!dev) return;
+	reg = populate_drm_conn_list(dev);
+	state = apply_create(dev);
+	if (!reg || !state) goto end;
+
+	sample_start(&s);
+	for (i = 0; i < APPLY_ITERATIONS; i++) {
+		cfg.nr_outputs = 0;
+		for (j = 0; j < REGISTRY_SIZE(reg); j++) {
+			obj = REGISTRY_AT(reg, j);
+			apply_config_add(&cfg, obj->connector_id,
+					 obj->modes[i & 1]);
+		}
+		apply_config(state, reg, &cfg);
+		/* Wait for the non-blocking commit */
+		apply_handle_events(state);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	us = (end.tv_sec - s.start.tv_sec) * 1e6 +
+	     (end.tv_nsec - s.start.tv_nsec) / 1e3;
+	fprintf(_out,
+		"  %-18s %10.1f us %8.1f commits %6.1f setcrtc %6.1f "
+		"buffers %6.1f allocs\n",
+		atomic ? "apply-atomic" : "apply-legacy",
+		us / APPLY_ITERATIONS,
+		(double)mock_drm_calls.atomic_commit / APPLY_ITERATIONS,
+		(double)mock_drm_calls.set_crtc / APPLY_ITERATIONS,
+		(double)mock_drm_calls.create_dumb / APPLY_ITERATIONS,
+		(double)(_allocs - s.allocs) / APPLY_ITERATIONS);
+end:
+	apply_destroy(state);
+	registry_destroy(reg);
+	drm_device_close(dev);
+	mock_drm_disable_atomic(0);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write a rules file with a serial number rule for every monitor
+ * of a large fleet, the fake monitors are among them
+ *
+ * @Param path Template for mkstemp, receives the file name
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int write_rules(char *path)
+{
+	FILE *fp;
+	int fd, i;
+
+	fd = mkstemp(path);
+	if (fd < 0) return -1;
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+	for (i = 0; i < POLICY_RULES; i++)
+		fprintf(fp,
+			"edid=MCK/%d/%d mode=%dx%d pos=%d,0\n",
+			MOCK_EDID_PRODUCT,
+			POLICY_RULES - i,
+			3840 - (i % 4) * 64,
+			2160 - (i % 4) * 36,
+			(i % 4) * 3840);
+	fprintf(fp, "type=HDMI-A mode=preferred\n*\toff\n");
+	return fclose(fp);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Time picking the mode of the wall displays from the rules
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_policy()
+{
+	char path[] = "/tmp/drmbench-rules-XXXXXX";
+	struct bench_sample s;
+	struct conn_registry *reg = NULL;
+	struct drm_device *dev = NULL;
+	struct policy *policy = NULL;
+	const struct policy_rule *rule;
+	struct drm_connector_obj *obj;
+	struct timespec end;
+	unsigned long matched = 0;
+	double us;
+	int i;
+
+	if (write_rules(path) < 0) return;
+	sample_start(&s);
+	policy = policy_load(path);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unlink(path);
+	if (!policy) return;
+	us = (end.tv_sec - s.start.tv_sec) * 1e6 +
+	     (end.tv_nsec - s.start.tv_nsec) / 1e3;
+	fprintf(_out, "  %-18s %10.1f us %8d rules\n", "policy-load", us,
+		policy->nr_rules);
+
+	if (mock_drm_setup(&wall) < 0) goto end;
+	dev = drm_device_open("/dev/null");
+	if (!dev) goto end;
+	reg = populate_drm_conn_list(dev);
+	if (!reg) goto end;
+	sample_start(&s);
+	for (i = 0; i < POLICY_ITERATIONS; i++) {
+		obj = REGISTRY_AT(reg, i % REGISTRY_SIZE(reg));
+		rule = policy_lookup(policy, obj);
+		if (rule && policy_pick_mode(rule, obj)) matched++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	us = (end.tv_sec - s.start.tv_sec) * 1e6 +
+	     (end.tv_nsec - s.start.tv_nsec) / 1e3;
+	fprintf(_out,
+		"  %-18s %10.3f us %8.1f matched %6.1f allocs\n",
+		"policy-lookup",
+		us / POLICY_ITERATIONS,
+		(double)matched / POLICY_ITERATIONS,
+		(double)(_allocs - s.allocs) / POLICY_ITERATIONS);
+end:
+	registry_destroy(reg);
+	drm_device_close(dev);
+	policy_destroy(policy);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Time unplugging and replugging a monitor, each followed by the
+ * targeted update a HOTPLUG uevent with a CONNECTOR key triggers
+ *
+ * @Param cached 1 to run with a warm EDID cache
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_reconnect(int cached)
+{
+	char path[] = "/tmp/drmbench-edid-XXXXXX";
+	struct bench_sample s;
+	struct conn_registry *reg = NULL;
+	struct drm_device *dev;
+	int i, fd;
+
+	if (cached) {
+		/* Start from an empty file, the populate warms the cache */
+		fd = mkstemp(path);
+		if (fd < 0) return;
+		close(fd);
+		unlink(path);
+		if (edid_cache_open(path) < 0) return;
+	}
+	if (mock_drm_setup(&dock) < 0) goto end;
+	dev = drm_device_open("/dev/null");
+	if (!dev) goto end;
+	reg = populate_drm_conn_list(dev);
+	if (!reg) goto close;
+
+	sample_start(&s);
+	for (i = 0; i < RECONNECT_ITERATIONS; i++) {
+		mock_drm_set_connection(0, DRM_MODE_DISCONNECTED);
+		update_drm_connector(reg, dev, mock_drm_connector_id(0), 1);
+		mock_drm_set_connection(0, DRM_MODE_CONNECTED);
+		update_drm_connector(reg, dev, mock_drm_connector_id(0), 1);
+	}
+	sample_report(&s, cached ? "replug-cached" : "replug",
+		      RECONNECT_ITERATIONS);
+	registry_destroy(reg);
+
+	if (cached) {
+		/* A restart with the cache file of the previous run */
+		edid_cache_open(path);
+		drmModeFreeResources(dev->res);
+		dev->res = NULL;
+		sample_start(&s);
+		reg = populate_drm_conn_list(dev);
+		sample_report(&s, "populate-cached", 1);
+		registry_destroy(reg);
+	}
+close:
+	drm_device_close(dev);
+end:
+	if (cached) {
+		edid_cache_close();
+		unlink(path);
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Microseconds since a sample started
+ */
+/* ---------------------------------------------------------------------------*/
+static double sample_elapsed(struct bench_sample *s)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - s->start.tv_sec) * 1e6 +
+	       (now.tv_nsec - s->start.tv_nsec) / 1e3;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Time a cold start and a start from the snapshot it left, until
+ * the first state and until the registry matches the hardware
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_warm_start()
+{
+	char path[] = "/tmp/drmbench-snap-XXXXXX";
+	struct bench_sample s, total;
+	struct snapshot *snap;
+	struct conn_registry *reg;
+	struct drm_card *card;
+	double cold_us, first_us, consistent_us;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) return;
+	close(fd);
+
+	/* Cold: the probe of every connector comes before the first state */
+	if (mock_drm_setup(&desk) < 0) goto end;
+	card = card_open("/dev/null");
+	if (!card) goto end;
+	card->auto_apply = 1;
+	sample_start(&s);
+	card_populate(card);
+	cold_us = sample_elapsed(&s);
+	sample_report(&s, "cold-start", 1);
+	if (snapshot_save(path, &card, 1) < 0) {
+		card_close(card);
+		goto end;
+	}
+	card_close(card);
+
+	/* Warm: map the snapshot, apply the last layout, then probe */
+	if (mock_drm_setup(&desk) < 0) goto end;
+	card = card_open("/dev/null");
+	if (!card) goto end;
+	card->auto_apply = 1;
+	sample_start(&total);
+	sample_start(&s);
+	snap = snapshot_open(path);
+	reg = snap ? snapshot_restore(snap, card->drm) : NULL;
+	snapshot_close(snap);
+	if (!reg) {
+		card_close(card);
+		goto end;
+	}
+	card_warm_start(card, reg);
+	first_us = sample_elapsed(&total);
+	sample_report(&s, "warm-first-state", 1);
+	sample_start(&s);
+	card_rescan(card);
+	consistent_us = sample_elapsed(&total);
+	sample_report(&s, "warm-reconcile", 1);
+	fprintf(_out,
+		"  %-18s %10.1f us first state %10.1f us consistent\n"
+		"  %-18s %10.1f us first state %10.1f us consistent\n",
+		"cold",
+		cold_us,
+		cold_us,
+		"warm",
+		first_us,
+		consistent_us);
+	card_close(card);
+end:
+	unlink(path);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  What a reader process counted
+ */
+/* ---------------------------------------------------------------------------*/
+struct reader_result {
+	unsigned long reads;
+	/* Snapshots mixing two updates, must stay 0 */
+	unsigned long torn;
+};
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy the state page until the deadline
+ * Every update moves all outputs to the same position, a snapshot with
+ * two positions mixes two updates.
+ *
+ * @Param deadline_us Monotonic time to stop
+ * @Param res Receives the counts
+ */
+/* ---------------------------------------------------------------------------*/
+static void state_reader(uint64_t deadline_us, struct reader_result *res)
+{
+	static struct drmstate_snapshot snap;
+	struct drmstate *st;
+	uint32_t i;
+
+	memset(res, 0, sizeof(*res));
+	st = drmstate_attach(state_page_fd());
+	if (!st) return;
+	/* The clock is read through the vDSO, no syscall either */
+	while ((res->reads & 1023) || now_us() < deadline_us) {
+		if (drmstate_read(st, &snap) < 0) continue;
+		res->reads++;
+		for (i = 1; i < snap.nr_connectors; i++) {
+			if (snap.connectors[i].x != snap.connectors[0].x) {
+				res->torn++;
+				break;
+			}
+		}
+	}
+	drmstate_close(st);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy the state page from reader processes while it is updated
+ *
+ * @Param nr_readers Number of reader processes
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_state_readers(int nr_readers)
+{
+	struct reader_result res, total;
+	struct drm_card *card;
+	uint64_t deadline_us;
+	unsigned long updates = 0;
+	char name[32];
+	int fds[2], i, j, started = 0;
+	pid_t pid;
+
+	if (state_page_fd() < 0 && state_page_create() < 0) return;
+	if (mock_drm_setup(&wall) < 0 || pipe(fds) < 0) return;
+	card = card_open("/dev/null");
+	if (!card) goto end;
+	card_populate(card);
+	state_page_publish(&card, 1);
+
+	deadline_us = now_us() + STATE_READ_MS * 1000;
+	for (i = 0; i < nr_readers; i++) {
+		pid = fork();
+		if (pid < 0) break;
+		if (pid == 0) {
+			state_reader(deadline_us, &res);
+			if (write(fds[1], &res, sizeof(res)) != sizeof(res))
+				_exit(1);
+			_exit(0);
+		}
+		started++;
+	}
+	while (now_us() < deadline_us) {
+		updates++;
+		for (j = 0; j < REGISTRY_SIZE(card->connectors); j++)
+			REGISTRY_AT(card->connectors, j)->x = updates;
+		state_page_publish(&card, 1);
+		usleep(STATE_UPDATE_US);
+	}
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < started; i++) {
+		if (read(fds[0], &res, sizeof(res)) != sizeof(res)) break;
+		total.reads += res.reads;
+		total.torn += res.torn;
+	}
+	while (wait(NULL) > 0)
+		;
+	snprintf(name, sizeof(name), "%d reader(s)", started);
+	fprintf(_out,
+		"  %-18s %10.0f reads/s %8.0f per reader %6lu torn %6lu updates\n",
+		name,
+		total.reads * 1000.0 / STATE_READ_MS,
+		total.reads * 1000.0 / STATE_READ_MS / (started ? started : 1),
+		total.torn,
+		updates);
+	card_close(card);
+end:
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  What the subscriber process saw, shared with the benchmark
+ */
+/* ---------------------------------------------------------------------------*/
+struct stream_result {
+	/* Time the last reading client received the event of a hotplug */
+	uint64_t last_us[STREAM_HOTPLUGS];
+	unsigned long events;
+	/* Resyncs of the reading clients, must stay 0 */
+	unsigned long resyncs;
+	/* Resyncs of the clients that rarely read */
+	unsigned long slow_resyncs;
+	int clients;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A client of the subscriber process
+ */
+/* ---------------------------------------------------------------------------*/
+struct stream_sub {
+	int fd;
+	/* Lines received after the "ok" */
+	int lines;
+	int line_start;
+};
+
+static int stream_connect(const char *path, const char *filter)
+{
+	struct sockaddr_un addr;
+	char ok[3];
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    write(fd, filter, strlen(filter)) < 0 ||
+	    read(fd, ok, sizeof(ok)) != sizeof(ok) || memcmp(ok, "ok\n", 3)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read what a client received once and count the lines
+ *
+ * @Param sub The client
+ * @Param res Receives the delivery times and counts
+ * @Param slow 1 for a client that only reads now and then
+ *
+ * @Returns   1 if something was read, 0 if nothing was pending, -1 when
+ * the stream closed
+ */
+/* ---------------------------------------------------------------------------*/
+static int stream_read(struct stream_sub *sub, struct stream_result *res,
+		       int slow)
+{
+	char buf[4096];
+	uint64_t now;
+	ssize_t n, i;
+
+	n = recv(sub->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n == 0) return -1;
+	if (n < 0) return 0;
+	now = now_us();
+	for (i = 0; i < n; i++) {
+		if (sub->line_start && buf[i] == 'r') {
+			if (slow) res->slow_resyncs++;
+			else res->resyncs++;
+		}
+		sub->line_start = buf[i] == '\n';
+		if (!sub->line_start || slow) continue;
+		if (sub->lines < STREAM_HOTPLUGS &&
+		    res->last_us[sub->lines] < now)
+			res->last_us[sub->lines] = now;
+		sub->lines++;
+		res->events++;
+	}
+	return 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Subscribe the clients and read the stream until it closes
+ * Most clients follow connects and disconnects of every output, every
+ * fourth only those of an output that never changes and every
+ * STREAM_SLOW_EVERY-th subscribes to everything but only reads halfway
+ * through the hotplugs and once the stream closed.
+ *
+ * @Param path The stream socket
+ * @Param nr_clients Number of clients
+ * @Param quiet Name of the output that never changes
+ * @Param ready Written once all clients subscribed
+ * @Param res Receives the delivery times and counts
+ */
+/* ---------------------------------------------------------------------------*/
+static void stream_subscribers(const char *path, int nr_clients,
+			       const char *quiet, int ready,
+			       struct stream_result *res)
+{
+	static struct stream_sub subs[STREAM_CLIENTS];
+	struct stream_sub *sub;
+	struct epoll_event events[64];
+	char filter[64];
+	int i, n, epfd, open_subs = 0, drained = 0;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) return;
+	snprintf(filter, sizeof(filter), "name=%s events=connect,disconnect\n",
+		 quiet);
+	for (i = 0; i < nr_clients; i++) {
+		if (i % STREAM_SLOW_EVERY == STREAM_SLOW_EVERY - 1)
+			subs[i].fd = stream_connect(path, "\n");
+		else if (i % 4 == 1)
+			subs[i].fd = stream_connect(path, filter);
+		else
+			subs[i].fd = stream_connect(path,
+						    "events=connect,disconnect\n");
+		if (subs[i].fd < 0) break;
+		subs[i].line_start = 1;
+		res->clients++;
+		if (i % STREAM_SLOW_EVERY == STREAM_SLOW_EVERY - 1) continue;
+		events[0].events = EPOLLIN;
+		events[0].data.ptr = &subs[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, subs[i].fd, &events[0]) < 0)
+			break;
+		open_subs++;
+	}
+	if (write(ready, "r", 1) != 1) return;
+
+	while (open_subs > 0) {
+		/* The first client reads everything */
+		if (!drained && subs[0].lines >= STREAM_HOTPLUGS / 2) {
+			for (i = STREAM_SLOW_EVERY - 1; i < res->clients;
+			     i += STREAM_SLOW_EVERY)
+				while (stream_read(&subs[i], res, 1) > 0)
+					;
+			drained = 1;
+		}
+		n = epoll_wait(epfd, events, 64, -1);
+		for (i = 0; i < n; i++) {
+			sub = events[i].data.ptr;
+			if (stream_read(sub, res, 0) < 0) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, sub->fd, NULL);
+				open_subs--;
+			}
+		}
+	}
+	for (i = STREAM_SLOW_EVERY - 1; i < res->clients;
+	     i += STREAM_SLOW_EVERY)
+		while (stream_read(&subs[i], res, 1) > 0)
+			;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Hotplug an output while subscribers follow the event stream
+ * The time to hand the events of a scan to the stream is what the
+ * hotplug path pays, the delivery is the time until the last reading
+ * client received the event.
+ *
+ * @Param nr_clients Number of subscribers, at most STREAM_CLIENTS
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_event_stream(int nr_clients)
+{
+	static uint64_t sent_us[STREAM_HOTPLUGS], delivery[STREAM_HOTPLUGS];
+	char path[] = "/tmp/drmbench-stream-XXXXXX";
+	struct stream_result *res;
+	struct drm_card *card;
+	struct rlimit rl;
+	uint64_t start_us, publish_us = 0;
+	char name[32], quiet[32], byte;
+	int i, fd, fds[2], nr_delivered = 0;
+	pid_t pid;
+
+	/* Both ends of every connection need an fd */
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < nr_clients + 64) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0 ||
+		    rl.rlim_cur < nr_clients + 64) {
+			fprintf(_out, "  not enough fds for %d subscriber(s)\n",
+				nr_clients);
+			return;
+		}
+	}
+	fd = mkstemp(path);
+	if (fd < 0) return;
+	close(fd);
+	unlink(path);
+	res = mmap(NULL, sizeof(*res), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (res == MAP_FAILED) return;
+	memset(res, 0, sizeof(*res));
+	if (mock_drm_setup(&wall) < 0 || pipe(fds) < 0) goto unmap;
+	card = card_open("/dev/null");
+	if (!card) goto end;
+	card_populate(card);
+	card_clear_changes(card);
+	snprintf(quiet, sizeof(quiet), "%s",
+		 registry_lookup(card->connectors, mock_drm_connector_id(1))
+		     ->name);
+	if (event_stream_listen(path) < 0) goto close;
+
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		stream_subscribers(path, nr_clients, quiet, fds[1], res);
+		_exit(0);
+	}
+	if (pid < 0 || read(fds[0], &byte, 1) != 1) goto stop;
+
+	for (i = 0; i < STREAM_HOTPLUGS; i++) {
+		mock_drm_set_connection(0, i & 1 ? DRM_MODE_CONNECTED
+						 : DRM_MODE_DISCONNECTED);
+		update_drm_connector(card->connectors, card->drm,
+				     mock_drm_connector_id(0), 1);
+		start_us = sent_us[i] = now_us();
+		event_stream_publish(&card, 1);
+		publish_us += now_us() - start_us;
+		card_clear_changes(card);
+		usleep(STREAM_HOTPLUG_US);
+	}
+	/* Let the last events reach the readers before the stream closes */
+	usleep(100000);
+stop:
+	event_stream_close();
+	if (pid > 0) waitpid(pid, NULL, 0);
+
+	for (i = 0; i < STREAM_HOTPLUGS; i++) {
+		if (res->last_us[i])
+			delivery[nr_delivered++] = res->last_us[i] - sent_us[i];
+	}
+	qsort(delivery, nr_delivered, sizeof(*delivery), compare_u64);
+	snprintf(name, sizeof(name), "%d subscriber(s)", res->clients);
+	fprintf(_out,
+		"  %-18s %8.1f us publish %8llu us p50 %8llu us p99 "
+		"%8llu us max delivery\n"
+		"  %-18s %8lu events %6lu resyncs %6lu slow resyncs\n",
+		name,
+		(double)publish_us / STREAM_HOTPLUGS,
+		nr_delivered ? delivery[nr_delivered / 2] : 0ULL,
+		nr_delivered ? delivery[nr_delivered * 99 / 100] : 0ULL,
+		nr_delivered ? delivery[nr_delivered - 1] : 0ULL,
+		"",
+		res->events,
+		res->resyncs,
+		res->slow_resyncs);
+close:
+	card_close(card);
+end:
+	close(fds[0]);
+	close(fds[1]);
+unmap:
+	munmap(res, sizeof(*res));
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Carry uevents through the SPSC ring or through the dlist queue
+ * A burst is enqueued and drained like the event loop does. The ring
+ * consumer goes back to sleep after every burst, and like netlink_handler
+ * the producer pushes a burst as one batch, so its eventfd write is done
+ * once at the end of the burst instead of in the first push. That write
+ * is reported apart as the wake time per burst. The throughput is timed
+ * without the per enqueue clock reads of the latency run.
+ *
+ * @Param ring 1 for the SPSC ring, 0 for the dlist
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_queue(int ring)
+{
+	static uint64_t latency[QUEUE_EVENTS];
+	struct spsc_ring *r = NULL;
+	struct dlist *list = NULL;
+	struct bench_sample s;
+	struct timespec a, b;
+	unsigned long allocs = 0;
+	uint64_t wake_ns = 0;
+	double us = 0;
+	void *ev;
+	int i, j, pass;
+
+	if (ring)
+		r = spsc_ring_create(QUEUE_RING_SIZE);
+	else
+		list = list_init(NULL);
+	if (!r && !list) return;
+
+	for (pass = 0; pass < 2; pass++) {
+		sample_start(&s);
+		for (i = 0; i < QUEUE_EVENTS; i += QUEUE_BURST) {
+			if (ring) spsc_ring_begin_batch(r);
+			for (j = i; j < i + QUEUE_BURST; j++) {
+				if (pass) clock_gettime(CLOCK_MONOTONIC, &a);
+				ev = (void *)(uintptr_t)(j + 1);
+				if (ring)
+					spsc_ring_push(r, ev);
+				else
+					list_insert_next(list, LIST_TAIL(list),
+							 ev);
+				if (!pass) continue;
+				clock_gettime(CLOCK_MONOTONIC, &b);
+				latency[j] = (b.tv_sec - a.tv_sec) * 1000000000ULL +
+					     b.tv_nsec - a.tv_nsec;
+			}
+			if (ring) {
+				if (pass) clock_gettime(CLOCK_MONOTONIC, &a);
+				spsc_ring_end_batch(r);
+				if (pass) {
+					clock_gettime(CLOCK_MONOTONIC, &b);
+					wake_ns += (b.tv_sec - a.tv_sec) *
+						       1000000000ULL +
+						   b.tv_nsec - a.tv_nsec;
+				}
+				spsc_ring_ack(r);
+				while (spsc_ring_pop(r, &ev) == 0)
+					;
+				spsc_ring_sleep(r);
+			} else {
+				while (LIST_SIZE(list))
+					list_remove_item(list, LIST_HEAD(list),
+							 &ev);
+			}
+		}
+		if (pass) continue;
+		us = sample_elapsed(&s);
+		allocs = _allocs - s.allocs;
+	}
+	qsort(latency, QUEUE_EVENTS, sizeof(*latency), compare_u64);
+	fprintf(_out,
+		"  %-18s %10.0f events/s %6llu ns p99 enqueue %8.1f allocs "
+		"%6llu ns wake per burst\n",
+		ring ? "spsc ring" : "dlist",
+		QUEUE_EVENTS / (us / 1e6),
+		(unsigned long long)latency[QUEUE_EVENTS * 99 / 100],
+		(double)allocs / QUEUE_EVENTS,
+		(unsigned long long)(wake_ns / (QUEUE_EVENTS / QUEUE_BURST)));
+	if (ring)
+		spsc_ring_destroy(r);
+	else
+		list_destroy(list);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Time log_info calls while the runtime level only logs errors
+ * In a RELEASE=1 build info is not compiled in and the calls are gone.
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_suppressed_log()
+{
+	struct bench_sample s;
+	double us;
+	int i;
+
+	sample_start(&s);
+	for (i = 0; i < LOG_CALLS; i++)
+		log_info("Suppressed message %d of %s", i, "drmbench");
+	us = sample_elapsed(&s);
+	fprintf(_out,
+		"  %-18s %10.2f ns per call %8.1f allocs  (info %s)\n",
+		"log-suppressed",
+		us * 1000 / LOG_CALLS,
+		(double)(_allocs - s.allocs) / LOG_CALLS,
+		LOG_COMPILED_LVL & LOG_LVL_INFO ? "compiled in"
+						: "compiled out");
+}
+
+static void idle_wakeup(struct event_loop *loop, int fd, uint32_t events,
+			void *data)
+{
+}
+
+static void idle_stop(struct event_loop *loop, int fd, uint32_t events,
+		      void *data)
+{
+	event_loop_stop(loop);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Let an event loop with the idle sources of the daemon, the uevent
+ * ring and a disarmed timer, run for IDLE_MS and fail if it woke up
+ * A second timer ends the run, its expiry is the only wakeup allowed.
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_idle_loop()
+{
+	struct event_loop *loop = event_loop_create();
+	struct spsc_ring *ring = spsc_ring_create(QUEUE_RING_SIZE);
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	int stop_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	long wakeups;
+
+	if (!loop || !ring || timer_fd < 0 || stop_fd < 0) goto end;
+	if (event_loop_add_fd(loop, SPSC_RING_FD(ring), EPOLLIN, idle_wakeup,
+			      NULL) < 0 ||
+	    event_loop_add_fd(loop, timer_fd, EPOLLIN, idle_wakeup, NULL) < 0 ||
+	    event_loop_add_fd(loop, stop_fd, EPOLLIN, idle_stop, NULL) < 0 ||
+	    event_loop_arm_timer(stop_fd, IDLE_MS) < 0)
+		goto end;
+	event_loop_run(loop);
+
+	wakeups = loop->wakeups - 1;
+	fprintf(_out, "  %-18s %10ld wakeup(s)\n", "idle", wakeups);
+	if (wakeups) {
+		fprintf(_out, "  FAIL idle: the loop woke up without events\n");
+		_failures++;
+	}
+end:
+	if (stop_fd >= 0) close(stop_fd);
+	if (timer_fd >= 0) close(timer_fd);
+	spsc_ring_destroy(ring);
+	event_loop_destroy(loop);
+}
+
+int main(int argc, char **argv)
+{
+	int i, iterations = DEFAULT_ITERATIONS;
+
+	if (argc > 1) iterations = atoi(argv[1]);
+	if (iterations <= 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	/* Keep the results, silence the debug output of the scan code */
+	_out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!_out || !freopen("/dev/null", "w", stdout)) return 1;
+	logger_set_loglevel(LOG_LVL_ERROR);
+	init_drm_handler();
+
+	for (i = 0; i < sizeof(topologies) / sizeof(topologies[0]); i++)
+		run_topology(&topologies[i], iterations);
+	fprintf(_out,
+		"%d display wall, modeset %d us, %d iteration(s)\n",
+		wall.nr_connectors,
+		wall.modeset_delay_us,
+		APPLY_ITERATIONS);
+	run_apply(1);
+	run_apply(0);
+	run_policy();
+	fprintf(_out,
+		"%d connector(s), %d monitor(s), probe %d us, %d replug(s)\n",
+		dock.nr_connectors,
+		dock.nr_crtcs,
+		dock.probe_delay_us,
+		RECONNECT_ITERATIONS);
+	run_reconnect(0);
+	run_reconnect(1);
+	fprintf(_out,
+		"%d connector(s), %d monitor(s), probe %d us, start\n",
+		desk.nr_connectors,
+		desk.nr_crtcs,
+		desk.probe_delay_us);
+	run_warm_start();
+	fprintf(_out, "%d connector(s), state page readers\n",
+		wall.nr_connectors);
+	run_state_readers(1);
+	run_state_readers(4);
+	run_state_readers(16);
+	fprintf(_out, "%d connector(s), %d hotplug(s) every %d us, event stream\n",
+		wall.nr_connectors,
+		STREAM_HOTPLUGS,
+		STREAM_HOTPLUG_US);
+	run_event_stream(1);
+	run_event_stream(STREAM_CLIENTS);
+	fprintf(_out, "%d uevent(s) in bursts of %d, uevent queue\n",
+		QUEUE_EVENTS,
+		QUEUE_BURST);
+	run_queue(1);
+	run_queue(0);
+	fprintf(_out, "%d info message(s), errors logged\n", LOG_CALLS);
+	run_suppressed_log();
+	fprintf(_out, "event loop idle for %d ms\n", IDLE_MS);
+	run_idle_loop();
+	if (_failures) fprintf(_out, "%d check(s) failed\n", _failures);
+	fclose(_out);
+	return _failures ? 1 : 0;
+}
@@ -0,0 +1,674 @@
+/**
+ * @file mock_drm.c
+ * @Brief  Link-time fake of the libdrm calls used by the daemon
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-03
+ *
+ * Objects are returned as freshly allocated copies, like libdrm does, so
+ * the allocation counts of a scan match the real library.
+ */
+
+#include "mock_drm.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Every kind of object gets its own range of 10000 ids */
+#define CONNECTOR_ID_BASE 10000
+#define ENCODER_ID_BASE 20000
+#define CRTC_ID_BASE 30000
+#define PLANE_ID_BASE 40000
+#define FB_ID_BASE 50000
+#define EDID_BLOB_BASE 60000
+#define BLOB_ID_BASE 70000
+/* Properties of the atomic API */
+enum {
+	PROP_CRTC_ID = 90000,
+	PROP_ACTIVE,
+	PROP_MODE_ID,
+	PROP_TYPE,
+	PROP_FB_ID,
+	PROP_SRC_X,
+	PROP_SRC_Y,
+	PROP_SRC_W,
+	PROP_SRC_H,
+	PROP_CRTC_X,
+	PROP_CRTC_Y,
+	PROP_CRTC_W,
+	PROP_CRTC_H,
+	PROP_EDID,
+	PROP_END,
+};
+/* DRM_MODE_CONNECTOR_HDMIA */
+#define MOCK_CONNECTOR_TYPE 11
+#define MOCK_EDID_LEN 128
+
+struct mock_counters mock_drm_calls;
+
+static struct mock_topology _topo;
+static drmModeConnection *_status;
+static drmModeModeInfo *_modes;
+static int _atomic_disabled;
+
+static const char *const prop_names[PROP_END - PROP_CRTC_ID] = {
+    "CRTC_ID", "ACTIVE", "MODE_ID", "type", "FB_ID", "SRC_X", "SRC_Y",
+    "SRC_W", "SRC_H", "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "EDID",
+};
+
+/* Property ids of every object type */
+static const uint32_t connector_props[] = {PROP_CRTC_ID, PROP_EDID};
+static const uint32_t crtc_props[] = {PROP_ACTIVE, PROP_MODE_ID};
+static const uint32_t plane_props[] = {
+    PROP_TYPE, PROP_FB_ID, PROP_CRTC_ID, PROP_SRC_X, PROP_SRC_Y,
+    PROP_SRC_W, PROP_SRC_H, PROP_CRTC_X, PROP_CRTC_Y, PROP_CRTC_W,
+    PROP_CRTC_H,
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Atomic request, a list of object, property, value triples
+ */
+/* ---------------------------------------------------------------------------*/
+struct _drmModeAtomicReq {
+	int count;
+	int capacity;
+	struct {
+		uint32_t object_id;
+		uint32_t property_id;
+		uint64_t value;
+	} * items;
+};
+
+/* Ids handed out for buffers and blobs */
+static uint32_t _next_handle = 1;
+static uint32_t _next_fb = FB_ID_BASE;
+static uint32_t _next_blob = BLOB_ID_BASE;
+/* Completion of the last non-blocking commit */
+static int _pending_events;
+static void *_pending_data;
+static struct timespec _pending_done;
+
+uint32_t mock_drm_connector_id(int idx)
+{
+	return CONNECTOR_ID_BASE + idx;
+}
+
+void mock_drm_disable_atomic(int disabled)
+{
+	_atomic_disabled = disabled;
+}
+
+void mock_drm_reset_counters()
+{
+	memset(&mock_drm_calls, 0, sizeof(mock_drm_calls));
+}
+
+int mock_drm_setup(const struct mock_topology *topo)
+{
+	int i;
+
+	free(_status);
+	free(_modes);
+	_topo = *topo;
+	_pending_events = 0;
+	_status = calloc(topo->nr_connectors, sizeof(*_status));
+	_modes = calloc(topo->modes_per_connector, sizeof(*_modes));
+	if (!_status || !_modes) return -1;
+
+	for (i = 0; i < topo->nr_connectors; i++)
+		_status[i] = i < topo->nr_crtcs ? DRM_MODE_CONNECTED
+						: DRM_MODE_DISCONNECTED;
+	/* Every monitor reports the same list, like a wall of identical
+	 * displays */
+	for (i = 0; i < topo->modes_per_connector; i++) {
+		_modes[i].hdisplay = 3840 - i * 64;
+		_modes[i].vdisplay = 2160 - i * 36;
+		_modes[i].vrefresh = 60;
+		_modes[i].clock = _modes[i].hdisplay * _modes[i].vdisplay / 16;
+		_modes[i].type = i == 0 ? DRM_MODE_TYPE_PREFERRED : 0;
+		snprintf(_modes[i].name,
+			 DRM_DISPLAY_MODE_LEN,
+			 "%dx%d",
+			 _modes[i].hdisplay,
+			 _modes[i].vdisplay);
+	}
+	mock_drm_reset_counters();
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Build the EDID of the monitor on a connector
+ * Every monitor is the same model with its own serial number.
+ *
+ * @Param idx The connector index
+ * @Param edid Receives the 128 byte base block
+ */
+/* ---------------------------------------------------------------------------*/
+static void build_edid(int idx, uint8_t *edid)
+{
+	static const uint8_t header[8] = {0x00, 0xff, 0xff, 0xff,
+					  0xff, 0xff, 0xff, 0x00};
+	uint32_t serial = idx + 1;
+	uint8_t sum = 0;
+	int i;
+
+	memset(edid, 0, MOCK_EDID_LEN);
+	memcpy(edid, header, sizeof(header));
+	/* "MCK" */
+	edid[8] = ('M' - '@') << 2 | ('C' - '@') >> 3;
+	edid[9] = ('C' - '@') << 5 | ('K' - '@');
+	edid[10] = MOCK_EDID_PRODUCT & 0xff;
+	edid[11] = MOCK_EDID_PRODUCT >> 8;
+	for (i = 0; i < 4; i++) edid[12 + i] = serial >> (i * 8);
+	edid[18] = 1;
+	edid[19] = 4;
+	/* Monitor name descriptor */
+	edid[54 + 3] = 0xfc;
+	memcpy(&edid[54 + 5], "Mock wall\n   ", 13);
+	for (i = 0; i < MOCK_EDID_LEN - 1; i++) sum += edid[i];
+	edid[MOCK_EDID_LEN - 1] = -sum;
+}
+
+void mock_drm_set_connection(int idx, drmModeConnection status)
+{
+	if (idx >= 0 && idx < _topo.nr_connectors) _status[idx] = status;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Map an object id on its index
+ *
+ * @Param id The object id
+ * @Param base The id of the first object of this type
+ * @Param count The number of objects of this type
+ *
+ * @Returns   The index or -1 if the object does not exist
+ */
+/* ---------------------------------------------------------------------------*/
+static int object_index(uint32_t id, uint32_t base, int count)
+{
+	if (id < base || id >= base + count) return -1;
+	return id - base;
+}
+
+static void probe_delay(int us)
+{
+	struct timespec ts = {0, us * 1000L};
+	if (us > 0) nanosleep(&ts, NULL);
+}
+
+int drmGetCap(int fd, uint64_t capability, uint64_t *value)
+{
+	mock_drm_calls.get_cap++;
+	*value = capability == DRM_CAP_DUMB_BUFFER;
+	return 0;
+}
+
+int drmSetClientCap(int fd, uint64_t capability, uint64_t value)
+{
+	if (capability == DRM_CLIENT_CAP_ATOMIC && _atomic_disabled) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return 0;
+}
+
+drmModeResPtr drmModeGetResources(int fd)
+{
+	drmModeRes *res;
+	int i;
+
+	mock_drm_calls.get_resources++;
+	res = calloc(1, sizeof(*res));
+	if (!res) return NULL;
+	res->count_connectors = _topo.nr_connectors;
+	res->count_encoders = _topo.nr_connectors;
+	res->count_crtcs = _topo.nr_crtcs;
+	res->connectors = malloc(_topo.nr_connectors * sizeof(uint32_t));
+	res->encoders = malloc(_topo.nr_connectors * sizeof(uint32_t));
+	res->crtcs = malloc(_topo.nr_crtcs * sizeof(uint32_t));
+	for (i = 0; i < _topo.nr_connectors; i++) {
+		res->connectors[i] = CONNECTOR_ID_BASE + i;
+		res->encoders[i] = ENCODER_ID_BASE + i;
+	}
+	for (i = 0; i < _topo.nr_crtcs; i++) res->crtcs[i] = CRTC_ID_BASE + i;
+	res->max_width = res->max_height = 16384;
+	return res;
+}
+
+void drmModeFreeResources(drmModeResPtr ptr)
+{
+	if (!ptr) return;
+	free(ptr->connectors);
+	free(ptr->encoders);
+	free(ptr->crtcs);
+	free(ptr);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Build a copy of a connector
+ *
+ * @Param connector_id The connector id
+ * @Param probe 1 to simulate the probe delay
+ *
+ * @Returns   The connector or NULL if it does not exist
+ */
+/* ---------------------------------------------------------------------------*/
+static drmModeConnector *get_connector(uint32_t connector_id, int probe)
+{
+	drmModeConnector *conn;
+	int idx = object_index(connector_id, CONNECTOR_ID_BASE,
+			       _topo.nr_connectors);
+
+	if (idx < 0) return NULL;
+	if (probe) probe_delay(_topo.probe_delay_us);
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) return NULL;
+	conn->connector_id = connector_id;
+	conn->connector_type = MOCK_CONNECTOR_TYPE;
+	conn->connector_type_id = idx + 1;
+	conn->connection = _status[idx];
+	conn->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+	conn->count_encoders = 1;
+	conn->encoders = malloc(sizeof(uint32_t));
+	conn->encoders[0] = ENCODER_ID_BASE + idx;
+	conn->count_props = sizeof(connector_props) / sizeof(connector_props[0]);
+	conn->props = malloc(sizeof(connector_props));
+	conn->prop_values = calloc(conn->count_props, sizeof(uint64_t));
+	memcpy(conn->props, connector_props, sizeof(connector_props));
+	if (conn->connection != DRM_MODE_CONNECTED) return conn;
+
+	conn->prop_values[1] = EDID_BLOB_BASE + idx;
+
+	conn->encoder_id = idx < _topo.nr_crtcs ? ENCODER_ID_BASE + idx : 0;
+	conn->count_modes = _topo.modes_per_connector;
+	conn->modes = malloc(conn->count_modes * sizeof(drmModeModeInfo));
+	memcpy(conn->modes, _modes, conn->count_modes * sizeof(drmModeModeInfo));
+	return conn;
+}
+
+drmModeConnectorPtr drmModeGetConnector(int fd, uint32_t connectorId)
+{
+	mock_drm_calls.get_connector++;
+	return get_connector(connectorId, 1);
+}
+
+drmModeConnectorPtr drmModeGetConnectorCurrent(int fd, uint32_t connector_id)
+{
+	mock_drm_calls.get_connector_current++;
+	return get_connector(connector_id, 0);
+}
+
+void drmModeFreeConnector(drmModeConnectorPtr ptr)
+{
+	if (!ptr) return;
+	free(ptr->encoders);
+	free(ptr->modes);
+	free(ptr->props);
+	free(ptr->prop_values);
+	free(ptr);
+}
+
+drmModeEncoderPtr drmModeGetEncoder(int fd, uint32_t encoder_id)
+{
+	drmModeEncoder *enc;
+	int idx = object_index(encoder_id, ENCODER_ID_BASE,
+			       _topo.nr_connectors);
+
+	mock_drm_calls.get_encoder++;
+	if (idx < 0) return NULL;
+	enc = calloc(1, sizeof(*enc));
+	if (!enc) return NULL;
+	enc->encoder_id = encoder_id;
+	if (idx < _topo.nr_crtcs && _status[idx] == DRM_MODE_CONNECTED)
+		enc->crtc_id = CRTC_ID_BASE + idx;
+	enc->possible_crtcs = (1u << (_topo.nr_crtcs & 31)) - 1;
+	return enc;
+}
+
+void drmModeFreeEncoder(drmModeEncoderPtr ptr)
+{
+	free(ptr);
+}
+
+drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtcId)
+{
+	drmModeCrtc *crtc;
+	int idx = object_index(crtcId, CRTC_ID_BASE, _topo.nr_crtcs);
+
+	mock_drm_calls.get_crtc++;
+	if (idx < 0) return NULL;
+	crtc = calloc(1, sizeof(*crtc));
+	if (!crtc) return NULL;
+	crtc->crtc_id = crtcId;
+	if (_status[idx] == DRM_MODE_CONNECTED &&
+	    _topo.modes_per_connector > 0) {
+		crtc->mode_valid = 1;
+		crtc->mode = _modes[0];
+		crtc->width = crtc->mode.hdisplay;
+		crtc->height = crtc->mode.vdisplay;
+	}
+	return crtc;
+}
+
+void drmModeFreeCrtc(drmModeCrtcPtr ptr)
+{
+	free(ptr);
+}
+
+drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+{
+	drmModePlaneRes *res;
+	int i;
+
+	res = calloc(1, sizeof(*res));
+	if (!res) return NULL;
+	res->count_planes = _topo.nr_crtcs;
+	res->planes = malloc(_topo.nr_crtcs * sizeof(uint32_t));
+	for (i = 0; i < _topo.nr_crtcs; i++)
+		res->planes[i] = PLANE_ID_BASE + i;
+	return res;
+}
+
+void drmModeFreePlaneResources(drmModePlaneResPtr ptr)
+{
+	if (!ptr) return;
+	free(ptr->planes);
+	free(ptr);
+}
+
+drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
+{
+	drmModePlane *plane;
+	int idx = object_index(plane_id, PLANE_ID_BASE, _topo.nr_crtcs);
+
+	if (idx < 0) return NULL;
+	plane = calloc(1, sizeof(*plane));
+	if (!plane) return NULL;
+	plane->plane_id = plane_id;
+	plane->possible_crtcs = 1u << idx;
+	return plane;
+}
+
+void drmModeFreePlane(drmModePlanePtr ptr)
+{
+	free(ptr);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Property ids of an object
+ *
+ * @Param object_id The object
+ * @Param count Receives the number of properties
+ *
+ * @Returns   The property ids or NULL if the object does not exist
+ */
+/* ---------------------------------------------------------------------------*/
+static const uint32_t *object_props(uint32_t object_id, int *count)
+{
+	if (object_index(object_id, CONNECTOR_ID_BASE, _topo.nr_connectors) >=
+	    0) {
+		*count = sizeof(connector_props) / sizeof(connector_props[0]);
+		return connector_props;
+	}
+	if (object_index(object_id, CRTC_ID_BASE, _topo.nr_crtcs) >= 0) {
+		*count = sizeof(crtc_props) / sizeof(crtc_props[0]);
+		return crtc_props;
+	}
+	if (object_index(object_id, PLANE_ID_BASE, _topo.nr_crtcs) >= 0) {
+		*count = sizeof(plane_props) / sizeof(plane_props[0]);
+		return plane_props;
+	}
+	return NULL;
+}
+
+drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd,
+						      uint32_t object_id,
+						      uint32_t object_type)
+{
+	drmModeObjectProperties *props;
+	const uint32_t *ids;
+	int i, count;
+
+	ids = object_props(object_id, &count);
+	if (!ids) return NULL;
+	props = calloc(1, sizeof(*props));
+	if (!props) return NULL;
+	props->count_props = count;
+	props->props = malloc(count * sizeof(uint32_t));
+	props->prop_values = calloc(count, sizeof(uint64_t));
+	for (i = 0; i < count; i++) {
+		props->props[i] = ids[i];
+		if (ids[i] == PROP_TYPE)
+			props->prop_values[i] = DRM_PLANE_TYPE_PRIMARY;
+		else if (ids[i] == PROP_EDID &&
+			 _status[object_id - CONNECTOR_ID_BASE] ==
+			     DRM_MODE_CONNECTED)
+			props->prop_values[i] =
+			    EDID_BLOB_BASE + object_id - CONNECTOR_ID_BASE;
+	}
+	return props;
+}
+
+void drmModeFreeObjectProperties(drmModeObjectPropertiesPtr ptr)
+{
+	if (!ptr) return;
+	free(ptr->props);
+	free(ptr->prop_values);
+	free(ptr);
+}
+
+drmModePropertyPtr drmModeGetProperty(int fd, uint32_t propertyId)
+{
+	drmModePropertyRes *prop;
+
+	if (propertyId < PROP_CRTC_ID || propertyId >= PROP_END) return NULL;
+	prop = calloc(1, sizeof(*prop));
+	if (!prop) return NULL;
+	prop->prop_id = propertyId;
+	snprintf(prop->name, sizeof(prop->name), "%s",
+		 prop_names[propertyId - PROP_CRTC_ID]);
+	return prop;
+}
+
+void drmModeFreeProperty(drmModePropertyPtr ptr)
+{
+	free(ptr);
+}
+
+drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+	drmModePropertyBlobRes *blob;
+	int idx = object_index(blob_id, EDID_BLOB_BASE, _topo.nr_connectors);
+
+	mock_drm_calls.get_property_blob++;
+	if (idx < 0) return NULL;
+	blob = calloc(1, sizeof(*blob) + MOCK_EDID_LEN);
+	if (!blob) return NULL;
+	blob->id = blob_id;
+	blob->length = MOCK_EDID_LEN;
+	blob->data = blob + 1;
+	build_edid(idx, blob->data);
+	return blob;
+}
+
+void drmModeFreePropertyBlob(drmModePropertyBlobPtr ptr)
+{
+	free(ptr);
+}
+
+int drmModeCreatePropertyBlob(int fd, const void *data, size_t size,
+			      uint32_t *id)
+{
+	*id = _next_blob++;
+	return 0;
+}
+
+int drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+	return 0;
+}
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	struct drm_mode_create_dumb *create = arg;
+
+	if (request == DRM_IOCTL_MODE_CREATE_DUMB) {
+		mock_drm_calls.create_dumb++;
+		create->handle = _next_handle++;
+		create->pitch = create->width * ((create->bpp + 7) / 8);
+		create->size = (uint64_t)create->pitch * create->height;
+	}
+	return 0;
+}
+
+int drmModeAddFB(int fd, uint32_t width, uint32_t height, uint8_t depth,
+		 uint8_t bpp, uint32_t pitch, uint32_t bo_handle,
+		 uint32_t *buf_id)
+{
+	*buf_id = _next_fb++;
+	return 0;
+}
+
+int drmModeRmFB(int fd, uint32_t bufferId)
+{
+	return 0;
+}
+
+int drmModeSetCrtc(int fd, uint32_t crtcId, uint32_t bufferId, uint32_t x,
+		   uint32_t y, uint32_t *connectors, int count,
+		   drmModeModeInfoPtr mode)
+{
+	mock_drm_calls.set_crtc++;
+	if (object_index(crtcId, CRTC_ID_BASE, _topo.nr_crtcs) < 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+	probe_delay(_topo.modeset_delay_us);
+	return 0;
+}
+
+drmModeAtomicReqPtr drmModeAtomicAlloc(void)
+{
+	return calloc(1, sizeof(drmModeAtomicReq));
+}
+
+void drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+	if (!req) return;
+	free(req->items);
+	free(req);
+}
+
+int drmModeAtomicAddProperty(drmModeAtomicReqPtr req, uint32_t object_id,
+			     uint32_t property_id, uint64_t value)
+{
+	void *items;
+
+	if (req->count == req->capacity) {
+		req->capacity = req->capacity ? req->capacity * 2 : 16;
+		items = realloc(req->items,
+				req->capacity * sizeof(req->items[0]));
+		if (!items) return -ENOMEM;
+		req->items = items;
+	}
+	req->items[req->count].object_id = object_id;
+	req->items[req->count].property_id = property_id;
+	req->items[req->count].value = value;
+	return ++req->count;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check that every property of a request exists on its object
+ *
+ * @Param req The request
+ * @Param nr_crtcs Receives the number of CRTCs in the request
+ *
+ * @Returns   0 if valid, -EINVAL otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int check_request(drmModeAtomicReq *req, int *nr_crtcs)
+{
+	const uint32_t *ids;
+	uint32_t seen = 0;
+	int i, j, count, idx;
+
+	for (i = 0; i < req->count; i++) {
+		ids = object_props(req->items[i].object_id, &count);
+		if (!ids) return -EINVAL;
+		for (j = 0; j < count; j++) {
+			if (ids[j] == req->items[i].property_id) break;
+		}
+		if (j == count) return -EINVAL;
+		idx = object_index(req->items[i].object_id, CRTC_ID_BASE,
+				   _topo.nr_crtcs);
+		if (idx >= 0) seen |= 1u << (idx & 31);
+	}
+	*nr_crtcs = __builtin_popcount(seen);
+	return 0;
+}
+
+int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+			void *user_data)
+{
+	int ret, nr_crtcs;
+
+	mock_drm_calls.atomic_commit++;
+	ret = check_request(req, &nr_crtcs);
+	if (ret < 0 || flags & DRM_MODE_ATOMIC_TEST_ONLY) {
+		if (ret < 0) errno = -ret;
+		return ret;
+	}
+	if (_pending_events) {
+		errno = EBUSY;
+		return -EBUSY;
+	}
+	if (!(flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+		probe_delay(_topo.modeset_delay_us);
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &_pending_done);
+	_pending_done.tv_nsec += _topo.modeset_delay_us * 1000L;
+	_pending_done.tv_sec += _pending_done.tv_nsec / 1000000000L;
+	_pending_done.tv_nsec %= 1000000000L;
+	if (flags & DRM_MODE_PAGE_FLIP_EVENT) {
+		_pending_events = nr_crtcs;
+		_pending_data = user_data;
+		/* Makes a FIFO used as the card node readable */
+		if (write(fd, "", 1) < 0) return -errno;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Deliver the completion events of the last commit
+ * Blocks until the commit is done. /dev/null as the card node is always
+ * readable, a FIFO is readable while a commit has pending events, like a
+ * real card. drmdaemon-mock uses a FIFO since epoll refuses /dev/null.
+ */
+/* ---------------------------------------------------------------------------*/
+int drmHandleEvent(int fd, drmEventContext *evctx)
+{
+	int n = _pending_events;
+	char c;
+
+	if (!n) return 0;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &_pending_done, NULL);
+	if (read(fd, &c, 1) < 0) return -1;
+	_pending_events = 0;
+	while (n--) {
+		if (evctx->page_flip_handler)
+			evctx->page_flip_handler(fd, 0, 0, 0, _pending_data);
+	}
+	return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file mock_drm.h
+ * @Brief  Link-time fake of the libdrm calls used by the daemon
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-03
+ *
+ * Linked instead of -ldrm, the fake serves a card described by a
+ * topology so the scan code runs without a GPU.
+ */
+
+#ifndef _MOCK_DRM_H_
+#define _MOCK_DRM_H_
+
+#include <stdint.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/* Product code in the EDID of the fake monitors */
+#define MOCK_EDID_PRODUCT 0x1000
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Description of the fake card
+ * Connector i drives CRTC i when i < nr_crtcs, the others are
+ * disconnected. Every CRTC has one primary plane. The monitors report
+ * vendor MCK, product MOCK_EDID_PRODUCT and serial number i + 1.
+ */
+/* ---------------------------------------------------------------------------*/
+struct mock_topology {
+	int nr_connectors;
+	int nr_crtcs;
+	int modes_per_connector;
+	/* Time a full probe (drmModeGetConnector) takes, e.g. DDC/EDID */
+	int probe_delay_us;
+	/* Time until a modeset runs on the screen, drmModeSetCrtc blocks for
+	 * it, an atomic commit completes after it */
+	int modeset_delay_us;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Number of calls per faked libdrm function
+ */
+/* ---------------------------------------------------------------------------*/
+struct mock_counters {
+	unsigned long get_resources;
+	unsigned long get_connector;
+	unsigned long get_connector_current;
+	unsigned long get_encoder;
+	unsigned long get_crtc;
+	unsigned long get_cap;
+	unsigned long get_property_blob;
+	unsigned long atomic_commit;
+	unsigned long set_crtc;
+	unsigned long create_dumb;
+};
+
+extern struct mock_counters mock_drm_calls;
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Build the fake card, replacing a previous one
+ *
+ * @Param topo The topology
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int mock_drm_setup(const struct mock_topology *topo);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Simulate a hotplug by changing the status of a connector
+ *
+ * @Param idx The connector index
+ * @Param status DRM_MODE_CONNECTED or DRM_MODE_DISCONNECTED
+ */
+/* ---------------------------------------------------------------------------*/
+void mock_drm_set_connection(int idx, drmModeConnection status);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Connector id of a connector index
+ *
+ * @Param idx The connector index
+ *
+ * @Returns   The connector id
+ */
+/* ---------------------------------------------------------------------------*/
+uint32_t mock_drm_connector_id(int idx);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Disable the atomic client capability, like a legacy driver
+ *
+ * @Param disabled 1 to refuse DRM_CLIENT_CAP_ATOMIC
+ */
+/* ---------------------------------------------------------------------------*/
+void mock_drm_disable_atomic(int disabled);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Reset the call counters
+ */
+/* ---------------------------------------------------------------------------*/
+void mock_drm_reset_counters();
+
+#endif
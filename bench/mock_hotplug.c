@@ -0,0 +1,49 @@
+/**
+ * @file mock_hotplug.c
+ * @Brief  Fake card of drmdaemon-mock, SIGUSR2 plugs a monitor in or out
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-29
+ *
+ * Linked into the daemon together with mock_drm.c, see the drmdaemon-mock
+ * target in the Makefile. The card has four connectors with a monitor on
+ * the first two. SIGUSR2 toggles a monitor on the third connector, a
+ * SIGHUP afterwards makes the daemon rescan and notice it.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock_drm.h"
+
+static const struct mock_topology topo = {4, 2, 16, 0, 0};
+static volatile sig_atomic_t _plugged;
+
+static void hotplug(int sig)
+{
+	_plugged = !_plugged;
+	mock_drm_set_connection(topo.nr_crtcs, _plugged
+						   ? DRM_MODE_CONNECTED
+						   : DRM_MODE_DISCONNECTED);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Build the fake card before main opens it
+ */
+/* ---------------------------------------------------------------------------*/
+__attribute__((constructor)) static void mock_hotplug_init()
+{
+	struct sigaction sa;
+
+	if (mock_drm_setup(&topo) < 0) {
+		fprintf(stderr, "Failed to set up the fake card\n");
+		exit(1);
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = hotplug;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &sa, NULL);
+}
@@ -0,0 +1,357 @@
+/**
+ * @file card.c
+ * @Brief  Per card state: DRM device, connector registry and pending work
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-27
+ */
+
+#include "card.h"
+#include "metrics.h"
+#include "trace.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open a card, the connectors are not populated yet
+ *
+ * @Param device_name The device node, e.g. /dev/dri/card0
+ *
+ * @Returns   A newly allocated card or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_card *card_open(const char *device_name)
+{
+	struct drm_card *card = malloc(sizeof(*card));
+	if (!card) {
+		log_error("Failed to allocate card");
+		return NULL;
+	}
+	memset(card, 0, sizeof(*card));
+	card->drm = drm_device_open(device_name);
+	if (!card->drm) {
+		free(card);
+		return NULL;
+	}
+	card->apply = apply_create(card->drm);
+	if (!card->apply)
+		log_warning("%s: modes cannot be applied",
+			    card->drm->device_name);
+	return card;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Close a card and free its connector registry
+ *
+ * @Param card The card
+ */
+/* ---------------------------------------------------------------------------*/
+void card_close(struct drm_card *card)
+{
+	if (!card) return;
+	registry_destroy(card->connectors);
+	apply_destroy(card->apply);
+	drm_device_close(card->drm);
+	free(card);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Warn about outputs that did not fit in one commit
+ *
+ * @Param card The card
+ * @Param skipped Number of outputs left out of the commit
+ */
+/* ---------------------------------------------------------------------------*/
+static void warn_skipped(struct drm_card *card, int skipped)
+{
+	if (!skipped) return;
+	log_warning("%s: %d output(s) left unchanged, a commit takes at most "
+		    "%d", card->drm->device_name, skipped, MAX_APPLY_OUTPUTS);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Start a card from a registry restored from a snapshot
+ * With auto_apply set the modes the outputs were left in are applied
+ * right away. A full rescan is queued to reconcile the registry with the
+ * hardware.
+ *
+ * @Param card The card
+ * @Param reg The restored registry, owned by the card afterwards
+ */
+/* ---------------------------------------------------------------------------*/
+void card_warm_start(struct drm_card *card, struct conn_registry *reg)
+{
+	struct apply_config cfg;
+	struct drm_connector_obj *obj;
+	int i, skipped = 0;
+
+	card->connectors = reg;
+	card_track_connector(card, 0, 1);
+	if (!card->auto_apply || !card->apply) return;
+	/* The hardware is in its boot state, so every lit output is set,
+	 * even though the registry says it already has its mode */
+	cfg.nr_outputs = 0;
+	for (i = 0; i < REGISTRY_SIZE(reg); i++) {
+		obj = REGISTRY_AT(reg, i);
+		if (obj->status != DRM_MODE_CONNECTED ||
+		    obj->current_mode == MODE_HANDLE_NONE)
+			continue;
+		if (apply_config_add(&cfg, obj->connector_id,
+				     obj->current_mode) < 0)
+			skipped++;
+	}
+	warn_skipped(card, skipped);
+	if (cfg.nr_outputs && apply_config(card->apply, reg, &cfg) < 0)
+		log_warning("%s: last layout rejected, waiting for the probe",
+			    card->drm->device_name);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Populate the connector registry of a card
+ * A card that was warm started is left alone.
+ * With auto_apply set the policy is applied afterwards.
+ * Has the signature of a worker pool job.
+ *
+ * @Param data The card
+ */
+/* ---------------------------------------------------------------------------*/
+void card_populate(void *data)
+{
+	struct drm_card *card = data;
+	if (card->connectors) return;
+	card->dirty = 1;
+	card->connectors = populate_drm_conn_list(card->drm);
+	if (!card->connectors)
+		log_error("%s: failed to retrieve connectors",
+			  card->drm->device_name);
+	else if (card->auto_apply)
+		card_apply_policy(card);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if another connected output scans out from a CRTC
+ *
+ * @Param reg The connector registry
+ * @Param obj The output that is asking
+ *
+ * @Returns   1 if the CRTC of obj is in use by another output, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int crtc_shared(struct conn_registry *reg,
+		       struct drm_connector_obj *obj)
+{
+	struct drm_connector_obj *other;
+	int i;
+
+	for (i = 0; i < REGISTRY_SIZE(reg); i++) {
+		other = REGISTRY_AT(reg, i);
+		if (other != obj && other->crtc_id == obj->crtc_id &&
+		    other->status == DRM_MODE_CONNECTED)
+			return 1;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the mode the policy wants for an output
+ *
+ * @Param card The card
+ * @Param obj The output, its position is set if a rule places it
+ *
+ * @Returns   The mode, MODE_HANDLE_NONE to switch the output off
+ */
+/* ---------------------------------------------------------------------------*/
+static mode_handle wanted_mode(struct drm_card *card,
+			       struct drm_connector_obj *obj)
+{
+	const struct policy_rule *rule = NULL;
+	mode_handle mode;
+
+	if (obj->status != DRM_MODE_CONNECTED) return MODE_HANDLE_NONE;
+	if (card->policy) rule = policy_lookup(card->policy, obj);
+	if (rule) {
+		if (rule->has_pos) {
+			if (obj->x != rule->x || obj->y != rule->y)
+				obj->changed |= CONN_CHANGED_POSITION;
+			obj->x = rule->x;
+			obj->y = rule->y;
+		}
+		return policy_pick_mode(rule, obj);
+	}
+	/* Without a rule a lit output keeps its mode */
+	if (obj->crtc_id && obj->current_mode != MODE_HANDLE_NONE)
+		return obj->current_mode;
+	mode = obj->preferred_mode;
+	if (!mode && obj->nr_of_modes) mode = obj->modes[0];
+	return mode;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Bring the outputs in the state the policy asks for, in one commit
+ * Outputs matched by a rule get the mode and position of the rule.
+ * Other connected outputs without a mode get their preferred mode.
+ * Outputs that were disconnected are switched off.
+ *
+ * @Param card The card
+ *
+ * @Returns   0 if successfull or nothing to do, -1 if failed or if outputs
+ * beyond MAX_APPLY_OUTPUTS were left unchanged
+ */
+/* ---------------------------------------------------------------------------*/
+int card_apply_policy(struct drm_card *card)
+{
+	struct apply_config cfg;
+	struct drm_connector_obj *obj;
+	mode_handle mode;
+	int i, skipped = 0;
+
+	if (!card->apply || !card->connectors) return -1;
+	cfg.nr_outputs = 0;
+	for (i = 0; i < REGISTRY_SIZE(card->connectors); i++) {
+		obj = REGISTRY_AT(card->connectors, i);
+		mode = wanted_mode(card, obj);
+		if (mode == MODE_HANDLE_NONE) {
+			/* A clone shares the CRTC with an output that stays */
+			if (!obj->crtc_id || crtc_shared(card->connectors, obj))
+				continue;
+		} else if (obj->crtc_id && mode == obj->current_mode) {
+			continue;
+		}
+		if (apply_config_add(&cfg, obj->connector_id, mode) < 0)
+			skipped++;
+	}
+	warn_skipped(card, skipped);
+	if (apply_config(card->apply, card->connectors, &cfg) < 0) return -1;
+	return skipped ? -1 : 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remember a connector that needs a rescan
+ *
+ * @Param card The card
+ * @Param connector_id The connector id, 0 to rescan all connectors
+ * @Param probe 1 to force a probe, 0 if the current state suffices
+ */
+/* ---------------------------------------------------------------------------*/
+void card_track_connector(struct drm_card *card, uint32_t connector_id,
+			  int probe)
+{
+	int i;
+
+	if (!card_has_pending(card)) card->queued_us = metrics_now_us();
+	if (card->pending_full) return;
+	if (connector_id == 0) {
+		card->pending_full = 1;
+		return;
+	}
+	for (i = 0; i < card->nr_pending; i++) {
+		if (card->pending[i].connector_id == connector_id) {
+			card->pending[i].probe |= probe;
+			return;
+		}
+	}
+	if (card->nr_pending == MAX_PENDING_CONNECTORS) {
+		card->pending_full = 1;
+		return;
+	}
+	card->pending[card->nr_pending].connector_id = connector_id;
+	card->pending[card->nr_pending].probe = probe;
+	card->nr_pending++;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if a card has pending work
+ *
+ * @Param card The card
+ *
+ * @Returns   1 if a rescan is needed, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+int card_has_pending(struct drm_card *card)
+{
+	return card->pending_full || card->nr_pending > 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Run the pending rescan of a card
+ * Pending connectors are updated one by one, everything is rescanned if
+ * the pending set overflowed or one of them is unknown.
+ * Has the signature of a worker pool job.
+ *
+ * @Param data The card
+ */
+/* ---------------------------------------------------------------------------*/
+void card_rescan(void *data)
+{
+	struct drm_card *card = data;
+	uint64_t start_us, end_us;
+	int i, changed = 0, ret;
+
+	start_us = metrics_now_us();
+	if (card_has_pending(card))
+		metrics_observe(METRIC_QUEUE_TO_SCAN,
+				start_us - card->queued_us);
+	trace(TRACE_RESCAN_START, card->drm->minor, 0, card->nr_pending,
+	      card->pending_full, 0);
+	if (!card->connectors) {
+		/* The initial population failed, try again from scratch */
+		card_populate(card);
+		goto end;
+	}
+	for (i = 0; i < card->nr_pending && !card->pending_full; i++) {
+		ret = update_drm_connector(card->connectors,
+					   card->drm,
+					   card->pending[i].connector_id,
+					   card->pending[i].probe);
+		/* Unknown connector, e.g. a new MST port: scan everything */
+		if (ret < 0)
+			card->pending_full = 1;
+		else
+			changed += ret;
+		card->connector_rescans++;
+		metrics_inc(METRIC_CONNECTOR_RESCANS);
+	}
+	if (card->pending_full) {
+		log_info("Updating %s", card->drm->device_name);
+		ret = update_drm_conn_list(card->connectors, card->drm);
+		if (ret > 0) changed += ret;
+	}
+	if (changed && card->auto_apply) card_apply_policy(card);
+	if (changed) card->dirty = 1;
+end:
+	card->nr_pending = 0;
+	card->pending_full = 0;
+	card->rescans++;
+	end_us = metrics_now_us();
+	metrics_inc(METRIC_RESCANS);
+	metrics_add(METRIC_CONNECTORS_CHANGED, changed);
+	metrics_observe(METRIC_SCAN_DURATION, end_us - start_us);
+	trace(TRACE_RESCAN_END, card->drm->minor, 0, end_us - start_us, 0, 0);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Forget the changed fields and removed connectors of a card once
+ * they were reported
+ *
+ * @Param card The card
+ */
+/* ---------------------------------------------------------------------------*/
+void card_clear_changes(struct drm_card *card)
+{
+	int i;
+
+	if (!card->connectors) return;
+	for (i = 0; i < REGISTRY_SIZE(card->connectors); i++)
+		REGISTRY_AT(card->connectors, i)->changed = 0;
+	card->connectors->nr_removed = 0;
+}
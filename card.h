@@ -0,0 +1,170 @@
+/**
+ * @file card.h
+ * @Brief  Per card state: DRM device, connector registry and pending work
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-27
+ */
+
+#ifndef _CARD_H_
+#define _CARD_H_
+
+#include <stdint.h>
+
+#include "apply.h"
+#include "drm_device.h"
+#include "policy.h"
+#include "registry.h"
+
+/* Connectors tracked for a targeted rescan before falling back to a full
+ * rescan */
+#define MAX_PENDING_CONNECTORS 16
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Connector named by a CONNECTOR uevent key, waiting for a rescan
+ */
+/* ---------------------------------------------------------------------------*/
+struct pending_connector {
+	uint32_t connector_id;
+	/* 0 if only properties changed and the current state suffices */
+	int probe;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  DRM card context
+ * A card is only touched by one thread at a time: the event loop tracks
+ * pending work, a worker runs the scan while the event loop waits.
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_card {
+	struct drm_device *drm;
+	struct conn_registry *connectors;
+	/* Mode apply state, NULL if it could not be created */
+	struct apply_state *apply;
+	/* 1 to light up connected outputs and switch off disconnected ones
+	 * after a scan */
+	int auto_apply;
+	/* Output rules shared by all cards, NULL to use the preferred mode */
+	const struct policy *policy;
+	/* Connectors to rescan, or all of them if pending_full is set */
+	struct pending_connector pending[MAX_PENDING_CONNECTORS];
+	int nr_pending;
+	int pending_full;
+	/* Monotonic time in us the first pending work was queued */
+	uint64_t queued_us;
+	/* 1 if the registry changed since it was last written to the
+	 * snapshot */
+	int dirty;
+	/* Counters */
+	unsigned long rescans;
+	unsigned long connector_rescans;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open a card, the connectors are not populated yet
+ *
+ * @Param device_name The device node, e.g. /dev/dri/card0
+ *
+ * @Returns   A newly allocated card or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_card *card_open(const char *device_name);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Close a card and free its connector registry
+ *
+ * @Param card The card
+ */
+/* ---------------------------------------------------------------------------*/
+void card_close(struct drm_card *card);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Start a card from a registry restored from a snapshot
+ * With auto_apply set the modes the outputs were left in are applied
+ * right away. A full rescan is queued to reconcile the registry with the
+ * hardware.
+ *
+ * @Param card The card
+ * @Param reg The restored registry, owned by the card afterwards
+ */
+/* ---------------------------------------------------------------------------*/
+void card_warm_start(struct drm_card *card, struct conn_registry *reg);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Populate the connector registry of a card
+ * A card that was warm started is left alone.
+ * With auto_apply set the policy is applied afterwards.
+ * Has the signature of a worker pool job.
+ *
+ * @Param data The card
+ */
+/* ---------------------------------------------------------------------------*/
+void card_populate(void *data);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Bring the outputs in the state the policy asks for, in one commit
+ * Outputs matched by a rule get the mode and position of the rule.
+ * Other connected outputs without a mode get their preferred mode.
+ * Outputs that were disconnected are switched off.
+ *
+ * @Param card The card
+ *
+ * @Returns   0 if successfull or nothing to do, -1 if failed or if outputs
+ * beyond MAX_APPLY_OUTPUTS were left unchanged
+ */
+/* ---------------------------------------------------------------------------*/
+int card_apply_policy(struct drm_card *card);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remember a connector that needs a rescan
+ *
+ * @Param card The card
+ * @Param connector_id The connector id, 0 to rescan all connectors
+ * @Param probe 1 to force a probe, 0 if the current state suffices
+ */
+/* ---------------------------------------------------------------------------*/
+void card_track_connector(struct drm_card *card, uint32_t connector_id,
+			  int probe);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if a card has pending work
+ *
+ * @Param card The card
+ *
+ * @Returns   1 if a rescan is needed, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+int card_has_pending(struct drm_card *card);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Run the pending rescan of a card
+ * Pending connectors are updated one by one, everything is rescanned if
+ * the pending set overflowed or one of them is unknown.
+ * Has the signature of a worker pool job.
+ *
+ * @Param data The card
+ */
+/* ---------------------------------------------------------------------------*/
+void card_rescan(void *data);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Forget the changed fields and removed connectors of a card once
+ * they were reported
+ *
+ * @Param card The card
+ */
+/* ---------------------------------------------------------------------------*/
+void card_clear_changes(struct drm_card *card);
+
+#endif
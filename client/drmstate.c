@@ -0,0 +1,214 @@
+/**
+ * @file drmstate.c
+ * @Brief  Client library for the connector state published by drmdaemon
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-22
+ */
+
+#include "drmstate.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Attempts before a read gives up on a page that keeps changing, an
+ * update takes microseconds so this only trips if the daemon died in
+ * the middle of one */
+#define DRMSTATE_MAX_RETRIES 100000
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Receive the fd of the page from the daemon
+ *
+ * @Param sock The connected socket
+ *
+ * @Returns   The fd or -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int receive_fd(int sock)
+{
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t magic;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &magic;
+	iov.iov_len = sizeof(magic);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(magic)) return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	if (magic != DRMSTATE_MAGIC) {
+		close(fd);
+		errno = EPROTO;
+		return -1;
+	}
+	return fd;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Connect to the state socket of the daemon and map the page
+ *
+ * @Param path The socket path given to drmdaemon -S
+ *
+ * @Returns   The mapped state or NULL with errno set if failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmstate *drmstate_open(const char *path)
+{
+	struct sockaddr_un addr;
+	struct drmstate *st = NULL;
+	int sock, fd, err;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) return NULL;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+	    (fd = receive_fd(sock)) >= 0) {
+		st = drmstate_attach(fd);
+		err = errno;
+		close(fd);
+		errno = err;
+	}
+	err = errno;
+	close(sock);
+	errno = err;
+	return st;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Map a state page from its fd
+ * The fd is not needed afterwards and may be closed.
+ *
+ * @Param fd The fd of the page
+ *
+ * @Returns   The mapped state or NULL with errno set if failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmstate *drmstate_attach(int fd)
+{
+	struct drmstate *st;
+	struct stat sb;
+	void *map;
+
+	/* The daemon seals the size, a smaller page is not ours */
+	if (fstat(fd, &sb) < 0) return NULL;
+	if (sb.st_size < (off_t)sizeof(struct drmstate_page)) {
+		errno = EPROTO;
+		return NULL;
+	}
+	map = mmap(NULL, sizeof(struct drmstate_page), PROT_READ, MAP_SHARED,
+		   fd, 0);
+	if (map == MAP_FAILED) return NULL;
+	st = malloc(sizeof(*st));
+	if (!st) {
+		munmap(map, sizeof(struct drmstate_page));
+		return NULL;
+	}
+	st->page = map;
+	if (st->page->magic != DRMSTATE_MAGIC ||
+	    st->page->version != DRMSTATE_VERSION) {
+		drmstate_close(st);
+		errno = EPROTO;
+		return NULL;
+	}
+	return st;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Current sequence of the page, without copying anything
+ * The value changes on every update, it is odd while one is running.
+ *
+ * @Param st The mapped state
+ *
+ * @Returns   The sequence
+ */
+/* ---------------------------------------------------------------------------*/
+uint32_t drmstate_generation(const struct drmstate *st)
+{
+	return __atomic_load_n(&st->page->seq, __ATOMIC_ACQUIRE);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy a consistent snapshot of the state
+ * Retries while the daemon is updating the page.
+ *
+ * @Param st The mapped state
+ * @Param snap Receives the state
+ *
+ * @Returns   0 if successfull, -1 with errno EAGAIN if the page kept
+ * changing
+ */
+/* ---------------------------------------------------------------------------*/
+int drmstate_read(const struct drmstate *st, struct drmstate_snapshot *snap)
+{
+	const struct drmstate_snapshot *src = &st->page->state;
+	uint32_t seq, nr_connectors, nr_modes;
+	int i;
+
+	for (i = 0; i < DRMSTATE_MAX_RETRIES; i++) {
+		seq = __atomic_load_n(&st->page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) continue;
+		/* The counts may be torn too, only copy what the page holds */
+		nr_connectors = src->nr_connectors;
+		nr_modes = src->nr_modes;
+		if (nr_connectors > DRMSTATE_MAX_CONNECTORS)
+			nr_connectors = DRMSTATE_MAX_CONNECTORS;
+		if (nr_modes > DRMSTATE_MAX_MODES) nr_modes = DRMSTATE_MAX_MODES;
+		snap->flags = src->flags;
+		memcpy(snap->connectors, src->connectors,
+		       nr_connectors * sizeof(*snap->connectors));
+		memcpy(snap->modes, src->modes, nr_modes * sizeof(*snap->modes));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&st->page->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		snap->generation = seq;
+		snap->nr_connectors = nr_connectors;
+		snap->nr_modes = nr_modes;
+		return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Unmap the page
+ *
+ * @Param st The mapped state, may be NULL
+ */
+/* ---------------------------------------------------------------------------*/
+void drmstate_close(struct drmstate *st)
+{
+	if (!st) return;
+	munmap((void *)st->page, sizeof(struct drmstate_page));
+	free(st);
+}
@@ -0,0 +1,208 @@
+/**
+ * @file drmstate.h
+ * @Brief  Client library for the connector state published by drmdaemon
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-22
+ *
+ * The daemon keeps the state of every connector in a shared memory page
+ * (a sealed memfd). A client connects once to the state socket (-S) and
+ * receives the fd of the page, after that a read is a copy out of its own
+ * read-only mapping: no syscall and no round-trip to the daemon, however
+ * many clients there are.
+ *
+ * The page is protected by a seqlock. The daemon makes the sequence odd
+ * while it writes and even when it is done, a reader that saw the
+ * sequence change retries. Polling drmstate_generation() is the cheap way
+ * to notice a change.
+ *
+ *   struct drmstate *st = drmstate_open("/run/drmdaemon.state");
+ *   static struct drmstate_snapshot snap;
+ *   if (st && drmstate_read(st, &snap) == 0)
+ *           printf("%u connectors\n", snap.nr_connectors);
+ *
+ * This header is the whole interface, it does not need libdrm.
+ */
+
+#ifndef _DRMSTATE_H_
+#define _DRMSTATE_H_
+
+#include <stdint.h>
+
+/* "DRMS", first word of the page */
+#define DRMSTATE_MAGIC 0x534d5244u
+
+/* Layout version, bumped on every change to the structures below */
+#define DRMSTATE_VERSION 1
+
+/* Capacity of the page, the connectors of all cards together */
+#define DRMSTATE_MAX_CONNECTORS 64
+#define DRMSTATE_MAX_MODES 2048
+
+#define DRMSTATE_NAME_LEN 32
+#define DRMSTATE_EDID_TEXT_LEN 14
+
+/* More connectors or modes than the page holds, the rest is left out */
+#define DRMSTATE_FLAG_TRUNCATED 0x1
+/* The daemon stopped, the page is no longer updated */
+#define DRMSTATE_FLAG_CLOSED 0x2
+
+/* Connection status, the values of DRM_MODE_CONNECTED and friends */
+#define DRMSTATE_CONNECTED 1
+#define DRMSTATE_DISCONNECTED 2
+#define DRMSTATE_UNKNOWN 3
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A display mode
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmstate_mode {
+	uint16_t width;
+	uint16_t height;
+	/* Refresh rate in Hz */
+	uint32_t refresh;
+	/* Pixel clock in kHz */
+	uint32_t clock;
+	/* DRM_MODE_FLAG_* */
+	uint32_t flags;
+	char name[DRMSTATE_NAME_LEN];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A connector
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmstate_connector {
+	/* Minor of the card, 0 for /dev/dri/card0 */
+	uint32_t card;
+	uint32_t connector_id;
+	/* DRMSTATE_CONNECTED, DRMSTATE_DISCONNECTED or DRMSTATE_UNKNOWN */
+	uint32_t status;
+	/* DRM_MODE_CONNECTOR_* */
+	uint32_t type;
+	/* The CRTC scanning out, 0 if the output is off */
+	uint32_t crtc_id;
+	/* Position in the output layout */
+	int32_t x;
+	int32_t y;
+	/* The modes of the connector are modes[first_mode] up to
+	 * modes[first_mode + nr_modes - 1] of the snapshot */
+	uint32_t first_mode;
+	uint32_t nr_modes;
+	/* Index of the preferred mode in the modes of the connector, -1 if
+	 * there is none */
+	int32_t preferred;
+	/* The mode on the screen, zeroed if the output is off */
+	struct drmstate_mode current;
+	/* e.g. Card0-DP-1 */
+	char name[DRMSTATE_NAME_LEN];
+	/* Monitor identity from the EDID, empty if there is none */
+	char vendor[4];
+	uint16_t product;
+	char serial[DRMSTATE_EDID_TEXT_LEN];
+	char monitor[DRMSTATE_EDID_TEXT_LEN];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A consistent copy of the state
+ * Large, allocate it once and reuse it for every read.
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmstate_snapshot {
+	/* Sequence the copy was taken at, see drmstate_generation */
+	uint32_t generation;
+	/* DRMSTATE_FLAG_* */
+	uint32_t flags;
+	uint32_t nr_connectors;
+	uint32_t nr_modes;
+	struct drmstate_connector connectors[DRMSTATE_MAX_CONNECTORS];
+	struct drmstate_mode modes[DRMSTATE_MAX_MODES];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  The shared page
+ * Only the daemon writes it. The generation field of the state is not
+ * used, the sequence takes its place.
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmstate_page {
+	uint32_t magic;
+	uint32_t version;
+	/* Seqlock sequence, odd while the daemon writes */
+	uint32_t seq;
+	uint32_t reserved;
+	struct drmstate_snapshot state;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A mapped state page
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmstate {
+	const struct drmstate_page *page;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Connect to the state socket of the daemon and map the page
+ *
+ * @Param path The socket path given to drmdaemon -S
+ *
+ * @Returns   The mapped state or NULL with errno set if failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmstate *drmstate_open(const char *path);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Map a state page from its fd
+ * The fd is not needed afterwards and may be closed.
+ *
+ * @Param fd The fd of the page
+ *
+ * @Returns   The mapped state or NULL with errno set if failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmstate *drmstate_attach(int fd);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Current sequence of the page, without copying anything
+ * The value changes on every update, it is odd while one is running.
+ *
+ * @Param st The mapped state
+ *
+ * @Returns   The sequence
+ */
+/* ---------------------------------------------------------------------------*/
+uint32_t drmstate_generation(const struct drmstate *st);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy a consistent snapshot of the state
+ * Retries while the daemon is updating the page.
+ *
+ * @Param st The mapped state
+ * @Param snap Receives the state
+ *
+ * @Returns   0 if successfull, -1 with errno EAGAIN if the page kept
+ * changing
+ */
+/* ---------------------------------------------------------------------------*/
+int drmstate_read(const struct drmstate *st, struct drmstate_snapshot *snap);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Unmap the page
+ *
+ * @Param st The mapped state, may be NULL
+ */
+/* ---------------------------------------------------------------------------*/
+void drmstate_close(struct drmstate *st);
+
+#endif
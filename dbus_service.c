@@ -0,0 +1,598 @@
+/**
+ * @file dbus_service.c
+ * @Brief  D-Bus interface to the connectors and modes
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-29
+ */
+
+#include "dbus_service.h"
+
+#include <dbus/dbus.h>
+
+#include "metrics.h"
+#include "registry.h"
+
+#define ERROR_NO_SUCH_CONNECTOR DBUS_SERVICE_INTERFACE ".Error.NoSuchConnector"
+#define ERROR_NO_SUCH_MODE DBUS_SERVICE_INTERFACE ".Error.NoSuchMode"
+#define ERROR_APPLY_FAILED DBUS_SERVICE_INTERFACE ".Error.ApplyFailed"
+
+/* The changes a client can see, the encoder is not exported */
+#define EXPORTED_CHANGES                                                     \
+	(CONN_CHANGED_STATUS | CONN_CHANGED_MONITOR | CONN_CHANGED_CRTC |    \
+	 CONN_CHANGED_MODES | CONN_CHANGED_CURRENT_MODE |                    \
+	 CONN_CHANGED_POSITION | CONN_CHANGED_ADDED)
+
+static const char introspect_xml[] =
+    DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+    "<node>\n"
+    " <interface name=\"" DBUS_INTERFACE_INTROSPECTABLE "\">\n"
+    "  <method name=\"Introspect\">\n"
+    "   <arg name=\"xml\" type=\"s\" direction=\"out\"/>\n"
+    "  </method>\n"
+    " </interface>\n"
+    " <interface name=\"" DBUS_SERVICE_INTERFACE "\">\n"
+    "  <method name=\"GetConnectors\">\n"
+    "   <arg name=\"connectors\" type=\"a(uua{sv})\" direction=\"out\"/>\n"
+    "  </method>\n"
+    "  <method name=\"SetMode\">\n"
+    "   <arg name=\"card\" type=\"u\" direction=\"in\"/>\n"
+    "   <arg name=\"connector\" type=\"u\" direction=\"in\"/>\n"
+    "   <arg name=\"width\" type=\"q\" direction=\"in\"/>\n"
+    "   <arg name=\"height\" type=\"q\" direction=\"in\"/>\n"
+    "   <arg name=\"refresh\" type=\"u\" direction=\"in\"/>\n"
+    "  </method>\n"
+    "  <signal name=\"ConnectorsChanged\">\n"
+    "   <arg name=\"changed\" type=\"a(uua{sv})\"/>\n"
+    "   <arg name=\"removed\" type=\"a(uu)\"/>\n"
+    "  </signal>\n"
+    " </interface>\n"
+    "</node>\n";
+
+static const char *const status_names[] = {
+    "unknown", "connected", "disconnected", "unknown",
+};
+
+static DBusConnection *_conn;
+static int _fd = -1;
+static struct event_loop *_loop;
+/* EPOLLOUT is watched, messages wait for room in the socket */
+static int _writing;
+static struct drm_card *const *_cards;
+static int _nr_cards;
+static dbus_changed_cb _changed;
+static void *_changed_data;
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Append a mode as (qqu), zeroes for no mode
+ *
+ * @Param iter The iterator to append to
+ * @Param handle The mode
+ */
+/* ---------------------------------------------------------------------------*/
+static void append_mode(DBusMessageIter *iter, mode_handle handle)
+{
+	const drmModeModeInfo *mode;
+	DBusMessageIter st;
+	uint16_t width = 0, height = 0;
+	uint32_t refresh = 0;
+
+	if (handle != MODE_HANDLE_NONE) {
+		mode = mode_pool_get(handle);
+		width = mode->hdisplay;
+		height = mode->vdisplay;
+		refresh = mode->vrefresh;
+	}
+	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL, &st);
+	dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT16, &width);
+	dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT16, &height);
+	dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32, &refresh);
+	dbus_message_iter_close_container(iter, &st);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open a {sv} entry of a field dictionary
+ *
+ * @Param dict The dictionary
+ * @Param key The field name
+ * @Param sig Signature of the value
+ * @Param entry Receives the entry
+ * @Param value Receives the variant to append the value to
+ */
+/* ---------------------------------------------------------------------------*/
+static void open_field(DBusMessageIter *dict, const char *key,
+		       const char *sig, DBusMessageIter *entry,
+		       DBusMessageIter *value)
+{
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL,
+					 entry);
+	dbus_message_iter_append_basic(entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(entry, DBUS_TYPE_VARIANT, sig, value);
+}
+
+static void close_field(DBusMessageIter *dict, DBusMessageIter *entry,
+			DBusMessageIter *value)
+{
+	dbus_message_iter_close_container(entry, value);
+	dbus_message_iter_close_container(dict, entry);
+}
+
+static void append_string_field(DBusMessageIter *dict, const char *key,
+				const char *str)
+{
+	DBusMessageIter entry, value;
+
+	open_field(dict, key, DBUS_TYPE_STRING_AS_STRING, &entry, &value);
+	dbus_message_iter_append_basic(&value, DBUS_TYPE_STRING, &str);
+	close_field(dict, &entry, &value);
+}
+
+static void append_mode_field(DBusMessageIter *dict, const char *key,
+			      mode_handle mode)
+{
+	DBusMessageIter entry, value;
+
+	open_field(dict, key, "(qqu)", &entry, &value);
+	append_mode(&value, mode);
+	close_field(dict, &entry, &value);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Append a connector as (uua{sv})
+ *
+ * @Param iter The array to append to
+ * @Param minor Minor of the card
+ * @Param obj The connector
+ * @Param fields CONN_CHANGED_* bits of the fields to include,
+ * CONN_CHANGED_ADDED for all of them
+ */
+/* ---------------------------------------------------------------------------*/
+static void append_connector(DBusMessageIter *iter, int minor,
+			     const struct drm_connector_obj *obj,
+			     uint32_t fields)
+{
+	DBusMessageIter st, dict, entry, value, inner;
+	uint32_t card = minor, status = obj->status;
+	const char *str;
+	int i;
+
+	if (fields & CONN_CHANGED_ADDED) fields = EXPORTED_CHANGES;
+	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL, &st);
+	dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32, &card);
+	dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32,
+				       &obj->connector_id);
+	dbus_message_iter_open_container(&st, DBUS_TYPE_ARRAY, "{sv}", &dict);
+
+	if (fields & CONN_CHANGED_ADDED) {
+		append_string_field(&dict, "Name", obj->name);
+		str = obj->connector_type < sizeof(drm_output_names) /
+						sizeof(*drm_output_names)
+			  ? drm_output_names[obj->connector_type]
+			  : "Unknown";
+		append_string_field(&dict, "Type", str);
+	}
+	if (fields & CONN_CHANGED_STATUS) {
+		if (status >= sizeof(status_names) / sizeof(*status_names))
+			status = 0;
+		append_string_field(&dict, "Status", status_names[status]);
+	}
+	if (fields & CONN_CHANGED_MONITOR) {
+		open_field(&dict, "Monitor", "(sqss)", &entry, &value);
+		dbus_message_iter_open_container(&value, DBUS_TYPE_STRUCT, NULL,
+						 &inner);
+		str = obj->edid.vendor;
+		dbus_message_iter_append_basic(&inner, DBUS_TYPE_STRING, &str);
+		dbus_message_iter_append_basic(&inner, DBUS_TYPE_UINT16,
+					       &obj->edid.product);
+		str = obj->edid.serial;
+		dbus_message_iter_append_basic(&inner, DBUS_TYPE_STRING, &str);
+		str = obj->edid.name;
+		dbus_message_iter_append_basic(&inner, DBUS_TYPE_STRING, &str);
+		dbus_message_iter_close_container(&value, &inner);
+		close_field(&dict, &entry, &value);
+	}
+	if (fields & CONN_CHANGED_CRTC) {
+		open_field(&dict, "Crtc", DBUS_TYPE_UINT32_AS_STRING, &entry,
+			   &value);
+		dbus_message_iter_append_basic(&value, DBUS_TYPE_UINT32,
+					       &obj->crtc_id);
+		close_field(&dict, &entry, &value);
+	}
+	/* An output without a CRTC keeps its last mode in the registry */
+	if (fields & (CONN_CHANGED_CRTC | CONN_CHANGED_CURRENT_MODE))
+		append_mode_field(&dict, "CurrentMode",
+				  obj->crtc_id ? obj->current_mode
+					       : MODE_HANDLE_NONE);
+	if (fields & CONN_CHANGED_MODES) {
+		open_field(&dict, "Modes", "a(qqu)", &entry, &value);
+		dbus_message_iter_open_container(&value, DBUS_TYPE_ARRAY,
+						 "(qqu)", &inner);
+		for (i = 0; i < obj->nr_of_modes; i++)
+			append_mode(&inner, obj->modes[i]);
+		dbus_message_iter_close_container(&value, &inner);
+		close_field(&dict, &entry, &value);
+		append_mode_field(&dict, "PreferredMode", obj->preferred_mode);
+	}
+	if (fields & CONN_CHANGED_POSITION) {
+		open_field(&dict, "Position", "(ii)", &entry, &value);
+		dbus_message_iter_open_container(&value, DBUS_TYPE_STRUCT, NULL,
+						 &inner);
+		dbus_message_iter_append_basic(&inner, DBUS_TYPE_INT32, &obj->x);
+		dbus_message_iter_append_basic(&inner, DBUS_TYPE_INT32, &obj->y);
+		dbus_message_iter_close_container(&value, &inner);
+		close_field(&dict, &entry, &value);
+	}
+
+	dbus_message_iter_close_container(&st, &dict);
+	dbus_message_iter_close_container(iter, &st);
+}
+
+static DBusMessage *get_connectors(DBusMessage *msg)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+	struct conn_registry *reg;
+	int i, j;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply) return NULL;
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(uua{sv})",
+					 &array);
+	for (i = 0; i < _nr_cards; i++) {
+		if (!(reg = _cards[i]->connectors)) continue;
+		for (j = 0; j < REGISTRY_SIZE(reg); j++)
+			append_connector(&array, _cards[i]->drm->minor,
+					 REGISTRY_AT(reg, j),
+					 CONN_CHANGED_ADDED);
+	}
+	dbus_message_iter_close_container(&iter, &array);
+	return reply;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Find a mode of an output
+ *
+ * @Param obj The connector
+ * @Param width Width in pixels
+ * @Param height Height in pixels
+ * @Param refresh Refresh rate in Hz, 0 for the highest
+ *
+ * @Returns   The mode or MODE_HANDLE_NONE if the output lacks it
+ */
+/* ---------------------------------------------------------------------------*/
+static mode_handle find_mode(const struct drm_connector_obj *obj,
+			     uint16_t width, uint16_t height,
+			     uint32_t refresh)
+{
+	const drmModeModeInfo *mode;
+	mode_handle best = MODE_HANDLE_NONE;
+	uint32_t best_refresh = 0;
+	int i;
+
+	for (i = 0; i < obj->nr_of_modes; i++) {
+		mode = mode_pool_get(obj->modes[i]);
+		if (mode->hdisplay != width || mode->vdisplay != height)
+			continue;
+		if (refresh && mode->vrefresh != refresh) continue;
+		if (best == MODE_HANDLE_NONE || mode->vrefresh > best_refresh) {
+			best = obj->modes[i];
+			best_refresh = mode->vrefresh;
+		}
+	}
+	return best;
+}
+
+static DBusMessage *set_mode(DBusMessage *msg)
+{
+	struct drm_card *card = NULL;
+	struct drm_connector_obj *obj = NULL;
+	struct apply_config cfg;
+	mode_handle mode = MODE_HANDLE_NONE;
+	uint32_t minor, connector_id, refresh;
+	uint16_t width, height;
+	int i;
+
+	if (!dbus_message_get_args(msg, NULL,
+				   DBUS_TYPE_UINT32, &minor,
+				   DBUS_TYPE_UINT32, &connector_id,
+				   DBUS_TYPE_UINT16, &width,
+				   DBUS_TYPE_UINT16, &height,
+				   DBUS_TYPE_UINT32, &refresh,
+				   DBUS_TYPE_INVALID))
+		return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS,
+					      "Expected (uuqqu)");
+	for (i = 0; i < _nr_cards; i++) {
+		if (_cards[i]->drm->minor == (int)minor) card = _cards[i];
+	}
+	if (card && card->connectors)
+		obj = registry_lookup(card->connectors, connector_id);
+	if (!obj)
+		return dbus_message_new_error_printf(
+		    msg, ERROR_NO_SUCH_CONNECTOR,
+		    "No connector %u on card %u", connector_id, minor);
+	if (width) {
+		if (obj->status == DRM_MODE_CONNECTED)
+			mode = find_mode(obj, width, height, refresh);
+		if (mode == MODE_HANDLE_NONE)
+			return dbus_message_new_error_printf(
+			    msg, ERROR_NO_SUCH_MODE, "%s has no %ux%u mode",
+			    obj->name, width, height);
+	} else if (!obj->crtc_id) {
+		/* Already off */
+		return dbus_message_new_method_return(msg);
+	}
+	if (!card->apply)
+		return dbus_message_new_error(msg, ERROR_APPLY_FAILED,
+					      "Mode setting is not available");
+
+	metrics_inc(METRIC_DBUS_SET_MODE);
+	cfg.nr_outputs = 0;
+	if (apply_config_add(&cfg, connector_id, mode) < 0 ||
+	    apply_config(card->apply, card->connectors, &cfg) < 0)
+		return dbus_message_new_error_printf(
+		    msg, ERROR_APPLY_FAILED, "%s rejected the mode",
+		    card->drm->device_name);
+	card->dirty = 1;
+	if (_changed) _changed(_changed_data);
+	return dbus_message_new_method_return(msg);
+}
+
+static DBusHandlerResult handle_message(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	const char *xml = introspect_xml;
+
+	if (dbus_message_is_method_call(msg, DBUS_INTERFACE_INTROSPECTABLE,
+					"Introspect")) {
+		reply = dbus_message_new_method_return(msg);
+		if (reply)
+			dbus_message_append_args(reply, DBUS_TYPE_STRING, &xml,
+						 DBUS_TYPE_INVALID);
+	} else if (dbus_message_is_method_call(msg, DBUS_SERVICE_INTERFACE,
+					       "GetConnectors")) {
+		reply = get_connectors(msg);
+	} else if (dbus_message_is_method_call(msg, DBUS_SERVICE_INTERFACE,
+					       "SetMode")) {
+		reply = set_mode(msg);
+	} else {
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+	if (!reply) return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	dbus_connection_send(conn, reply, NULL);
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable vtable = {
+    .message_function = handle_message,
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Watch EPOLLOUT while messages wait to be written
+ * Nothing blocks on a slow bus, the loop writes the rest once the socket
+ * has room.
+ */
+/* ---------------------------------------------------------------------------*/
+static void update_watch()
+{
+	int writing = dbus_connection_has_messages_to_send(_conn);
+
+	if (writing == _writing) return;
+	if (event_loop_mod_fd(_loop, _fd,
+			      writing ? EPOLLIN | EPOLLOUT : EPOLLIN) == 0)
+		_writing = writing;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read and dispatch what the bus sent, then write what the socket
+ * takes of the replies and signals
+ */
+/* ---------------------------------------------------------------------------*/
+static void dbus_handler(struct event_loop *loop, int fd, uint32_t events,
+			 void *data)
+{
+	/* A timeout of 0 only does what is possible without blocking */
+	dbus_connection_read_write(_conn, 0);
+	while (dbus_connection_dispatch(_conn) == DBUS_DISPATCH_DATA_REMAINS)
+		;
+	if (!dbus_connection_get_is_connected(_conn)) {
+		log_warning("Lost the D-Bus connection");
+		event_loop_del_fd(loop, _fd);
+		_fd = -1;
+		return;
+	}
+	update_watch();
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open a private connection to a bus
+ *
+ * @Param bus "system", "session" or the address of a bus
+ *
+ * @Returns   The connection or NULL if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static DBusConnection *connect_bus(const char *bus)
+{
+	DBusConnection *conn;
+	DBusError err;
+
+	dbus_error_init(&err);
+	if (!strcmp(bus, "system")) {
+		conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+	} else if (!strcmp(bus, "session")) {
+		conn = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+	} else {
+		conn = dbus_connection_open_private(bus, &err);
+		if (conn && !dbus_bus_register(conn, &err)) {
+			dbus_connection_close(conn);
+			dbus_connection_unref(conn);
+			conn = NULL;
+		}
+	}
+	if (!conn) {
+		log_error("Failed to connect to the %s bus: %s", bus,
+			  err.message);
+		dbus_error_free(&err);
+		return NULL;
+	}
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+	return conn;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Connect to a bus and serve the connectors of the cards
+ *
+ * @Param loop The event loop that dispatches the calls
+ * @Param bus "system", "session" or the address of a bus
+ * @Param cards The cards, the array must outlive the service
+ * @Param nr_cards Number of cards
+ * @Param changed Called after SetMode changed a card, may be NULL
+ * @Param data User data handed to changed
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int dbus_service_open(struct event_loop *loop, const char *bus,
+		      struct drm_card *const *cards, int nr_cards,
+		      dbus_changed_cb changed, void *data)
+{
+	DBusError err;
+	int ret;
+
+	_conn = connect_bus(bus);
+	if (!_conn) return -1;
+	_loop = loop;
+	_cards = cards;
+	_nr_cards = nr_cards;
+	_changed = changed;
+	_changed_data = data;
+
+	dbus_error_init(&err);
+	ret = dbus_bus_request_name(_conn, DBUS_SERVICE_NAME,
+				    DBUS_NAME_FLAG_DO_NOT_QUEUE, &err);
+	if (ret != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		log_error("Failed to own %s: %s", DBUS_SERVICE_NAME,
+			  dbus_error_is_set(&err) ? err.message
+						  : "name is taken");
+		goto err;
+	}
+	if (!dbus_connection_try_register_object_path(_conn, DBUS_SERVICE_PATH,
+						      &vtable, NULL, &err)) {
+		log_error("Failed to register %s: %s", DBUS_SERVICE_PATH,
+			  err.message);
+		goto err;
+	}
+	if (!dbus_connection_get_unix_fd(_conn, &_fd) ||
+	    event_loop_add_fd(loop, _fd, EPOLLIN, dbus_handler, NULL) < 0) {
+		log_error("Failed to watch the D-Bus connection");
+		_fd = -1;
+		goto err;
+	}
+	/* Messages read while requesting the name do not wake up the loop */
+	while (dbus_connection_dispatch(_conn) == DBUS_DISPATCH_DATA_REMAINS)
+		;
+	log_ok("Serving %s on the %s bus", DBUS_SERVICE_NAME, bus);
+	return 0;
+err:
+	dbus_error_free(&err);
+	dbus_connection_close(_conn);
+	dbus_connection_unref(_conn);
+	_conn = NULL;
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Send the changes of the cards in one ConnectorsChanged signal
+ * The signal is queued, what the socket does not take right away is
+ * written by the event loop. The changes are left in the registries, see
+ * card_clear_changes.
+ *
+ * @Param cards The cards
+ * @Param nr_cards Number of cards
+ */
+/* ---------------------------------------------------------------------------*/
+void dbus_service_emit_changes(struct drm_card *const *cards, int nr_cards)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter, array, st;
+	struct conn_registry *reg;
+	struct drm_connector_obj *obj;
+	uint32_t minor;
+	int i, j, nr_changes = 0;
+
+	if (_fd < 0) return;
+	msg = dbus_message_new_signal(DBUS_SERVICE_PATH, DBUS_SERVICE_INTERFACE,
+				      "ConnectorsChanged");
+	if (!msg) return;
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(uua{sv})",
+					 &array);
+	for (i = 0; i < nr_cards; i++) {
+		if (!(reg = cards[i]->connectors)) continue;
+		for (j = 0; j < REGISTRY_SIZE(reg); j++) {
+			obj = REGISTRY_AT(reg, j);
+			if (!(obj->changed & EXPORTED_CHANGES)) continue;
+			append_connector(&array, cards[i]->drm->minor, obj,
+					 obj->changed);
+			nr_changes++;
+		}
+	}
+	dbus_message_iter_close_container(&iter, &array);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(uu)",
+					 &array);
+	for (i = 0; i < nr_cards; i++) {
+		if (!(reg = cards[i]->connectors)) continue;
+		minor = cards[i]->drm->minor;
+		for (j = 0; j < reg->nr_removed; j++) {
+			dbus_message_iter_open_container(&array,
+							 DBUS_TYPE_STRUCT, NULL,
+							 &st);
+			dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32,
+						       &minor);
+			dbus_message_iter_append_basic(
+			    &st, DBUS_TYPE_UINT32, &reg->removed[j].connector_id);
+			dbus_message_iter_close_container(&array, &st);
+			nr_changes++;
+		}
+	}
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (nr_changes) {
+		dbus_connection_send(_conn, msg, NULL);
+		update_watch();
+		metrics_inc(METRIC_DBUS_SIGNALS);
+	}
+	dbus_message_unref(msg);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Release the bus name and close the connection
+ *
+ * @Param loop The event loop passed to dbus_service_open
+ */
+/* ---------------------------------------------------------------------------*/
+void dbus_service_close(struct event_loop *loop)
+{
+	if (!_conn) return;
+	if (_fd >= 0) {
+		event_loop_del_fd(loop, _fd);
+		_fd = -1;
+	}
+	dbus_connection_close(_conn);
+	dbus_connection_unref(_conn);
+	_conn = NULL;
+	_writing = 0;
+}
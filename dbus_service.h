@@ -0,0 +1,79 @@
+/**
+ * @file dbus_service.h
+ * @Brief  D-Bus interface to the connectors and modes
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-29
+ *
+ * The daemon owns DBUS_SERVICE_NAME and serves one object at
+ * DBUS_SERVICE_PATH with the interface DBUS_SERVICE_INTERFACE:
+ *
+ *   GetConnectors() -> a(uua{sv}) connectors
+ *   SetMode(u card, u connector, q width, q height, u refresh)
+ *   signal ConnectorsChanged(a(uua{sv}) changed, a(uu) removed)
+ *
+ * A connector is its card minor, its connector id and a dictionary of
+ * fields: Name, Type, Status, Monitor (sqss), Crtc, CurrentMode (qqu),
+ * Modes a(qqu), PreferredMode (qqu) and Position (ii). GetConnectors
+ * returns every field, ConnectorsChanged only the fields that changed, so
+ * a client applies the signal to the dictionaries it got before: first
+ * it drops the removed connectors, then it merges the changed ones. The
+ * signal is sent once per scan that changed something.
+ *
+ * SetMode with a width of 0 switches the output off, a refresh of 0 picks
+ * the highest refresh rate of the size.
+ */
+
+#ifndef _DBUS_SERVICE_H_
+#define _DBUS_SERVICE_H_
+
+#include "card.h"
+#include "event_loop.h"
+
+#define DBUS_SERVICE_NAME "org.drmdaemon.Display1"
+#define DBUS_SERVICE_PATH "/org/drmdaemon/Display1"
+#define DBUS_SERVICE_INTERFACE "org.drmdaemon.Display1"
+
+/**@brief Called after SetMode changed the registry of a card
+ */
+typedef void (*dbus_changed_cb)(void *data);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Connect to a bus and serve the connectors of the cards
+ *
+ * @Param loop The event loop that dispatches the calls
+ * @Param bus "system", "session" or the address of a bus
+ * @Param cards The cards, the array must outlive the service
+ * @Param nr_cards Number of cards
+ * @Param changed Called after SetMode changed a card, may be NULL
+ * @Param data User data handed to changed
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int dbus_service_open(struct event_loop *loop, const char *bus,
+		      struct drm_card *const *cards, int nr_cards,
+		      dbus_changed_cb changed, void *data);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Send the changes of the cards in one ConnectorsChanged signal
+ * The changes are left in the registries, see card_clear_changes.
+ *
+ * @Param cards The cards
+ * @Param nr_cards Number of cards
+ */
+/* ---------------------------------------------------------------------------*/
+void dbus_service_emit_changes(struct drm_card *const *cards, int nr_cards);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Release the bus name and close the connection
+ *
+ * @Param loop The event loop passed to dbus_service_open
+ */
+/* ---------------------------------------------------------------------------*/
+void dbus_service_close(struct event_loop *loop);
+
+#endif
@@ -1,6 +1,12 @@
-#include "debug.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-//TODO: Finish Log to file
+#include "debug.h"
 
 /**
  *
@@ -11,11 +17,164 @@
  *
  * This file contains all the functions for the logger
  *
+ * Messages are formatted by the caller into a fixed size record of a lock
+ * free multi producer ring. A background thread writes the records to the
+ * log file or stdout in batches with writev, so callers never block on
+ * stdio or slow storage. When the ring is full the message is dropped and
+ * counted.
+ *
+ */
+
+/**< Number of records in the log ring, must be a power of two */
+#define LOG_RING_SIZE 1024
+
+/**< Maximum number of records written by one writev call */
+#define LOG_BATCH_SIZE 64
+
+/**< Log record, the text is truncated to fit */
+struct log_record {
+	/* Ring sequence number, see log_ring */
+	size_t seq;
+	int len;
+	char text[LOG_RECORD_SIZE];
+};
+
+/**< Bounded multi producer, single consumer ring of records */
+int _loglvl = LOG_LVL_ALL;
+
+static struct {
+	struct log_record records[LOG_RING_SIZE];
+	size_t enqueue_pos __attribute__((aligned(64)));
+	size_t dequeue_pos __attribute__((aligned(64)));
+	/* Set while the flush thread waits on the eventfd */
+	int sleeping;
+	int efd;
+	/* Serialises the consumers: flush thread and logger_flush */
+	pthread_mutex_t consumer_lock;
+	pthread_t thread;
+	int started;
+	/* Output file descriptor and whether it is a terminal stream */
+	int fd;
+	int colors;
+	unsigned long dropped;
+} _ring = {.consumer_lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+static pthread_once_t _ring_once = PTHREAD_ONCE_INIT;
+
+/**< Logger counters, bumped by the log_* macros */
+unsigned long _log_counts[4];
+
+/**< Per thread timestamp cache, refreshed once per second */
+static __thread time_t _ts_sec = -1;
+static __thread char _ts_str[MAX_HDR_LEN];
+static __thread int _ts_len;
+
+/**
+ * @brief Check if the next record for the consumer is complete
+ *
+ * @return 1 if a record can be written out, 0 otherwise
+ */
+static int record_ready()
+{
+	size_t pos = _ring.dequeue_pos;
+	struct log_record *rec = &_ring.records[pos & (LOG_RING_SIZE - 1)];
+	return __atomic_load_n(&rec->seq, __ATOMIC_SEQ_CST) == pos + 1;
+}
+
+/**
+ * @brief Write out the records that are ready
+ * Caller must hold the consumer lock.
+ *
+ * @return number of records written
  */
+static int drain_records()
+{
+	struct iovec iov[LOG_BATCH_SIZE];
+	struct log_record *rec;
+	size_t pos = _ring.dequeue_pos, first = pos;
+	int n = 0, i, total = 0;
+
+	while (1) {
+		n = 0;
+		first = pos;
+		while (n < LOG_BATCH_SIZE) {
+			rec = &_ring.records[pos & (LOG_RING_SIZE - 1)];
+			if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) !=
+			    pos + 1)
+				break;
+			iov[n].iov_base = rec->text;
+			iov[n].iov_len = rec->len;
+			n++;
+			pos++;
+		}
+		if (n == 0) break;
+		while (writev(_ring.fd, iov, n) < 0 && errno == EINTR)
+			;
+		/* Hand the slots back to the producers */
+		for (i = 0; i < n; i++) {
+			rec = &_ring.records[(first + i) & (LOG_RING_SIZE - 1)];
+			__atomic_store_n(&rec->seq, first + i + LOG_RING_SIZE,
+					 __ATOMIC_RELEASE);
+		}
+		_ring.dequeue_pos = pos;
+		total += n;
+	}
+	return total;
+}
+
+/**
+ * @brief Background thread that flushes the log ring
+ */
+static void *flush_thread(void *data)
+{
+	uint64_t val;
+	while (1) {
+		pthread_mutex_lock(&_ring.consumer_lock);
+		drain_records();
+		pthread_mutex_unlock(&_ring.consumer_lock);
+
+		/* Announce the sleep, then check once more before blocking */
+		__atomic_store_n(&_ring.sleeping, 1, __ATOMIC_SEQ_CST);
+		if (record_ready()) {
+			__atomic_store_n(&_ring.sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (read(_ring.efd, &val, sizeof(val)) < 0 && errno != EINTR)
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Set up the ring and start the flush thread
+ * When the thread cannot be started the records are written out
+ * synchronously by the caller.
+ */
+static void logger_setup()
+{
+	size_t i;
+
+	for (i = 0; i < LOG_RING_SIZE; i++) _ring.records[i].seq = i;
+	if (_ring.fd < 0) {
+		_ring.fd = STDOUT_FILENO;
+		_ring.colors = 1;
+	}
+	atexit(logger_flush);
+	_ring.efd = eventfd(0, EFD_CLOEXEC);
+	if (_ring.efd < 0) return;
+	if (pthread_create(&_ring.thread, NULL, flush_thread, NULL) != 0) {
+		close(_ring.efd);
+		return;
+	}
+	_ring.started = 1;
+}
 
+/**
+ * @brief Initialise the logging
+ */
 void logger_init()
 {
-	_fp = stdout;
+	pthread_once(&_ring_once, logger_setup);
 }
 
 /**
@@ -25,33 +184,13 @@ void logger_init()
  * @return 0 if correct -1 if failed
  */
 static int check_loglvl(int loglvl) {
-	if (loglvl != LOG_LVL_INFO | loglvl != LOG_LVL_WARNING |
-	    loglvl != LOG_LVL_ERROR | loglvl != LOG_LVL_OK) {
+	if (loglvl != LOG_LVL_INFO && loglvl != LOG_LVL_WARNING &&
+	    loglvl != LOG_LVL_ERROR && loglvl != LOG_LVL_OK) {
 		return -1;
 	}
 	return 0;
 }
 
-/**
- * @brief Update the logger counters
- * This function will update the correct counter. Keeping
- * track of how many info/warning/error messages have been
- * logged. Usefull when not all messages are being printed
- *
- * @param loglvl the counter that has to be updated
- */
-static void update_counters(int loglvl)
-{
-	switch (loglvl) {
-	case LOG_LVL_INFO: _info++; break;
-	case LOG_LVL_WARNING: _warnings++; break;
-	case LOG_LVL_ERROR: _errors++; break;
-	case LOG_LVL_OK: _ok++; break;
-	default: break;
-	}
-	return;
-}
-
 /**
  * @brief Convert the loglvl to a char array
  *
@@ -68,44 +207,51 @@ static char *retrieve_loglvl_string(int loglvl) {
 
 /**
  * @brief Create a timestamp
+ * The formatted timestamp is cached per thread and only rebuilt when the
+ * second changes.
  *
- * @return Return a char pointer to a timestamp
- */
-static void print_timestamp(FILE *out) {
-	char outstr[MAX_HDR_LEN];
-	time_t t;
-	struct tm *tmp, tmbuf;
-	t = time(NULL);
-	tmp = localtime_r(&t, &tmbuf);
-	if (tmp == NULL)
-		return;
-	if (strftime(outstr, sizeof(outstr), "%y-%m-%d %H:%M:%S", tmp) == 0)
-		return;
-	fprintf(out,"%s ",outstr);
-	return;
+ * @param out Buffer that receives the timestamp
+ * @param size Size of the buffer
+ * @return Number of characters written
+ */
+static int print_timestamp(char *out, size_t size) {
+	struct tm tmbuf;
+	time_t t = time(NULL);
+	if (t != _ts_sec) {
+		_ts_len = 0;
+		if (localtime_r(&t, &tmbuf) != NULL)
+			_ts_len = strftime(_ts_str, sizeof(_ts_str),
+					   "%y-%m-%d %H:%M:%S ", &tmbuf);
+		_ts_sec = t;
+	}
+	if ((size_t)_ts_len >= size) return 0;
+	memcpy(out, _ts_str, _ts_len);
+	return _ts_len;
 }
 
 /**
  * @brief Create the logger prefix
  *
+ * @param out Buffer that receives the prefix
+ * @param size Size of the buffer
  * @param loglvl The loglevel that is used for the
  * header
- * @return Returns a header as char pointer
+ * @return Number of characters written
  */
-static void print_loglvl(FILE *out,int loglvl) {
-	if (out != stdout) {
-		return;
+static int print_loglvl(char *out, size_t size, int loglvl) {
+	if (!_ring.colors) {
+		return 0;
 	} else {
 		if (loglvl == LOG_LVL_ERROR)
-			fprintf(out,"[%s%s%s] ",KRED,"error",KNRM);
+			return snprintf(out,size,"[%s%s%s] ",KRED,"error",KNRM);
 		if (loglvl == LOG_LVL_WARNING)
-			fprintf(out,"[%s%s%s] ",KYEL,"warning",KNRM);
+			return snprintf(out,size,"[%s%s%s] ",KYEL,"warning",KNRM);
 		if (loglvl == LOG_LVL_INFO)
-			fprintf(out,"[%s%s%s] ",KBLU,"info",KNRM);
+			return snprintf(out,size,"[%s%s%s] ",KBLU,"info",KNRM);
 		if (loglvl == LOG_LVL_OK)
-			fprintf(out,"[%s%s%s] ",KGRN,"ok",KNRM);
+			return snprintf(out,size,"[%s%s%s] ",KGRN,"ok",KNRM);
 	}
-	return;
+	return 0;
 }
 
 /**
@@ -128,49 +274,131 @@ void logger_set_loglevel(int loglvl) {
  * @param timestap Add timestamp to the filename
  */
 void logger_set_file_logging(char *filename) {
-	_fp = fopen(filename, "w");
-	if (!_fp) {
-		// log error
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	logger_init();
+	if (fd < 0) {
+		log_error("Failed to open %s", filename);
 		return;
 	}
+	/* Write out what is queued for the old output first */
+	pthread_mutex_lock(&_ring.consumer_lock);
+	drain_records();
+	if (_ring.fd > STDERR_FILENO) close(_ring.fd);
+	_ring.fd = fd;
+	_ring.colors = 0;
+	pthread_mutex_unlock(&_ring.consumer_lock);
 	return;
 }
 
 /**
  * @brief Log some data
- * Log some data using a VAlist
+ * Log some data using a VAlist. The message is formatted into a ring
+ * record and written out by the flush thread.
  *
  * @param loglvl The severity of the message
  * @param msg The message that will be logged
  */
 void logger_log(int loglvl, char *format, ...) {
-	if (!_fp) {
-		logger_init();
-	}
-	if (!check_loglvl(loglvl)) {
+	struct log_record *rec;
+	size_t pos, seq;
+	uint64_t one = 1;
+	int len, max = LOG_RECORD_SIZE - 1;
+	va_list args;
+
+	logger_init();
+	if (check_loglvl(loglvl)) {
 		logger_log(LOG_LVL_ERROR,"Invalid loglevel provided\n");
 		return;
 	}
-	update_counters(loglvl);
-	if ((_loglvl & loglvl)) {
-		print_timestamp(_fp);
-		print_loglvl(_fp, loglvl);
-		va_list args;
-		va_start(args,format);
-		vfprintf(_fp,format, args);
-		va_end(args);
-		fprintf(_fp,"\n");
+	if (!(_loglvl & loglvl)) return;
+
+	/* Claim a record, drop the message if the ring is full */
+	pos = __atomic_load_n(&_ring.enqueue_pos, __ATOMIC_RELAXED);
+	while (1) {
+		rec = &_ring.records[pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&_ring.enqueue_pos,
+							&pos, pos + 1, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - pos) < 0) {
+			__atomic_fetch_add(&_ring.dropped, 1,
+					   __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&_ring.enqueue_pos,
+					      __ATOMIC_RELAXED);
+		}
+	}
+
+	len = print_timestamp(rec->text, max);
+	len += print_loglvl(rec->text + len, max - len, loglvl);
+	va_start(args,format);
+	len += vsnprintf(rec->text + len, max - len, format, args);
+	va_end(args);
+	if (len > max - 1) len = max - 1;
+	rec->text[len++] = '\n';
+	rec->len = len;
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+	if (!_ring.started) {
+		logger_flush();
+		return;
+	}
+	/* Only wake the flush thread when it is waiting */
+	if (__atomic_exchange_n(&_ring.sleeping, 0, __ATOMIC_SEQ_CST)) {
+		if (write(_ring.efd, &one, sizeof(one)) < 0) return;
 	}
 	return;
 }
 
+/**
+ * @brief Write out all queued records from the calling thread
+ * Used on shutdown and on fatal errors, when the flush thread may not
+ * get another chance to run.
+ */
+void logger_flush() {
+	pthread_mutex_lock(&_ring.consumer_lock);
+	drain_records();
+	pthread_mutex_unlock(&_ring.consumer_lock);
+}
+
+/**
+ * @brief Best effort flush from a fatal signal handler
+ * Does not wait for the consumer lock: if the crashing thread holds it,
+ * the records are written out anyway since the process is going down.
+ */
+void logger_flush_fatal() {
+	int locked = pthread_mutex_trylock(&_ring.consumer_lock) == 0;
+	drain_records();
+	if (locked) pthread_mutex_unlock(&_ring.consumer_lock);
+}
+
+/**
+ * @brief Number of messages dropped because the ring was full
+ */
+unsigned long logger_dropped() {
+	return __atomic_load_n(&_ring.dropped, __ATOMIC_RELAXED);
+}
+
 /**
  * @brief Print log statistics
- * Print the logcounter providing information about logged messages
+ * Print the logcounter providing information about logged messages,
+ * including the ones the runtime loglevel did not print
  */
 void logger_print_stats() {
-	logger_log(LOG_LVL_INFO, "%ld error(s), %ld warning(s) and %ld info"
-		   " message(s)", _errors,_warnings,_info);
+	unsigned long errors, warnings, info;
+
+	/* Read before log_info counts the stats message itself */
+	errors = __atomic_load_n(&_log_counts[__builtin_ctz(LOG_LVL_ERROR)],
+				 __ATOMIC_RELAXED);
+	warnings = __atomic_load_n(&_log_counts[__builtin_ctz(LOG_LVL_WARNING)],
+				   __ATOMIC_RELAXED);
+	info = __atomic_load_n(&_log_counts[__builtin_ctz(LOG_LVL_INFO)],
+			       __ATOMIC_RELAXED);
+	log_info("%lu error(s), %lu warning(s) and %lu info message(s), "
+		 "%lu dropped", errors, warnings, info, logger_dropped());
 	return;
 }
-
@@ -21,13 +21,23 @@
 
 #define MAX_HDR_LEN 64
 
+/**< Maximum length of a formatted log line, longer lines are truncated */
+#define LOG_RECORD_SIZE 240
+
 /**< Loglevel defines */
 #define LOG_LVL_INFO 0x01
 #define LOG_LVL_WARNING 0x02
 #define LOG_LVL_ERROR 0x04
 #define LOG_LVL_OK 0x08
 
-#define LOG_LVL_ALL LOG_LVL_INFO | LOG_LVL_WARNING | LOG_LVL_ERROR | LOG_LVL_OK
+#define LOG_LVL_ALL (LOG_LVL_INFO | LOG_LVL_WARNING | LOG_LVL_ERROR | LOG_LVL_OK)
+
+/**< Levels compiled into the binary, calls for other levels are removed.
+ * Release builds set this from the Makefile, e.g. -DLOG_COMPILED_LVL=0x06
+ */
+#ifndef LOG_COMPILED_LVL
+#define LOG_COMPILED_LVL LOG_LVL_ALL
+#endif
 
 /**< Logger enable colors */
 #define KNRM "\x1B[0m"
@@ -39,22 +49,47 @@
 #define KCYN "\x1B[36m"
 #define KWHT "\x1B[37m"
 
-/**
- *TODO: Add defines for easy logging
-	- log_error
-	- log_info
-	- log_msg
-	- log_warning
+/**< Runtime loglevel mask, set through logger_set_loglevel */
+extern int _loglvl;
+
+/**< Messages per level, also the ones the runtime level does not print.
+ * Indexed by the bit number of the level, see log_count.
  */
+extern unsigned long _log_counts[4];
 
-/**< Static loglevel variable */
-static int _loglvl = LOG_LVL_ALL;
+/**
+ * @brief Count a message of a level
+ * The index folds to a constant for the constant levels of the log_*
+ * macros.
+ */
+#define log_count(lvl)                                                         \
+	__atomic_fetch_add(&_log_counts[__builtin_ctz(lvl)], 1,                \
+			   __ATOMIC_RELAXED)
 
-/**< Static logger file pointer */
-static FILE *_fp = NULL;
+/**
+ * @brief Check if a level would be logged
+ * The compile time part folds to a constant, so a level that is not
+ * compiled in lets the compiler drop the whole call.
+ */
+#define log_enabled(lvl) (((LOG_COMPILED_LVL) & (lvl)) && (_loglvl & (lvl)))
 
-/**< Static logger counters */
-static long _ok, _errors, _warnings, _info;
+/**
+ * @brief Log a message if its level is enabled
+ * Every message of a compiled in level is counted, the arguments are only
+ * evaluated when the message will be logged.
+ */
+#define log_msg(lvl, ...)                                                      \
+	do {                                                                   \
+		if ((LOG_COMPILED_LVL) & (lvl)) {                              \
+			log_count(lvl);                                        \
+			if (_loglvl & (lvl)) logger_log(lvl, __VA_ARGS__);     \
+		}                                                              \
+	} while (0)
+
+#define log_info(...) log_msg(LOG_LVL_INFO, __VA_ARGS__)
+#define log_warning(...) log_msg(LOG_LVL_WARNING, __VA_ARGS__)
+#define log_error(...) log_msg(LOG_LVL_ERROR, __VA_ARGS__)
+#define log_ok(...) log_msg(LOG_LVL_OK, __VA_ARGS__)
 
 /**
  * @brief Initialise the logging
@@ -80,16 +115,36 @@ void logger_set_file_logging(char *filename);
 
 /**
  * @brief Log some data
- * Log some data using a VAlist
+ * Log some data using a VAlist. Prefer the log_* macros, which skip the call
+ * and the argument evaluation for disabled levels. Only the macros count
+ * the message for logger_print_stats.
  *
  * @param loglvl The severity of the message
  * @param msg The message that will be logged
  */
 void logger_log(int loglvl, char *format, ...);
 
+/**
+ * @brief Write out all queued log messages from the calling thread
+ * Used on shutdown and on fatal errors, when the background flush thread
+ * may not get another chance to run.
+ */
+void logger_flush();
+
+/**
+ * @brief Best effort flush from a fatal signal handler
+ */
+void logger_flush_fatal();
+
+/**
+ * @brief Number of messages dropped because the ring was full
+ */
+unsigned long logger_dropped();
+
 /**
  * @brief Print log statistics
- * Print the logcounter providing information about logged messages
+ * Print the logcounter providing information about logged messages,
+ * including the ones the runtime loglevel did not print
  */
 void logger_print_stats();
 
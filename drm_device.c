@@ -0,0 +1,168 @@
+/**
+ * @file drm_device.c
+ * @Brief  Long-lived DRM device context
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-09
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "drm_device.h"
+#include "metrics.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Lookup table mapping the capability table to DRM_CAP values
+ */
+/* ---------------------------------------------------------------------------*/
+static const uint64_t drm_cap_ids[DRM_DEVICE_CAP_COUNT] = {
+    [DRM_DEVICE_CAP_DUMB_BUFFER] = DRM_CAP_DUMB_BUFFER,
+    [DRM_DEVICE_CAP_PRIME] = DRM_CAP_PRIME,
+    [DRM_DEVICE_CAP_TIMESTAMP_MONOTONIC] = DRM_CAP_TIMESTAMP_MONOTONIC,
+    [DRM_DEVICE_CAP_ASYNC_PAGE_FLIP] = DRM_CAP_ASYNC_PAGE_FLIP,
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if two resources describe the same set of objects
+ *
+ * @Param a First resources
+ * @Param b Second resources
+ *
+ * @Returns   1 if equal, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int resources_equal(drmModeRes *a, drmModeRes *b)
+{
+	if (a->count_crtcs != b->count_crtcs ||
+	    a->count_connectors != b->count_connectors ||
+	    a->count_encoders != b->count_encoders)
+		return 0;
+	/* Same counts but a different MST port can reuse the slot */
+	if (memcmp(a->connectors, b->connectors,
+		   a->count_connectors * sizeof(uint32_t)))
+		return 0;
+	return 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open a DRM device and query its capabilities
+ *
+ * @Param device_name The device name (most cases: /dev/dri/card0)
+ *
+ * @Returns   A newly allocated device or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_device *drm_device_open(const char *device_name)
+{
+	struct drm_device *dev;
+	const char *base;
+	int i, minor;
+
+	dev = malloc(sizeof(*dev));
+	if (!dev) {
+		log_error("Failed to allocate drm device");
+		return NULL;
+	}
+	memset(dev, 0, sizeof(*dev));
+	snprintf(dev->device_name, sizeof(dev->device_name), "%s",
+		 device_name);
+	base = strrchr(device_name, '/');
+	if (!base || sscanf(base, "/card%d", &minor) != 1) minor = 0;
+	snprintf(dev->card_name, sizeof(dev->card_name), "Card%d", minor);
+	dev->minor = minor;
+
+	dev->fd = open(device_name, O_RDWR | O_CLOEXEC);
+	if (dev->fd < 0) {
+		log_error("Failed to open device %s", device_name);
+		free(dev);
+		return NULL;
+	}
+
+	for (i = 0; i < DRM_DEVICE_CAP_COUNT; i++) {
+		if (drmGetCap(dev->fd, drm_cap_ids[i], &dev->caps[i]) < 0)
+			dev->caps[i] = 0;
+	}
+	if (!dev->caps[DRM_DEVICE_CAP_DUMB_BUFFER]) {
+		log_error("DUMB Buffers not supported");
+		drm_device_close(dev);
+		return NULL;
+	}
+
+	dev->universal_planes =
+	    drmSetClientCap(dev->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) == 0;
+	dev->atomic = drmSetClientCap(dev->fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+	log_info("%s: universal planes %s, atomic %s",
+		 device_name,
+		 dev->universal_planes ? "yes" : "no",
+		 dev->atomic ? "yes" : "no");
+
+	if (drm_device_refresh_resources(dev) < 0) {
+		drm_device_close(dev);
+		return NULL;
+	}
+	return dev;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Close the device and free the cached resources
+ *
+ * @Param dev The device
+ */
+/* ---------------------------------------------------------------------------*/
+void drm_device_close(struct drm_device *dev)
+{
+	if (!dev) return;
+	if (dev->res) drmModeFreeResources(dev->res);
+	if (dev->fd >= 0) close(dev->fd);
+	free(dev);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the cached resources of the device
+ *
+ * @Param dev The device
+ *
+ * @Returns   The cached resources or NULL if they could not be retrieved
+ *
+ * @Note The resources are owned by the device, do not free them
+ */
+/* ---------------------------------------------------------------------------*/
+drmModeRes *drm_device_get_resources(struct drm_device *dev)
+{
+	if (!dev->res && drm_device_refresh_resources(dev) < 0) return NULL;
+	return dev->res;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Query the resources again and update the cache if the object
+ * counts changed (e.g. a DP MST hub added connectors)
+ *
+ * @Param dev The device
+ *
+ * @Returns   1 if the cache was replaced, 0 if unchanged, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int drm_device_refresh_resources(struct drm_device *dev)
+{
+	drmModeRes *res = drmModeGetResources(dev->fd);
+	metrics_inc(METRIC_IOCTL_GET_RESOURCES);
+	if (!res) {
+		log_error("Failed to retrieve resource");
+		return -1;
+	}
+	if (dev->res && resources_equal(dev->res, res)) {
+		drmModeFreeResources(res);
+		return 0;
+	}
+	if (dev->res) drmModeFreeResources(dev->res);
+	dev->res = res;
+	dev->res_generation++;
+	return 1;
+}
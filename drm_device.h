@@ -0,0 +1,109 @@
+/**
+ * @file drm_device.h
+ * @Brief  Long-lived DRM device context
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-09
+ *
+ * The device is opened once at startup. Capabilities are queried once and
+ * the drmModeRes of the card is cached until a hotplug changes the
+ * number of CRTCs, connectors or encoders.
+ */
+
+#ifndef _DRM_DEVICE_H_
+#define _DRM_DEVICE_H_
+
+#include <stdint.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "debug.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Index in the capability table of a drm_device
+ */
+/* ---------------------------------------------------------------------------*/
+enum drm_device_cap {
+	DRM_DEVICE_CAP_DUMB_BUFFER,
+	DRM_DEVICE_CAP_PRIME,
+	DRM_DEVICE_CAP_TIMESTAMP_MONOTONIC,
+	DRM_DEVICE_CAP_ASYNC_PAGE_FLIP,
+	DRM_DEVICE_CAP_COUNT,
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  DRM device context
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_device {
+	/* File descriptor of the opened card */
+	int fd;
+	/* Device name e.g.: /dev/dri/card0 */
+	char device_name[64];
+	/* Prefix for connector names e.g.: Card0 */
+	char card_name[16];
+	/* Minor number of the card node, 0 for /dev/dri/card0 */
+	int minor;
+	/* Capability values, 0 if the query failed */
+	uint64_t caps[DRM_DEVICE_CAP_COUNT];
+	/* Client capabilities that were accepted by the kernel */
+	int universal_planes;
+	int atomic;
+	/* Property id of the connector EDID blob, looked up on the first
+	 * connector, 0 if the driver has none */
+	uint32_t edid_prop;
+	int edid_prop_known;
+	/* Cached resources, refreshed when the object counts change */
+	drmModeRes *res;
+	/* Number of times the resource cache was replaced */
+	unsigned long res_generation;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open a DRM device and query its capabilities
+ *
+ * @Param device_name The device name (most cases: /dev/dri/card0)
+ *
+ * @Returns   A newly allocated device or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_device *drm_device_open(const char *device_name);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Close the device and free the cached resources
+ *
+ * @Param dev The device
+ */
+/* ---------------------------------------------------------------------------*/
+void drm_device_close(struct drm_device *dev);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the cached resources of the device
+ *
+ * @Param dev The device
+ *
+ * @Returns   The cached resources or NULL if they could not be retrieved
+ *
+ * @Note The resources are owned by the device, do not free them
+ */
+/* ---------------------------------------------------------------------------*/
+drmModeRes *drm_device_get_resources(struct drm_device *dev);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Query the resources again and update the cache if the object
+ * counts changed (e.g. a DP MST hub added connectors)
+ *
+ * @Param dev The device
+ *
+ * @Returns   1 if the cache was replaced, 0 if unchanged, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int drm_device_refresh_resources(struct drm_device *dev);
+
+#endif
@@ -6,32 +6,143 @@
  * @version 1.0
  * @date 2017-01-16
  * TODO: Change debug define with parameter parsing at boot
- * TODO: cleanup drm_connector_obj list properly
- * TODO: Add queueing mechanism for udev events
- * Note: Select in reading udev statement due to libudev bug
+ * Note: The udev monitor fd is polled by epoll instead of blocking in
+ * udev_monitor_receive_device due to libudev bug
  * http://stackoverflow.com/questions/15687784/libudev-monitoring-returns-null-pointer-on-raspbian
  */
 
-#include <pthread.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "debug.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "card.h"
+#include "dbus_service.h"
+#include "edid_cache.h"
+#include "event_stream.h"
 #include "modeset.h"
-#include "queue.h"
+#include "replay.h"
+#include "ring.h"
+#include "snapshot.h"
+#include "state_page.h"
+#include "trace.h"
 #include "udev_helper.h"
-
-/* Pthread mutex used to protect condition variable */
-pthread_mutex_t cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+#include "uevent_netlink.h"
+#include "workpool.h"
 
 /* Uncomment to run without daemon and console logging */
 #define DEBUG
 
+/* Default quiet period that ends a burst of uevents */
+#define DEFAULT_DEBOUNCE_MS 50
+
+/* Default upper bound between the first uevent of a burst and the rescan */
+#define DEFAULT_MAX_LATENCY_MS 250
+
+/* Number of uevents that can be in flight between receive and processing */
+#define UEVENT_RING_SIZE 256
+
+/* Maximum number of DRM cards handled by one daemon */
+#define MAX_DRM_CARDS 8
+
+/* Maximum number of worker threads used to scan cards in parallel */
+#define MAX_SCAN_WORKERS 4
+
+/* Delay between a change and writing it to disk, bounds the writes */
+#define PERSIST_DELAY_MS 5000
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Daemon context shared by all event handlers
+ */
+/* ---------------------------------------------------------------------------*/
+struct drmdaemon {
+	struct event_loop *loop;
+	struct udev *udev;
+	struct udev_monitor *mon;
+	/* Direct netlink receiver used instead of the udev monitor with -n */
+	int use_netlink;
+	struct uevent_netlink *netlink;
+	/* Receive buffer of the uevent socket in bytes, 0 for the default */
+	int rcvbuf;
+	/* SEQNUM of the last received uevent, logged when uevents are lost */
+	uint64_t last_seqnum;
+	/* SEQNUM read before the initial scan, uevents up to it were
+	 * buffered during startup and their changes are in the scan */
+	uint64_t scan_seqnum;
+	/* signalfd for SIGTERM/SIGINT/SIGHUP */
+	int sig_fd;
+	/* One shot timerfd used for deferred connector updates */
+	int timer_fd;
+	int timer_armed;
+	/* One shot timerfd that writes the changed caches to disk */
+	int persist_fd;
+	int persist_armed;
+	/* The registries changed since the snapshot was written */
+	int snapshot_pending;
+	/* Debounce configuration in milliseconds */
+	long debounce_ms;
+	long max_latency_ms;
+	/* Monotonic time of the first uevent of the pending burst */
+	long burst_start_ms;
+	/* Counters for received events versus executed rescans */
+	unsigned long events_received;
+	unsigned long rescans;
+	unsigned long socket_overflows;
+	unsigned long resyncs;
+	/* Received uevents waiting to be processed */
+	struct spsc_ring *uevent_ring;
+	/* Device nodes to open, enumerated through udev unless given */
+	char devnodes[MAX_DRM_CARDS][DEVNODE_LEN];
+	int nr_devnodes;
+	/* Opened cards */
+	struct drm_card *cards[MAX_DRM_CARDS];
+	int nr_cards;
+	/* Apply the policy to the outputs after a scan */
+	int auto_apply;
+	/* Output rules, NULL to use the preferred modes */
+	const char *policy_file;
+	struct policy *policy;
+	/* Monitors probed before, NULL to always probe */
+	const char *edid_cache;
+	/* Registries of the last run, NULL to populate at every start */
+	const char *snapshot_file;
+	/* Monotonic time in us the daemon started */
+	uint64_t start_us;
+	/* 1 once the registries of all cards match the hardware */
+	int consistent;
+	/* Workers that scan the cards in parallel, NULL for a single card */
+	struct workpool *scanners;
+	/* Metrics socket, NULL if the metrics are not exported */
+	const char *metrics_socket;
+	/* State socket, NULL if the state page is not shared */
+	const char *state_socket;
+	/* Bus of the D-Bus service, NULL if it is not offered */
+	const char *dbus_bus;
+	/* Event stream socket, NULL if events are not streamed */
+	const char *stream_socket;
+	/* Received uevents are appended here, NULL if not recording */
+	const char *record_file;
+	FILE *record;
+	/* Recorded uevents fed in instead of the udev monitor */
+	const char *replay_file;
+	int replay_paced;
+	struct replay *replay;
+	/* Binary trace file, NULL if tracing is disabled */
+	const char *trace_file;
+	long trace_records;
+};
+
 static int daemonize()
 {
 	int x;
@@ -39,7 +150,7 @@ static int daemonize()
 
 	pid = fork();
 	if (pid < 0) { /* Failed to create fork */
-		logger_log(LOG_LVL_ERROR, "Failed to fork");
+		log_error("Failed to fork");
 		return -1;
 	}
 
@@ -55,7 +166,7 @@ static int daemonize()
 
 	pid = fork();
 	if (pid < 0) {
-		logger_log(LOG_LVL_ERROR, "Failed to create second fork");
+		log_error("Failed to create second fork");
 		return -1;
 	}
 
@@ -70,102 +181,954 @@ static int daemonize()
 	return 0;
 }
 
-void *udev_thread_handler(void *data)
-{
-	struct udev *udev = NULL;
-	struct udev_monitor *mon = NULL;
-	struct queue *udev_queue = (struct queue *)data;
-	udev = udev_new();
-	if (!udev) {
-		logger_log(LOG_LVL_ERROR, "Failed to create udev instance");
-		return 0;
-	}
-	mon = setup_udev_monitor(udev, "drm");
-	if (!mon) {
-		/* TODO: remove udev struct */
-		return 0;
-	}
-	logger_log(LOG_LVL_OK, "Udev initialisation ok");
-
-	int fd = udev_monitor_get_fd(mon);
-	while (1) {
-		fd_set fds;
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
-		int ret = select(fd + 1, &fds, NULL, NULL, NULL);
-		if (ret > 0 && FD_ISSET(fd, &fds)) {
-			struct udev_device *dev =
-			    udev_monitor_receive_device(mon);
-			if (dev == NULL) {
-				logger_log(LOG_LVL_ERROR,
-					   "Failed to retrieve device\n");
-				continue;
-			}
-
-			/* Push data to the udev queue that is handled by main
-			 * thread*/
-			pthread_mutex_lock(&cond_mutex);
-			queue_push(udev_queue, (void *)dev);
-			pthread_mutex_unlock(&cond_mutex);
+static long monotonic_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write out the queued log messages before dying on a fatal signal
+ */
+/* ---------------------------------------------------------------------------*/
+static void fatal_signal_handler(int sig)
+{
+	logger_flush_fatal();
+	raise(sig);
+}
+
+static void install_fatal_handlers()
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = fatal_signal_handler;
+	/* Restore the default action so raise() terminates the process */
+	sa.sa_flags = SA_RESETHAND;
+	sigaction(SIGSEGV, &sa, NULL);
+	sigaction(SIGBUS, &sa, NULL);
+	sigaction(SIGABRT, &sa, NULL);
+	sigaction(SIGFPE, &sa, NULL);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Schedule the deferred DRM update
+ * Every call pushes the update back by the debounce window, so a burst of
+ * uevents is merged into a single rescan. The rescan is never pushed
+ * further than max_latency_ms after the first uevent of the burst, so a
+ * continuous storm cannot starve updates.
+ *
+ * @Param daemon The daemon context
+ */
+/* ---------------------------------------------------------------------------*/
+static void schedule_update(struct drmdaemon *daemon)
+{
+	long now = monotonic_ms();
+	long deadline;
+
+	if (!daemon->timer_armed) daemon->burst_start_ms = now;
+	deadline = now + daemon->debounce_ms;
+	if (deadline > daemon->burst_start_ms + daemon->max_latency_ms)
+		deadline = daemon->burst_start_ms + daemon->max_latency_ms;
+	/* A zero delay would disarm the timer */
+	if (deadline <= now) deadline = now + 1;
+
+	if (event_loop_arm_timer(daemon->timer_fd, deadline - now) == 0)
+		daemon->timer_armed = 1;
+}
+
+static void print_stats(struct drmdaemon *daemon)
+{
+	unsigned long connector_rescans = 0;
+	int i;
+
+	for (i = 0; i < daemon->nr_cards; i++)
+		connector_rescans += daemon->cards[i]->connector_rescans;
+	log_info("%lu uevent(s) received, %lu rescan(s) executed, "
+		 "%lu targeted connector rescan(s)",
+		 daemon->events_received,
+		 daemon->rescans,
+		 connector_rescans);
+	log_info("%lu uevent socket overflow(s), %lu resync(s)",
+		 daemon->socket_overflows,
+		 daemon->resyncs);
+}
+
+static void mark_all_cards(struct drmdaemon *daemon)
+{
+	int i;
+	for (i = 0; i < daemon->nr_cards; i++)
+		card_track_connector(daemon->cards[i], 0, 1);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Run a card job on every card, in parallel when there is more
+ * than one card
+ *
+ * @Param daemon The daemon context
+ * @Param fn The job, card_populate or card_rescan
+ * @Param only_pending 1 to skip cards without pending work
+ */
+/* ---------------------------------------------------------------------------*/
+static void run_card_jobs(struct drmdaemon *daemon, void (*fn)(void *),
+			  int only_pending)
+{
+	int i;
+
+	for (i = 0; i < daemon->nr_cards; i++) {
+		if (only_pending && !card_has_pending(daemon->cards[i]))
+			continue;
+		if (!daemon->scanners ||
+		    workpool_submit(daemon->scanners, fn, daemon->cards[i]) < 0)
+			fn(daemon->cards[i]);
+	}
+	if (daemon->scanners) workpool_wait(daemon->scanners);
+}
+
+static struct drm_card *find_card(struct drmdaemon *daemon,
+				  const char *devnode)
+{
+	int i;
+	if (!devnode) return NULL;
+	for (i = 0; i < daemon->nr_cards; i++) {
+		if (!strcmp(daemon->cards[i]->drm->device_name, devnode))
+			return daemon->cards[i];
+	}
+	return NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remember which card and connector a uevent refers to
+ * Uevents buffered during startup that the initial scan already covered
+ * are dropped. The uevent is routed to its card by device node. Kernels
+ * that support it add CONNECTOR=<id> and optionally PROPERTY=<id> to the
+ * hotplug uevent. Without those keys, or when too many connectors are
+ * pending, the next rescan covers every connector of the card.
+ *
+ * @Param daemon The daemon context
+ * @Param ev The received uevent
+ */
+/* ---------------------------------------------------------------------------*/
+static void track_uevent(struct drmdaemon *daemon, struct uevent *ev)
+{
+	struct drm_card *card;
+	int probe = ev->property_id == 0;
+
+	replay_tracked(daemon->replay, ev);
+	if (ev->seqnum && ev->seqnum <= daemon->scan_seqnum) {
+		metrics_inc(METRIC_UEVENTS_SUPERSEDED);
+		return;
+	}
+	card = find_card(daemon, ev->devnode);
+	if (!card) {
+		log_warning("Uevent for unknown card %s", ev->devnode);
+		return;
+	}
+	trace(TRACE_UEVENT, card->drm->minor, ev->connector_id, probe, 0, 0);
+	card_track_connector(card, ev->connector_id, probe);
+	metrics_observe(METRIC_UEVENT_TO_QUEUE,
+			metrics_now_us() - ev->received_us);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Record a received uevent and hand it to the processing side
+ *
+ * @Param daemon The daemon context
+ * @Param ev The uevent, copied into a ring slot
+ */
+/* ---------------------------------------------------------------------------*/
+static void queue_uevent(struct drmdaemon *daemon, const struct uevent *ev)
+{
+	metrics_inc(METRIC_UEVENTS);
+	if (ev->seqnum) daemon->last_seqnum = ev->seqnum;
+	if (daemon->record && uevent_write(daemon->record, ev) < 0) {
+		log_error("Failed to record uevent, recording stopped");
+		fclose(daemon->record);
+		daemon->record = NULL;
+	}
+	/* A full ring drops the uevent and raises its overflow flag */
+	if (spsc_ring_push_item(daemon->uevent_ring, ev) < 0)
+		metrics_inc(METRIC_UEVENTS_DROPPED);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Handle an overflow of the uevent socket
+ * The kernel does not say how many uevents were lost or for which card,
+ * so the processing side is told to do one full rescan through the ring
+ * overflow flag, the same as for uevents the ring dropped.
+ *
+ * @Param daemon The daemon context
+ */
+/* ---------------------------------------------------------------------------*/
+static void uevents_lost(struct drmdaemon *daemon)
+{
+	daemon->socket_overflows++;
+	metrics_inc(METRIC_UEVENT_SOCKET_OVERFLOWS);
+	log_warning("Uevent socket overflow after SEQNUM %llu",
+		    (unsigned long long)daemon->last_seqnum);
+	spsc_ring_raise_overflow(daemon->uevent_ring);
+}
+
+static void udev_handler(struct event_loop *loop, int fd, uint32_t events,
+			 void *data)
+{
+	struct drmdaemon *daemon = data;
+	struct uevent ev;
+	uint64_t received_us = metrics_now_us();
+	struct udev_device *dev = udev_monitor_receive_device(daemon->mon);
+	if (dev == NULL) {
+		if (errno == ENOBUFS)
+			uevents_lost(daemon);
+		else
+			log_error("Failed to retrieve device");
+		return;
+	}
+	uevent_from_udev(dev, &ev);
+	ev.received_us = received_us;
+	udev_device_unref(dev);
+	queue_uevent(daemon, &ev);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Drain the netlink socket in batches
+ * Only drm uevents pass the socket filter, so other subsystems never wake
+ * the daemon. The ring consumer is woken once, after the socket is empty.
+ */
+/* ---------------------------------------------------------------------------*/
+static void netlink_handler(struct event_loop *loop, int fd, uint32_t events,
+			    void *data)
+{
+	struct drmdaemon *daemon = data;
+	struct uevent batch[UEVENT_NETLINK_BATCH];
+	uint64_t received_us;
+	int i, n, nr_read;
+
+	spsc_ring_begin_batch(daemon->uevent_ring);
+	do {
+		n = uevent_netlink_receive(daemon->netlink, batch, &nr_read);
+		if (n < 0 && errno != ENOBUFS) break;
+		/* The uevents queued after the overflow are still readable */
+		if (n < 0) {
+			uevents_lost(daemon);
+			nr_read = UEVENT_NETLINK_BATCH;
+			continue;
+		}
+		received_us = metrics_now_us();
+		for (i = 0; i < n; i++) {
+			batch[i].received_us = received_us;
+			queue_uevent(daemon, &batch[i]);
+		}
+	} while (nr_read == UEVENT_NETLINK_BATCH);
+	spsc_ring_end_batch(daemon->uevent_ring);
+}
+
+static void uevent_ring_handler(struct event_loop *loop, int fd,
+				uint32_t events, void *data)
+{
+	struct drmdaemon *daemon = data;
+	struct uevent ev;
+	int received = 0;
+
+	spsc_ring_ack(daemon->uevent_ring);
+	do {
+		while (spsc_ring_pop_item(daemon->uevent_ring, &ev) == 0) {
+			track_uevent(daemon, &ev);
+			received++;
+		}
+	} while (spsc_ring_sleep(daemon->uevent_ring) < 0);
+
+	/* Dropped or lost events are unknown, only a full rescan is safe.
+	 * Any number of losses before the rescan cost a single resync. */
+	if (spsc_ring_take_overflow(daemon->uevent_ring)) {
+		log_warning("Uevents lost, %llu dropped by the ring, %lu socket "
+			    "overflow(s), resyncing",
+			    (unsigned long long)daemon->uevent_ring->dropped,
+			    daemon->socket_overflows);
+		daemon->resyncs++;
+		metrics_inc(METRIC_RESYNCS);
+		trace(TRACE_UEVENT_OVERFLOW, 0, 0,
+		      daemon->uevent_ring->dropped, 0, 0);
+		mark_all_cards(daemon);
+		replay_overflow(daemon->replay);
+		received++;
+	}
+	if (!received) return;
+	daemon->events_received += received;
+	schedule_update(daemon);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Arm the persist timer if the snapshot or the EDID cache has
+ * changes to write
+ * The files are written by persist_handler, never on the scan path.
+ *
+ * @Param daemon The daemon context
+ */
+/* ---------------------------------------------------------------------------*/
+static void schedule_persist(struct drmdaemon *daemon)
+{
+	if (daemon->persist_fd < 0 || daemon->persist_armed) return;
+	if (!daemon->snapshot_pending && !edid_cache_pending()) return;
+	if (event_loop_arm_timer(daemon->persist_fd, PERSIST_DELAY_MS) == 0)
+		daemon->persist_armed = 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write the pending snapshot and EDID cache changes to disk
+ * Must not run concurrently with a scan.
+ *
+ * @Param daemon The daemon context
+ */
+/* ---------------------------------------------------------------------------*/
+static void persist(struct drmdaemon *daemon)
+{
+	if (daemon->snapshot_pending) {
+		daemon->snapshot_pending = 0;
+		if (snapshot_save(daemon->snapshot_file, daemon->cards,
+				  daemon->nr_cards) < 0)
+			log_warning("Snapshot not written");
+	}
+	if (edid_cache_sync() < 0) log_warning("EDID cache not written");
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write the registries to the state page, signal and stream the
+ * changes and schedule the snapshot if any of them changed
+ *
+ * @Param daemon The daemon context
+ */
+/* ---------------------------------------------------------------------------*/
+static void publish_changes(struct drmdaemon *daemon)
+{
+	int i, dirty = 0;
+
+	for (i = 0; i < daemon->nr_cards; i++) {
+		dirty |= daemon->cards[i]->dirty;
+		daemon->cards[i]->dirty = 0;
+	}
+	if (dirty && daemon->snapshot_file) daemon->snapshot_pending = 1;
+	schedule_persist(daemon);
+	if (!dirty) return;
+	state_page_publish(daemon->cards, daemon->nr_cards);
+	dbus_service_emit_changes(daemon->cards, daemon->nr_cards);
+	event_stream_publish(daemon->cards, daemon->nr_cards);
+	for (i = 0; i < daemon->nr_cards; i++)
+		card_clear_changes(daemon->cards[i]);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A D-Bus client set a mode
+ *
+ * @Param data The daemon context
+ */
+/* ---------------------------------------------------------------------------*/
+static void dbus_mode_set(void *data)
+{
+	publish_changes(data);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Report the time until the registries matched the hardware
+ *
+ * @Param daemon The daemon context
+ */
+/* ---------------------------------------------------------------------------*/
+static void startup_done(struct drmdaemon *daemon)
+{
+	uint64_t us = metrics_now_us() - daemon->start_us;
+
+	daemon->consistent = 1;
+	metrics_observe(METRIC_STARTUP_CONSISTENT, us);
+	log_info("Consistent state %.1f ms after start", us / 1000.0);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Give every card its first registry
+ * Cards found in the snapshot are restored and get their last layout
+ * back, their probe runs as the first rescan of the event loop. The other
+ * cards are populated.
+ *
+ * @Param daemon The daemon context
+ */
+/* ---------------------------------------------------------------------------*/
+static void start_cards(struct drmdaemon *daemon)
+{
+	struct snapshot *snap = NULL;
+	struct conn_registry *reg;
+	uint64_t us;
+	int i, warm = 0;
+
+	if (daemon->snapshot_file) snap = snapshot_open(daemon->snapshot_file);
+	for (i = 0; snap && i < daemon->nr_cards; i++) {
+		reg = snapshot_restore(snap, daemon->cards[i]->drm);
+		if (!reg) continue;
+		card_warm_start(daemon->cards[i], reg);
+		warm++;
+	}
+	snapshot_close(snap);
+	if (warm < daemon->nr_cards) {
+		log_info("Populating DRM connector list");
+		run_card_jobs(daemon, card_populate, 0);
+		log_ok("List populated");
+	}
+
+	us = metrics_now_us() - daemon->start_us;
+	metrics_observe(METRIC_STARTUP_FIRST_STATE, us);
+	log_info("First state %.1f ms after start, %d of %d card(s) from the "
+		 "snapshot",
+		 us / 1000.0,
+		 warm,
+		 daemon->nr_cards);
+	if (!warm) {
+		startup_done(daemon);
+		publish_changes(daemon);
+	} else {
+		/* Restored registries are not dirty, the snapshot has them */
+		state_page_publish(daemon->cards, daemon->nr_cards);
+	}
+}
+
+static void timer_handler(struct event_loop *loop, int fd, uint32_t events,
+			  void *data)
+{
+	struct drmdaemon *daemon = data;
+	uint64_t expirations;
+	uint32_t replayed = daemon->replay ? daemon->replay->tracked : 0;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+	daemon->timer_armed = 0;
+
+	run_card_jobs(daemon, card_rescan, 1);
+	daemon->rescans++;
+	if (!daemon->consistent) startup_done(daemon);
+	publish_changes(daemon);
+	replay_scan_done(daemon->replay, replayed);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write the changed caches to disk
+ * Runs on the event loop between scans, no scan holds a cache record.
+ */
+/* ---------------------------------------------------------------------------*/
+static void persist_handler(struct event_loop *loop, int fd, uint32_t events,
+			    void *data)
+{
+	struct drmdaemon *daemon = data;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+	daemon->persist_armed = 0;
+	persist(daemon);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Completion events of the non-blocking commits of a card
+ */
+/* ---------------------------------------------------------------------------*/
+static void drm_event_handler(struct event_loop *loop, int fd,
+			      uint32_t events, void *data)
+{
+	struct drm_card *card = data;
+	apply_handle_events(card->apply);
+}
+
+static void signal_handler(struct event_loop *loop, int fd, uint32_t events,
+			   void *data)
+{
+	struct drmdaemon *daemon = data;
+	struct signalfd_siginfo info;
+
+	if (read(fd, &info, sizeof(info)) != sizeof(info)) return;
+	switch (info.ssi_signo) {
+	case SIGHUP:
+		log_info("SIGHUP received, rescanning");
+		mark_all_cards(daemon);
+		schedule_update(daemon);
+		break;
+	case SIGUSR1:
+		print_stats(daemon);
+		break;
+	case SIGINT:
+	case SIGTERM:
+		log_info("Signal %d received, stopping", info.ssi_signo);
+		event_loop_stop(loop);
+		break;
+	default: break;
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Subscribe to the drm uevents before the initial scan
+ * The socket buffers the uevents while the cards are scanned, they are
+ * read once the event loop runs. The SEQNUM read afterwards marks the
+ * uevents the scan covers. A replay stands in for the kernel and needs
+ * neither.
+ *
+ * @Param daemon The daemon context
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int subscribe_uevents(struct drmdaemon *daemon)
+{
+	if (daemon->replay) return 0;
+	if (daemon->use_netlink) {
+		daemon->netlink = uevent_netlink_open("drm", daemon->rcvbuf);
+		if (!daemon->netlink) return -1;
+	} else {
+		daemon->mon = setup_udev_monitor(daemon->udev, "drm",
+						 daemon->rcvbuf);
+		if (!daemon->mon) return -1;
+	}
+	daemon->scan_seqnum = uevent_kernel_seqnum();
+	log_info("Subscribed to uevents, initial scan covers SEQNUM %llu",
+		 (unsigned long long)daemon->scan_seqnum);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check that every replayed uevent is for an opened card
+ * A uevent for another card never causes a rescan, so its latency would
+ * mean nothing. Replay on the same cards with -d instead.
+ *
+ * @Param daemon The daemon context
+ *
+ * @Returns   0 if they all match, -1 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int check_replay_cards(struct drmdaemon *daemon)
+{
+	struct uevent *ev;
+	uint32_t i;
+
+	for (i = 0; i < daemon->replay->nr_events; i++) {
+		ev = &daemon->replay->events[i];
+		if (find_card(daemon, ev->devnode)) continue;
+		log_error("Replayed uevent %u is for %s, which is not opened",
+			  i + 1,
+			  ev->devnode);
+		return -1;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  The signals the daemon reads from its signalfd
+ *
+ * @Param mask Receives the signals
+ */
+/* ---------------------------------------------------------------------------*/
+static void handled_signals(sigset_t *mask)
+{
+	sigemptyset(mask);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGHUP);
+	sigaddset(mask, SIGUSR1);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add the uevent source (or start the replay), signalfd and
+ * timerfd to the event loop, together with the cards when modes are
+ * applied
+ *
+ * @Param daemon The daemon context
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int setup_event_sources(struct drmdaemon *daemon)
+{
+	sigset_t mask;
+	int i;
+
+	/* A replay stands in for the kernel */
+	if (daemon->replay) {
+		if (check_replay_cards(daemon) < 0) return -1;
+		if (replay_start(daemon->replay, daemon->loop,
+				 daemon->uevent_ring) < 0)
+			return -1;
+	} else if (daemon->netlink) {
+		if (event_loop_add_fd(daemon->loop,
+				      uevent_netlink_fd(daemon->netlink),
+				      EPOLLIN,
+				      netlink_handler,
+				      daemon) < 0)
+			return -1;
+	} else if (event_loop_add_fd(daemon->loop,
+				     udev_monitor_get_fd(daemon->mon),
+				     EPOLLIN,
+				     udev_handler,
+				     daemon) < 0) {
+		return -1;
+	}
+	if (event_loop_add_fd(daemon->loop,
+			      SPSC_RING_FD(daemon->uevent_ring),
+			      EPOLLIN,
+			      uevent_ring_handler,
+			      daemon) < 0)
+		return -1;
+	log_ok("Udev initialisation ok");
+
+	/* daemonize() ignores SIGHUP, ignored signals never reach a signalfd */
+	signal(SIGHUP, SIG_DFL);
+	handled_signals(&mask);
+	daemon->sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (daemon->sig_fd < 0) {
+		log_error("Failed to create signalfd");
+		return -1;
+	}
+	if (event_loop_add_fd(daemon->loop, daemon->sig_fd, EPOLLIN,
+			      signal_handler, daemon) < 0)
+		return -1;
+
+	daemon->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (daemon->timer_fd < 0) {
+		log_error("Failed to create timerfd");
+		return -1;
+	}
+	if (event_loop_add_fd(daemon->loop, daemon->timer_fd, EPOLLIN,
+			      timer_handler, daemon) < 0)
+		return -1;
+
+	daemon->persist_fd = timerfd_create(CLOCK_MONOTONIC,
+					    TFD_NONBLOCK | TFD_CLOEXEC);
+	if (daemon->persist_fd < 0) {
+		log_error("Failed to create timerfd");
+		return -1;
+	}
+	if (event_loop_add_fd(daemon->loop, daemon->persist_fd, EPOLLIN,
+			      persist_handler, daemon) < 0)
+		return -1;
+
+	/* Page flip completions of -a and of the D-Bus SetMode */
+	for (i = 0; i < daemon->nr_cards; i++) {
+		if (!daemon->cards[i]->apply) continue;
+		if (event_loop_add_fd(daemon->loop,
+				      daemon->cards[i]->drm->fd,
+				      EPOLLIN,
+				      drm_event_handler,
+				      daemon->cards[i]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open every DRM card and start the scan workers
+ * Without -d options the cards are enumerated through udev.
+ *
+ * @Param daemon The daemon context
+ *
+ * @Returns   0 if at least one card was opened, -1 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int open_cards(struct drmdaemon *daemon)
+{
+	int i, workers;
+
+	daemon->udev = udev_new();
+	if (!daemon->udev) {
+		log_error("Failed to create udev instance");
+		return -1;
+	}
+	if (daemon->nr_devnodes == 0) {
+		daemon->nr_devnodes = enumerate_drm_cards(
+		    daemon->udev, daemon->devnodes, MAX_DRM_CARDS);
+		if (daemon->nr_devnodes < 0) daemon->nr_devnodes = 0;
+	}
+	for (i = 0; i < daemon->nr_devnodes; i++) {
+		daemon->cards[daemon->nr_cards] = card_open(daemon->devnodes[i]);
+		if (!daemon->cards[daemon->nr_cards]) continue;
+		log_ok("Opened %s", daemon->devnodes[i]);
+		daemon->cards[daemon->nr_cards]->auto_apply = daemon->auto_apply;
+		daemon->cards[daemon->nr_cards]->policy = daemon->policy;
+		daemon->nr_cards++;
+	}
+	if (daemon->nr_cards == 0) {
+		log_error("No DRM card could be opened");
+		return -1;
+	}
+
+	workers = daemon->nr_cards;
+	if (workers > MAX_SCAN_WORKERS) workers = MAX_SCAN_WORKERS;
+	if (workers > 1) daemon->scanners = workpool_create(workers);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Release everything that was allocated by main
+ *
+ * @Param daemon The daemon context
+ */
+/* ---------------------------------------------------------------------------*/
+static void cleanup(struct drmdaemon *daemon)
+{
+	int i;
+
+	print_stats(daemon);
+	replay_close(daemon->replay);
+	if (daemon->record) fclose(daemon->record);
+	if (daemon->loop) {
+		metrics_close(daemon->loop);
+		state_page_close(daemon->loop);
+		dbus_service_close(daemon->loop);
+		event_stream_close();
+		log_info("Event loop woke up %ld time(s)",
+			 daemon->loop->wakeups);
+		event_loop_destroy(daemon->loop);
+	}
+	if (daemon->timer_fd >= 0) close(daemon->timer_fd);
+	if (daemon->persist_fd >= 0) close(daemon->persist_fd);
+	if (daemon->sig_fd >= 0) close(daemon->sig_fd);
+	if (daemon->mon) udev_monitor_unref(daemon->mon);
+	uevent_netlink_close(daemon->netlink);
+	if (daemon->udev) udev_unref(daemon->udev);
+	if (daemon->uevent_ring) spsc_ring_destroy(daemon->uevent_ring);
+	workpool_destroy(daemon->scanners);
+	/* Changes still waiting for the persist timer */
+	persist(daemon);
+	for (i = 0; i < daemon->nr_cards; i++) card_close(daemon->cards[i]);
+	policy_destroy(daemon->policy);
+	edid_cache_close();
+	trace_close();
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -w <ms>  debounce window for uevent bursts (default %d)\n"
+		"  -l <ms>  maximum delay before a rescan (default %d)\n"
+		"  -d <dev> DRM device to manage, may be repeated "
+		"(default: all cards)\n"
+		"  -m <path> serve metrics on a unix socket\n"
+		"  -t <file> write a binary trace to a circular file\n"
+		"  -T <n>   number of trace records (default %d, at most %d)\n"
+		"  -r <file> append the received uevents to a recording\n"
+		"  -R <file> replay a recording instead of listening to udev,\n"
+		"           as fast as possible, report and exit\n"
+		"  -p       replay at the recorded pace\n"
+		"  -n       read uevents from netlink directly instead of\n"
+		"           through libudev\n"
+		"  -b <bytes> receive buffer of the uevent socket\n"
+		"           (default: libudev or system default)\n"
+		"  -a       light up connected outputs in their preferred mode\n"
+		"           and switch off disconnected ones\n"
+		"  -c <file> pick modes and positions from a rules file,\n"
+		"           implies -a\n"
+		"  -e <file> remember probed monitors in a cache file, a\n"
+		"           known monitor is not probed again when replugged\n"
+		"  -s <file> start from the state saved in a snapshot file and\n"
+		"           probe in the background\n"
+		"  -S <path> share the connector state with clients through a\n"
+		"           unix socket (see client/drmstate.h)\n"
+		"  -D <bus> offer the D-Bus service on the system or session\n"
+		"           bus or on the bus at an address (see dbus_service.h)\n"
+		"  -E <path> stream connector events to subscribers on a\n"
+		"           unix socket (see event_stream.h)\n",
+		name,
+		DEFAULT_DEBOUNCE_MS,
+		DEFAULT_MAX_LATENCY_MS,
+		TRACE_DEFAULT_RECORDS,
+		TRACE_MAX_RECORDS);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse the command line options into the daemon context
+ *
+ * @Param daemon The daemon context
+ * @Param argc Argument count
+ * @Param argv Argument vector
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int parse_options(struct drmdaemon *daemon, int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "w:l:d:m:t:T:r:R:pnb:ac:e:s:S:D:E:h")) != -1) {
+		switch (opt) {
+		case 'w': daemon->debounce_ms = atol(optarg); break;
+		case 'l': daemon->max_latency_ms = atol(optarg); break;
+		case 'd':
+			if (daemon->nr_devnodes == MAX_DRM_CARDS) break;
+			snprintf(daemon->devnodes[daemon->nr_devnodes++],
+				 DEVNODE_LEN,
+				 "%s",
+				 optarg);
+			break;
+		case 'm': daemon->metrics_socket = optarg; break;
+		case 't': daemon->trace_file = optarg; break;
+		case 'T': daemon->trace_records = atol(optarg); break;
+		case 'r': daemon->record_file = optarg; break;
+		case 'R': daemon->replay_file = optarg; break;
+		case 'p': daemon->replay_paced = 1; break;
+		case 'n': daemon->use_netlink = 1; break;
+		case 'b': daemon->rcvbuf = atoi(optarg); break;
+		case 'a': daemon->auto_apply = 1; break;
+		case 'c':
+			daemon->policy_file = optarg;
+			daemon->auto_apply = 1;
+			break;
+		case 'e': daemon->edid_cache = optarg; break;
+		case 's': daemon->snapshot_file = optarg; break;
+		case 'S': daemon->state_socket = optarg; break;
+		case 'D': daemon->dbus_bus = optarg; break;
+		case 'E': daemon->stream_socket = optarg; break;
+		default: usage(argv[0]); return -1;
 		}
 	}
+	if (daemon->debounce_ms < 0 || daemon->max_latency_ms < 0 ||
+	    daemon->trace_records <= 0 ||
+	    daemon->trace_records > TRACE_MAX_RECORDS || daemon->rcvbuf < 0) {
+		usage(argv[0]);
+		return -1;
+	}
 	return 0;
 }
 
 int main(int argc, char **argv)
 {
 	int retval = 0;
-	pthread_t udev_thread;
-	struct queue *udev_queue;
-	struct drm_connector_obj *connectors = NULL;
+	struct drmdaemon daemon;
+	sigset_t mask;
+
+	memset(&daemon, 0, sizeof(daemon));
+	daemon.start_us = metrics_now_us();
+	daemon.sig_fd = -1;
+	daemon.timer_fd = -1;
+	daemon.persist_fd = -1;
+	daemon.debounce_ms = DEFAULT_DEBOUNCE_MS;
+	daemon.max_latency_ms = DEFAULT_MAX_LATENCY_MS;
+	daemon.trace_records = TRACE_DEFAULT_RECORDS;
 
-	/*TODO: Add cleanup function!! */
-	udev_queue = queue_init(NULL);
+	if (parse_options(&daemon, argc, argv) < 0) return -1;
+	/* Blocked before the logger and scan threads start, they inherit the
+	 * mask; a thread with the signals unblocked would be killed by them
+	 * instead of the signalfd seeing them */
+	handled_signals(&mask);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		log_error("Failed to block signals");
+		return -1;
+	}
 
 #ifndef DEBUG
 	if (daemonize() < 0) {
-		logger_log(LOG_LVL_ERROR, "Failed to daemonize");
+		log_error("Failed to daemonize");
 		return -1;
 	}
 	logger_set_file_logging("log.txt");
 #endif
-	logger_log(LOG_LVL_INFO, "Running drmdaemon");
-	logger_log(LOG_LVL_INFO, "Creating daemon");
+	install_fatal_handlers();
+	log_info("Running drmdaemon");
+	log_info("Creating daemon");
+	if (daemon.trace_file &&
+	    trace_open(daemon.trace_file, daemon.trace_records) < 0)
+		log_warning("Continuing without trace");
+	if (daemon.record_file) {
+		daemon.record = fopen(daemon.record_file, "a");
+		if (!daemon.record)
+			log_warning("Failed to open recording %s",
+				    daemon.record_file);
+	}
+	if (daemon.replay_file) {
+		daemon.replay =
+		    replay_open(daemon.replay_file, daemon.replay_paced);
+		if (!daemon.replay) {
+			retval = -1;
+			goto end;
+		}
+	}
 
+	daemon.uevent_ring = spsc_ring_create_items(UEVENT_RING_SIZE,
+						    sizeof(struct uevent));
+	daemon.loop = event_loop_create();
+	if (!daemon.uevent_ring || !daemon.loop) {
+		retval = -1;
+		goto end;
+	}
+
+	if (daemon.policy_file) {
+		daemon.policy = policy_load(daemon.policy_file);
+		if (!daemon.policy) {
+			retval = -1;
+			goto end;
+		}
+	}
+	if (daemon.edid_cache && edid_cache_open(daemon.edid_cache) < 0)
+		log_warning("Continuing without EDID cache");
 	if (init_drm_handler() < 0) {
 		retval = -1;
 		goto end;
 	}
-	logger_log(LOG_LVL_INFO, "Populating DRM connector list");
-	connectors = populate_drm_conn_list("/dev/dri/card0");
-	if (!connectors) {
-		logger_log(LOG_LVL_ERROR, "Failed to retrieve connectors");
+	if (open_cards(&daemon) < 0) {
 		retval = -1;
 		goto end;
 	}
-	logger_log(LOG_LVL_OK, "List populated");
-
-	/* Create pthread for udev */
-	if (pthread_create(
-		&udev_thread, NULL, udev_thread_handler, (void *)udev_queue) <
-	    0) {
-		logger_log(LOG_LVL_ERROR, "Failed to create pthread");
+	if (daemon.state_socket && state_page_create() < 0)
+		log_warning("Continuing without state page");
+	/* Hotplugs during the scan wait in the socket instead of being lost */
+	if (subscribe_uevents(&daemon) < 0) {
+		retval = -1;
 		goto end;
 	}
+	start_cards(&daemon);
 
-	/* While wait for condition from udev*/
-	/* Trigger DRM comparision when signal is received from udev */
-	while (1) {
-
-		pthread_mutex_lock(&cond_mutex);
-		if (QUEUE_SIZE(udev_queue) != 0) {
-			logger_log(LOG_LVL_INFO, "new items added");
-			void *data;
-			queue_pop(udev_queue, &data);
-			udev_device_unref((struct udev_device *)data);
-		}
-		pthread_mutex_unlock(&cond_mutex);
+	if (setup_event_sources(&daemon) < 0) {
+		retval = -1;
+		goto end;
+	}
+	/* The probe of warm started cards runs first thing in the loop */
+	if (!daemon.consistent) {
+		daemon.burst_start_ms = monotonic_ms();
+		if (event_loop_arm_timer(daemon.timer_fd, 1) == 0)
+			daemon.timer_armed = 1;
 	}
+	/* Monitors probed by the initial scan */
+	schedule_persist(&daemon);
+	if (daemon.metrics_socket &&
+	    metrics_listen(daemon.loop, daemon.metrics_socket) < 0)
+		log_warning("Continuing without metrics");
+	if (daemon.state_socket && state_page_fd() >= 0 &&
+	    state_page_listen(daemon.loop, daemon.state_socket) < 0)
+		log_warning("Continuing without state socket");
+	if (daemon.dbus_bus &&
+	    dbus_service_open(daemon.loop, daemon.dbus_bus, daemon.cards,
+			      daemon.nr_cards, dbus_mode_set, &daemon) < 0)
+		log_warning("Continuing without D-Bus");
+	if (daemon.stream_socket &&
+	    event_stream_listen(daemon.stream_socket) < 0)
+		log_warning("Continuing without event stream");
+
+	/* Block until udev, a signal or the update timer needs attention */
+	if (event_loop_run(daemon.loop) < 0) retval = -1;
 end:
+	cleanup(&daemon);
+	logger_print_stats();
+	logger_flush();
 	return retval;
 }
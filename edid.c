@@ -0,0 +1,99 @@
+/**
+ * @file edid.c
+ * @Brief  Identity of a monitor parsed from its EDID
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-02
+ */
+
+#include "edid.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Offsets in the base block */
+#define EDID_VENDOR 8
+#define EDID_PRODUCT 10
+#define EDID_SERIAL 12
+#define EDID_DESCRIPTORS 54
+#define EDID_DESCRIPTOR_LEN 18
+#define EDID_NR_DESCRIPTORS 4
+
+/* Display descriptor tags */
+#define EDID_TAG_SERIAL 0xff
+#define EDID_TAG_NAME 0xfc
+
+static const uint8_t edid_header[8] = {0x00, 0xff, 0xff, 0xff,
+				       0xff, 0xff, 0xff, 0x00};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy the text of a display descriptor
+ * The text ends at a newline and is padded with spaces.
+ *
+ * @Param desc The descriptor
+ * @Param out Receives the text, EDID_TEXT_LEN bytes
+ */
+/* ---------------------------------------------------------------------------*/
+static void descriptor_text(const uint8_t *desc, char *out)
+{
+	int i;
+
+	for (i = 0; i < EDID_TEXT_LEN - 1; i++) {
+		if (desc[5 + i] == '\n' || desc[5 + i] == '\0') break;
+		/* Keep the text printable, it ends up in logs and keys */
+		out[i] = desc[5 + i] >= 0x20 && desc[5 + i] < 0x7f ? desc[5 + i]
+								     : '?';
+	}
+	while (i > 0 && out[i - 1] == ' ') i--;
+	out[i] = '\0';
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse the identity from an EDID blob
+ *
+ * @Param data The EDID blob
+ * @Param len Length of the blob in bytes
+ * @Param info Receives the identity, zeroed if the blob is invalid
+ *
+ * @Returns   0 if successfull, -1 if the blob is not a valid EDID
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_parse(const uint8_t *data, size_t len, struct edid_info *info)
+{
+	const uint8_t *desc;
+	uint8_t sum = 0;
+	uint32_t serial;
+	uint16_t vendor;
+	int i;
+
+	memset(info, 0, sizeof(*info));
+	if (!data || len < EDID_BLOCK_LEN ||
+	    memcmp(data, edid_header, sizeof(edid_header)))
+		return -1;
+	for (i = 0; i < EDID_BLOCK_LEN; i++) sum += data[i];
+	if (sum) return -1;
+
+	/* Three 5 bit letters, 1 is 'A' */
+	vendor = data[EDID_VENDOR] << 8 | data[EDID_VENDOR + 1];
+	info->vendor[0] = '@' + ((vendor >> 10) & 0x1f);
+	info->vendor[1] = '@' + ((vendor >> 5) & 0x1f);
+	info->vendor[2] = '@' + (vendor & 0x1f);
+	info->product = data[EDID_PRODUCT] | data[EDID_PRODUCT + 1] << 8;
+	serial = data[EDID_SERIAL] | data[EDID_SERIAL + 1] << 8 |
+		 data[EDID_SERIAL + 2] << 16 | (uint32_t)data[EDID_SERIAL + 3] << 24;
+
+	for (i = 0; i < EDID_NR_DESCRIPTORS; i++) {
+		desc = data + EDID_DESCRIPTORS + i * EDID_DESCRIPTOR_LEN;
+		/* Detailed timings have a non zero pixel clock */
+		if (desc[0] || desc[1]) continue;
+		if (desc[3] == EDID_TAG_SERIAL)
+			descriptor_text(desc, info->serial);
+		else if (desc[3] == EDID_TAG_NAME)
+			descriptor_text(desc, info->name);
+	}
+	if (!info->serial[0] && serial)
+		snprintf(info->serial, sizeof(info->serial), "%u", serial);
+	return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * @file edid.h
+ * @Brief  Identity of a monitor parsed from its EDID
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-02
+ *
+ * Only the fields that identify a monitor are parsed: the PNP vendor id,
+ * the product code, the serial number and the monitor name.
+ */
+
+#ifndef _EDID_H_
+#define _EDID_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of an EDID base block */
+#define EDID_BLOCK_LEN 128
+
+/* A display descriptor holds at most 13 characters of text */
+#define EDID_TEXT_LEN 14
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Identity of a monitor
+ */
+/* ---------------------------------------------------------------------------*/
+struct edid_info {
+	/* Three letter PNP id, e.g. "DEL", empty if there is no EDID */
+	char vendor[4];
+	uint16_t product;
+	/* The serial number descriptor, or the numeric serial number in
+	 * decimal if there is none, empty if the monitor reports neither */
+	char serial[EDID_TEXT_LEN];
+	/* The monitor name descriptor, empty if there is none */
+	char name[EDID_TEXT_LEN];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse the identity from an EDID blob
+ *
+ * @Param data The EDID blob
+ * @Param len Length of the blob in bytes
+ * @Param info Receives the identity, zeroed if the blob is invalid
+ *
+ * @Returns   0 if successfull, -1 if the blob is not a valid EDID
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_parse(const uint8_t *data, size_t len, struct edid_info *info);
+
+#endif
@@ -0,0 +1,485 @@
+/**
+ * @file edid_cache.c
+ * @Brief  Persistent cache of the monitors seen on each connector
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-08
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "edid_cache.h"
+#include "metrics.h"
+
+/* Open addressing table of record index + 1, kept at most half full */
+#define TABLE_SIZE (EDID_CACHE_MAX_RECORDS * 2)
+
+/* Mode lists longer than this are rejected when loading */
+#define MAX_MODES 1024
+
+static const char cache_magic[8] = "DRMEDIDC";
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Header of the cache file
+ */
+/* ---------------------------------------------------------------------------*/
+struct file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Header of a record in the file, followed by the EDID and the
+ * modes
+ */
+/* ---------------------------------------------------------------------------*/
+struct file_record {
+	uint64_t hash;
+	char name[EDID_CACHE_NAME_LEN];
+	struct edid_info info;
+	uint32_t edid_len;
+	uint32_t nr_modes;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Global cache
+ */
+/* ---------------------------------------------------------------------------*/
+static struct {
+	pthread_mutex_t lock;
+	char *path;
+	struct edid_record *records[EDID_CACHE_MAX_RECORDS];
+	int count;
+	uint32_t table[TABLE_SIZE];
+	/* Records were added since the file was written */
+	int dirty;
+	/* Replaced records, freed by the next sync */
+	struct edid_record *retired;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  FNV-1a hash over the connector name and the EDID
+ *
+ * @Param name The connector name
+ * @Param edid The EDID blob
+ * @Param len Length of the blob
+ *
+ * @Returns   The hash value
+ */
+/* ---------------------------------------------------------------------------*/
+static uint64_t hash_monitor(const char *name, const uint8_t *edid,
+			     size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	/* The terminator separates the name from the EDID */
+	for (i = 0; i == 0 || name[i - 1]; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 1099511628211ULL;
+	}
+	for (i = 0; i < len; i++) {
+		hash ^= edid[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Find the table slot of a monitor
+ *
+ * @Returns   The slot holding the monitor, or the free slot where it
+ * belongs
+ */
+/* ---------------------------------------------------------------------------*/
+static uint32_t find_slot(uint64_t hash, const char *name,
+			  const uint8_t *edid, size_t len)
+{
+	uint32_t slot = hash & (TABLE_SIZE - 1);
+	struct edid_record *rec;
+
+	while (cache.table[slot]) {
+		rec = cache.records[cache.table[slot] - 1];
+		if (rec->hash == hash && rec->edid_len == len &&
+		    !memcmp(rec->edid, edid, len) && !strcmp(rec->name, name))
+			break;
+		slot = (slot + 1) & (TABLE_SIZE - 1);
+	}
+	return slot;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Allocate a record with room for its EDID and modes
+ *
+ * @Param edid_len Length of the EDID
+ * @Param nr_modes Number of modes
+ *
+ * @Returns   The record or NULL if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static struct edid_record *record_alloc(uint32_t edid_len, uint32_t nr_modes)
+{
+	struct edid_record *rec;
+
+	rec = calloc(1, sizeof(*rec) + nr_modes * sizeof(drmModeModeInfo) +
+			    edid_len);
+	if (!rec) return NULL;
+	rec->modes = (drmModeModeInfo *)(rec + 1);
+	rec->nr_modes = nr_modes;
+	rec->edid = (uint8_t *)(rec->modes + nr_modes);
+	rec->edid_len = edid_len;
+	return rec;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add a record to the table
+ * A record of the same monitor with another mode list, e.g. after a
+ * kernel update, takes over the index of the old record. The old record
+ * stays allocated until the next sync, a scan may still be using it.
+ *
+ * @Param rec The record
+ *
+ * @Returns   0 if added, 1 if the monitor is known with the same modes, -1
+ * if the cache is full
+ */
+/* ---------------------------------------------------------------------------*/
+static int cache_insert(struct edid_record *rec)
+{
+	struct edid_record *old = NULL;
+	uint32_t slot;
+
+	slot = find_slot(rec->hash, rec->name, rec->edid, rec->edid_len);
+	if (cache.table[slot]) old = cache.records[cache.table[slot] - 1];
+	if (old && old->nr_modes == rec->nr_modes &&
+	    !memcmp(old->modes, rec->modes, rec->nr_modes * sizeof(*rec->modes)))
+		return 1;
+	if (old) {
+		cache.records[cache.table[slot] - 1] = rec;
+		old->retired = cache.retired;
+		cache.retired = old;
+		return 0;
+	}
+	if (cache.count == EDID_CACHE_MAX_RECORDS) return -1;
+	cache.records[cache.count++] = rec;
+	cache.table[slot] = cache.count;
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Free the replaced records
+ */
+/* ---------------------------------------------------------------------------*/
+static void free_retired()
+{
+	struct edid_record *rec;
+
+	while ((rec = cache.retired)) {
+		cache.retired = rec->retired;
+		free(rec);
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Free all records
+ */
+/* ---------------------------------------------------------------------------*/
+static void cache_clear()
+{
+	int i;
+
+	for (i = 0; i < cache.count; i++) free(cache.records[i]);
+	free_retired();
+	cache.count = 0;
+	cache.dirty = 0;
+	memset(cache.table, 0, sizeof(cache.table));
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the records of the cache file
+ *
+ * @Param fp The opened cache file
+ *
+ * @Returns   0 if successfull, -1 if the file is damaged or of another
+ * version
+ */
+/* ---------------------------------------------------------------------------*/
+static int cache_load(FILE *fp)
+{
+	struct file_header hdr;
+	struct file_record frec;
+	struct edid_record *rec;
+	uint32_t i;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, cache_magic, sizeof(cache_magic)) ||
+	    hdr.version != EDID_CACHE_VERSION ||
+	    hdr.count > EDID_CACHE_MAX_RECORDS)
+		return -1;
+	for (i = 0; i < hdr.count; i++) {
+		if (fread(&frec, sizeof(frec), 1, fp) != 1) return -1;
+		if (frec.edid_len > EDID_CACHE_MAX_EDID ||
+		    frec.nr_modes > MAX_MODES)
+			return -1;
+		rec = record_alloc(frec.edid_len, frec.nr_modes);
+		if (!rec) return -1;
+		memcpy(rec->name, frec.name, sizeof(rec->name));
+		rec->name[sizeof(rec->name) - 1] = '\0';
+		rec->info = frec.info;
+		rec->hash = frec.hash;
+		if (fread(rec->modes, sizeof(*rec->modes), rec->nr_modes, fp) !=
+			rec->nr_modes ||
+		    fread(rec->edid, 1, rec->edid_len, fp) != rec->edid_len ||
+		    hash_monitor(rec->name, rec->edid, rec->edid_len) !=
+			rec->hash ||
+		    cache_insert(rec) != 0) {
+			free(rec);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write all records to a temporary file and move it over the
+ * cache file, a crash leaves either the old or the new file
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int cache_save()
+{
+	struct file_header hdr;
+	struct file_record frec;
+	struct edid_record *rec;
+	char tmp[256];
+	FILE *fp;
+	int ret = 0;
+	uint32_t slot;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache.path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		log_error("Failed to write EDID cache %s", tmp);
+		return -1;
+	}
+	memcpy(hdr.magic, cache_magic, sizeof(hdr.magic));
+	hdr.version = EDID_CACHE_VERSION;
+	hdr.count = cache.count;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ret = -1;
+	for (slot = 0; slot < TABLE_SIZE && ret == 0; slot++) {
+		if (!cache.table[slot]) continue;
+		rec = cache.records[cache.table[slot] - 1];
+		memset(&frec, 0, sizeof(frec));
+		frec.hash = rec->hash;
+		memcpy(frec.name, rec->name, sizeof(frec.name));
+		frec.info = rec->info;
+		frec.edid_len = rec->edid_len;
+		frec.nr_modes = rec->nr_modes;
+		if (fwrite(&frec, sizeof(frec), 1, fp) != 1 ||
+		    fwrite(rec->modes, sizeof(*rec->modes), rec->nr_modes, fp) !=
+			rec->nr_modes ||
+		    fwrite(rec->edid, 1, rec->edid_len, fp) != rec->edid_len)
+			ret = -1;
+	}
+	if (fflush(fp) || fsync(fileno(fp))) ret = -1;
+	if (fclose(fp)) ret = -1;
+	if (ret == 0 && rename(tmp, cache.path) < 0) ret = -1;
+	if (ret < 0) {
+		log_error("Failed to write EDID cache %s", cache.path);
+		unlink(tmp);
+	}
+	return ret;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open the cache and load the records of a file
+ * A missing file gives an empty cache, a damaged one is ignored.
+ *
+ * @Param path The cache file
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_open(const char *path)
+{
+	FILE *fp;
+
+	edid_cache_close();
+	cache.path = strdup(path);
+	if (!cache.path) return -1;
+	fp = fopen(path, "r");
+	if (!fp) {
+		log_info("Starting with an empty EDID cache %s", path);
+		return 0;
+	}
+	if (cache_load(fp) < 0) {
+		log_warning("Ignoring damaged or outdated EDID cache %s", path);
+		cache_clear();
+	} else {
+		log_info("Loaded %d monitor(s) from %s", cache.count, path);
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if the cache is open
+ *
+ * @Returns   1 if open, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_enabled()
+{
+	return cache.path != NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Lookup a monitor, counts a hit or a miss
+ *
+ * @Param name The connector name
+ * @Param edid The EDID blob
+ * @Param len Length of the blob
+ *
+ * @Returns   The record or NULL if the monitor is unknown or the cache is
+ * not open
+ */
+/* ---------------------------------------------------------------------------*/
+const struct edid_record *edid_cache_lookup(const char *name,
+					    const uint8_t *edid, size_t len)
+{
+	struct edid_record *rec = NULL;
+	uint64_t hash;
+	uint32_t slot;
+
+	if (!cache.path || !edid || !len) return NULL;
+	hash = hash_monitor(name, edid, len);
+	pthread_mutex_lock(&cache.lock);
+	slot = find_slot(hash, name, edid, len);
+	if (cache.table[slot]) rec = cache.records[cache.table[slot] - 1];
+	pthread_mutex_unlock(&cache.lock);
+	metrics_inc(rec ? METRIC_EDID_CACHE_HITS : METRIC_EDID_CACHE_MISSES);
+	return rec;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add a probed monitor, the file is written by edid_cache_sync
+ * A known monitor whose mode list changed is replaced.
+ *
+ * @Param name The connector name
+ * @Param edid The EDID blob
+ * @Param len Length of the blob
+ * @Param info The parsed identity
+ * @Param modes The modes returned by the probe
+ * @Param nr_modes Number of modes
+ *
+ * @Returns   0 if successfull or already cached, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_store(const char *name, const uint8_t *edid, size_t len,
+		     const struct edid_info *info,
+		     const drmModeModeInfo *modes, int nr_modes)
+{
+	struct edid_record *rec;
+	int ret;
+
+	if (!cache.path || !edid || !len) return 0;
+	if (len > EDID_CACHE_MAX_EDID || nr_modes > MAX_MODES) return -1;
+	rec = record_alloc(len, nr_modes);
+	if (!rec) return -1;
+	snprintf(rec->name, sizeof(rec->name), "%s", name);
+	rec->info = *info;
+	memcpy(rec->edid, edid, len);
+	memcpy(rec->modes, modes, nr_modes * sizeof(*modes));
+	rec->hash = hash_monitor(rec->name, edid, len);
+
+	pthread_mutex_lock(&cache.lock);
+	ret = cache_insert(rec);
+	if (ret != 0) {
+		pthread_mutex_unlock(&cache.lock);
+		free(rec);
+		if (ret < 0) log_warning("EDID cache is full, %s not cached", name);
+		return ret < 0 ? -1 : 0;
+	}
+	/* No file I/O on the scan path */
+	cache.dirty = 1;
+	pthread_mutex_unlock(&cache.lock);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if the cache has changes that edid_cache_sync has to
+ * write or free
+ *
+ * @Returns   1 if so, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_pending()
+{
+	int pending;
+
+	pthread_mutex_lock(&cache.lock);
+	pending = cache.dirty || cache.retired;
+	pthread_mutex_unlock(&cache.lock);
+	return pending;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Rewrite the cache file if monitors were added and free the
+ * replaced records
+ * Must not run concurrently with a scan, a scan may hold a replaced
+ * record.
+ *
+ * @Returns   0 if successfull or nothing changed, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_sync()
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&cache.lock);
+	free_retired();
+	if (cache.path && cache.dirty) {
+		ret = cache_save();
+		if (ret == 0) cache.dirty = 0;
+	}
+	pthread_mutex_unlock(&cache.lock);
+	return ret;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write pending changes, free the records and close the cache
+ */
+/* ---------------------------------------------------------------------------*/
+void edid_cache_close()
+{
+	edid_cache_sync();
+	pthread_mutex_lock(&cache.lock);
+	cache_clear();
+	free(cache.path);
+	cache.path = NULL;
+	pthread_mutex_unlock(&cache.lock);
+}
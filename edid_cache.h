@@ -0,0 +1,146 @@
+/**
+ * @file edid_cache.h
+ * @Brief  Persistent cache of the monitors seen on each connector
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-08
+ *
+ * A record holds what a probe of a monitor returned: its identity and its
+ * mode list. Records are keyed by the connector name and the EDID blob,
+ * hashed with FNV-1a and compared byte for byte on a hit, so a collision
+ * can never hand out the modes of another monitor. The same monitor on
+ * another connector gets its own record, as ports can differ in the modes
+ * they drive.
+ *
+ * The records are loaded from a file at startup. Scans only add records
+ * and mark the cache dirty, the file is rewritten by edid_cache_sync,
+ * which the daemon calls outside the scans at most once per persist delay.
+ * A replaced record is freed by the next edid_cache_sync, so a record
+ * returned by a lookup stays valid without holding the lock until then.
+ */
+
+#ifndef _EDID_CACHE_H_
+#define _EDID_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "edid.h"
+
+/* Version of the file format, a file of another version is ignored */
+#define EDID_CACHE_VERSION 1
+
+/* Records kept at most, monitors seen after that are not cached */
+#define EDID_CACHE_MAX_RECORDS 256
+
+/* Largest EDID that is cached, 8 blocks */
+#define EDID_CACHE_MAX_EDID (8 * EDID_BLOCK_LEN)
+
+/* Length of the connector name in a record */
+#define EDID_CACHE_NAME_LEN 32
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A monitor as probed on a connector
+ */
+/* ---------------------------------------------------------------------------*/
+struct edid_record {
+	uint64_t hash;
+	char name[EDID_CACHE_NAME_LEN];
+	struct edid_info info;
+	uint32_t edid_len;
+	uint8_t *edid;
+	/* The modes in the order the kernel reported them, the preferred
+	 * mode is flagged with DRM_MODE_TYPE_PREFERRED */
+	drmModeModeInfo *modes;
+	uint32_t nr_modes;
+	/* Next replaced record waiting to be freed */
+	struct edid_record *retired;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open the cache and load the records of a file
+ * A missing file gives an empty cache, a damaged one is ignored.
+ *
+ * @Param path The cache file
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_open(const char *path);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if the cache is open
+ *
+ * @Returns   1 if open, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_enabled();
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Lookup a monitor, counts a hit or a miss
+ *
+ * @Param name The connector name
+ * @Param edid The EDID blob
+ * @Param len Length of the blob
+ *
+ * @Returns   The record or NULL if the monitor is unknown or the cache is
+ * not open
+ */
+/* ---------------------------------------------------------------------------*/
+const struct edid_record *edid_cache_lookup(const char *name,
+					    const uint8_t *edid, size_t len);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add a probed monitor, the file is written by edid_cache_sync
+ * A known monitor whose mode list changed is replaced.
+ *
+ * @Param name The connector name
+ * @Param edid The EDID blob
+ * @Param len Length of the blob
+ * @Param info The parsed identity
+ * @Param modes The modes returned by the probe
+ * @Param nr_modes Number of modes
+ *
+ * @Returns   0 if successfull or already cached, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_store(const char *name, const uint8_t *edid, size_t len,
+		     const struct edid_info *info,
+		     const drmModeModeInfo *modes, int nr_modes);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if the cache has changes that edid_cache_sync has to
+ * write or free
+ *
+ * @Returns   1 if so, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_pending();
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Rewrite the cache file if monitors were added and free the
+ * replaced records
+ * Must not run concurrently with a scan, a scan may hold a replaced
+ * record.
+ *
+ * @Returns   0 if successfull or nothing changed, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int edid_cache_sync();
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write pending changes, free the records and close the cache
+ */
+/* ---------------------------------------------------------------------------*/
+void edid_cache_close();
+
+#endif
@@ -0,0 +1,251 @@
+/**
+ * @file event_loop.c
+ * @Brief  Small epoll based event loop
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-02
+ */
+
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+
+#define MAX_EVENTS 16
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A registered file descriptor
+ */
+/* ---------------------------------------------------------------------------*/
+struct event_source {
+	int fd;
+	event_cb cb;
+	void *data;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a new event loop
+ *
+ * @Returns   A newly allocated loop or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct event_loop *event_loop_create()
+{
+	struct event_loop *loop = malloc(sizeof(*loop));
+	if (!loop) {
+		log_error("Failed to allocate event loop");
+		return NULL;
+	}
+	memset(loop, 0, sizeof(*loop));
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		log_error("Failed to create epoll instance");
+		free(loop);
+		return NULL;
+	}
+	loop->sources = list_init(free);
+	if (!loop->sources) {
+		close(loop->epfd);
+		free(loop);
+		return NULL;
+	}
+	return loop;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Register a file descriptor with the loop
+ *
+ * @Param loop The event loop
+ * @Param fd The file descriptor to watch
+ * @Param events The epoll events to watch for
+ * @Param cb The callback invoked when the fd is ready
+ * @Param data User data handed to the callback
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events,
+		      event_cb cb, void *data)
+{
+	struct event_source *src;
+	struct epoll_event ev;
+
+	if (!loop || fd < 0 || !cb) return -1;
+
+	src = malloc(sizeof(*src));
+	if (!src) {
+		log_error("Failed to allocate event source");
+		return -1;
+	}
+	src->fd = fd;
+	src->cb = cb;
+	src->data = data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		log_error("Failed to add fd %d to epoll", fd);
+		free(src);
+		return -1;
+	}
+	if (list_insert_next(loop->sources, LIST_TAIL(loop->sources), src) <
+	    0) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+		free(src);
+		return -1;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remove a file descriptor from the loop
+ * The fd itself is not closed.
+ *
+ * @Param loop The event loop
+ * @Param fd The file descriptor to remove
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_del_fd(struct event_loop *loop, int fd)
+{
+	struct dlist_element *iter;
+	void *data;
+
+	if (!loop) return -1;
+
+	for (iter = LIST_HEAD(loop->sources); iter != NULL;
+	     iter = iter->next) {
+		struct event_source *src = iter->data;
+		if (src->fd != fd) continue;
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+		list_remove_item(loop->sources, iter, &data);
+		free(data);
+		return 0;
+	}
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Change the epoll events watched for a registered fd
+ *
+ * @Param loop The event loop
+ * @Param fd The registered file descriptor
+ * @Param events The epoll events to watch for
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_mod_fd(struct event_loop *loop, int fd, uint32_t events)
+{
+	struct dlist_element *iter;
+	struct epoll_event ev;
+
+	if (!loop) return -1;
+
+	for (iter = LIST_HEAD(loop->sources); iter != NULL;
+	     iter = iter->next) {
+		struct event_source *src = iter->data;
+		if (src->fd != fd) continue;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.ptr = src;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+			log_error("Failed to modify fd %d in epoll", fd);
+			return -1;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Dispatch events until event_loop_stop is called
+ * The loop blocks in epoll_wait without a timeout, so an idle daemon
+ * does not wake up at all.
+ *
+ * @Param loop The event loop
+ *
+ * @Returns   0 if stopped, -1 if epoll failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_run(struct event_loop *loop)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int i, n;
+
+	if (!loop) return -1;
+
+	while (!loop->stop) {
+		n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			log_error("epoll_wait failed");
+			return -1;
+		}
+		loop->wakeups++;
+		for (i = 0; i < n; i++) {
+			struct event_source *src = events[i].data.ptr;
+			src->cb(loop, src->fd, events[i].events, src->data);
+		}
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Ask the loop to return after the current dispatch round
+ *
+ * @Param loop The event loop
+ */
+/* ---------------------------------------------------------------------------*/
+void event_loop_stop(struct event_loop *loop)
+{
+	if (loop) loop->stop = 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Destroy the loop and free all registered sources
+ *
+ * @Param loop The event loop
+ */
+/* ---------------------------------------------------------------------------*/
+void event_loop_destroy(struct event_loop *loop)
+{
+	if (!loop) return;
+	list_destroy(loop->sources);
+	close(loop->epfd);
+	free(loop);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Arm a timerfd as a one shot timer
+ *
+ * @Param fd The timerfd
+ * @Param delay_ms Delay in milliseconds, 0 disarms the timer
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_arm_timer(int fd, long delay_ms)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = delay_ms / 1000;
+	its.it_value.tv_nsec = (delay_ms % 1000) * 1000000L;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		log_error("Failed to arm timer");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,143 @@
+/**
+ * @file event_loop.h
+ * @Brief  Small epoll based event loop
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-02
+ */
+
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "debug.h"
+#include "list.h"
+
+struct event_loop;
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Callback that is invoked when a registered fd becomes ready
+ *
+ * @Param loop The loop that dispatched the event
+ * @Param fd The file descriptor that is ready
+ * @Param events The epoll event mask (EPOLLIN, EPOLLOUT, ...)
+ * @Param data The user data passed during registration
+ */
+/* ---------------------------------------------------------------------------*/
+typedef void (*event_cb)(struct event_loop *loop, int fd, uint32_t events,
+			 void *data);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Main event loop structure
+ */
+/* ---------------------------------------------------------------------------*/
+struct event_loop {
+	/* The epoll instance */
+	int epfd;
+	/* Set to 1 to leave event_loop_run */
+	int stop;
+	/* Number of times epoll_wait returned */
+	long wakeups;
+	/* Registered event sources */
+	struct dlist *sources;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a new event loop
+ *
+ * @Returns   A newly allocated loop or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct event_loop *event_loop_create();
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Register a file descriptor with the loop
+ *
+ * @Param loop The event loop
+ * @Param fd The file descriptor to watch
+ * @Param events The epoll events to watch for
+ * @Param cb The callback invoked when the fd is ready
+ * @Param data User data handed to the callback
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events,
+		      event_cb cb, void *data);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remove a file descriptor from the loop
+ * The fd itself is not closed.
+ *
+ * @Param loop The event loop
+ * @Param fd The file descriptor to remove
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_del_fd(struct event_loop *loop, int fd);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Change the epoll events watched for a registered fd
+ *
+ * @Param loop The event loop
+ * @Param fd The registered file descriptor
+ * @Param events The epoll events to watch for
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_mod_fd(struct event_loop *loop, int fd, uint32_t events);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Dispatch events until event_loop_stop is called
+ * The loop blocks in epoll_wait without a timeout, so an idle daemon
+ * does not wake up at all.
+ *
+ * @Param loop The event loop
+ *
+ * @Returns   0 if stopped, -1 if epoll failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_run(struct event_loop *loop);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Ask the loop to return after the current dispatch round
+ *
+ * @Param loop The event loop
+ */
+/* ---------------------------------------------------------------------------*/
+void event_loop_stop(struct event_loop *loop);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Destroy the loop and free all registered sources
+ *
+ * @Param loop The event loop
+ */
+/* ---------------------------------------------------------------------------*/
+void event_loop_destroy(struct event_loop *loop);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Arm a timerfd as a one shot timer
+ *
+ * @Param fd The timerfd
+ * @Param delay_ms Delay in milliseconds, 0 disarms the timer
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_loop_arm_timer(int fd, long delay_ms);
+
+#endif
@@ -0,0 +1,624 @@
+/**
+ * @file event_stream.c
+ * @Brief  Connector events streamed to subscribed clients
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-06-06
+ */
+
+/* accept4 */
+#define _GNU_SOURCE
+#include "event_stream.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "metrics.h"
+#include "registry.h"
+#include "ring.h"
+
+/* Batches on their way from the main thread to the stream thread */
+#define STREAM_RING_SIZE 64
+/* Longest subscription line */
+#define STREAM_LINE_LEN 128
+/* Formatted lines of a client that were not written yet */
+#define STREAM_OUT_LEN 1024
+/* Longest event line */
+#define STREAM_EVENT_LEN 96
+/* Socket send buffer of a client, bounds what the kernel holds for it */
+#define STREAM_SNDBUF 16384
+
+#define STREAM_CONNECT 0x1
+#define STREAM_DISCONNECT 0x2
+#define STREAM_MODE 0x4
+#define STREAM_ALL (STREAM_CONNECT | STREAM_DISCONNECT | STREAM_MODE)
+
+static const char *const kind_names[] = {
+    [STREAM_CONNECT] = "connect",
+    [STREAM_DISCONNECT] = "disconnect",
+    [STREAM_MODE] = "mode",
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  An event, copied out of the registry by the main thread
+ */
+/* ---------------------------------------------------------------------------*/
+struct stream_event {
+	uint32_t kind;
+	uint32_t card;
+	uint32_t connector_id;
+	uint16_t width;
+	uint16_t height;
+	uint32_t refresh;
+	char name[sizeof(((struct drm_connector_obj *)0)->name)];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  The events of one scan, handed to the stream thread at once
+ */
+/* ---------------------------------------------------------------------------*/
+struct stream_batch {
+	int count;
+	struct stream_event events[];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A subscriber, owned by the stream thread
+ */
+/* ---------------------------------------------------------------------------*/
+struct stream_client {
+	int fd;
+	/* Index in _clients */
+	int idx;
+	/* Filter, no kinds until the client subscribed */
+	char glob[STREAM_LINE_LEN];
+	uint32_t kinds;
+	/* Sequence of the next event of the log to look at */
+	uint64_t seq;
+	/* Send "resync" before the next event */
+	int resync;
+	/* The socket failed, the client is dropped on its next wakeup */
+	int dead;
+	/* Partial subscription line */
+	char in[STREAM_LINE_LEN];
+	int in_len;
+	char out[STREAM_OUT_LEN];
+	int out_off;
+	int out_len;
+};
+
+static struct spsc_ring *_ring;
+static struct event_loop *_loop;
+static pthread_t _thread;
+static int _stop;
+static int _listen_fd = -1;
+static char _listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/* The last STREAM_QUEUE_LEN events, shared by all clients. A client only
+ * keeps the sequence of the next event it has to look at, so an event
+ * costs the same memory for one client as for a thousand. */
+static struct stream_event _log[STREAM_QUEUE_LEN];
+static uint64_t _head;
+
+static struct stream_client **_clients;
+static int _nr_clients;
+static int _clients_capacity;
+
+static void set_event(struct stream_event *ev, uint32_t kind, int minor,
+		      const struct drm_connector_obj *obj)
+{
+	const drmModeModeInfo *mode;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->kind = kind;
+	ev->card = minor;
+	ev->connector_id = obj->connector_id;
+	snprintf(ev->name, sizeof(ev->name), "%s", obj->name);
+	/* An output without a CRTC keeps its last mode in the registry */
+	if (kind != STREAM_MODE || !obj->crtc_id ||
+	    obj->current_mode == MODE_HANDLE_NONE)
+		return;
+	mode = mode_pool_get(obj->current_mode);
+	ev->width = mode->hdisplay;
+	ev->height = mode->vdisplay;
+	ev->refresh = mode->vrefresh;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Turn the changed fields of a connector into events
+ *
+ * @Param out Receives up to two events
+ * @Param minor Minor of the card
+ * @Param obj The connector
+ *
+ * @Returns   Number of events
+ */
+/* ---------------------------------------------------------------------------*/
+static int connector_events(struct stream_event *out, int minor,
+			    const struct drm_connector_obj *obj)
+{
+	uint32_t changed = obj->changed;
+	int connected = obj->status == DRM_MODE_CONNECTED;
+	int n = 0;
+
+	if (changed & (CONN_CHANGED_STATUS | CONN_CHANGED_ADDED)) {
+		if (connected)
+			set_event(&out[n++], STREAM_CONNECT, minor, obj);
+		else if (!(changed & CONN_CHANGED_ADDED))
+			set_event(&out[n++], STREAM_DISCONNECT, minor, obj);
+	}
+	/* A disconnect implies the output is off */
+	if (connected &&
+	    ((changed & (CONN_CHANGED_CRTC | CONN_CHANGED_CURRENT_MODE)) ||
+	     ((changed & CONN_CHANGED_ADDED) && obj->crtc_id)))
+		set_event(&out[n++], STREAM_MODE, minor, obj);
+	return n;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Queue the events of the changed connectors of the cards
+ * Must be called before the changes are cleared, see card_clear_changes.
+ *
+ * @Param cards The cards
+ * @Param nr_cards Number of cards
+ */
+/* ---------------------------------------------------------------------------*/
+void event_stream_publish(struct drm_card *const *cards, int nr_cards)
+{
+	struct stream_batch *batch;
+	struct stream_event *ev;
+	struct conn_registry *reg;
+	struct removed_connector *removed;
+	int i, j, max = 0;
+
+	if (!_ring) return;
+	for (i = 0; i < nr_cards; i++) {
+		if (!(reg = cards[i]->connectors)) continue;
+		for (j = 0; j < REGISTRY_SIZE(reg); j++) {
+			if (REGISTRY_AT(reg, j)->changed) max += 2;
+		}
+		max += reg->nr_removed;
+	}
+	if (!max) return;
+
+	batch = malloc(sizeof(*batch) + max * sizeof(batch->events[0]));
+	if (!batch) {
+		/* The clients cannot tell what they missed */
+		spsc_ring_raise_overflow(_ring);
+		return;
+	}
+	batch->count = 0;
+	for (i = 0; i < nr_cards; i++) {
+		if (!(reg = cards[i]->connectors)) continue;
+		for (j = 0; j < REGISTRY_SIZE(reg); j++)
+			batch->count += connector_events(
+			    &batch->events[batch->count], cards[i]->drm->minor,
+			    REGISTRY_AT(reg, j));
+		for (j = 0; j < reg->nr_removed; j++) {
+			removed = &reg->removed[j];
+			if (removed->status != DRM_MODE_CONNECTED) continue;
+			ev = &batch->events[batch->count++];
+			memset(ev, 0, sizeof(*ev));
+			ev->kind = STREAM_DISCONNECT;
+			ev->card = cards[i]->drm->minor;
+			ev->connector_id = removed->connector_id;
+			memcpy(ev->name, removed->name, sizeof(ev->name));
+		}
+	}
+	if (!batch->count || spsc_ring_push(_ring, batch) < 0) free(batch);
+}
+
+static int format_event(char *buf, const struct stream_event *ev)
+{
+	int n;
+
+	if (ev->kind == STREAM_MODE)
+		n = snprintf(buf, STREAM_EVENT_LEN, "mode %u %u %s %ux%u@%u\n",
+			     ev->card, ev->connector_id, ev->name, ev->width,
+			     ev->height, ev->refresh);
+	else
+		n = snprintf(buf, STREAM_EVENT_LEN, "%s %u %u %s\n",
+			     kind_names[ev->kind], ev->card, ev->connector_id,
+			     ev->name);
+	return n < STREAM_EVENT_LEN ? n : STREAM_EVENT_LEN - 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Queue a reply line if it fits, a client that does not read its
+ * replies only misses them
+ */
+/* ---------------------------------------------------------------------------*/
+static void queue_line(struct stream_client *c, const char *line)
+{
+	int len = strlen(line);
+
+	if (c->out_len + len > STREAM_OUT_LEN) return;
+	memcpy(c->out + c->out_len, line, len);
+	c->out_len += len;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Format the pending events that pass the filter of a client
+ * Stops when the output buffer is full.
+ *
+ * @Param c The client, its output buffer must be empty
+ */
+/* ---------------------------------------------------------------------------*/
+static void fill_client(struct stream_client *c)
+{
+	const struct stream_event *ev;
+
+	if (c->resync) {
+		queue_line(c, "resync\n");
+		c->resync = 0;
+	}
+	while (c->seq != _head &&
+	       c->out_len + STREAM_EVENT_LEN <= STREAM_OUT_LEN) {
+		ev = &_log[c->seq++ & (STREAM_QUEUE_LEN - 1)];
+		if (!(c->kinds & ev->kind) || fnmatch(c->glob, ev->name, 0))
+			continue;
+		c->out_len += format_event(c->out + c->out_len, ev);
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Replace the pending events of a client by a resync marker
+ */
+/* ---------------------------------------------------------------------------*/
+static void resync_client(struct stream_client *c)
+{
+	c->seq = _head;
+	c->resync = 1;
+	metrics_inc(METRIC_STREAM_RESYNCS);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write the pending events of a client until its socket is full
+ * A failed client is shut down, so its own handler drops it: another
+ * client may still have an event in the current dispatch round.
+ *
+ * @Param c The client
+ */
+/* ---------------------------------------------------------------------------*/
+static void flush_client(struct stream_client *c)
+{
+	ssize_t n;
+
+	if (c->dead) return;
+	/* Not subscribed yet, nothing is pending */
+	if (!c->kinds) c->seq = _head;
+	/* The log overwrote what the client did not look at */
+	if (_head - c->seq > STREAM_QUEUE_LEN) resync_client(c);
+	while (1) {
+		if (c->out_off == c->out_len) {
+			c->out_off = c->out_len = 0;
+			fill_client(c);
+			if (!c->out_len) return;
+		}
+		n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+			 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			/* EAGAIN: EPOLLOUT flushes again */
+			if (errno != EAGAIN) {
+				c->dead = 1;
+				shutdown(c->fd, SHUT_RDWR);
+			}
+			return;
+		}
+		c->out_off += n;
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse a subscription line and replace the filter of a client
+ *
+ * @Param c The client
+ * @Param line The line without the newline
+ */
+/* ---------------------------------------------------------------------------*/
+static void subscribe(struct stream_client *c, char *line)
+{
+	char glob[STREAM_LINE_LEN] = "*";
+	uint32_t kinds = STREAM_ALL, kind;
+	char *tok, *save, *name, *name_save;
+
+	for (tok = strtok_r(line, " \t\r", &save); tok;
+	     tok = strtok_r(NULL, " \t\r", &save)) {
+		if (!strncmp(tok, "name=", 5)) {
+			snprintf(glob, sizeof(glob), "%s", tok + 5);
+			continue;
+		}
+		if (strncmp(tok, "events=", 7)) {
+			queue_line(c, "error unknown key\n");
+			return;
+		}
+		kinds = 0;
+		for (name = strtok_r(tok + 7, ",", &name_save); name;
+		     name = strtok_r(NULL, ",", &name_save)) {
+			for (kind = STREAM_CONNECT; kind <= STREAM_MODE;
+			     kind <<= 1) {
+				if (!strcmp(name, kind_names[kind])) break;
+			}
+			if (kind > STREAM_MODE) {
+				queue_line(c, "error unknown event kind\n");
+				return;
+			}
+			kinds |= kind;
+		}
+		if (!kinds) {
+			queue_line(c, "error no event kind\n");
+			return;
+		}
+	}
+	/* Events from before the first subscription are not sent */
+	if (!c->kinds) c->seq = _head;
+	strcpy(c->glob, glob);
+	c->kinds = kinds;
+	queue_line(c, "ok\n");
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the subscription lines of a client
+ *
+ * @Param c The client
+ *
+ * @Returns   0 if the client stays, -1 if it closed or sent garbage
+ */
+/* ---------------------------------------------------------------------------*/
+static int read_client(struct stream_client *c)
+{
+	char *nl;
+	ssize_t n;
+
+	while (1) {
+		n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len,
+			 MSG_DONTWAIT);
+		if (n == 0) return -1;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		c->in_len += n;
+		c->in[c->in_len] = '\0';
+		while ((nl = strchr(c->in, '\n'))) {
+			*nl = '\0';
+			subscribe(c, c->in);
+			c->in_len -= nl + 1 - c->in;
+			memmove(c->in, nl + 1, c->in_len + 1);
+		}
+		if (c->in_len == sizeof(c->in) - 1) return -1;
+	}
+}
+
+static void drop_client(struct stream_client *c)
+{
+	event_loop_del_fd(_loop, c->fd);
+	close(c->fd);
+	/* Keep the array dense: move the last client into the hole */
+	_clients[c->idx] = _clients[--_nr_clients];
+	_clients[c->idx]->idx = c->idx;
+	free(c);
+}
+
+static void client_handler(struct event_loop *loop, int fd, uint32_t events,
+			   void *data)
+{
+	struct stream_client *c = data;
+
+	if (c->dead || read_client(c) < 0) {
+		drop_client(c);
+		return;
+	}
+	flush_client(c);
+}
+
+static int add_client(struct stream_client *c)
+{
+	struct stream_client **clients;
+	int capacity;
+
+	if (_nr_clients == _clients_capacity) {
+		capacity = _clients_capacity ? _clients_capacity * 2 : 16;
+		clients = realloc(_clients, capacity * sizeof(*clients));
+		if (!clients) return -1;
+		_clients = clients;
+		_clients_capacity = capacity;
+	}
+	c->idx = _nr_clients;
+	_clients[_nr_clients++] = c;
+	return 0;
+}
+
+static void stream_accept(struct event_loop *loop, int fd, uint32_t events,
+			  void *data)
+{
+	struct stream_client *c;
+	int client, sndbuf = STREAM_SNDBUF;
+
+	while ((client = accept4(fd, NULL, NULL,
+				 SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c || add_client(c) < 0) {
+			log_warning("Failed to allocate stream client");
+			free(c);
+			close(client);
+			continue;
+		}
+		c->fd = client;
+		c->seq = _head;
+		setsockopt(client, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+			   sizeof(sndbuf));
+		/* Edge triggered: a client is only woken when its socket
+		 * drained, not while it stays writable */
+		if (event_loop_add_fd(loop, client,
+				      EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+				      client_handler, c) < 0) {
+			_clients[c->idx] = _clients[--_nr_clients];
+			_clients[c->idx]->idx = c->idx;
+			close(client);
+			free(c);
+		}
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Move the batches of the main thread to the log and send them
+ */
+/* ---------------------------------------------------------------------------*/
+static void stream_ring_handler(struct event_loop *loop, int fd,
+				uint32_t events, void *data)
+{
+	struct stream_batch *batch;
+	void *item;
+	int i;
+
+	spsc_ring_ack(_ring);
+	if (__atomic_load_n(&_stop, __ATOMIC_ACQUIRE)) {
+		event_loop_stop(loop);
+		return;
+	}
+	do {
+		while (spsc_ring_pop(_ring, &item) == 0) {
+			batch = item;
+			for (i = 0; i < batch->count; i++)
+				_log[_head++ & (STREAM_QUEUE_LEN - 1)] =
+				    batch->events[i];
+			metrics_add(METRIC_STREAM_EVENTS, batch->count);
+			free(batch);
+		}
+	} while (spsc_ring_sleep(_ring) < 0);
+
+	/* Nobody knows what was lost, every client starts over */
+	if (spsc_ring_take_overflow(_ring)) {
+		log_warning("Stream events lost, resyncing %d client(s)",
+			    _nr_clients);
+		for (i = 0; i < _nr_clients; i++) {
+			if (_clients[i]->kinds) resync_client(_clients[i]);
+		}
+	}
+	for (i = 0; i < _nr_clients; i++) flush_client(_clients[i]);
+}
+
+static void *stream_thread(void *data)
+{
+	if (event_loop_run(_loop) < 0) log_error("Event stream stopped");
+	return NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Listen for subscribers and start the stream thread
+ *
+ * @Param path The socket path, an existing socket is replaced
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_stream_listen(const char *path)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("Stream socket path too long");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	_ring = spsc_ring_create(STREAM_RING_SIZE);
+	_loop = event_loop_create();
+	if (!_ring || !_loop) goto err;
+	_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			    0);
+	if (_listen_fd < 0) {
+		log_error("Failed to create stream socket");
+		goto err;
+	}
+	unlink(path);
+	if (bind(_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(_listen_fd, SOMAXCONN) < 0) {
+		log_error("Failed to bind stream socket %s", path);
+		goto err;
+	}
+	strcpy(_listen_path, path);
+	if (event_loop_add_fd(_loop, _listen_fd, EPOLLIN, stream_accept,
+			      NULL) < 0 ||
+	    event_loop_add_fd(_loop, SPSC_RING_FD(_ring), EPOLLIN,
+			      stream_ring_handler, NULL) < 0)
+		goto err;
+	if (pthread_create(&_thread, NULL, stream_thread, NULL) != 0) {
+		log_error("Failed to start the stream thread");
+		goto err;
+	}
+	log_ok("Streaming connector events on %s", path);
+	return 0;
+err:
+	if (_listen_fd >= 0) {
+		close(_listen_fd);
+		if (_listen_path[0]) unlink(_listen_path);
+	}
+	_listen_fd = -1;
+	_listen_path[0] = '\0';
+	event_loop_destroy(_loop);
+	_loop = NULL;
+	if (_ring) spsc_ring_destroy(_ring);
+	_ring = NULL;
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Stop the stream thread, disconnect the clients and remove the
+ * socket
+ */
+/* ---------------------------------------------------------------------------*/
+void event_stream_close()
+{
+	uint64_t one = 1;
+	void *item;
+	int i;
+
+	if (!_ring) return;
+	__atomic_store_n(&_stop, 1, __ATOMIC_RELEASE);
+	if (write(SPSC_RING_FD(_ring), &one, sizeof(one)) < 0)
+		log_warning("Failed to wake up the stream thread");
+	pthread_join(_thread, NULL);
+
+	for (i = 0; i < _nr_clients; i++) {
+		close(_clients[i]->fd);
+		free(_clients[i]);
+	}
+	free(_clients);
+	_clients = NULL;
+	_nr_clients = _clients_capacity = 0;
+	while (spsc_ring_pop(_ring, &item) == 0) free(item);
+	event_loop_destroy(_loop);
+	_loop = NULL;
+	spsc_ring_destroy(_ring);
+	_ring = NULL;
+	close(_listen_fd);
+	unlink(_listen_path);
+	_listen_fd = -1;
+	_listen_path[0] = '\0';
+	_head = 0;
+	_stop = 0;
+}
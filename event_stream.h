@@ -0,0 +1,72 @@
+/**
+ * @file event_stream.h
+ * @Brief  Connector events streamed to subscribed clients
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-06-06
+ *
+ * Clients connect to a unix socket and send a subscription line:
+ *
+ *   name=<glob> events=<kind>[,<kind>...]
+ *
+ * Both keys are optional, the defaults are name=* and every kind. The
+ * glob is matched against the connector name (fnmatch), the kinds are
+ * connect, disconnect and mode. The daemon answers "ok" or "error <why>"
+ * and from then on sends one line per matching event:
+ *
+ *   connect <card> <connector> <name>
+ *   disconnect <card> <connector> <name>
+ *   mode <card> <connector> <name> <width>x<height>@<refresh>
+ *
+ * A mode of 0x0@0 means the output was switched off. A new subscription
+ * line replaces the filter.
+ *
+ * Every client has room for STREAM_QUEUE_LEN pending events. A client that
+ * falls further behind loses its pending events and receives a single
+ * "resync" line instead; it should read the full state again (state page
+ * or D-Bus) and carry on with the events that follow.
+ *
+ * The clients are served by a thread with its own event loop. Publishing
+ * the changes of a scan only hands one batch to that thread, whatever the
+ * number of clients.
+ */
+
+#ifndef _EVENT_STREAM_H_
+#define _EVENT_STREAM_H_
+
+#include "card.h"
+
+/* Pending events per client before it is resynced, a power of two */
+#define STREAM_QUEUE_LEN 128
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Listen for subscribers and start the stream thread
+ *
+ * @Param path The socket path, an existing socket is replaced
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int event_stream_listen(const char *path);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Queue the events of the changed connectors of the cards
+ * Must be called before the changes are cleared, see card_clear_changes.
+ *
+ * @Param cards The cards
+ * @Param nr_cards Number of cards
+ */
+/* ---------------------------------------------------------------------------*/
+void event_stream_publish(struct drm_card *const *cards, int nr_cards);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Stop the stream thread, disconnect the clients and remove the
+ * socket
+ */
+/* ---------------------------------------------------------------------------*/
+void event_stream_close();
+
+#endif
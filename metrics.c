@@ -0,0 +1,434 @@
+/**
+ * @file metrics.c
+ * @Brief  Counters and latency histograms, exported over a unix socket
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-03-27
+ */
+
+/* accept4 */
+#define _GNU_SOURCE
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Size of the formatted output, large enough for every bucket */
+#define METRICS_BUF_SIZE 65536
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Histogram of a single thread
+ */
+/* ---------------------------------------------------------------------------*/
+struct metric_hist_shard {
+	uint64_t buckets[METRIC_HIST_BUCKETS];
+	uint64_t sum;
+	uint64_t count;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Metrics of a single thread, only written by that thread
+ */
+/* ---------------------------------------------------------------------------*/
+struct metrics_shard {
+	uint64_t counters[METRIC_COUNTER_COUNT];
+	struct metric_hist_shard hists[METRIC_HIST_COUNT];
+	struct metrics_shard *next;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Export name and label of the counters
+ */
+/* ---------------------------------------------------------------------------*/
+static const struct {
+	const char *name;
+	const char *label;
+} counter_names[METRIC_COUNTER_COUNT] = {
+    [METRIC_UEVENTS] = {"drmdaemon_uevents_total", NULL},
+    [METRIC_UEVENTS_DROPPED] = {"drmdaemon_uevents_dropped_total", NULL},
+    [METRIC_UEVENT_SOCKET_OVERFLOWS] = {
+	"drmdaemon_uevent_socket_overflows_total", NULL},
+    [METRIC_RESYNCS] = {"drmdaemon_resyncs_total", NULL},
+    [METRIC_UEVENTS_SUPERSEDED] = {"drmdaemon_uevents_superseded_total", NULL},
+    [METRIC_RESCANS] = {"drmdaemon_rescans_total", NULL},
+    [METRIC_CONNECTOR_RESCANS] = {"drmdaemon_connector_rescans_total", NULL},
+    [METRIC_CONNECTORS_CHANGED] = {"drmdaemon_connectors_changed_total",
+				   NULL},
+    [METRIC_IOCTL_GET_RESOURCES] = {"drmdaemon_ioctls_total",
+				    "get_resources"},
+    [METRIC_IOCTL_GET_CONNECTOR] = {"drmdaemon_ioctls_total",
+				    "get_connector"},
+    [METRIC_IOCTL_GET_CONNECTOR_CURRENT] = {"drmdaemon_ioctls_total",
+					    "get_connector_current"},
+    [METRIC_IOCTL_GET_ENCODER] = {"drmdaemon_ioctls_total", "get_encoder"},
+    [METRIC_IOCTL_GET_CRTC] = {"drmdaemon_ioctls_total", "get_crtc"},
+    [METRIC_IOCTL_GET_PROPERTY] = {"drmdaemon_ioctls_total", "get_property"},
+    [METRIC_IOCTL_GET_PROPERTY_BLOB] = {"drmdaemon_ioctls_total",
+					"get_property_blob"},
+    [METRIC_APPLY_ATOMIC] = {"drmdaemon_applies_total", "atomic"},
+    [METRIC_APPLY_LEGACY] = {"drmdaemon_applies_total", "legacy"},
+    [METRIC_APPLY_TEST_FAILURES] = {"drmdaemon_apply_test_failures_total",
+				    NULL},
+    [METRIC_EDID_CACHE_HITS] = {"drmdaemon_edid_cache_lookups_total", "hit"},
+    [METRIC_EDID_CACHE_MISSES] = {"drmdaemon_edid_cache_lookups_total",
+				  "miss"},
+    [METRIC_PROBES_SKIPPED] = {"drmdaemon_probes_skipped_total", NULL},
+    [METRIC_DBUS_SIGNALS] = {"drmdaemon_dbus_signals_total", NULL},
+    [METRIC_DBUS_SET_MODE] = {"drmdaemon_dbus_set_mode_total", NULL},
+    [METRIC_STREAM_EVENTS] = {"drmdaemon_stream_events_total", NULL},
+    [METRIC_STREAM_RESYNCS] = {"drmdaemon_stream_resyncs_total", NULL},
+};
+
+static const char *const hist_names[METRIC_HIST_COUNT] = {
+    [METRIC_UEVENT_TO_QUEUE] = "drmdaemon_uevent_to_queue_seconds",
+    [METRIC_QUEUE_TO_SCAN] = "drmdaemon_queue_to_scan_seconds",
+    [METRIC_SCAN_DURATION] = "drmdaemon_scan_duration_seconds",
+    [METRIC_APPLY_DURATION] = "drmdaemon_apply_duration_seconds",
+    [METRIC_STARTUP_FIRST_STATE] = "drmdaemon_startup_first_state_seconds",
+    [METRIC_STARTUP_CONSISTENT] = "drmdaemon_startup_consistent_seconds",
+};
+
+static struct metrics_shard *_shards;
+static pthread_mutex_t _shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct metrics_shard *_shard;
+
+static int _listen_fd = -1;
+static char _listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the shard of the calling thread, registering it on first use
+ * Shards are never freed, the counts of a thread that exited still count.
+ *
+ * @Returns   The shard or NULL if the allocation failed
+ */
+/* ---------------------------------------------------------------------------*/
+static struct metrics_shard *get_shard()
+{
+	struct metrics_shard *shard = _shard;
+
+	if (shard) return shard;
+	shard = calloc(1, sizeof(*shard));
+	if (!shard) return NULL;
+	pthread_mutex_lock(&_shards_lock);
+	shard->next = _shards;
+	__atomic_store_n(&_shards, shard, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_shards_lock);
+	_shard = shard;
+	return shard;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Only the owning thread writes a shard, a load and store is enough
+ * The atomic store keeps a concurrent reader from seeing a torn value.
+ */
+/* ---------------------------------------------------------------------------*/
+static inline void shard_add(uint64_t *val, uint64_t n)
+{
+	__atomic_store_n(val,
+			 __atomic_load_n(val, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Map a value on its histogram bucket
+ *
+ * @Param value The value
+ *
+ * @Returns   The bucket index
+ */
+/* ---------------------------------------------------------------------------*/
+static int hist_bucket(uint64_t value)
+{
+	int exp, idx;
+
+	if (value < (1 << METRIC_HIST_SUB_BITS)) return value;
+	exp = 63 - __builtin_clzll(value);
+	idx = ((exp - METRIC_HIST_SUB_BITS + 1) << METRIC_HIST_SUB_BITS) +
+	      ((value >> (exp - METRIC_HIST_SUB_BITS)) &
+	       ((1 << METRIC_HIST_SUB_BITS) - 1));
+	return idx < METRIC_HIST_BUCKETS ? idx : METRIC_HIST_BUCKETS - 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Largest value that maps on a bucket
+ *
+ * @Param idx The bucket index
+ *
+ * @Returns   The inclusive upper bound of the bucket
+ */
+/* ---------------------------------------------------------------------------*/
+static uint64_t hist_bucket_bound(int idx)
+{
+	int exp, sub, shift;
+
+	if (idx < (1 << METRIC_HIST_SUB_BITS)) return idx;
+	exp = (idx >> METRIC_HIST_SUB_BITS) + METRIC_HIST_SUB_BITS - 1;
+	sub = idx & ((1 << METRIC_HIST_SUB_BITS) - 1);
+	shift = exp - METRIC_HIST_SUB_BITS;
+	return ((uint64_t)((1 << METRIC_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Increment a counter of the calling thread
+ *
+ * @Param counter The counter
+ * @Param n The increment
+ */
+/* ---------------------------------------------------------------------------*/
+void metrics_add(enum metric_counter counter, uint64_t n)
+{
+	struct metrics_shard *shard = get_shard();
+	if (shard) shard_add(&shard->counters[counter], n);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add a value to a histogram of the calling thread
+ *
+ * @Param hist The histogram
+ * @Param value_us The value in microseconds
+ */
+/* ---------------------------------------------------------------------------*/
+void metrics_observe(enum metric_hist hist, uint64_t value_us)
+{
+	struct metrics_shard *shard = get_shard();
+	struct metric_hist_shard *h;
+
+	if (!shard) return;
+	h = &shard->hists[hist];
+	shard_add(&h->buckets[hist_bucket(value_us)], 1);
+	shard_add(&h->sum, value_us);
+	shard_add(&h->count, 1);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Monotonic timestamp for latency measurements
+ *
+ * @Returns   CLOCK_MONOTONIC in microseconds
+ */
+/* ---------------------------------------------------------------------------*/
+uint64_t metrics_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Sum the histogram of all threads
+ *
+ * @Param hist The histogram
+ * @Param total The summed histogram
+ */
+/* ---------------------------------------------------------------------------*/
+static void sum_hist(enum metric_hist hist, struct metric_hist_shard *total)
+{
+	struct metrics_shard *shard;
+	struct metric_hist_shard *h;
+	int i;
+
+	memset(total, 0, sizeof(*total));
+	shard = __atomic_load_n(&_shards, __ATOMIC_ACQUIRE);
+	for (; shard; shard = shard->next) {
+		h = &shard->hists[hist];
+		for (i = 0; i < METRIC_HIST_BUCKETS; i++)
+			total->buckets[i] +=
+			    __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		total->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+		total->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Sum a counter of all threads
+ *
+ * @Param counter The counter
+ *
+ * @Returns   The total
+ */
+/* ---------------------------------------------------------------------------*/
+static uint64_t sum_counter(enum metric_counter counter)
+{
+	struct metrics_shard *shard;
+	uint64_t total = 0;
+
+	shard = __atomic_load_n(&_shards, __ATOMIC_ACQUIRE);
+	for (; shard; shard = shard->next)
+		total += __atomic_load_n(&shard->counters[counter],
+					 __ATOMIC_RELAXED);
+	return total;
+}
+
+/* Append to the output buffer, stops writing once it is full */
+#define APPEND(...)                                                            \
+	do {                                                                   \
+		if (len < size)                                                \
+			len += snprintf(buf + len, size - len, __VA_ARGS__);   \
+	} while (0)
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Format all metrics in the Prometheus text format
+ *
+ * @Param buf The output buffer
+ * @Param size The size of the output buffer
+ *
+ * @Returns   The length of the output, truncated to size - 1
+ */
+/* ---------------------------------------------------------------------------*/
+size_t metrics_format(char *buf, size_t size)
+{
+	struct metric_hist_shard h;
+	const char *last = NULL;
+	uint64_t cumulative;
+	size_t len = 0;
+	int i, j;
+
+	if (size == 0) return 0;
+	buf[0] = '\0';
+	for (i = 0; i < METRIC_COUNTER_COUNT; i++) {
+		if (!last || strcmp(last, counter_names[i].name))
+			APPEND("# TYPE %s counter\n", counter_names[i].name);
+		last = counter_names[i].name;
+		if (counter_names[i].label)
+			APPEND("%s{type=\"%s\"} %llu\n",
+			       counter_names[i].name,
+			       counter_names[i].label,
+			       (unsigned long long)sum_counter(i));
+		else
+			APPEND("%s %llu\n",
+			       counter_names[i].name,
+			       (unsigned long long)sum_counter(i));
+	}
+	APPEND("# TYPE drmdaemon_log_dropped_total counter\n"
+	       "drmdaemon_log_dropped_total %lu\n",
+	       logger_dropped());
+
+	for (i = 0; i < METRIC_HIST_COUNT; i++) {
+		sum_hist(i, &h);
+		APPEND("# TYPE %s histogram\n", hist_names[i]);
+		/* Empty buckets add nothing to the cumulative counts */
+		cumulative = 0;
+		for (j = 0; j < METRIC_HIST_BUCKETS - 1; j++) {
+			if (!h.buckets[j]) continue;
+			cumulative += h.buckets[j];
+			APPEND("%s_bucket{le=\"%.6f\"} %llu\n",
+			       hist_names[i],
+			       hist_bucket_bound(j) / 1e6,
+			       (unsigned long long)cumulative);
+		}
+		APPEND("%s_bucket{le=\"+Inf\"} %llu\n"
+		       "%s_sum %.6f\n"
+		       "%s_count %llu\n",
+		       hist_names[i],
+		       (unsigned long long)h.count,
+		       hist_names[i],
+		       h.sum / 1e6,
+		       hist_names[i],
+		       (unsigned long long)h.count);
+	}
+	return len < size ? len : size - 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Send the metrics to a new client and close the connection
+ * The client socket is non-blocking, a client that does not read in time
+ * gets a truncated reply.
+ */
+/* ---------------------------------------------------------------------------*/
+static void metrics_accept(struct event_loop *loop, int fd, uint32_t events,
+			   void *data)
+{
+	static char buf[METRICS_BUF_SIZE];
+	size_t len, off = 0;
+	ssize_t ret;
+	int client;
+
+	client = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (client < 0) return;
+	len = metrics_format(buf, sizeof(buf));
+	while (off < len) {
+		ret = write(client, buf + off, len - off);
+		if (ret <= 0) break;
+		off += ret;
+	}
+	close(client);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Serve the metrics on a unix socket
+ * Every connection receives the current metrics and is closed.
+ *
+ * @Param loop The event loop that accepts the connections
+ * @Param path The socket path, an existing socket is replaced
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int metrics_listen(struct event_loop *loop, const char *path)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("Metrics socket path too long");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (_listen_fd < 0) {
+		log_error("Failed to create metrics socket");
+		return -1;
+	}
+	unlink(path);
+	if (bind(_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(_listen_fd, 4) < 0) {
+		log_error("Failed to bind metrics socket %s", path);
+		goto err;
+	}
+	if (event_loop_add_fd(loop, _listen_fd, EPOLLIN, metrics_accept,
+			      NULL) < 0)
+		goto err;
+	strcpy(_listen_path, path);
+	log_ok("Serving metrics on %s", path);
+	return 0;
+err:
+	close(_listen_fd);
+	_listen_fd = -1;
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Stop serving the metrics and remove the socket
+ *
+ * @Param loop The event loop passed to metrics_listen
+ */
+/* ---------------------------------------------------------------------------*/
+void metrics_close(struct event_loop *loop)
+{
+	if (_listen_fd < 0) return;
+	event_loop_del_fd(loop, _listen_fd);
+	close(_listen_fd);
+	unlink(_listen_path);
+	_listen_fd = -1;
+}
@@ -0,0 +1,158 @@
+/**
+ * @file metrics.h
+ * @Brief  Counters and latency histograms, exported over a unix socket
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-03-27
+ *
+ * Every thread updates its own shard, so updates never contend. A reader
+ * sums the shards of all threads. Connecting to the metrics socket
+ * returns the current values in the Prometheus text format, e.g.:
+ * socat - UNIX-CONNECT:/run/drmdaemon.metrics
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event_loop.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Counters
+ */
+/* ---------------------------------------------------------------------------*/
+enum metric_counter {
+	METRIC_UEVENTS,
+	METRIC_UEVENTS_DROPPED,
+	/* Receive socket overflows, each loses an unknown number of uevents */
+	METRIC_UEVENT_SOCKET_OVERFLOWS,
+	/* Full rescans after uevents were dropped or lost */
+	METRIC_RESYNCS,
+	/* Uevents buffered during startup that the initial scan covered */
+	METRIC_UEVENTS_SUPERSEDED,
+	METRIC_RESCANS,
+	METRIC_CONNECTOR_RESCANS,
+	METRIC_CONNECTORS_CHANGED,
+	/* libdrm calls, one per type */
+	METRIC_IOCTL_GET_RESOURCES,
+	METRIC_IOCTL_GET_CONNECTOR,
+	METRIC_IOCTL_GET_CONNECTOR_CURRENT,
+	METRIC_IOCTL_GET_ENCODER,
+	METRIC_IOCTL_GET_CRTC,
+	METRIC_IOCTL_GET_PROPERTY,
+	METRIC_IOCTL_GET_PROPERTY_BLOB,
+	/* Applied configurations, one per path */
+	METRIC_APPLY_ATOMIC,
+	METRIC_APPLY_LEGACY,
+	/* Configurations rejected by the TEST_ONLY commit */
+	METRIC_APPLY_TEST_FAILURES,
+	/* EDID cache lookups, one per result */
+	METRIC_EDID_CACHE_HITS,
+	METRIC_EDID_CACHE_MISSES,
+	/* Connector probes replaced by a cached monitor */
+	METRIC_PROBES_SKIPPED,
+	/* D-Bus change signals, one per scan that changed something */
+	METRIC_DBUS_SIGNALS,
+	METRIC_DBUS_SET_MODE,
+	/* Events handed to the stream thread, and clients that fell behind */
+	METRIC_STREAM_EVENTS,
+	METRIC_STREAM_RESYNCS,
+	METRIC_COUNTER_COUNT,
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Latency histograms, values in microseconds
+ */
+/* ---------------------------------------------------------------------------*/
+enum metric_hist {
+	/* Uevent read from the monitor until it is queued on its card */
+	METRIC_UEVENT_TO_QUEUE,
+	/* First queued uevent of a card until its rescan starts */
+	METRIC_QUEUE_TO_SCAN,
+	/* Duration of a card rescan */
+	METRIC_SCAN_DURATION,
+	/* Start of an apply until the commit is submitted */
+	METRIC_APPLY_DURATION,
+	/* Start of the daemon until every card has a registry, restored
+	 * from the snapshot or populated */
+	METRIC_STARTUP_FIRST_STATE,
+	/* Start of the daemon until the registries match the hardware */
+	METRIC_STARTUP_CONSISTENT,
+	METRIC_HIST_COUNT,
+};
+
+/* Histogram buckets: values below 4 have their own bucket, every power of
+ * two above is split in 4 buckets, which keeps the error under 25% */
+#define METRIC_HIST_SUB_BITS 2
+#define METRIC_HIST_BUCKETS 128
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Increment a counter of the calling thread
+ *
+ * @Param counter The counter
+ * @Param n The increment
+ */
+/* ---------------------------------------------------------------------------*/
+void metrics_add(enum metric_counter counter, uint64_t n);
+
+#define metrics_inc(counter) metrics_add(counter, 1)
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add a value to a histogram of the calling thread
+ *
+ * @Param hist The histogram
+ * @Param value_us The value in microseconds
+ */
+/* ---------------------------------------------------------------------------*/
+void metrics_observe(enum metric_hist hist, uint64_t value_us);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Monotonic timestamp for latency measurements
+ *
+ * @Returns   CLOCK_MONOTONIC in microseconds
+ */
+/* ---------------------------------------------------------------------------*/
+uint64_t metrics_now_us();
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Format all metrics in the Prometheus text format
+ *
+ * @Param buf The output buffer
+ * @Param size The size of the output buffer
+ *
+ * @Returns   The length of the output, truncated to size - 1
+ */
+/* ---------------------------------------------------------------------------*/
+size_t metrics_format(char *buf, size_t size);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Serve the metrics on a unix socket
+ * Every connection receives the current metrics and is closed.
+ *
+ * @Param loop The event loop that accepts the connections
+ * @Param path The socket path, an existing socket is replaced
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int metrics_listen(struct event_loop *loop, const char *path);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Stop serving the metrics and remove the socket
+ *
+ * @Param loop The event loop passed to metrics_listen
+ */
+/* ---------------------------------------------------------------------------*/
+void metrics_close(struct event_loop *loop);
+
+#endif
@@ -0,0 +1,316 @@
+/**
+ * @file modepool.c
+ * @Brief  Interned pool of display modes shared by all connectors
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-20
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "modepool.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Pool entry
+ */
+/* ---------------------------------------------------------------------------*/
+struct mode_entry {
+	drmModeModeInfo mode;
+	uint64_t hash;
+	/* 0 if the entry is on the free list */
+	uint32_t refcount;
+	/* Next free entry when refcount is 0 */
+	uint32_t next_free;
+};
+
+/* Entries are allocated in chunks so pointers to them stay valid */
+#define CHUNK_SHIFT 6
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define MAX_CHUNKS 1024
+
+#define ENTRY(handle)                                                          \
+	(&pool.chunks[(handle) >> CHUNK_SHIFT][(handle) & (CHUNK_SIZE - 1)])
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Global pool. Entry 0 is reserved for MODE_HANDLE_NONE.
+ */
+/* ---------------------------------------------------------------------------*/
+static struct {
+	pthread_mutex_t lock;
+	struct mode_entry *chunks[MAX_CHUNKS];
+	/* Number of entries ever handed out, including entry 0 */
+	uint32_t nr_entries;
+	/* Number of allocated entries */
+	uint32_t capacity;
+	uint32_t live;
+	uint32_t free_head;
+	/* Open addressing table of handles, 0 marks a free slot */
+	mode_handle *table;
+	uint32_t mask;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  FNV-1a hash over the timing fields of a mode
+ * The name and type are left out: the name is not filled in by every
+ * driver and the type only carries preferred/driver flags.
+ *
+ * @Param m The mode
+ *
+ * @Returns   The hash value
+ */
+/* ---------------------------------------------------------------------------*/
+static uint64_t hash_mode(const drmModeModeInfo *m)
+{
+	uint32_t fields[] = {m->clock,
+			     m->hdisplay,
+			     m->hsync_start,
+			     m->hsync_end,
+			     m->htotal,
+			     m->hskew,
+			     m->vdisplay,
+			     m->vsync_start,
+			     m->vsync_end,
+			     m->vtotal,
+			     m->vscan,
+			     m->vrefresh,
+			     m->flags};
+	const uint8_t *p = (const uint8_t *)fields;
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(fields); i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int timings_equal(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock && a->hdisplay == b->hdisplay &&
+	       a->hsync_start == b->hsync_start &&
+	       a->hsync_end == b->hsync_end && a->htotal == b->htotal &&
+	       a->hskew == b->hskew && a->vdisplay == b->vdisplay &&
+	       a->vsync_start == b->vsync_start &&
+	       a->vsync_end == b->vsync_end && a->vtotal == b->vtotal &&
+	       a->vscan == b->vscan && a->vrefresh == b->vrefresh &&
+	       a->flags == b->flags;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Find the table slot of a mode
+ *
+ * @Returns   The slot holding the mode, or the free slot where it belongs
+ */
+/* ---------------------------------------------------------------------------*/
+static uint32_t find_slot(const drmModeModeInfo *mode, uint64_t hash)
+{
+	uint32_t slot = hash & pool.mask;
+	struct mode_entry *e;
+
+	while (pool.table[slot]) {
+		e = ENTRY(pool.table[slot]);
+		if (e->hash == hash && timings_equal(&e->mode, mode)) break;
+		slot = (slot + 1) & pool.mask;
+	}
+	return slot;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Add a chunk of entries and rebuild the table
+ * Handles and mode pointers stay valid, existing chunks never move.
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int pool_grow()
+{
+	uint32_t chunk = pool.capacity >> CHUNK_SHIFT, size, i;
+	mode_handle *table;
+
+	if (chunk == MAX_CHUNKS) return -1;
+	pool.chunks[chunk] = calloc(CHUNK_SIZE, sizeof(struct mode_entry));
+	if (!pool.chunks[chunk]) return -1;
+	pool.capacity += CHUNK_SIZE;
+	if (pool.nr_entries == 0) pool.nr_entries = 1;
+
+	/* Keep the table at most half full */
+	size = pool.mask + 1;
+	while (size < pool.capacity * 2) size <<= 1;
+	if (size == pool.mask + 1 && pool.table) return 0;
+	table = calloc(size, sizeof(*table));
+	if (!table) return -1;
+	free(pool.table);
+	pool.table = table;
+	pool.mask = size - 1;
+	for (i = 1; i < pool.nr_entries; i++) {
+		if (!ENTRY(i)->refcount) continue;
+		pool.table[find_slot(&ENTRY(i)->mode, ENTRY(i)->hash)] = i;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remove a handle from the table, shifting back the entries of
+ * the same probe chain
+ *
+ * @Param handle The handle to remove
+ */
+/* ---------------------------------------------------------------------------*/
+static void table_remove(mode_handle handle)
+{
+	struct mode_entry *e = ENTRY(handle);
+	uint32_t slot = find_slot(&e->mode, e->hash), next, home;
+
+	pool.table[slot] = 0;
+	next = (slot + 1) & pool.mask;
+	while (pool.table[next]) {
+		home = ENTRY(pool.table[next])->hash & pool.mask;
+		if (((next - home) & pool.mask) >= ((next - slot) & pool.mask)) {
+			pool.table[slot] = pool.table[next];
+			pool.table[next] = 0;
+			slot = next;
+		}
+		next = (next + 1) & pool.mask;
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Intern a mode and take a reference on it
+ *
+ * @Param mode The mode to intern
+ *
+ * @Returns   The handle of the mode, MODE_HANDLE_NONE for an empty mode
+ * or if the pool could not grow
+ */
+/* ---------------------------------------------------------------------------*/
+mode_handle mode_pool_intern(const drmModeModeInfo *mode)
+{
+	uint64_t hash;
+	uint32_t slot;
+	mode_handle handle;
+	struct mode_entry *e;
+
+	if (!mode || mode->hdisplay == 0 || mode->vdisplay == 0)
+		return MODE_HANDLE_NONE;
+
+	hash = hash_mode(mode);
+	pthread_mutex_lock(&pool.lock);
+	/* Always keep room for one more entry */
+	if (pool.nr_entries + 1 >= pool.capacity && !pool.free_head &&
+	    pool_grow() < 0) {
+		pthread_mutex_unlock(&pool.lock);
+		log_error("Failed to grow mode pool");
+		return MODE_HANDLE_NONE;
+	}
+	slot = find_slot(mode, hash);
+	if (pool.table[slot]) {
+		handle = pool.table[slot];
+		ENTRY(handle)->refcount++;
+		pthread_mutex_unlock(&pool.lock);
+		return handle;
+	}
+
+	if (pool.free_head) {
+		handle = pool.free_head;
+		pool.free_head = ENTRY(handle)->next_free;
+	} else {
+		handle = pool.nr_entries++;
+	}
+	e = ENTRY(handle);
+	e->mode = *mode;
+	e->hash = hash;
+	e->refcount = 1;
+	e->next_free = 0;
+	/* Workaround for drivers (amd) that leave mode.name empty */
+	if (e->mode.name[0] == '\0') {
+		snprintf(e->mode.name,
+			 sizeof(e->mode.name),
+			 "%dx%d",
+			 e->mode.hdisplay,
+			 e->mode.vdisplay);
+	}
+	pool.table[slot] = handle;
+	pool.live++;
+	pthread_mutex_unlock(&pool.lock);
+	return handle;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Take an extra reference on a mode
+ *
+ * @Param handle The mode handle
+ */
+/* ---------------------------------------------------------------------------*/
+void mode_pool_ref(mode_handle handle)
+{
+	if (handle == MODE_HANDLE_NONE) return;
+	pthread_mutex_lock(&pool.lock);
+	ENTRY(handle)->refcount++;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Drop a reference, the entry is recycled when it reaches zero
+ *
+ * @Param handle The mode handle
+ */
+/* ---------------------------------------------------------------------------*/
+void mode_pool_unref(mode_handle handle)
+{
+	struct mode_entry *e;
+
+	if (handle == MODE_HANDLE_NONE) return;
+	pthread_mutex_lock(&pool.lock);
+	e = ENTRY(handle);
+	if (--e->refcount == 0) {
+		table_remove(handle);
+		e->next_free = pool.free_head;
+		pool.free_head = handle;
+		pool.live--;
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the mode of a handle
+ *
+ * @Param handle The mode handle
+ *
+ * @Returns   The mode, an all zero mode for MODE_HANDLE_NONE. The pointer
+ * stays valid as long as a reference on the handle is held.
+ */
+/* ---------------------------------------------------------------------------*/
+const drmModeModeInfo *mode_pool_get(mode_handle handle)
+{
+	static const drmModeModeInfo none;
+	if (handle == MODE_HANDLE_NONE || handle >= pool.nr_entries)
+		return &none;
+	return &ENTRY(handle)->mode;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Number of distinct modes in the pool
+ *
+ * @Returns   The number of live entries
+ */
+/* ---------------------------------------------------------------------------*/
+int mode_pool_size()
+{
+	return pool.live;
+}
@@ -0,0 +1,76 @@
+/**
+ * @file modepool.h
+ * @Brief  Interned pool of display modes shared by all connectors
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-20
+ *
+ * Modes are keyed by a hash of their timing fields, so two connectors
+ * reporting the same timings share one entry and mode equality is a
+ * plain handle compare. The mode name is not part of the key, which
+ * makes change detection work on drivers that leave it empty.
+ */
+
+#ifndef _MODEPOOL_H_
+#define _MODEPOOL_H_
+
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+/* Handle of an interned mode, 0 means no mode */
+typedef uint32_t mode_handle;
+
+#define MODE_HANDLE_NONE 0
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Intern a mode and take a reference on it
+ *
+ * @Param mode The mode to intern
+ *
+ * @Returns   The handle of the mode, MODE_HANDLE_NONE for an empty mode
+ * or if the pool could not grow
+ */
+/* ---------------------------------------------------------------------------*/
+mode_handle mode_pool_intern(const drmModeModeInfo *mode);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Take an extra reference on a mode
+ *
+ * @Param handle The mode handle
+ */
+/* ---------------------------------------------------------------------------*/
+void mode_pool_ref(mode_handle handle);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Drop a reference, the entry is recycled when it reaches zero
+ *
+ * @Param handle The mode handle
+ */
+/* ---------------------------------------------------------------------------*/
+void mode_pool_unref(mode_handle handle);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the mode of a handle
+ *
+ * @Param handle The mode handle
+ *
+ * @Returns   The mode, an all zero mode for MODE_HANDLE_NONE. The pointer
+ * stays valid as long as a reference on the handle is held.
+ */
+/* ---------------------------------------------------------------------------*/
+const drmModeModeInfo *mode_pool_get(mode_handle handle);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Number of distinct modes in the pool
+ *
+ * @Returns   The number of live entries
+ */
+/* ---------------------------------------------------------------------------*/
+int mode_pool_size();
+
+#endif
@@ -7,38 +7,88 @@
  */
 
 #include "modeset.h"
+#include "edid_cache.h"
+#include "registry.h"
+
+/* DRM encodes possible_crtcs as a 32 bit mask */
+#define MAX_CRTCS 32
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Per scan CRTC state table
+ * The CRTC state is read at most once per scan and shared by all the
+ * connectors that are handled in that scan. The table lives on the stack
+ * of the scan, so lookups never allocate.
+ */
+/* ---------------------------------------------------------------------------*/
+struct crtc_cache {
+	int fd;
+	drmModeRes *res;
+	/* Indexed like res->crtcs */
+	uint8_t fetched[MAX_CRTCS];
+	drmModeModeInfo modes[MAX_CRTCS];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A connector as read by a scan
+ */
+/* ---------------------------------------------------------------------------*/
+struct conn_scan {
+	drmModeConnector *conn;
+	/* 1 if the connector was probed, its mode list is fresh */
+	int probed;
+	/* Cached monitor whose modes replace the probe, NULL if there is
+	 * none */
+	const struct edid_record *known;
+};
+
+static void crtc_cache_init(struct crtc_cache *cache, int fd, drmModeRes *res)
+{
+	cache->fd = fd;
+	cache->res = res;
+	memset(cache->fetched, 0, sizeof(cache->fetched));
+}
 
 /* ---------------------------------------------------------------------------*/
 /**
  * @Brief  Retrieve the crtc mode that is in use for a given connector
  *
- * @Param res Pointer to the DRM resources
- * @Param fd File descriptor for the device
+ * @Param cache The CRTC table of the current scan
  * @Param crtc_id crtc_id of a connector
  *
- * @Returns   empty mode if not connected or found, current mode if found
+ * @Returns   MODE_HANDLE_NONE if not connected or found, a referenced handle
+ * of the current mode if found
  */
 /* ---------------------------------------------------------------------------*/
-static drmModeModeInfo retrieve_current_crtc_mode(drmModeRes *res, int fd,
-						  uint32_t crtc_id)
+static mode_handle retrieve_current_crtc_mode(struct crtc_cache *cache,
+					      uint32_t crtc_id)
 {
-	int i;
-	drmModeModeInfo mode;
-	memset(&mode, 0, sizeof(mode));
-	for (i = 0; i < res->count_crtcs; i++) {
-		drmModeCrtc *crtc = drmModeGetCrtc(fd, res->crtcs[i]);
-		if (crtc->crtc_id == crtc_id) {
-#ifdef DEBUG
-			printf("Found match %dx%d\n",
-			       crtc->mode.hdisplay,
-			       crtc->mode.vdisplay);
-#endif
-			mode = crtc->mode;
+	int i, count = cache->res->count_crtcs;
+	drmModeCrtc *crtc;
+
+	if (count > MAX_CRTCS) count = MAX_CRTCS;
+	for (i = 0; i < count; i++) {
+		if (cache->res->crtcs[i] == crtc_id) break;
+	}
+	if (i == count) return MODE_HANDLE_NONE;
+
+	if (!cache->fetched[i]) {
+		memset(&cache->modes[i], 0, sizeof(cache->modes[i]));
+		crtc = drmModeGetCrtc(cache->fd, crtc_id);
+		metrics_inc(METRIC_IOCTL_GET_CRTC);
+		if (crtc) {
+			cache->modes[i] = crtc->mode;
 			drmModeFreeCrtc(crtc);
-			return mode;
 		}
+		cache->fetched[i] = 1;
 	}
-	return mode;
+#ifdef DEBUG
+	printf("Found match %dx%d\n",
+	       cache->modes[i].hdisplay,
+	       cache->modes[i].vdisplay);
+#endif
+	return mode_pool_intern(&cache->modes[i]);
 }
 
 /* ---------------------------------------------------------------------------*/
@@ -56,18 +106,18 @@ static int retrieve_drm_crtc_id(int *fd, drmModeConnector *conn)
 	int crtc_id = 0;
 	drmModeEncoder *enc;
 	if (!fd || !conn) {
-		logger_log(LOG_LVL_ERROR, "Params cannot be NULL");
+		log_error("Params cannot be NULL");
 		return -1;
 	}
 	if (conn->count_encoders == 0 || conn->encoder_id == 0) {
-		logger_log(LOG_LVL_WARNING,
-			   "No encoders or invalid encoder id");
-		logger_log(LOG_LVL_INFO, "Probably no display connected");
+		log_warning("No encoders or invalid encoder id");
+		log_info("Probably no display connected");
 		return -1;
 	}
 	enc = drmModeGetEncoder(*fd, conn->encoders[0]);
+	metrics_inc(METRIC_IOCTL_GET_ENCODER);
 	if (!enc) {
-		logger_log(LOG_LVL_ERROR, "Failed to retrieve encoder");
+		log_error("Failed to retrieve encoder");
 		return -1;
 	}
 	crtc_id = enc->crtc_id;
@@ -75,136 +125,418 @@ static int retrieve_drm_crtc_id(int *fd, drmModeConnector *conn)
 	return crtc_id;
 }
 
+static void release_modes(mode_handle *modes, int nr_of_modes)
+{
+	int i;
+	for (i = 0; i < nr_of_modes; i++) mode_pool_unref(modes[i]);
+	free(modes);
+}
+
 /* ---------------------------------------------------------------------------*/
 /**
  * @Brief  Helper function to fill in the modes into the drm_connector_obj
- * struct
+ * struct. The modes are interned in the mode pool, the connector only
+ * keeps their handles.
  *
- * @Param conn The connection from which we will take the modes
- * @Param obj The object that will contain the copied list
+ * @Param scan The scanned connector, the modes come from the cached
+ * monitor if there is one
+ * @Param obj The object that will contain the handle list
  *
- * @Returns   0 if success, -1 if failed
+ * @Returns   1 if the mode list changed, 0 if not, -1 if failed
  */
 /* ---------------------------------------------------------------------------*/
-static int retrieve_drm_modes(drmModeConnector *conn,
+static int retrieve_drm_modes(const struct conn_scan *scan,
 			      struct drm_connector_obj *obj)
 {
-	int i;
-	drmModeModeInfo mode;
-	if (!conn || !obj) return -1;
+	int i, count;
+	const drmModeModeInfo *src;
+	mode_handle *modes = NULL, preferred = MODE_HANDLE_NONE;
+	if (!scan->conn || !obj) return -1;
 
-	obj->modes = malloc(conn->count_modes * sizeof(drmModeModeInfo));
-	if (!obj->modes) {
-		logger_log(LOG_LVL_ERROR, "Failed to create modes object");
-		return -1;
+	if (scan->known) {
+		src = scan->known->modes;
+		count = scan->known->nr_modes;
+	} else {
+		src = scan->conn->modes;
+		count = scan->conn->count_modes;
 	}
-	if (conn->count_modes == 0) {
-		logger_log(LOG_LVL_WARNING, "No modes available for connector");
+	if (count == 0) log_warning("No modes available for connector");
+
+	if (count) {
+		modes = malloc(count * sizeof(*modes));
+		if (!modes) {
+			log_error("Failed to create modes object");
+			return -1;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		modes[i] = mode_pool_intern(&src[i]);
+		if (!preferred && (src[i].type & DRM_MODE_TYPE_PREFERRED))
+			preferred = modes[i];
+#ifdef DEBUG
+		printf("%s\n", mode_pool_get(modes[i])->name);
+#endif
+	}
+
+	/* Same timings give the same handles, so this is a plain compare */
+	if (count == obj->nr_of_modes &&
+	    (count == 0 || !memcmp(modes, obj->modes, count * sizeof(*modes)))) {
+		release_modes(modes, count);
 		return 0;
 	}
 
-	memset(obj->modes, 0, (conn->count_modes * sizeof(drmModeModeInfo)));
-	memcpy(obj->modes,
-	       conn->modes,
-	       (conn->count_modes * sizeof(drmModeModeInfo)));
-	obj->nr_of_modes = conn->count_modes;
+	release_modes(obj->modes, obj->nr_of_modes);
+	obj->modes = modes;
+	obj->nr_of_modes = count;
+	mode_pool_ref(preferred);
+	mode_pool_unref(obj->preferred_mode);
+	obj->preferred_mode = preferred;
+	return 1;
+}
 
-#ifdef DEBUG
-	for (i = 0; i < conn->count_modes; i++) {
-		mode = obj->modes[i];
-		printf("%s\n", mode.name);
-		// printf("%dx%d - %dhz\n",mode.hdisplay, mode.vdisplay,
-		//       mode.vrefresh);
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Find the blob id of the EDID property of a connector
+ * The property id is the same for every connector of a device, it is
+ * looked up by name once.
+ *
+ * @Param dev The opened DRM device
+ * @Param conn The DRM connector
+ *
+ * @Returns   The blob id, 0 if the connector has no EDID
+ */
+/* ---------------------------------------------------------------------------*/
+static uint32_t retrieve_edid_blob_id(struct drm_device *dev,
+				      drmModeConnector *conn)
+{
+	drmModePropertyRes *prop;
+	int i;
+
+	for (i = 0; !dev->edid_prop_known && i < conn->count_props; i++) {
+		prop = drmModeGetProperty(dev->fd, conn->props[i]);
+		metrics_inc(METRIC_IOCTL_GET_PROPERTY);
+		if (!prop) continue;
+		if (!strcmp(prop->name, "EDID")) dev->edid_prop = prop->prop_id;
+		drmModeFreeProperty(prop);
+		if (dev->edid_prop) break;
+	}
+	if (conn->count_props) dev->edid_prop_known = 1;
+
+	for (i = 0; dev->edid_prop && i < conn->count_props; i++) {
+		if (conn->props[i] == dev->edid_prop)
+			return conn->prop_values[i];
 	}
-#endif
 	return 0;
 }
 
 /* ---------------------------------------------------------------------------*/
 /**
- * @Brief  Retrieve a resource pointer from the drm subsystem
+ * @Brief  Read an EDID blob
  *
- * @Param fd file discriptor to the graphics card
+ * @Param dev The opened DRM device
+ * @Param blob_id The blob id, may be 0
  *
- * @Returns   NULL if failed, an allocated resource if successfull
+ * @Returns   The blob or NULL if there is none
+ */
+/* ---------------------------------------------------------------------------*/
+static drmModePropertyBlobRes *retrieve_edid_blob(struct drm_device *dev,
+						  uint32_t blob_id)
+{
+	if (!blob_id) return NULL;
+	metrics_inc(METRIC_IOCTL_GET_PROPERTY_BLOB);
+	return drmModeGetPropertyBlob(dev->fd, blob_id);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the identity of the monitor from the EDID of a connector
+ * The kernel replaces the blob when the EDID changes, the blob is only
+ * read when its id differs from the last one. A probed monitor is added to
+ * the EDID cache.
  *
- * @Note User must clean up the memory!
+ * @Param dev The opened DRM device
+ * @Param scan The scanned connector
+ * @Param obj The connector object
+ *
+ * @Returns   1 if the identity changed, 0 if not
  */
 /* ---------------------------------------------------------------------------*/
-static drmModeRes *retrieve_drm_resources(int *fd)
+static int retrieve_edid(struct drm_device *dev, const struct conn_scan *scan,
+			 struct drm_connector_obj *obj)
 {
-	uint64_t has_dumb;
-	drmModeRes *resource = NULL;
+	drmModeConnector *conn = scan->conn;
+	drmModePropertyBlobRes *blob = NULL;
+	struct edid_info info;
+	uint32_t blob_id;
+
+	blob_id = retrieve_edid_blob_id(dev, conn);
+	if (blob_id == obj->edid_blob) return 0;
+	obj->edid_blob = blob_id;
+	if (scan->known)
+		info = scan->known->info;
+	else if (!(blob = retrieve_edid_blob(dev, blob_id)) ||
+		 edid_parse(blob->data, blob->length, &info) < 0)
+		memset(&info, 0, sizeof(info));
+	/* Only a probe gives a mode list that belongs to this EDID */
+	if (blob && info.vendor[0] && scan->probed &&
+	    conn->connection == DRM_MODE_CONNECTED)
+		edid_cache_store(obj->name, blob->data, blob->length, &info,
+				 conn->modes, conn->count_modes);
+	drmModeFreePropertyBlob(blob);
+	if (!memcmp(&info, &obj->edid, sizeof(info))) return 0;
+	obj->edid = info;
+	if (info.vendor[0])
+		log_info("%s: monitor %s %u %s \"%s\"",
+			 obj->name,
+			 info.vendor,
+			 info.product,
+			 info.serial,
+			 info.name);
+	return 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Build the name of a connector, e.g. Card0-DP-1
+ *
+ * @Param dev The opened DRM device
+ * @Param conn The DRM connector
+ * @Param name Receives the name
+ * @Param len Size of name
+ */
+/* ---------------------------------------------------------------------------*/
+static void connector_name(struct drm_device *dev, drmModeConnector *conn,
+			   char *name, size_t len)
+{
+	snprintf(name,
+		 len,
+		 "%s-%s-%d",
+		 dev->card_name,
+		 drm_output_names[conn->connector_type],
+		 conn->connector_type_id);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read a connector, skipping the probe for a known monitor
+ * With the EDID cache open the current state is read first. On hotplug
+ * the kernel reads the EDID when it detects the monitor, so a connected
+ * connector with an EDID blob that is new since the last scan names the
+ * monitor without a probe. If the cache knows that monitor on this
+ * connector its mode list replaces the probe, otherwise the connector is
+ * probed.
+ *
+ * @Param dev The opened DRM device
+ * @Param connector_id The connector id
+ * @Param probe 1 to probe or use the cache, 0 to read the current state
+ * @Param last_blob The EDID blob id seen by the last scan, 0 if none
+ * @Param scan Receives the connector
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int scan_connector(struct drm_device *dev, uint32_t connector_id,
+			  int probe, uint32_t last_blob,
+			  struct conn_scan *scan)
+{
+	drmModePropertyBlobRes *blob;
+	char name[sizeof(((struct drm_connector_obj *)0)->name)];
+	uint32_t blob_id;
 
-	if (drmGetCap(*fd, DRM_CAP_DUMB_BUFFER, &has_dumb) < 0 || !has_dumb) {
-		logger_log(LOG_LVL_ERROR, "DUMB Buffers not supported");
-		return NULL;
+	memset(scan, 0, sizeof(*scan));
+	if (!probe || edid_cache_enabled()) {
+		scan->conn = drmModeGetConnectorCurrent(dev->fd, connector_id);
+		metrics_inc(METRIC_IOCTL_GET_CONNECTOR_CURRENT);
 	}
-	resource = drmModeGetResources(*fd);
-	if (!resource) {
-		logger_log(LOG_LVL_ERROR, "Failed to retrieve resource");
-		return NULL;
+	if (scan->conn && probe &&
+	    scan->conn->connection == DRM_MODE_CONNECTED) {
+		blob_id = retrieve_edid_blob_id(dev, scan->conn);
+		blob = blob_id != last_blob ? retrieve_edid_blob(dev, blob_id)
+					    : NULL;
+		if (blob) {
+			connector_name(dev, scan->conn, name, sizeof(name));
+			scan->known = edid_cache_lookup(name, blob->data,
+							blob->length);
+			drmModeFreePropertyBlob(blob);
+		}
+	}
+	if (!probe || scan->known) {
+		if (scan->known) metrics_inc(METRIC_PROBES_SKIPPED);
+		return scan->conn ? 0 : -1;
 	}
-	return resource;
+	drmModeFreeConnector(scan->conn);
+	scan->conn = drmModeGetConnector(dev->fd, connector_id);
+	metrics_inc(METRIC_IOCTL_GET_CONNECTOR);
+	scan->probed = 1;
+	return scan->conn ? 0 : -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Trace the current mode of a connector
+ *
+ * @Param dev The opened DRM device
+ * @Param obj The connector
+ */
+/* ---------------------------------------------------------------------------*/
+static void trace_mode(struct drm_device *dev, struct drm_connector_obj *obj)
+{
+	const drmModeModeInfo *mode;
+
+	if (!_trace || obj->current_mode == MODE_HANDLE_NONE) return;
+	mode = mode_pool_get(obj->current_mode);
+	trace_record(TRACE_CONNECTOR_MODE, dev->minor, obj->connector_id,
+		     mode->hdisplay, mode->vdisplay, mode->vrefresh);
 }
 
-static int update_connector(int fd, drmModeConnector *conn, drmModeRes *res,
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Update a connector from a scan
+ * The fields that differ are added to obj->changed.
+ *
+ * @Param dev The opened DRM device
+ * @Param scan The scanned connector
+ * @Param crtcs The CRTC table of the current scan
+ * @Param obj The registry entry
+ *
+ * @Returns   1 if something changed, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int update_connector(struct drm_device *dev,
+			    const struct conn_scan *scan,
+			    struct crtc_cache *crtcs,
 			    struct drm_connector_obj *obj)
 {
+	drmModeConnector *conn = scan->conn;
+	int fd = dev->fd;
 	uint32_t tmpval = 0;
-	drmModeModeInfo tmpMode;
-	int updated = 0;
+	mode_handle tmpMode;
+	uint32_t changed = 0;
+	int retval;
 
-	logger_log(LOG_LVL_INFO, "Updating %s", obj->name);
+	log_info("Updating %s", obj->name);
 	if (obj->status != conn->connection) {
-		logger_log(LOG_LVL_INFO,
-			   "Updating status: %s",
-			   drm_states[conn->connection]);
+		log_info("Updating status: %s", drm_states[conn->connection]);
 		obj->status = conn->connection;
-		updated = 1;
+		trace(TRACE_CONNECTOR_STATUS, dev->minor, obj->connector_id,
+		      obj->status, 0, 0);
+		changed |= CONN_CHANGED_STATUS;
+	}
+	if (retrieve_edid(dev, scan, obj)) {
+		log_info("Updating monitor identity");
+		changed |= CONN_CHANGED_MONITOR;
 	}
 
 	if (obj->status == DRM_MODE_CONNECTED) {
 		if (obj->encoder_id != conn->encoder_id) {
-			obj->connector_id = conn->encoder_id;
-			logger_log(LOG_LVL_INFO,
-				   "Updating encoder id %d",
-				   obj->connector_id);
-			updated = 1;
+			obj->encoder_id = conn->encoder_id;
+			log_info("Updating encoder id %d", obj->encoder_id);
+			changed |= CONN_CHANGED_ENCODER;
 		}
-		tmpval = retrieve_drm_crtc_id(&fd, conn);
+		/* No encoder means no CRTC, not crtc id -1 */
+		retval = retrieve_drm_crtc_id(&fd, conn);
+		tmpval = retval < 0 ? 0 : retval;
 		if (obj->crtc_id != tmpval) {
-			logger_log(LOG_LVL_INFO, "Updating crtc id %d", tmpval);
+			log_info("Updating crtc id %d", tmpval);
 			obj->crtc_id = tmpval;
-			updated = 1;
+			trace(TRACE_CONNECTOR_CRTC, dev->minor, obj->connector_id,
+			      tmpval, 0, 0);
+			changed |= CONN_CHANGED_CRTC;
 		}
-		tmpMode = retrieve_current_crtc_mode(res, fd, obj->crtc_id);
-		if (strcmp(tmpMode.name, obj->current_mode.name)) {
-			logger_log(LOG_LVL_INFO, "Updating current mode");
+		if (retrieve_drm_modes(scan, obj) > 0) {
+			log_info("Updating mode list");
+			trace(TRACE_CONNECTOR_MODES, dev->minor, obj->connector_id,
+			      obj->nr_of_modes, 0, 0);
+			changed |= CONN_CHANGED_MODES;
+		}
+		tmpMode = retrieve_current_crtc_mode(crtcs, obj->crtc_id);
+		if (tmpMode != obj->current_mode) {
+			log_info("Updating current mode: %s",
+				 mode_pool_get(tmpMode)->name);
+			mode_pool_unref(obj->current_mode);
 			obj->current_mode = tmpMode;
-			updated = 1;
+			trace_mode(dev, obj);
+			changed |= CONN_CHANGED_CURRENT_MODE;
+		} else {
+			mode_pool_unref(tmpMode);
 		}
 	}
-	return updated;
+	obj->changed |= changed;
+	return changed != 0;
 }
 
-static int compare_and_update_connector(int fd, drmModeConnector *conn,
-					drmModeRes *res,
-					struct drm_connector_obj *head)
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Fill in a connector that was just added to the registry
+ *
+ * @Param dev The opened DRM device
+ * @Param scan The scanned connector
+ * @Param crtcs The CRTC table of the current scan
+ * @Param obj The new registry entry
+ */
+/* ---------------------------------------------------------------------------*/
+static void init_connector(struct drm_device *dev,
+			   const struct conn_scan *scan,
+			   struct crtc_cache *crtcs,
+			   struct drm_connector_obj *obj)
 {
-	int updated = 0, update_count = 0;
-	struct drm_connector_obj *iter;
-	for (iter = head; iter != NULL; iter = iter->next) {
-		if (iter->connector_id == conn->connector_id) {
-			logger_log(LOG_LVL_INFO, "Found connector");
-			updated = update_connector(fd, conn, res, iter);
-			if (updated) {
-				logger_log(LOG_LVL_INFO, "Connector updated");
-				update_count++;
-			}
+	drmModeConnector *conn = scan->conn;
+	int fd = dev->fd, retval;
+
+	connector_name(dev, conn, obj->name, sizeof(obj->name));
+	log_info("Connector: %s is %s", obj->name, drm_states[conn->connection]);
+	obj->status = conn->connection;
+	obj->encoder_id = conn->encoder_id;
+	obj->connector_type = conn->connector_type;
+	obj->changed = CONN_CHANGED_ADDED;
+	retrieve_edid(dev, scan, obj);
+	trace(TRACE_CONNECTOR_ADDED, dev->minor, obj->connector_id,
+	      obj->status, 0, 0);
+	if (conn->connection != DRM_MODE_CONNECTED) return;
+
+	/* Retrieve modes for this connector */
+	if (retrieve_drm_modes(scan, obj) < 0) return;
+	if ((retval = retrieve_drm_crtc_id(&fd, conn)) < 0) return;
+	obj->crtc_id = retval;
+	/* TODO: Fix the mode.name in the AMD kernel driver */
+	obj->current_mode = retrieve_current_crtc_mode(crtcs, obj->crtc_id);
+	log_info("Current mode for %s: %s",
+		 obj->name,
+		 mode_pool_get(obj->current_mode)->name);
+	trace_mode(dev, obj);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remove connectors that are no longer reported by the card
+ *
+ * @Param reg The connector registry
+ * @Param dev The opened DRM device, with refreshed resources
+ *
+ * @Returns   number of removed connectors
+ */
+/* ---------------------------------------------------------------------------*/
+static int remove_stale_connectors(struct conn_registry *reg,
+				   struct drm_device *dev)
+{
+	drmModeRes *res = dev->res;
+	int i, j, removed = 0;
+	struct drm_connector_obj *obj;
+
+	/* Walk backwards, removal moves the last entry into the hole */
+	for (i = REGISTRY_SIZE(reg) - 1; i >= 0; i--) {
+		obj = REGISTRY_AT(reg, i);
+		for (j = 0; j < res->count_connectors; j++) {
+			if (res->connectors[j] == obj->connector_id) break;
 		}
+		if (j < res->count_connectors) continue;
+		log_info("Removing %s", obj->name);
+		trace(TRACE_CONNECTOR_REMOVED, dev->minor, obj->connector_id, 0, 0,
+		      0);
+		registry_remove(reg, obj->connector_id);
+		removed++;
 	}
-	return update_count;
+	return removed;
 }
 
 /* ---------------------------------------------------------------------------*/
@@ -217,7 +549,7 @@ static int compare_and_update_connector(int fd, drmModeConnector *conn,
 int init_drm_handler()
 {
 	if (pthread_mutex_init(&_drm_obj_mutex, NULL) < 0) {
-		logger_log(LOG_LVL_ERROR, "Failed to init mutex\n");
+		log_error("Failed to init mutex\n");
 		return -1;
 	}
 	return 0;
@@ -225,138 +557,160 @@ int init_drm_handler()
 
 /* ---------------------------------------------------------------------------*/
 /**
- * @Brief  Populate the drm connector list.
- * This function populates the initial drm connector list. This list will
- * serve as a reference for following updates
+ * @Brief  Populate the drm connector registry.
+ * This function populates the initial drm connector registry. This registry
+ * will serve as a reference for following updates
  *
- * @Param device_name The device name (most cases: /dev/dri/card0)
+ * @Param dev The opened DRM device
  *
- * @Returns   The head of a linked list containing the available connectors
+ * @Returns   A registry containing the available connectors, NULL if failed
  */
 /* ---------------------------------------------------------------------------*/
-struct drm_connector_obj *populate_drm_conn_list(char *device_name)
+struct conn_registry *populate_drm_conn_list(struct drm_device *dev)
 {
-	int fd, i, retval;
-	struct drm_connector_obj *head = NULL;
-	struct drm_connector_obj *new, *tmp = NULL;
+	int fd = dev->fd, i;
+	struct conn_registry *reg = NULL;
+	struct drm_connector_obj *new;
 	drmModeRes *resource = NULL;
-	drmModeConnector *conn = NULL;
+	struct conn_scan scan;
+	struct crtc_cache crtcs;
 
-	fd = open(device_name, O_RDWR | O_CLOEXEC);
-	if (!fd) {
-		logger_log(LOG_LVL_ERROR, "Failed to open device");
-		goto end;
-	}
+	resource = drm_device_get_resources(dev);
+	if (!resource) return NULL;
+	crtc_cache_init(&crtcs, fd, resource);
 
-	resource = retrieve_drm_resources(&fd);
-	if (!resource) {
-		goto end;
-	}
+	reg = registry_create(resource->count_connectors);
+	if (!reg) return NULL;
 
 	for (i = 0; i < resource->count_connectors; i++) {
 		/* Retrieve connector */
-		conn = drmModeGetConnector(fd, resource->connectors[i]);
-		if (!conn) {
-			logger_log(LOG_LVL_ERROR,
-				   "Failed to retrieve connector");
+		if (scan_connector(dev, resource->connectors[i], 1, 0, &scan) <
+		    0) {
+			log_error("Failed to retrieve connector");
 			continue;
 		}
-
-		new = malloc(sizeof(*new));
-		memset(new, 0, sizeof(*new));
-		new->id = i;
-		new->connector_id = conn->connector_id;
-
-		/* TODO: make card name dynamic by using device_name */
-		snprintf(new->name,
-			 256,
-			 "Card0-%s-%d",
-			 drm_output_names[conn->connector_type],
-			 conn->connector_type_id);
-#ifdef DEBUG
-		fprintf(stdout,
-			"Connector: %s is %s\n",
-			new->name,
-			drm_states[conn->connection]);
-#endif
-		/* Retrieve modes for this connector */
-		if (conn->connection == DRM_MODE_CONNECTED) {
-			if (retrieve_drm_modes(conn, new) < 0) {
-				if (conn) drmModeFreeConnector(conn);
-				if (new) free(new);
-				continue;
-			}
-			if ((retval = retrieve_drm_crtc_id(&fd, conn)) < 0) {
-				if (conn) drmModeFreeConnector(conn);
-				if (new) free(new);
-				continue;
-			}
-			new->crtc_id = retval;
-			/* TODO: Add workaround for mode.name not filled in by
-			 * amd */
-			/* TODO: Fix the mode.name in the AMD kernel driver */
-			new->current_mode = retrieve_current_crtc_mode(
-			    resource, fd, new->crtc_id);
-			logger_log(LOG_LVL_INFO,
-				   "Current mode for %s: %s",
-				   new->name,
-				   new->current_mode.name);
+		new = registry_insert(reg, scan.conn->connector_id);
+		if (new) {
+			new->id = i;
+			init_connector(dev, &scan, &crtcs, new);
 		}
 		/* Cleanup drm connector */
-		if (conn) drmModeFreeConnector(conn);
-		/* Set head of list */
-		if (head == NULL) head = new;
-		/* If tmp is set, link next ptr to current item */
-		if (tmp) tmp->next = new;
-		/* Set prev ptr of new to last saved item */
-		new->prev = tmp;
-		/* Update tmp */
-		tmp = new;
+		drmModeFreeConnector(scan.conn);
 	}
-
-end:
-	if (resource) drmModeFreeResources(resource);
-	if (fd) close(fd);
-	return head;
+	return reg;
 }
 
 /* ---------------------------------------------------------------------------*/
 /**
- * @Brief  Update the current drm list with new values if something has changed
+ * @Brief  Update the current drm registry with new values if something has
+ * changed. Connectors that appeared are added, connectors that disappeared
+ * (e.g. DP MST ports) are removed.
  *
- * @Param drm_connector_obj The head of the drm_connector_obj list
- * @Param device_name The device name of the card
+ * @Param reg The connector registry
+ * @Param dev The opened DRM device
  *
- * @Returns   number of changes
+ * @Returns   number of changes, -1 if failed
  */
 /* ---------------------------------------------------------------------------*/
-int update_drm_conn_list(struct drm_connector_obj *head, char *device_name)
+int update_drm_conn_list(struct conn_registry *reg, struct drm_device *dev)
 {
-	int fd, i, retval = 0;
+	int fd = dev->fd, i, retval = 0;
 	drmModeRes *resource = NULL;
 	drmModeConnector *conn = NULL;
+	struct drm_connector_obj *obj;
+	struct crtc_cache crtcs;
+	/* A full rescan is the fallback when uevents were lost, it always
+	 * probes instead of trusting the EDID cache */
+	struct conn_scan scan = {.probed = 1};
 
-	fd = open(device_name, O_RDWR | O_CLOEXEC);
-	if (!fd) {
-		logger_log(LOG_LVL_ERROR, "Failed to open device");
-		retval = -1;
-		goto end;
-	}
+	/* A full rescan is the only place where new objects can show up */
+	if ((i = drm_device_refresh_resources(dev)) < 0) return -1;
+	resource = dev->res;
+	crtc_cache_init(&crtcs, fd, resource);
+	if (i) retval += remove_stale_connectors(reg, dev);
 
-	resource = retrieve_drm_resources(&fd);
-	if (!resource) {
-		retval = -1;
-		goto end;
-	}
-
-	logger_log(LOG_LVL_INFO, "Updating DRM connector list");
+	log_info("Updating DRM connector list");
 	for (i = 0; i < resource->count_connectors; i++) {
 		conn = drmModeGetConnector(fd, resource->connectors[i]);
-		retval = compare_and_update_connector(fd, conn, resource, head);
+		metrics_inc(METRIC_IOCTL_GET_CONNECTOR);
+		if (!conn) continue;
+		scan.conn = conn;
+		obj = registry_lookup(reg, conn->connector_id);
+		if (!obj) {
+			obj = registry_insert(reg, conn->connector_id);
+			if (obj) {
+				obj->id = i;
+				init_connector(dev, &scan, &crtcs, obj);
+				log_info("Added %s", obj->name);
+				retval++;
+			}
+		} else if (update_connector(dev, &scan, &crtcs, obj)) {
+			log_info("Connector updated");
+			retval++;
+		}
 		drmModeFreeConnector(conn);
 	}
+	return retval;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Update a single connector of the drm registry
+ * Used when the uevent names the connector that changed, so only that
+ * connector is probed instead of every connector of the card.
+ *
+ * @Param reg The connector registry
+ * @Param dev The opened DRM device
+ * @Param connector_id The connector id from the CONNECTOR uevent key
+ * @Param probe 1 to probe (DDC/EDID) or use the EDID cache for a known
+ * monitor, 0 to read the current state
+ *
+ * @Returns   number of changes, -1 if the connector is unknown or failed
+ */
+/* ---------------------------------------------------------------------------*/
+int update_drm_connector(struct conn_registry *reg, struct drm_device *dev,
+			 uint32_t connector_id, int probe)
+{
+	int fd = dev->fd, retval = -1;
+	drmModeRes *resource = NULL;
+	struct drm_connector_obj *obj;
+	struct conn_scan scan;
+	struct crtc_cache crtcs;
+
+	obj = registry_lookup(reg, connector_id);
+	if (!obj) {
+		log_warning("Unknown connector %u", connector_id);
+		return -1;
+	}
 
-end:
-	if (resource) drmModeFreeResources(resource);
+	resource = drm_device_get_resources(dev);
+	if (!resource) return -1;
+
+	if (scan_connector(dev, connector_id, probe, obj->edid_blob, &scan) <
+	    0) {
+		log_error("Failed to retrieve connector");
+		return -1;
+	}
+	crtc_cache_init(&crtcs, fd, resource);
+	retval = update_connector(dev, &scan, &crtcs, obj);
+	drmModeFreeConnector(scan.conn);
 	return retval;
 }
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Release the mode handles held by a connector
+ *
+ * @Param obj The connector
+ */
+/* ---------------------------------------------------------------------------*/
+void drm_connector_obj_release(struct drm_connector_obj *obj)
+{
+	release_modes(obj->modes, obj->nr_of_modes);
+	obj->modes = NULL;
+	obj->nr_of_modes = 0;
+	mode_pool_unref(obj->current_mode);
+	mode_pool_unref(obj->preferred_mode);
+	obj->current_mode = MODE_HANDLE_NONE;
+	obj->preferred_mode = MODE_HANDLE_NONE;
+}
@@ -5,10 +5,17 @@
  * @version 1.0
  * @date 2017-01-16
  * TODO: Add way to retrieve current resolution: SEE TESTCODE FOR WORKING POC
- * TODO: Add way to set resolution
  */
 
+#ifndef _MODESET_H_
+#define _MODESET_H_
+
 #include "debug.h"
+#include "drm_device.h"
+#include "edid.h"
+#include "metrics.h"
+#include "modepool.h"
+#include "trace.h"
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -18,8 +25,6 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
-#define DEBUG
-
 static pthread_mutex_t _drm_obj_mutex;
 
 /* ---------------------------------------------------------------------------*/
@@ -56,16 +61,23 @@ static const char *const drm_output_names[] = {
     "DSI",
 };
 
+/* Fields of a connector that changed, bits of drm_connector_obj.changed */
+#define CONN_CHANGED_STATUS 0x01
+#define CONN_CHANGED_MONITOR 0x02
+#define CONN_CHANGED_ENCODER 0x04
+#define CONN_CHANGED_CRTC 0x08
+#define CONN_CHANGED_MODES 0x10
+#define CONN_CHANGED_CURRENT_MODE 0x20
+#define CONN_CHANGED_POSITION 0x40
+/* The connector is new, every field counts as changed */
+#define CONN_CHANGED_ADDED 0x80
+
 /* ---------------------------------------------------------------------------*/
 /**
  * @Brief  Main drm connector structure
  */
 /* ---------------------------------------------------------------------------*/
 struct drm_connector_obj {
-	/* Next and prev for Linked list structure */
-	struct drm_connector_obj *next;
-	struct drm_connector_obj *prev;
-
 	/* Connector id*/
 	uint32_t connector_id;
 
@@ -81,14 +93,28 @@ struct drm_connector_obj {
 	/* DRM Defined connected, disconnected and error*/
 	drmModeConnection status;
 	/* DRM Node name e.g.: Card0-DP-1 */
-	char name[256];
-	/* Available resolutions */
-	drmModeModeInfo *modes;
+	char name[32];
+	/* DRM_MODE_CONNECTOR_* type, indexes drm_output_names */
+	uint32_t connector_type;
+	/* Blob id of the EDID property, 0 if no monitor reported one */
+	uint32_t edid_blob;
+	/* Identity of the connected monitor */
+	struct edid_info edid;
+	/* Position in the output layout, set by the policy */
+	int32_t x, y;
+	/* Available resolutions, as handles into the mode pool */
+	mode_handle *modes;
 	int nr_of_modes;
+	/* The mode flagged as preferred by the monitor */
+	mode_handle preferred_mode;
 	/* If connected, the current mode, if disconnected the last mode*/
-	drmModeModeInfo current_mode;
+	mode_handle current_mode;
+	/* CONN_CHANGED_* bits set since the changes were last reported */
+	uint32_t changed;
 };
 
+struct conn_registry;
+
 /* ---------------------------------------------------------------------------*/
 /**
  * @Brief  Initialise the DRM handling lib
@@ -100,25 +126,56 @@ int init_drm_handler();
 
 /* ---------------------------------------------------------------------------*/
 /**
- * @Brief  Populate the drm connector list.
- * This function populates the initial drm connector list. This list will
- * serve as a reference for following updates
+ * @Brief  Populate the drm connector registry.
+ * This function populates the initial drm connector registry. This registry
+ * will serve as a reference for following updates
  *
- * @Param device_name The device name (most cases: /dev/dri/card0)
+ * @Param dev The opened DRM device
  *
- * @Returns   The head of a linked list containing the available connectors
+ * @Returns   A registry containing the available connectors, NULL if failed
  */
 /* ---------------------------------------------------------------------------*/
-struct drm_connector_obj *populate_drm_conn_list(char *device_name);
+struct conn_registry *populate_drm_conn_list(struct drm_device *dev);
 
 /* ---------------------------------------------------------------------------*/
 /**
- * @Brief  Update the current drm list with new values if something has changed
+ * @Brief  Update the current drm registry with new values if something has
+ * changed. Connectors that appeared are added, connectors that disappeared
+ * (e.g. DP MST ports) are removed.
  *
- * @Param drm_connector_obj The head of the drm_connector_obj list
- * @Param device_name The device name of the card
+ * @Param reg The connector registry
+ * @Param dev The opened DRM device
  *
- * @Returns   number of changes
+ * @Returns   number of changes, -1 if failed
  */
 /* ---------------------------------------------------------------------------*/
-int update_drm_conn_list(struct drm_connector_obj *head, char *device_name);
+int update_drm_conn_list(struct conn_registry *reg, struct drm_device *dev);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Update a single connector of the drm registry
+ * Used when the uevent names the connector that changed, so only that
+ * connector is probed instead of every connector of the card.
+ *
+ * @Param reg The connector registry
+ * @Param dev The opened DRM device
+ * @Param connector_id The connector id from the CONNECTOR uevent key
+ * @Param probe 1 to probe (DDC/EDID) or use the EDID cache for a known
+ * monitor, 0 to read the current state
+ *
+ * @Returns   number of changes, -1 if the connector is unknown or failed
+ */
+/* ---------------------------------------------------------------------------*/
+int update_drm_connector(struct conn_registry *reg, struct drm_device *dev,
+			 uint32_t connector_id, int probe);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Release the mode handles held by a connector
+ *
+ * @Param obj The connector
+ */
+/* ---------------------------------------------------------------------------*/
+void drm_connector_obj_release(struct drm_connector_obj *obj);
+
+#endif
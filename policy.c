@@ -0,0 +1,445 @@
+/**
+ * @file policy.c
+ * @Brief  Output rules compiled into lookup tables
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-02
+ */
+
+#include "policy.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <strings.h>
+
+/* Maximum length of a line in the rules file */
+#define POLICY_LINE_LEN 256
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  FNV-1a hash of a match key
+ *
+ * @Param key The canonical key
+ *
+ * @Returns   The hash value, never 0
+ */
+/* ---------------------------------------------------------------------------*/
+static uint64_t hash_key(const char *key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (; *key; key++) {
+		hash ^= (uint8_t)*key;
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Find the hash slot of a key
+ *
+ * @Param policy The rules
+ * @Param key The canonical key
+ * @Param hash The hash of the key
+ *
+ * @Returns   The slot holding the key, or the free slot where it belongs
+ */
+/* ---------------------------------------------------------------------------*/
+static uint32_t find_slot(const struct policy *policy, const char *key,
+			  uint64_t hash)
+{
+	uint32_t slot = hash & policy->mask;
+
+	while (policy->index[slot] &&
+	       (policy->hashes[slot] != hash ||
+		strcmp(policy->rules[policy->index[slot] - 1].key, key)))
+		slot = (slot + 1) & policy->mask;
+	return slot;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Lookup a key in the hash table
+ *
+ * @Param policy The rules
+ * @Param key The canonical key
+ *
+ * @Returns   The rule or NULL if no rule has this key
+ */
+/* ---------------------------------------------------------------------------*/
+static const struct policy_rule *lookup_key(const struct policy *policy,
+					    const char *key)
+{
+	uint32_t slot;
+
+	if (!policy->index) return NULL;
+	slot = find_slot(policy, key, hash_key(key));
+	return policy->index[slot] ? &policy->rules[policy->index[slot] - 1]
+				   : NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Map a connector type name on its DRM_MODE_CONNECTOR_* value
+ *
+ * @Param name The name, e.g. HDMI-A, case insensitive
+ *
+ * @Returns   The connector type or -1 if unknown
+ */
+/* ---------------------------------------------------------------------------*/
+static int parse_type(const char *name)
+{
+	int i, n = sizeof(drm_output_names) / sizeof(drm_output_names[0]);
+
+	for (i = 0; i < n; i++) {
+		if (!strcasecmp(name, drm_output_names[i])) return i;
+	}
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse the match of a rule into its canonical key
+ * EDID product codes may be written in hex, the key has them in decimal.
+ *
+ * @Param match The match, e.g. edid=GSM/0x5b09
+ * @Param rule The rule, receives the key
+ *
+ * @Returns   0 if successfull, -1 if the match is invalid
+ */
+/* ---------------------------------------------------------------------------*/
+static int parse_match(const char *match, struct policy_rule *rule)
+{
+	char vendor[4];
+	const char *p;
+	char *end;
+	unsigned long product;
+	int type, len;
+
+	if (!strcmp(match, "*")) {
+		snprintf(rule->key, sizeof(rule->key), "*");
+		return 0;
+	}
+	if (!strncmp(match, "name=", 5) && match[5]) {
+		len = snprintf(rule->key, sizeof(rule->key), "name:%s",
+			       match + 5);
+		return len < (int)sizeof(rule->key) ? 0 : -1;
+	}
+	if (!strncmp(match, "type=", 5)) {
+		type = parse_type(match + 5);
+		if (type < 0) return -1;
+		snprintf(rule->key, sizeof(rule->key), "type:%d", type);
+		return 0;
+	}
+	if (strncmp(match, "edid=", 5)) return -1;
+
+	p = match + 5;
+	for (len = 0; len < 3; len++) {
+		if (!isalpha((unsigned char)p[len])) return -1;
+		vendor[len] = toupper((unsigned char)p[len]);
+	}
+	vendor[3] = '\0';
+	p += 3;
+	if (*p == '\0') {
+		snprintf(rule->key, sizeof(rule->key), "edid:%s", vendor);
+		return 0;
+	}
+	if (*p++ != '/') return -1;
+	errno = 0;
+	product = strtoul(p, &end, 0);
+	if (end == p || errno || product > 0xffff) return -1;
+	if (*end == '\0') {
+		snprintf(rule->key, sizeof(rule->key), "edid:%s/%lu", vendor,
+			 product);
+		return 0;
+	}
+	if (*end != '/' || end[1] == '\0' || strlen(end + 1) >= EDID_TEXT_LEN)
+		return -1;
+	snprintf(rule->key, sizeof(rule->key), "edid:%s/%lu/%s", vendor,
+		 product, end + 1);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse an action of a rule
+ *
+ * @Param action The action, e.g. mode=1920x1080@60
+ * @Param rule The rule
+ *
+ * @Returns   0 if successfull, -1 if the action is invalid
+ */
+/* ---------------------------------------------------------------------------*/
+static int parse_action(const char *action, struct policy_rule *rule)
+{
+	unsigned int width, height, refresh = 0;
+	int x, y, n = 0, m = 0;
+
+	if (!strcmp(action, "off")) {
+		rule->off = 1;
+		return 0;
+	}
+	if (!strcmp(action, "mode=preferred")) {
+		rule->width = rule->height = rule->refresh = 0;
+		return 0;
+	}
+	if (sscanf(action, "mode=%ux%u%n", &width, &height, &n) == 2) {
+		if (action[n] == '@' &&
+		    sscanf(action + n, "@%u%n", &refresh, &m) != 1)
+			return -1;
+		if (action[n + m] != '\0' || !width || !height ||
+		    width > 0xffff || height > 0xffff)
+			return -1;
+		rule->width = width;
+		rule->height = height;
+		rule->refresh = refresh;
+		return 0;
+	}
+	n = 0;
+	if (sscanf(action, "pos=%d,%d%n", &x, &y, &n) == 2 &&
+	    action[n] == '\0') {
+		rule->has_pos = 1;
+		rule->x = x;
+		rule->y = y;
+		return 0;
+	}
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse a line of the rules file
+ *
+ * @Param line The line, modified
+ * @Param rule Receives the rule
+ *
+ * @Returns   1 if the line holds a rule, 0 if it is empty, -1 if invalid
+ */
+/* ---------------------------------------------------------------------------*/
+static int parse_line(char *line, struct policy_rule *rule)
+{
+	char *save, *tok;
+
+	if ((tok = strchr(line, '#'))) *tok = '\0';
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (!tok) return 0;
+	if (parse_match(tok, rule) < 0) {
+		log_error("Invalid match '%s'", tok);
+		return -1;
+	}
+	while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+		if (parse_action(tok, rule) < 0) {
+			log_error("Invalid action '%s'", tok);
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Put the rules in their lookup tables
+ * The hash table is kept at most half full.
+ *
+ * @Param policy The rules
+ *
+ * @Returns   0 if successfull, -1 if failed or a key is used twice
+ */
+/* ---------------------------------------------------------------------------*/
+static int policy_compile(struct policy *policy)
+{
+	struct policy_rule *rule;
+	uint32_t size = 8, slot;
+	uint64_t hash;
+	int i, *entry, type;
+
+	while (size < (uint32_t)policy->nr_rules * 2) size <<= 1;
+	policy->hashes = calloc(size, sizeof(*policy->hashes));
+	policy->index = calloc(size, sizeof(*policy->index));
+	if (!policy->hashes || !policy->index) return -1;
+	policy->mask = size - 1;
+
+	for (i = 0; i < policy->nr_rules; i++) {
+		rule = &policy->rules[i];
+		if (!strcmp(rule->key, "*")) {
+			entry = &policy->fallback;
+		} else if (sscanf(rule->key, "type:%d", &type) == 1) {
+			if (type >= POLICY_MAX_TYPES) return -1;
+			entry = &policy->by_type[type];
+		} else {
+			hash = hash_key(rule->key);
+			slot = find_slot(policy, rule->key, hash);
+			policy->hashes[slot] = hash;
+			entry = &policy->index[slot];
+		}
+		if (*entry) {
+			log_error("Rule on line %d repeats line %d",
+				  rule->line,
+				  policy->rules[*entry - 1].line);
+			return -1;
+		}
+		*entry = i + 1;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse and compile a rules file
+ *
+ * @Param filename The rules file
+ *
+ * @Returns   The compiled rules or NULL if the file could not be read or
+ * has an invalid or duplicate rule
+ */
+/* ---------------------------------------------------------------------------*/
+struct policy *policy_load(const char *filename)
+{
+	struct policy *policy;
+	struct policy_rule *rules;
+	char line[POLICY_LINE_LEN];
+	int capacity = 0, nr_line = 0, ret;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		log_error("Failed to open rules %s", filename);
+		return NULL;
+	}
+	policy = calloc(1, sizeof(*policy));
+	if (!policy) goto err;
+
+	while (fgets(line, sizeof(line), fp)) {
+		nr_line++;
+		if (policy->nr_rules == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			rules = realloc(policy->rules,
+					capacity * sizeof(*rules));
+			if (!rules) goto err;
+			policy->rules = rules;
+		}
+		rules = &policy->rules[policy->nr_rules];
+		memset(rules, 0, sizeof(*rules));
+		rules->line = nr_line;
+		ret = parse_line(line, rules);
+		if (ret < 0) {
+			log_error("%s:%d: invalid rule", filename, nr_line);
+			goto err;
+		}
+		policy->nr_rules += ret;
+	}
+	fclose(fp);
+	fp = NULL;
+	if (policy_compile(policy) < 0) {
+		log_error("Failed to compile rules %s", filename);
+		goto err;
+	}
+	log_info("Loaded %d rule(s) from %s", policy->nr_rules, filename);
+	return policy;
+err:
+	if (fp) fclose(fp);
+	policy_destroy(policy);
+	return NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Free compiled rules
+ *
+ * @Param policy The rules, may be NULL
+ */
+/* ---------------------------------------------------------------------------*/
+void policy_destroy(struct policy *policy)
+{
+	if (!policy) return;
+	free(policy->rules);
+	free(policy->hashes);
+	free(policy->index);
+	free(policy);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Find the most specific rule for an output
+ *
+ * @Param policy The rules
+ * @Param obj The connector
+ *
+ * @Returns   The rule or NULL if no rule matches
+ */
+/* ---------------------------------------------------------------------------*/
+const struct policy_rule *policy_lookup(const struct policy *policy,
+					const struct drm_connector_obj *obj)
+{
+	const struct policy_rule *rule;
+	const struct edid_info *edid = &obj->edid;
+	char key[POLICY_KEY_LEN];
+
+	snprintf(key, sizeof(key), "name:%s", obj->name);
+	if ((rule = lookup_key(policy, key))) return rule;
+	if (edid->vendor[0]) {
+		if (edid->serial[0]) {
+			snprintf(key, sizeof(key), "edid:%s/%u/%s", edid->vendor,
+				 edid->product, edid->serial);
+			if ((rule = lookup_key(policy, key))) return rule;
+		}
+		snprintf(key, sizeof(key), "edid:%s/%u", edid->vendor,
+			 edid->product);
+		if ((rule = lookup_key(policy, key))) return rule;
+		snprintf(key, sizeof(key), "edid:%s", edid->vendor);
+		if ((rule = lookup_key(policy, key))) return rule;
+	}
+	if (obj->connector_type < POLICY_MAX_TYPES &&
+	    policy->by_type[obj->connector_type])
+		return &policy->rules[policy->by_type[obj->connector_type] - 1];
+	if (policy->fallback) return &policy->rules[policy->fallback - 1];
+	return NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Pick the mode a rule asks for from the modes of an output
+ * Falls back to the preferred mode if the output lacks the mode.
+ *
+ * @Param rule The rule
+ * @Param obj The connector
+ *
+ * @Returns   The mode, no reference is taken. MODE_HANDLE_NONE if the rule
+ * switches the output off or the output has no modes.
+ */
+/* ---------------------------------------------------------------------------*/
+mode_handle policy_pick_mode(const struct policy_rule *rule,
+			     const struct drm_connector_obj *obj)
+{
+	const drmModeModeInfo *mode;
+	mode_handle best = MODE_HANDLE_NONE, fallback;
+	uint32_t best_refresh = 0;
+	int i;
+
+	if (rule->off) return MODE_HANDLE_NONE;
+	fallback = obj->preferred_mode;
+	if (!fallback && obj->nr_of_modes) fallback = obj->modes[0];
+	if (!rule->width) return fallback;
+
+	for (i = 0; i < obj->nr_of_modes; i++) {
+		mode = mode_pool_get(obj->modes[i]);
+		if (mode->hdisplay != rule->width ||
+		    mode->vdisplay != rule->height)
+			continue;
+		if (rule->refresh && mode->vrefresh != rule->refresh) continue;
+		/* The first of equal candidates, drivers list the best first */
+		if (!best || mode->vrefresh > best_refresh) {
+			best = obj->modes[i];
+			best_refresh = mode->vrefresh;
+		}
+	}
+	if (best) return best;
+	log_warning("%s: no %ux%u mode for the rule on line %d, using the "
+		    "preferred mode",
+		    obj->name,
+		    rule->width,
+		    rule->height,
+		    rule->line);
+	return fallback;
+}
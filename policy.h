@@ -0,0 +1,133 @@
+/**
+ * @file policy.h
+ * @Brief  Output rules compiled into lookup tables
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-02
+ *
+ * A rules file picks the mode and position of an output when it shows
+ * up. Every line matches on one key and lists the actions:
+ *
+ *   # match                  actions
+ *   name=Card0-DP-1          mode=2560x1440@144 pos=0,0
+ *   edid=DEL/41199/7MT0186   mode=3840x2160 pos=2560,0
+ *   edid=GSM/0x5b09          mode=preferred
+ *   type=HDMI-A              off
+ *   *                        mode=preferred
+ *
+ * edid= takes the PNP vendor id, optionally followed by the product code
+ * and the serial number. mode= takes a resolution with an optional
+ * refresh rate, without one the highest rate is used.
+ *
+ * The file is parsed once. Name and EDID rules go into one hash table,
+ * type rules into a table indexed by connector type, so evaluating the
+ * rules for an output is at most five lookups, however long the file is.
+ * The most specific rule wins: name, EDID with serial, EDID with product,
+ * EDID vendor, connector type and last the * rule.
+ */
+
+#ifndef _POLICY_H_
+#define _POLICY_H_
+
+#include <stdint.h>
+
+#include "modeset.h"
+
+/* Maximum length of a canonical match key, e.g. "edid:DEL/41199/7MT0186" */
+#define POLICY_KEY_LEN 48
+
+/* Connector types with their own slot in the type table */
+#define POLICY_MAX_TYPES 32
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A compiled rule
+ */
+/* ---------------------------------------------------------------------------*/
+struct policy_rule {
+	/* Canonical match key, e.g. "name:Card0-DP-1" or "edid:DEL/41199" */
+	char key[POLICY_KEY_LEN];
+	/* Line in the rules file */
+	int line;
+	/* 1 to switch the output off */
+	int off;
+	/* Requested resolution, 0 for the preferred mode */
+	uint16_t width;
+	uint16_t height;
+	/* Requested refresh rate, 0 for the highest */
+	uint32_t refresh;
+	/* 1 if the rule places the output */
+	int has_pos;
+	int32_t x;
+	int32_t y;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Compiled rules file
+ */
+/* ---------------------------------------------------------------------------*/
+struct policy {
+	struct policy_rule *rules;
+	int nr_rules;
+	/* Hash table of the name and EDID keys: rule index + 1, 0 marks a
+	 * free slot */
+	uint64_t *hashes;
+	int *index;
+	uint32_t mask;
+	/* Rule index + 1 per connector type, 0 if there is none */
+	int by_type[POLICY_MAX_TYPES];
+	/* Rule index + 1 of the * rule, 0 if there is none */
+	int fallback;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse and compile a rules file
+ *
+ * @Param filename The rules file
+ *
+ * @Returns   The compiled rules or NULL if the file could not be read or
+ * has an invalid or duplicate rule
+ */
+/* ---------------------------------------------------------------------------*/
+struct policy *policy_load(const char *filename);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Free compiled rules
+ *
+ * @Param policy The rules, may be NULL
+ */
+/* ---------------------------------------------------------------------------*/
+void policy_destroy(struct policy *policy);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Find the most specific rule for an output
+ *
+ * @Param policy The rules
+ * @Param obj The connector
+ *
+ * @Returns   The rule or NULL if no rule matches
+ */
+/* ---------------------------------------------------------------------------*/
+const struct policy_rule *policy_lookup(const struct policy *policy,
+					const struct drm_connector_obj *obj);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Pick the mode a rule asks for from the modes of an output
+ * Falls back to the preferred mode if the output lacks the mode.
+ *
+ * @Param rule The rule
+ * @Param obj The connector
+ *
+ * @Returns   The mode, no reference is taken. MODE_HANDLE_NONE if the rule
+ * switches the output off or the output has no modes.
+ */
+/* ---------------------------------------------------------------------------*/
+mode_handle policy_pick_mode(const struct policy_rule *rule,
+			     const struct drm_connector_obj *obj);
+
+#endif
@@ -0,0 +1,257 @@
+/**
+ * @file registry.c
+ * @Brief  Connector registry indexed by connector id
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-14
+ */
+
+#include "registry.h"
+
+/* Multiplying by an odd constant is a bijection on the low bits, so the
+ * small sequential DRM object ids do not collide */
+static inline uint32_t hash_id(uint32_t id, uint32_t mask)
+{
+	return (id * 2654435761u) & mask;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Find the hash slot of a connector id
+ *
+ * @Param reg The registry
+ * @Param connector_id The DRM connector id
+ *
+ * @Returns   The slot holding the id, or the free slot where it belongs
+ */
+/* ---------------------------------------------------------------------------*/
+static uint32_t find_slot(struct conn_registry *reg, uint32_t connector_id)
+{
+	uint32_t slot = hash_id(connector_id, reg->mask);
+	while (reg->index[slot] && reg->keys[slot] != connector_id)
+		slot = (slot + 1) & reg->mask;
+	return slot;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Grow the dense array and the hash table
+ * The hash table is kept at most half full.
+ *
+ * @Param reg The registry
+ * @Param capacity The new dense capacity
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int registry_grow(struct conn_registry *reg, int capacity)
+{
+	struct drm_connector_obj *objs;
+	uint32_t *keys, size = 8, slot;
+	int *index, i;
+
+	while (size < (uint32_t)capacity * 2) size <<= 1;
+
+	objs = realloc(reg->objs, capacity * sizeof(*objs));
+	if (!objs) return -1;
+	reg->objs = objs;
+
+	keys = calloc(size, sizeof(*keys));
+	index = calloc(size, sizeof(*index));
+	if (!keys || !index) {
+		free(keys);
+		free(index);
+		return -1;
+	}
+	free(reg->keys);
+	free(reg->index);
+	reg->keys = keys;
+	reg->index = index;
+	reg->mask = size - 1;
+	reg->capacity = capacity;
+
+	for (i = 0; i < reg->count; i++) {
+		slot = find_slot(reg, reg->objs[i].connector_id);
+		reg->keys[slot] = reg->objs[i].connector_id;
+		reg->index[slot] = i + 1;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a new registry
+ *
+ * @Param capacity Expected number of connectors
+ *
+ * @Returns   A newly allocated registry or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct conn_registry *registry_create(int capacity)
+{
+	struct conn_registry *reg = malloc(sizeof(*reg));
+	if (!reg) {
+		log_error("Failed to allocate registry");
+		return NULL;
+	}
+	memset(reg, 0, sizeof(*reg));
+	if (capacity < 4) capacity = 4;
+	if (registry_grow(reg, capacity) < 0) {
+		log_error("Failed to allocate registry");
+		free(reg);
+		return NULL;
+	}
+	return reg;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Destroy the registry and release the modes of its connectors
+ *
+ * @Param reg The registry
+ */
+/* ---------------------------------------------------------------------------*/
+void registry_destroy(struct conn_registry *reg)
+{
+	int i;
+	if (!reg) return;
+	for (i = 0; i < reg->count; i++)
+		drm_connector_obj_release(&reg->objs[i]);
+	free(reg->objs);
+	free(reg->keys);
+	free(reg->index);
+	free(reg->removed);
+	free(reg);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Lookup a connector
+ *
+ * @Param reg The registry
+ * @Param connector_id The DRM connector id
+ *
+ * @Returns   The connector or NULL if it is not in the registry
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_connector_obj *registry_lookup(struct conn_registry *reg,
+					  uint32_t connector_id)
+{
+	uint32_t slot = find_slot(reg, connector_id);
+	if (!reg->index[slot]) return NULL;
+	return &reg->objs[reg->index[slot] - 1];
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Insert a new, zeroed connector
+ *
+ * @Param reg The registry
+ * @Param connector_id The DRM connector id
+ *
+ * @Returns   The new connector, the existing one if the id is already
+ * present, or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_connector_obj *registry_insert(struct conn_registry *reg,
+					  uint32_t connector_id)
+{
+	struct drm_connector_obj *obj;
+	uint32_t slot;
+
+	slot = find_slot(reg, connector_id);
+	if (reg->index[slot]) return &reg->objs[reg->index[slot] - 1];
+
+	if (reg->count == reg->capacity) {
+		if (registry_grow(reg, reg->capacity * 2) < 0) {
+			log_error("Failed to grow registry");
+			return NULL;
+		}
+		slot = find_slot(reg, connector_id);
+	}
+	obj = &reg->objs[reg->count];
+	memset(obj, 0, sizeof(*obj));
+	obj->connector_id = connector_id;
+	reg->keys[slot] = connector_id;
+	reg->index[slot] = ++reg->count;
+	return obj;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remember a removed connector until the change is reported
+ *
+ * @Param reg The registry
+ * @Param obj The connector
+ */
+/* ---------------------------------------------------------------------------*/
+static void note_removed(struct conn_registry *reg,
+			 const struct drm_connector_obj *obj)
+{
+	struct removed_connector *removed;
+	int capacity;
+
+	if (reg->nr_removed == reg->removed_capacity) {
+		capacity = reg->removed_capacity ? reg->removed_capacity * 2 : 4;
+		removed = realloc(reg->removed, capacity * sizeof(*removed));
+		if (!removed) {
+			log_warning("Removal of connector %u not reported",
+				    obj->connector_id);
+			return;
+		}
+		reg->removed = removed;
+		reg->removed_capacity = capacity;
+	}
+	removed = &reg->removed[reg->nr_removed++];
+	removed->connector_id = obj->connector_id;
+	removed->status = obj->status;
+	snprintf(removed->name, sizeof(removed->name), "%s", obj->name);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remove a connector and release its modes
+ * The id is added to the removed connectors.
+ *
+ * @Param reg The registry
+ * @Param connector_id The DRM connector id
+ *
+ * @Returns   0 if successfull, -1 if the connector was not found
+ */
+/* ---------------------------------------------------------------------------*/
+int registry_remove(struct conn_registry *reg, uint32_t connector_id)
+{
+	uint32_t slot, next, home;
+	int idx, last;
+
+	slot = find_slot(reg, connector_id);
+	if (!reg->index[slot]) return -1;
+	idx = reg->index[slot] - 1;
+	last = reg->count - 1;
+
+	note_removed(reg, &reg->objs[idx]);
+	drm_connector_obj_release(&reg->objs[idx]);
+	/* Keep the array dense: move the last connector into the hole */
+	if (idx != last) {
+		reg->objs[idx] = reg->objs[last];
+		reg->index[find_slot(reg, reg->objs[idx].connector_id)] =
+		    idx + 1;
+	}
+	reg->count--;
+
+	/* Backward shift deletion, no tombstones needed */
+	reg->index[slot] = 0;
+	next = (slot + 1) & reg->mask;
+	while (reg->index[next]) {
+		home = hash_id(reg->keys[next], reg->mask);
+		/* Move the entry back if the hole lies between home and next */
+		if (((next - home) & reg->mask) >= ((next - slot) & reg->mask)) {
+			reg->keys[slot] = reg->keys[next];
+			reg->index[slot] = reg->index[next];
+			reg->index[next] = 0;
+			slot = next;
+		}
+		next = (next + 1) & reg->mask;
+	}
+	return 0;
+}
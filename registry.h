@@ -0,0 +1,124 @@
+/**
+ * @file registry.h
+ * @Brief  Connector registry indexed by connector id
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-14
+ *
+ * The connectors are stored in a dense array so a full scan walks
+ * contiguous memory. An open addressing hash table maps a connector id to
+ * its index in the dense array for O(1) lookups. Removing a connector
+ * moves the last connector into the freed slot.
+ *
+ * @Note Pointers returned by the registry are only valid until the next
+ * insert or remove.
+ */
+
+#ifndef _REGISTRY_H_
+#define _REGISTRY_H_
+
+#include <stdint.h>
+
+#include "modeset.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  What is left of a removed connector until the change is reported
+ */
+/* ---------------------------------------------------------------------------*/
+struct removed_connector {
+	uint32_t connector_id;
+	/* Status before the removal */
+	drmModeConnection status;
+	char name[sizeof(((struct drm_connector_obj *)0)->name)];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Connector registry structure
+ */
+/* ---------------------------------------------------------------------------*/
+struct conn_registry {
+	/* Dense array of connectors */
+	struct drm_connector_obj *objs;
+	int count;
+	int capacity;
+	/* Hash table: connector id to dense index + 1, 0 marks a free slot */
+	uint32_t *keys;
+	int *index;
+	uint32_t mask;
+	/* Connectors removed since the changes were last reported */
+	struct removed_connector *removed;
+	int nr_removed;
+	int removed_capacity;
+};
+
+/**@brief Macro to get the number of connectors in the registry
+ */
+#define REGISTRY_SIZE(reg) ((reg)->count)
+
+/**@brief Macro to get a connector by its dense index
+ */
+#define REGISTRY_AT(reg, i) (&(reg)->objs[(i)])
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a new registry
+ *
+ * @Param capacity Expected number of connectors
+ *
+ * @Returns   A newly allocated registry or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct conn_registry *registry_create(int capacity);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Destroy the registry and release the modes of its connectors
+ *
+ * @Param reg The registry
+ */
+/* ---------------------------------------------------------------------------*/
+void registry_destroy(struct conn_registry *reg);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Lookup a connector
+ *
+ * @Param reg The registry
+ * @Param connector_id The DRM connector id
+ *
+ * @Returns   The connector or NULL if it is not in the registry
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_connector_obj *registry_lookup(struct conn_registry *reg,
+					  uint32_t connector_id);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Insert a new, zeroed connector
+ *
+ * @Param reg The registry
+ * @Param connector_id The DRM connector id
+ *
+ * @Returns   The new connector, the existing one if the id is already
+ * present, or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct drm_connector_obj *registry_insert(struct conn_registry *reg,
+					  uint32_t connector_id);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Remove a connector and release its modes
+ * The id is added to the removed connectors.
+ *
+ * @Param reg The registry
+ * @Param connector_id The DRM connector id
+ *
+ * @Returns   0 if successfull, -1 if the connector was not found
+ */
+/* ---------------------------------------------------------------------------*/
+int registry_remove(struct conn_registry *reg, uint32_t connector_id);
+
+#endif
@@ -0,0 +1,297 @@
+/**
+ * @file replay.c
+ * @Brief  Feed a uevent recording into the daemon instead of the kernel
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-10
+ */
+
+#include "replay.h"
+#include "metrics.h"
+
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/* Uevents pushed per wakeup when replaying as fast as possible, the ring
+ * handler gets a turn in between */
+#define REPLAY_BATCH 32
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Load a recording
+ *
+ * @Param filename The recording
+ * @Param paced 1 to keep the recorded pacing, 0 for as fast as possible
+ *
+ * @Returns   The replay or NULL if failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct replay *replay_open(const char *filename, int paced)
+{
+	struct replay *replay;
+	struct uevent *events;
+	char line[UEVENT_LINE_LEN];
+	uint32_t capacity = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		log_error("Failed to open recording %s", filename);
+		return NULL;
+	}
+	replay = calloc(1, sizeof(*replay));
+	if (!replay) goto err;
+	replay->paced = paced;
+	replay->timer_fd = -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (replay->nr_events == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			events = realloc(replay->events,
+					 capacity * sizeof(*events));
+			if (!events) goto err;
+			replay->events = events;
+		}
+		if (uevent_parse(line, &replay->events[replay->nr_events]) < 0)
+			continue;
+		replay->events[replay->nr_events].replay_idx =
+		    replay->nr_events + 1;
+		replay->nr_events++;
+	}
+	fclose(fp);
+	fp = NULL;
+	if (replay->nr_events == 0) {
+		log_error("No uevents in recording %s", filename);
+		goto err;
+	}
+	replay->injected_us = calloc(replay->nr_events, sizeof(uint64_t));
+	replay->latency_us = calloc(replay->nr_events, sizeof(uint64_t));
+	if (!replay->injected_us || !replay->latency_us) goto err;
+	log_info("Loaded %u uevent(s) from %s", replay->nr_events, filename);
+	return replay;
+err:
+	if (fp) fclose(fp);
+	replay_close(replay);
+	return NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Arm the replay timer
+ *
+ * @Param replay The replay
+ * @Param delay_us Delay in us, 0 to fire on the next loop iteration
+ */
+/* ---------------------------------------------------------------------------*/
+static void replay_arm(struct replay *replay, uint64_t delay_us)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = delay_us / 1000000;
+	its.it_value.tv_nsec = (delay_us % 1000000) * 1000;
+	/* An all zero it_value would disarm the timer */
+	if (delay_us == 0) its.it_value.tv_nsec = 1;
+	timerfd_settime(replay->timer_fd, 0, &its, NULL);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Push the next uevent into the ring
+ *
+ * @Param replay The replay
+ * @Param now_us The current time
+ *
+ * @Returns   0 if pushed, -1 if the ring is full
+ */
+/* ---------------------------------------------------------------------------*/
+static int inject_next(struct replay *replay, uint64_t now_us)
+{
+	struct uevent ev = replay->events[replay->next];
+
+	ev.received_us = now_us;
+	if (spsc_ring_push_item(replay->ring, &ev) < 0) return -1;
+	metrics_inc(METRIC_UEVENTS);
+	replay->injected_us[replay->next++] = now_us;
+	return 0;
+}
+
+static void replay_handler(struct event_loop *loop, int fd, uint32_t events,
+			   void *data)
+{
+	struct replay *replay = data;
+	uint64_t expirations, now_us, due_us, first_us;
+	int i;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+	now_us = metrics_now_us();
+	first_us = replay->events[0].received_us;
+
+	if (!replay->paced) {
+		/* A full ring is retried on the next wakeup */
+		spsc_ring_begin_batch(replay->ring);
+		for (i = 0; i < REPLAY_BATCH && replay->next < replay->nr_events;
+		     i++) {
+			if (inject_next(replay, now_us) < 0) break;
+		}
+		spsc_ring_end_batch(replay->ring);
+		if (replay->next < replay->nr_events) replay_arm(replay, 0);
+		return;
+	}
+
+	spsc_ring_begin_batch(replay->ring);
+	while (replay->next < replay->nr_events) {
+		due_us = replay->start_us +
+			 (replay->events[replay->next].received_us - first_us);
+		if (due_us > now_us) {
+			replay_arm(replay, due_us - now_us);
+			break;
+		}
+		/* Like a live uevent, a full ring drops it */
+		if (inject_next(replay, now_us) < 0) {
+			replay->injected_us[replay->next++] = now_us;
+			replay->dropped++;
+			metrics_inc(METRIC_UEVENTS_DROPPED);
+		}
+	}
+	spsc_ring_end_batch(replay->ring);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Start injecting uevents into a ring
+ *
+ * @Param replay The replay
+ * @Param loop The event loop that drives the replay
+ * @Param ring The uevent ring of the daemon, uevents are copied into it
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int replay_start(struct replay *replay, struct event_loop *loop,
+		 struct spsc_ring *ring)
+{
+	replay->loop = loop;
+	replay->ring = ring;
+	replay->timer_fd =
+	    timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (replay->timer_fd < 0) {
+		log_error("Failed to create replay timer");
+		return -1;
+	}
+	if (event_loop_add_fd(loop, replay->timer_fd, EPOLLIN, replay_handler,
+			      replay) < 0)
+		return -1;
+	log_info("Replaying %u uevent(s) %s",
+		 replay->nr_events,
+		 replay->paced ? "at the recorded pace" : "as fast as possible");
+	replay->start_us = metrics_now_us();
+	replay_arm(replay, 0);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Note that a uevent was taken from the ring and queued
+ *
+ * @Param replay The replay, may be NULL
+ * @Param ev The uevent
+ */
+/* ---------------------------------------------------------------------------*/
+void replay_tracked(struct replay *replay, const struct uevent *ev)
+{
+	if (replay && ev->replay_idx > replay->tracked)
+		replay->tracked = ev->replay_idx;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Note that the ring overflowed, the full rescan that follows
+ * covers every uevent injected so far, including the dropped ones
+ *
+ * @Param replay The replay, may be NULL
+ */
+/* ---------------------------------------------------------------------------*/
+void replay_overflow(struct replay *replay)
+{
+	if (replay) replay->tracked = replay->next;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Log the throughput and latency percentiles of the replay
+ *
+ * @Param replay The replay, every uevent must be done
+ * @Param now_us The time the last uevent was done
+ */
+/* ---------------------------------------------------------------------------*/
+static void replay_report(struct replay *replay, uint64_t now_us)
+{
+	uint64_t *lat = replay->latency_us, elapsed_us;
+	uint32_t n = replay->nr_events;
+
+	elapsed_us = now_us - replay->start_us;
+	qsort(lat, n, sizeof(*lat), compare_u64);
+	log_ok("Replayed %u uevent(s) in %.3f s, %.1f uevent(s)/s, "
+	       "%lu dropped",
+	       n,
+	       elapsed_us / 1e6,
+	       elapsed_us ? n * 1e6 / elapsed_us : 0.0,
+	       replay->dropped);
+	log_ok("Uevent to rescan done latency: p50 %llu us, p90 %llu us, "
+	       "p99 %llu us, max %llu us",
+	       (unsigned long long)lat[(n - 1) * 50 / 100],
+	       (unsigned long long)lat[(n - 1) * 90 / 100],
+	       (unsigned long long)lat[(n - 1) * 99 / 100],
+	       (unsigned long long)lat[n - 1]);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Mark the uevents covered by a finished rescan as done
+ * Stops the event loop after logging the report once every uevent is done.
+ *
+ * @Param replay The replay, may be NULL
+ * @Param watermark The value of replay->tracked when the rescan started
+ */
+/* ---------------------------------------------------------------------------*/
+void replay_scan_done(struct replay *replay, uint32_t watermark)
+{
+	uint64_t now_us;
+
+	if (!replay || watermark <= replay->completed) return;
+	now_us = metrics_now_us();
+	for (; replay->completed < watermark; replay->completed++)
+		replay->latency_us[replay->completed] =
+		    now_us - replay->injected_us[replay->completed];
+	if (replay->completed < replay->nr_events) return;
+	replay_report(replay, now_us);
+	event_loop_stop(replay->loop);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Free a replay
+ *
+ * @Param replay The replay
+ */
+/* ---------------------------------------------------------------------------*/
+void replay_close(struct replay *replay)
+{
+	if (!replay) return;
+	if (replay->timer_fd >= 0) {
+		if (replay->loop) event_loop_del_fd(replay->loop, replay->timer_fd);
+		close(replay->timer_fd);
+	}
+	free(replay->events);
+	free(replay->injected_us);
+	free(replay->latency_us);
+	free(replay);
+}
@@ -0,0 +1,117 @@
+/**
+ * @file replay.h
+ * @Brief  Feed a uevent recording into the daemon instead of the kernel
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-10
+ *
+ * The recorded uevents are pushed into the same ring as live uevents,
+ * either at their original pacing or as fast as the daemon takes them.
+ * A uevent is done once a rescan that started after it was queued on its
+ * card finishes. When all uevents are done the throughput and latency
+ * percentiles are logged.
+ */
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdint.h>
+
+#include "event_loop.h"
+#include "ring.h"
+#include "uevent.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Replay state
+ */
+/* ---------------------------------------------------------------------------*/
+struct replay {
+	/* The recorded uevents, in file order */
+	struct uevent *events;
+	uint32_t nr_events;
+	/* 1 to keep the recorded time between uevents */
+	int paced;
+	/* Next uevent to inject */
+	uint32_t next;
+	/* Highest replay index taken from the ring */
+	uint32_t tracked;
+	/* Number of uevents that are done */
+	uint32_t completed;
+	/* Time each uevent was injected and became done, in us */
+	uint64_t *injected_us;
+	uint64_t *latency_us;
+	uint64_t start_us;
+	unsigned long dropped;
+	int timer_fd;
+	struct event_loop *loop;
+	struct spsc_ring *ring;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Load a recording
+ *
+ * @Param filename The recording
+ * @Param paced 1 to keep the recorded pacing, 0 for as fast as possible
+ *
+ * @Returns   The replay or NULL if failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct replay *replay_open(const char *filename, int paced);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Start injecting uevents into a ring
+ *
+ * @Param replay The replay
+ * @Param loop The event loop that drives the replay
+ * @Param ring The uevent ring of the daemon, uevents are copied into it
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int replay_start(struct replay *replay, struct event_loop *loop,
+		 struct spsc_ring *ring);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Note that a uevent was taken from the ring and queued
+ *
+ * @Param replay The replay, may be NULL
+ * @Param ev The uevent
+ */
+/* ---------------------------------------------------------------------------*/
+void replay_tracked(struct replay *replay, const struct uevent *ev);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Note that the ring overflowed, the full rescan that follows
+ * covers every uevent injected so far, including the dropped ones
+ *
+ * @Param replay The replay, may be NULL
+ */
+/* ---------------------------------------------------------------------------*/
+void replay_overflow(struct replay *replay);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Mark the uevents covered by a finished rescan as done
+ * Stops the event loop after logging the report once every uevent is done.
+ *
+ * @Param replay The replay, may be NULL
+ * @Param watermark The value of replay->tracked when the rescan started
+ */
+/* ---------------------------------------------------------------------------*/
+void replay_scan_done(struct replay *replay, uint32_t watermark);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Free a replay
+ *
+ * @Param replay The replay
+ */
+/* ---------------------------------------------------------------------------*/
+void replay_close(struct replay *replay);
+
+#endif
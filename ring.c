@@ -0,0 +1,337 @@
+/**
+ * @file ring.c
+ * @Brief  Lock-free single producer, single consumer ring buffer
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-06
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "ring.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a new ring
+ *
+ * @Param capacity Number of slots, rounded up to a power of two
+ *
+ * @Returns   A newly allocated ring or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct spsc_ring *spsc_ring_create(size_t capacity)
+{
+	return spsc_ring_create_items(capacity, 0);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a new ring that carries items by value
+ * Use spsc_ring_push_item and spsc_ring_pop_item on it.
+ *
+ * @Param capacity Number of slots, rounded up to a power of two
+ * @Param item_size Size of an item in bytes, 0 for a ring of pointers
+ *
+ * @Returns   A newly allocated ring or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct spsc_ring *spsc_ring_create_items(size_t capacity, size_t item_size)
+{
+	struct spsc_ring *ring;
+	size_t size = 2;
+
+	while (size < capacity) size <<= 1;
+
+	if (posix_memalign((void **)&ring, CACHE_LINE_SIZE, sizeof(*ring))) {
+		log_error("Failed to allocate ring");
+		return NULL;
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->mask = size - 1;
+	ring->sleeping = 1;
+	ring->item_size = item_size;
+	if (item_size)
+		ring->items = calloc(size, item_size);
+	else
+		ring->slots = calloc(size, sizeof(void *));
+	if (!ring->slots && !ring->items) {
+		log_error("Failed to allocate ring slots");
+		free(ring);
+		return NULL;
+	}
+	ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->efd < 0) {
+		log_error("Failed to create eventfd");
+		free(ring->items);
+		free(ring->slots);
+		free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Destroy a ring
+ * Items still in the ring are not freed, drain it first.
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_destroy(struct spsc_ring *ring)
+{
+	if (!ring) return;
+	close(ring->efd);
+	free(ring->items);
+	free(ring->slots);
+	free(ring);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Push an item (producer only)
+ * When the ring is full the item is not stored, the drop is counted and
+ * the overflow flag is raised so the consumer can resynchronise.
+ *
+ * @Param ring The ring
+ * @Param item The item to push
+ *
+ * @Returns   0 if successfull, -1 if the ring was full
+ */
+/* ---------------------------------------------------------------------------*/
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check for a free slot, count the drop if there is none
+ *
+ * @Param ring The ring
+ * @Param head The producer index
+ *
+ * @Returns   0 if a slot is free, -1 if the ring is full
+ */
+/* ---------------------------------------------------------------------------*/
+static int reserve_slot(struct spsc_ring *ring, size_t head)
+{
+	if (head - ring->cached_tail <= ring->mask) return 0;
+	ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - ring->cached_tail <= ring->mask) return 0;
+	ring->dropped++;
+	__atomic_store_n(&ring->overflow, 1, __ATOMIC_RELEASE);
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Wake the consumer if it announced it is waiting
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+static void wake_consumer(struct spsc_ring *ring)
+{
+	uint64_t one = 1;
+
+	if (__atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		if (write(ring->efd, &one, sizeof(one)) < 0)
+			log_error("Failed to signal eventfd");
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Hand the filled slot to the consumer and wake it if it sleeps
+ * Inside a batch the wakeup is left to spsc_ring_end_batch.
+ *
+ * @Param ring The ring
+ * @Param head The producer index of the filled slot
+ */
+/* ---------------------------------------------------------------------------*/
+static void publish_slot(struct spsc_ring *ring, size_t head)
+{
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	if (ring->batching)
+		ring->batch_pending = 1;
+	else
+		wake_consumer(ring);
+}
+
+int spsc_ring_push(struct spsc_ring *ring, void *item)
+{
+	size_t head = ring->head;
+
+	if (reserve_slot(ring, head) < 0) return -1;
+	ring->slots[head & ring->mask] = item;
+	publish_slot(ring, head);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy an item into a ring of items (producer only)
+ * A full ring drops the item like spsc_ring_push.
+ *
+ * @Param ring The ring
+ * @Param item The item to copy
+ *
+ * @Returns   0 if successfull, -1 if the ring was full
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_push_item(struct spsc_ring *ring, const void *item)
+{
+	size_t head = ring->head;
+
+	if (reserve_slot(ring, head) < 0) return -1;
+	memcpy(ring->items + (head & ring->mask) * ring->item_size, item,
+	       ring->item_size);
+	publish_slot(ring, head);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Raise the overflow flag without pushing (producer only)
+ * For items the producer lost before they reached the ring. The consumer
+ * is woken so it sees the flag.
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_raise_overflow(struct spsc_ring *ring)
+{
+	__atomic_store_n(&ring->overflow, 1, __ATOMIC_SEQ_CST);
+	if (ring->batching)
+		ring->batch_pending = 1;
+	else
+		wake_consumer(ring);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Start a batch of pushes (producer only)
+ * The consumer is not woken until spsc_ring_end_batch.
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_begin_batch(struct spsc_ring *ring)
+{
+	ring->batching = 1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  End a batch of pushes and wake the consumer once (producer only)
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_end_batch(struct spsc_ring *ring)
+{
+	ring->batching = 0;
+	if (!ring->batch_pending) return;
+	ring->batch_pending = 0;
+	wake_consumer(ring);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Pop an item (consumer only)
+ *
+ * @Param ring The ring
+ * @Param item Pointer that receives the item
+ *
+ * @Returns   0 if successfull, -1 if the ring was empty
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_pop(struct spsc_ring *ring, void **item)
+{
+	size_t tail = ring->tail;
+
+	if (tail == ring->cached_head) {
+		ring->cached_head = __atomic_load_n(&ring->head,
+						    __ATOMIC_ACQUIRE);
+		if (tail == ring->cached_head) return -1;
+	}
+	*item = ring->slots[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy the oldest item out of a ring of items (consumer only)
+ *
+ * @Param ring The ring
+ * @Param item Receives the item
+ *
+ * @Returns   0 if successfull, -1 if the ring was empty
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_pop_item(struct spsc_ring *ring, void *item)
+{
+	size_t tail = ring->tail;
+
+	if (tail == ring->cached_head) {
+		ring->cached_head = __atomic_load_n(&ring->head,
+						    __ATOMIC_ACQUIRE);
+		if (tail == ring->cached_head) return -1;
+	}
+	memcpy(item, ring->items + (tail & ring->mask) * ring->item_size,
+	       ring->item_size);
+	/* The slot is free for the producer once the copy is done */
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Acknowledge the eventfd wakeup (consumer only)
+ * Must be called before draining the ring.
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_ack(struct spsc_ring *ring)
+{
+	uint64_t val;
+	/* Nonblocking, EAGAIN just means there was nothing to clear */
+	if (read(ring->efd, &val, sizeof(val)) < 0) return;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Announce that the consumer goes back to sleep (consumer only)
+ *
+ * @Param ring The ring
+ *
+ * @Returns   0 if it is safe to wait for the eventfd, -1 if new items
+ * arrived in the meantime and the ring has to be drained again
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_sleep(struct spsc_ring *ring)
+{
+	__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail)
+		return 0;
+	/* Producer raced us, if it already woke us the eventfd stays set */
+	__atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Fetch and clear the overflow flag (consumer only)
+ *
+ * @Param ring The ring
+ *
+ * @Returns   1 if items were dropped or lost since the last call, 0
+ * otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_take_overflow(struct spsc_ring *ring)
+{
+	return __atomic_exchange_n(&ring->overflow, 0, __ATOMIC_ACQ_REL);
+}
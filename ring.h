@@ -0,0 +1,218 @@
+/**
+ * @file ring.h
+ * @Brief  Lock-free single producer, single consumer ring buffer
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-06
+ *
+ * The ring carries pointers from one producer to one consumer without
+ * allocating or locking. A ring created with spsc_ring_create_items
+ * carries fixed size items by value instead, copied in and out of slots
+ * allocated with the ring. The consumer is woken through an eventfd that
+ * can be added to the event loop. The producer only writes the eventfd
+ * when the consumer announced that it went back to sleep, so a burst of
+ * events costs a single wakeup. Between spsc_ring_begin_batch and
+ * spsc_ring_end_batch that wakeup is deferred to the end of the batch,
+ * which keeps the eventfd write out of the pushes.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  SPSC ring structure
+ * Producer and consumer owned fields live on separate cache lines to
+ * avoid false sharing.
+ */
+/* ---------------------------------------------------------------------------*/
+struct spsc_ring {
+	/* Producer side: next slot to write and cached consumer index */
+	size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+	size_t cached_tail;
+	/* Number of pushes that failed because the ring was full */
+	uint64_t dropped;
+	/* Set by the producer on a drop, cleared by the consumer */
+	int overflow;
+	/* Set between spsc_ring_begin_batch and spsc_ring_end_batch, and
+	 * whether the batch has something to wake the consumer for */
+	int batching;
+	int batch_pending;
+
+	/* Consumer side: next slot to read and cached producer index */
+	size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	size_t cached_head;
+
+	/* Set by the consumer before it waits for the eventfd */
+	int sleeping __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/* Read only after creation */
+	size_t mask __attribute__((aligned(CACHE_LINE_SIZE)));
+	int efd;
+	void **slots;
+	/* Slots of a ring of items by value, NULL for a ring of pointers */
+	char *items;
+	size_t item_size;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a new ring
+ *
+ * @Param capacity Number of slots, rounded up to a power of two
+ *
+ * @Returns   A newly allocated ring or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct spsc_ring *spsc_ring_create(size_t capacity);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a new ring that carries items by value
+ * Use spsc_ring_push_item and spsc_ring_pop_item on it.
+ *
+ * @Param capacity Number of slots, rounded up to a power of two
+ * @Param item_size Size of an item in bytes
+ *
+ * @Returns   A newly allocated ring or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct spsc_ring *spsc_ring_create_items(size_t capacity, size_t item_size);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Destroy a ring
+ * Items still in the ring are not freed, drain it first.
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_destroy(struct spsc_ring *ring);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Push an item (producer only)
+ * When the ring is full the item is not stored, the drop is counted and
+ * the overflow flag is raised so the consumer can resynchronise.
+ *
+ * @Param ring The ring
+ * @Param item The item to push
+ *
+ * @Returns   0 if successfull, -1 if the ring was full
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_push(struct spsc_ring *ring, void *item);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy an item into a ring of items (producer only)
+ * A full ring drops the item like spsc_ring_push.
+ *
+ * @Param ring The ring
+ * @Param item The item to copy
+ *
+ * @Returns   0 if successfull, -1 if the ring was full
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_push_item(struct spsc_ring *ring, const void *item);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Raise the overflow flag without pushing (producer only)
+ * For items the producer lost before they reached the ring. The consumer
+ * is woken so it sees the flag.
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_raise_overflow(struct spsc_ring *ring);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Start a batch of pushes (producer only)
+ * The consumer is not woken until spsc_ring_end_batch. Only for batches
+ * that end soon, e.g. a recvmmsg batch, a sleeping consumer does not see
+ * the items before that.
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_begin_batch(struct spsc_ring *ring);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  End a batch of pushes and wake the consumer once (producer only)
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_end_batch(struct spsc_ring *ring);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Pop an item (consumer only)
+ *
+ * @Param ring The ring
+ * @Param item Pointer that receives the item
+ *
+ * @Returns   0 if successfull, -1 if the ring was empty
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_pop(struct spsc_ring *ring, void **item);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy the oldest item out of a ring of items (consumer only)
+ *
+ * @Param ring The ring
+ * @Param item Receives the item
+ *
+ * @Returns   0 if successfull, -1 if the ring was empty
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_pop_item(struct spsc_ring *ring, void *item);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Acknowledge the eventfd wakeup (consumer only)
+ * Must be called before draining the ring.
+ *
+ * @Param ring The ring
+ */
+/* ---------------------------------------------------------------------------*/
+void spsc_ring_ack(struct spsc_ring *ring);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Announce that the consumer goes back to sleep (consumer only)
+ *
+ * @Param ring The ring
+ *
+ * @Returns   0 if it is safe to wait for the eventfd, -1 if new items
+ * arrived in the meantime and the ring has to be drained again
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_sleep(struct spsc_ring *ring);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Fetch and clear the overflow flag (consumer only)
+ *
+ * @Param ring The ring
+ *
+ * @Returns   1 if items were dropped or lost since the last call, 0
+ * otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+int spsc_ring_take_overflow(struct spsc_ring *ring);
+
+/**@brief Macro to get the eventfd of the ring
+ */
+#define SPSC_RING_FD(ring) ((ring)->efd)
+
+#endif
@@ -0,0 +1,454 @@
+/**
+ * @file snapshot.c
+ * @Brief  Memory mapped snapshot of the connector registries
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-15
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "registry.h"
+#include "snapshot.h"
+
+/* Mode lists longer than this are rejected when mapping */
+#define MAX_MODES 1024
+
+static const char snapshot_magic[8] = "DRMSNAPS";
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Header of the snapshot file
+ */
+/* ---------------------------------------------------------------------------*/
+struct file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_cards;
+	/* Size of the whole file */
+	uint64_t size;
+	/* FNV-1a over everything after the header */
+	uint64_t hash;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Header of a card, followed by its connectors
+ */
+/* ---------------------------------------------------------------------------*/
+struct card_record {
+	char device_name[64];
+	uint32_t nr_connectors;
+	/* Size of the card including its connectors */
+	uint32_t size;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A connector, followed by its modes
+ */
+/* ---------------------------------------------------------------------------*/
+struct connector_record {
+	uint32_t connector_id;
+	uint32_t connector_type;
+	uint32_t status;
+	uint32_t crtc_id;
+	uint32_t encoder_id;
+	int32_t id;
+	char name[32];
+	struct edid_info edid;
+	int32_t x;
+	int32_t y;
+	uint32_t nr_modes;
+	/* Index of the preferred mode, -1 if there is none */
+	int32_t preferred;
+	/* The mode the output was left in, zeroed if it was off */
+	drmModeModeInfo current;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  FNV-1a hash
+ *
+ * @Param data The data
+ * @Param len Length of the data
+ *
+ * @Returns   The hash value
+ */
+/* ---------------------------------------------------------------------------*/
+static uint64_t hash_bytes(const uint8_t *data, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Size of a connector record including its modes
+ */
+/* ---------------------------------------------------------------------------*/
+static size_t connector_size(uint32_t nr_modes)
+{
+	return sizeof(struct connector_record) +
+	       nr_modes * sizeof(drmModeModeInfo);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check that the records of a card stay within the card
+ *
+ * @Param card The card record
+ * @Param avail Bytes left in the file from the start of the card
+ *
+ * @Returns   0 if the card is consistent, -1 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int check_card(const struct card_record *card, size_t avail)
+{
+	const struct connector_record *rec;
+	size_t off = sizeof(*card);
+	uint32_t i;
+
+	if (avail < sizeof(*card) || card->size > avail ||
+	    card->size < sizeof(*card))
+		return -1;
+	for (i = 0; i < card->nr_connectors; i++) {
+		if (card->size - off < sizeof(*rec)) return -1;
+		rec = (const struct connector_record *)((const uint8_t *)card +
+							off);
+		if (rec->nr_modes > MAX_MODES ||
+		    card->size - off < connector_size(rec->nr_modes) ||
+		    rec->preferred < -1 ||
+		    rec->preferred >= (int32_t)rec->nr_modes ||
+		    rec->status > DRM_MODE_UNKNOWNCONNECTION)
+			return -1;
+		off += connector_size(rec->nr_modes);
+	}
+	return off == card->size ? 0 : -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Map a snapshot file and check it
+ *
+ * @Param path The snapshot file
+ *
+ * @Returns   The mapped snapshot or NULL if the file is missing, damaged
+ * or of another version
+ */
+/* ---------------------------------------------------------------------------*/
+struct snapshot *snapshot_open(const char *path)
+{
+	const struct file_header *hdr;
+	struct snapshot *snap;
+	struct stat st;
+	size_t off;
+	uint32_t i;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_info("No snapshot %s, populating", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		log_warning("Ignoring damaged snapshot %s", path);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_error("Failed to map snapshot %s", path);
+		return NULL;
+	}
+	snap = malloc(sizeof(*snap));
+	if (!snap) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	snap->map = map;
+	snap->size = st.st_size;
+
+	hdr = map;
+	if (memcmp(hdr->magic, snapshot_magic, sizeof(snapshot_magic)) ||
+	    hdr->version != SNAPSHOT_VERSION) {
+		log_warning("Ignoring outdated snapshot %s", path);
+		goto fail;
+	}
+	if (hdr->size != snap->size ||
+	    hash_bytes(snap->map + sizeof(*hdr), snap->size - sizeof(*hdr)) !=
+		hdr->hash)
+		goto damaged;
+	off = sizeof(*hdr);
+	for (i = 0; i < hdr->nr_cards; i++) {
+		if (check_card((const struct card_record *)(snap->map + off),
+			       snap->size - off) < 0)
+			goto damaged;
+		off += ((const struct card_record *)(snap->map + off))->size;
+	}
+	if (off != snap->size) goto damaged;
+	snap->nr_cards = hdr->nr_cards;
+	return snap;
+damaged:
+	log_warning("Ignoring damaged snapshot %s", path);
+fail:
+	snapshot_close(snap);
+	return NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Unmap a snapshot
+ *
+ * @Param snap The snapshot, may be NULL
+ */
+/* ---------------------------------------------------------------------------*/
+void snapshot_close(struct snapshot *snap)
+{
+	if (!snap) return;
+	munmap((void *)snap->map, snap->size);
+	free(snap);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if the card still reports a connector
+ *
+ * @Param res The resources of the card
+ * @Param connector_id The connector id
+ *
+ * @Returns   1 if reported, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int has_connector(drmModeRes *res, uint32_t connector_id)
+{
+	int i;
+
+	for (i = 0; i < res->count_connectors; i++)
+		if (res->connectors[i] == connector_id) return 1;
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Fill in a connector from its record
+ * The modes are interned in the mode pool like after a probe. The EDID
+ * blob id is left 0, blob ids do not survive a reboot, so the next scan
+ * reads the EDID again.
+ *
+ * @Param rec The connector record
+ * @Param obj The new registry entry
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int restore_connector(const struct connector_record *rec,
+			     struct drm_connector_obj *obj)
+{
+	const drmModeModeInfo *modes = (const drmModeModeInfo *)(rec + 1);
+	uint32_t i;
+
+	obj->id = rec->id;
+	obj->status = rec->status;
+	obj->crtc_id = rec->crtc_id;
+	obj->encoder_id = rec->encoder_id;
+	obj->connector_type = rec->connector_type;
+	memcpy(obj->name, rec->name, sizeof(obj->name));
+	obj->name[sizeof(obj->name) - 1] = '\0';
+	obj->edid = rec->edid;
+	obj->edid.vendor[sizeof(obj->edid.vendor) - 1] = '\0';
+	obj->edid.serial[sizeof(obj->edid.serial) - 1] = '\0';
+	obj->edid.name[sizeof(obj->edid.name) - 1] = '\0';
+	obj->x = rec->x;
+	obj->y = rec->y;
+	if (rec->nr_modes) {
+		obj->modes = malloc(rec->nr_modes * sizeof(*obj->modes));
+		if (!obj->modes) return -1;
+	}
+	for (i = 0; i < rec->nr_modes; i++)
+		obj->modes[i] = mode_pool_intern(&modes[i]);
+	obj->nr_of_modes = rec->nr_modes;
+	if (rec->preferred >= 0) {
+		obj->preferred_mode = obj->modes[rec->preferred];
+		mode_pool_ref(obj->preferred_mode);
+	}
+	obj->current_mode = mode_pool_intern(&rec->current);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Rebuild the registry of a card from a snapshot
+ * Connectors the card no longer reports are left out, connectors missing
+ * from the snapshot are added by the next full rescan.
+ *
+ * @Param snap The snapshot
+ * @Param dev The opened DRM device, matched by device name
+ *
+ * @Returns   A new registry or NULL if the card is not in the snapshot
+ */
+/* ---------------------------------------------------------------------------*/
+struct conn_registry *snapshot_restore(const struct snapshot *snap,
+				       struct drm_device *dev)
+{
+	const struct card_record *card = NULL;
+	const struct connector_record *rec;
+	struct conn_registry *reg;
+	struct drm_connector_obj *obj;
+	drmModeRes *res;
+	size_t off = sizeof(struct file_header);
+	uint32_t i;
+
+	for (i = 0; i < snap->nr_cards; i++) {
+		card = (const struct card_record *)(snap->map + off);
+		if (!strncmp(card->device_name, dev->device_name,
+			     sizeof(card->device_name)))
+			break;
+		off += card->size;
+	}
+	if (i == snap->nr_cards) return NULL;
+
+	res = drm_device_get_resources(dev);
+	if (!res) return NULL;
+	reg = registry_create(card->nr_connectors);
+	if (!reg) return NULL;
+	off += sizeof(*card);
+	for (i = 0; i < card->nr_connectors; i++) {
+		rec = (const struct connector_record *)(snap->map + off);
+		off += connector_size(rec->nr_modes);
+		if (!has_connector(res, rec->connector_id)) continue;
+		obj = registry_insert(reg, rec->connector_id);
+		if (!obj || restore_connector(rec, obj) < 0) {
+			registry_destroy(reg);
+			return NULL;
+		}
+	}
+	log_info("%s: restored %d connector(s) from the snapshot",
+		 dev->device_name,
+		 REGISTRY_SIZE(reg));
+	return reg;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write a connector record and its modes
+ *
+ * @Param obj The connector
+ * @Param out Receives the record, zeroed
+ *
+ * @Returns   Number of bytes written
+ */
+/* ---------------------------------------------------------------------------*/
+static size_t save_connector(const struct drm_connector_obj *obj,
+			     uint8_t *out)
+{
+	struct connector_record *rec = (struct connector_record *)out;
+	drmModeModeInfo *modes = (drmModeModeInfo *)(rec + 1);
+	int i;
+
+	rec->connector_id = obj->connector_id;
+	rec->connector_type = obj->connector_type;
+	rec->status = obj->status;
+	rec->crtc_id = obj->crtc_id;
+	rec->encoder_id = obj->encoder_id;
+	rec->id = obj->id;
+	memcpy(rec->name, obj->name, sizeof(rec->name));
+	rec->edid = obj->edid;
+	rec->x = obj->x;
+	rec->y = obj->y;
+	rec->nr_modes = obj->nr_of_modes;
+	rec->preferred = -1;
+	for (i = 0; i < obj->nr_of_modes; i++) {
+		modes[i] = *mode_pool_get(obj->modes[i]);
+		if (obj->modes[i] == obj->preferred_mode && rec->preferred < 0)
+			rec->preferred = i;
+	}
+	if (obj->current_mode != MODE_HANDLE_NONE)
+		rec->current = *mode_pool_get(obj->current_mode);
+	return connector_size(rec->nr_modes);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write the registries of the cards to a snapshot file
+ * The file is written next to the old one and moved over it, a crash
+ * leaves either the old or the new snapshot.
+ *
+ * @Param path The snapshot file
+ * @Param cards The cards, cards without a registry are left out
+ * @Param nr_cards Number of cards
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int snapshot_save(const char *path, struct drm_card *const *cards,
+		  int nr_cards)
+{
+	struct file_header *hdr;
+	struct card_record *card;
+	struct conn_registry *reg;
+	char tmp[256];
+	size_t size = sizeof(*hdr), off, start;
+	uint8_t *map;
+	int i, j, fd, ret = 0;
+
+	for (i = 0; i < nr_cards; i++) {
+		if (!(reg = cards[i]->connectors)) continue;
+		size += sizeof(*card);
+		for (j = 0; j < REGISTRY_SIZE(reg); j++)
+			size += connector_size(REGISTRY_AT(reg, j)->nr_of_modes);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || ftruncate(fd, size) < 0) goto fail;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) goto fail;
+
+	/* The new file reads as zeroes, padding included */
+	hdr = (struct file_header *)map;
+	memcpy(hdr->magic, snapshot_magic, sizeof(hdr->magic));
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->size = size;
+	off = sizeof(*hdr);
+	for (i = 0; i < nr_cards; i++) {
+		if (!(reg = cards[i]->connectors)) continue;
+		start = off;
+		card = (struct card_record *)(map + off);
+		snprintf(card->device_name, sizeof(card->device_name), "%s",
+			 cards[i]->drm->device_name);
+		card->nr_connectors = REGISTRY_SIZE(reg);
+		off += sizeof(*card);
+		for (j = 0; j < REGISTRY_SIZE(reg); j++)
+			off += save_connector(REGISTRY_AT(reg, j), map + off);
+		card->size = off - start;
+		hdr->nr_cards++;
+	}
+	hdr->hash = hash_bytes(map + sizeof(*hdr), size - sizeof(*hdr));
+	if (msync(map, size, MS_SYNC) < 0) ret = -1;
+	munmap(map, size);
+	if (ret == 0 && fsync(fd) < 0) ret = -1;
+	if (close(fd) < 0) ret = -1;
+	fd = -1;
+	if (ret == 0 && rename(tmp, path) == 0) return 0;
+fail:
+	if (fd >= 0) close(fd);
+	log_error("Failed to write snapshot %s", path);
+	unlink(tmp);
+	return -1;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file snapshot.h
+ * @Brief  Memory mapped snapshot of the connector registries
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-15
+ *
+ * The daemon writes the registry of every card, including the mode each
+ * output was left in, to a snapshot file. At the next start the file is
+ * mapped and the registries are rebuilt from it without probing a single
+ * connector, so the state is known and the last layout can be applied
+ * right away. A full rescan afterwards reconciles the registries with the
+ * hardware, only the connectors that differ count as changed.
+ *
+ * The file starts with a versioned header and a checksum over the
+ * records. A file of another version, or one that is truncated or
+ * damaged, is ignored and the cards are populated as usual.
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "card.h"
+
+/* Version of the file format, a file of another version is ignored */
+#define SNAPSHOT_VERSION 1
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Mapped snapshot file
+ */
+/* ---------------------------------------------------------------------------*/
+struct snapshot {
+	const uint8_t *map;
+	size_t size;
+	uint32_t nr_cards;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Map a snapshot file and check it
+ *
+ * @Param path The snapshot file
+ *
+ * @Returns   The mapped snapshot or NULL if the file is missing, damaged
+ * or of another version
+ */
+/* ---------------------------------------------------------------------------*/
+struct snapshot *snapshot_open(const char *path);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Unmap a snapshot
+ *
+ * @Param snap The snapshot, may be NULL
+ */
+/* ---------------------------------------------------------------------------*/
+void snapshot_close(struct snapshot *snap);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Rebuild the registry of a card from a snapshot
+ * Connectors the card no longer reports are left out, connectors missing
+ * from the snapshot are added by the next full rescan.
+ *
+ * @Param snap The snapshot
+ * @Param dev The opened DRM device, matched by device name
+ *
+ * @Returns   A new registry or NULL if the card is not in the snapshot
+ */
+/* ---------------------------------------------------------------------------*/
+struct conn_registry *snapshot_restore(const struct snapshot *snap,
+				       struct drm_device *dev);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write the registries of the cards to a snapshot file
+ * The file is written next to the old one and moved over it, a crash
+ * leaves either the old or the new snapshot.
+ *
+ * @Param path The snapshot file
+ * @Param cards The cards, cards without a registry are left out
+ * @Param nr_cards Number of cards
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int snapshot_save(const char *path, struct drm_card *const *cards,
+		  int nr_cards);
+
+#endif
@@ -0,0 +1,299 @@
+/**
+ * @file state_page.c
+ * @Brief  Publish the connector state in shared memory for clients
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-22
+ */
+
+/* memfd_create, accept4 */
+#define _GNU_SOURCE
+#include "state_page.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "registry.h"
+
+/* Kernels before 5.1 lack it, the page is then only sealed against
+ * resizing */
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+static struct drmstate_page *_page;
+static int _page_fd = -1;
+static int _listen_fd = -1;
+static char _listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create and seal the state page
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int state_page_create()
+{
+	void *map;
+
+	_page_fd = memfd_create("drmdaemon-state",
+				MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (_page_fd < 0) {
+		log_error("Failed to create state page");
+		return -1;
+	}
+	if (ftruncate(_page_fd, sizeof(*_page)) < 0) goto err;
+	map = mmap(NULL, sizeof(*_page), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   _page_fd, 0);
+	if (map == MAP_FAILED) goto err;
+	_page = map;
+	_page->magic = DRMSTATE_MAGIC;
+	_page->version = DRMSTATE_VERSION;
+
+	/* The mapping above stays writable, new ones can only read */
+	if (fcntl(_page_fd, F_ADD_SEALS,
+		  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) < 0) {
+		log_warning("State page is not write sealed");
+		if (fcntl(_page_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) <
+		    0)
+			goto err;
+	}
+	fcntl(_page_fd, F_ADD_SEALS, F_SEAL_SEAL);
+	return 0;
+err:
+	log_error("Failed to set up state page");
+	if (_page) munmap(_page, sizeof(*_page));
+	_page = NULL;
+	close(_page_fd);
+	_page_fd = -1;
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the fd of the state page
+ *
+ * @Returns   The fd, -1 if the page was not created
+ */
+/* ---------------------------------------------------------------------------*/
+int state_page_fd()
+{
+	return _page_fd;
+}
+
+static void copy_mode(struct drmstate_mode *out, mode_handle handle)
+{
+	const drmModeModeInfo *mode;
+
+	memset(out, 0, sizeof(*out));
+	if (handle == MODE_HANDLE_NONE) return;
+	mode = mode_pool_get(handle);
+	out->width = mode->hdisplay;
+	out->height = mode->vdisplay;
+	out->refresh = mode->vrefresh;
+	out->clock = mode->clock;
+	out->flags = mode->flags;
+	snprintf(out->name, sizeof(out->name), "%s", mode->name);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write a connector and its modes to the page
+ *
+ * @Param state The state in the page
+ * @Param minor Minor of the card
+ * @Param obj The connector
+ *
+ * @Returns   0 if successfull, -1 if the page is full
+ */
+/* ---------------------------------------------------------------------------*/
+static int publish_connector(struct drmstate_snapshot *state, int minor,
+			     const struct drm_connector_obj *obj)
+{
+	struct drmstate_connector *out;
+	int i;
+
+	if (state->nr_connectors == DRMSTATE_MAX_CONNECTORS ||
+	    state->nr_modes + obj->nr_of_modes > DRMSTATE_MAX_MODES)
+		return -1;
+	out = &state->connectors[state->nr_connectors++];
+	out->card = minor;
+	out->connector_id = obj->connector_id;
+	out->status = obj->status;
+	out->type = obj->connector_type;
+	out->crtc_id = obj->crtc_id;
+	out->x = obj->x;
+	out->y = obj->y;
+	out->first_mode = state->nr_modes;
+	out->nr_modes = obj->nr_of_modes;
+	out->preferred = -1;
+	for (i = 0; i < obj->nr_of_modes; i++) {
+		copy_mode(&state->modes[state->nr_modes++], obj->modes[i]);
+		if (obj->modes[i] == obj->preferred_mode && out->preferred < 0)
+			out->preferred = i;
+	}
+	/* An output without a CRTC keeps its last mode in the registry */
+	copy_mode(&out->current, obj->crtc_id ? obj->current_mode
+					      : MODE_HANDLE_NONE);
+	snprintf(out->name, sizeof(out->name), "%s", obj->name);
+	memcpy(out->vendor, obj->edid.vendor, sizeof(out->vendor));
+	out->product = obj->edid.product;
+	memcpy(out->serial, obj->edid.serial, sizeof(out->serial));
+	memcpy(out->monitor, obj->edid.name, sizeof(out->monitor));
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write the registries of the cards to the state page
+ * Must not run concurrently with a scan of one of the cards.
+ *
+ * @Param cards The cards, cards without a registry are left out
+ * @Param nr_cards Number of cards
+ */
+/* ---------------------------------------------------------------------------*/
+void state_page_publish(struct drm_card *const *cards, int nr_cards)
+{
+	struct drmstate_snapshot *state;
+	struct conn_registry *reg;
+	uint32_t seq;
+	int i, j;
+
+	if (!_page) return;
+	state = &_page->state;
+	/* Odd: readers that started before retry */
+	seq = _page->seq;
+	__atomic_store_n(&_page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	state->flags = 0;
+	state->nr_connectors = 0;
+	state->nr_modes = 0;
+	for (i = 0; i < nr_cards; i++) {
+		if (!(reg = cards[i]->connectors)) continue;
+		for (j = 0; j < REGISTRY_SIZE(reg); j++) {
+			if (publish_connector(state, cards[i]->drm->minor,
+					      REGISTRY_AT(reg, j)) < 0)
+				state->flags |= DRMSTATE_FLAG_TRUNCATED;
+		}
+	}
+
+	__atomic_store_n(&_page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Send the fd of the page to a new client and close the connection
+ */
+/* ---------------------------------------------------------------------------*/
+static void state_page_accept(struct event_loop *loop, int fd,
+			      uint32_t events, void *data)
+{
+	char buf[CMSG_SPACE(sizeof(int))];
+	uint32_t magic = DRMSTATE_MAGIC;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int client;
+
+	client = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (client < 0) return;
+	memset(&msg, 0, sizeof(msg));
+	memset(buf, 0, sizeof(buf));
+	iov.iov_base = &magic;
+	iov.iov_len = sizeof(magic);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &_page_fd, sizeof(int));
+	if (sendmsg(client, &msg, MSG_NOSIGNAL) < 0)
+		log_warning("Failed to send the state page to a client");
+	close(client);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Hand out the state page on a unix socket
+ * Every connection receives the fd of the page and is closed.
+ *
+ * @Param loop The event loop that accepts the connections
+ * @Param path The socket path, an existing socket is replaced
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int state_page_listen(struct event_loop *loop, const char *path)
+{
+	struct sockaddr_un addr;
+
+	if (_page_fd < 0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("State socket path too long");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (_listen_fd < 0) {
+		log_error("Failed to create state socket");
+		return -1;
+	}
+	unlink(path);
+	if (bind(_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(_listen_fd, 16) < 0) {
+		log_error("Failed to bind state socket %s", path);
+		goto err;
+	}
+	if (event_loop_add_fd(loop, _listen_fd, EPOLLIN, state_page_accept,
+			      NULL) < 0)
+		goto err;
+	strcpy(_listen_path, path);
+	log_ok("Serving connector state on %s", path);
+	return 0;
+err:
+	close(_listen_fd);
+	_listen_fd = -1;
+	return -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Mark the page closed for the clients, remove the socket and
+ * free the page
+ *
+ * @Param loop The event loop passed to state_page_listen
+ */
+/* ---------------------------------------------------------------------------*/
+void state_page_close(struct event_loop *loop)
+{
+	uint32_t seq;
+
+	if (_listen_fd >= 0) {
+		event_loop_del_fd(loop, _listen_fd);
+		close(_listen_fd);
+		unlink(_listen_path);
+		_listen_fd = -1;
+	}
+	if (!_page) return;
+	/* Clients keep their mapping, tell them it went stale */
+	seq = _page->seq;
+	__atomic_store_n(&_page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	_page->state.flags |= DRMSTATE_FLAG_CLOSED;
+	__atomic_store_n(&_page->seq, seq + 2, __ATOMIC_RELEASE);
+	munmap(_page, sizeof(*_page));
+	_page = NULL;
+	close(_page_fd);
+	_page_fd = -1;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file state_page.h
+ * @Brief  Publish the connector state in shared memory for clients
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-05-22
+ *
+ * The state of every connector is written to a page in a memfd after
+ * every scan that changed something. Clients connect to a unix socket,
+ * receive the fd of the page and read it through client/drmstate.h
+ * without ever talking to the daemon again. The page is sealed, clients
+ * can neither resize it nor map it writable.
+ */
+
+#ifndef _STATE_PAGE_H_
+#define _STATE_PAGE_H_
+
+#include "card.h"
+#include "client/drmstate.h"
+#include "event_loop.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create and seal the state page
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int state_page_create();
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the fd of the state page
+ *
+ * @Returns   The fd, -1 if the page was not created
+ */
+/* ---------------------------------------------------------------------------*/
+int state_page_fd();
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write the registries of the cards to the state page
+ * Must not run concurrently with a scan of one of the cards.
+ *
+ * @Param cards The cards, cards without a registry are left out
+ * @Param nr_cards Number of cards
+ */
+/* ---------------------------------------------------------------------------*/
+void state_page_publish(struct drm_card *const *cards, int nr_cards);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Hand out the state page on a unix socket
+ * Every connection receives the fd of the page and is closed.
+ *
+ * @Param loop The event loop that accepts the connections
+ * @Param path The socket path, an existing socket is replaced
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int state_page_listen(struct event_loop *loop, const char *path);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Mark the page closed for the clients, remove the socket and
+ * free the page
+ *
+ * @Param loop The event loop passed to state_page_listen
+ */
+/* ---------------------------------------------------------------------------*/
+void state_page_close(struct event_loop *loop);
+
+#endif
@@ -0,0 +1,97 @@
+#!/bin/sh
+# Runs the daemon against the fake libdrm on a private session bus and
+# checks GetConnectors, SetMode and the ConnectorsChanged signal of a
+# hotplug.
+# Usage: tools/dbus-test.sh [daemon], see make dbus-test
+
+DAEMON=${1:-./drmdaemon-mock}
+NAME=org.drmdaemon.Display1
+OBJECT=/org/drmdaemon/Display1
+# Connector ids of the fake card start at 10000, the third one is free
+HOTPLUG_ID=10002
+
+TMP=$(mktemp -d)
+BUS_PID=
+DAEMON_PID=
+MONITOR_PID=
+
+cleanup() {
+	[ -n "$MONITOR_PID" ] && kill $MONITOR_PID 2>/dev/null
+	[ -n "$DAEMON_PID" ] && kill $DAEMON_PID 2>/dev/null
+	[ -n "$BUS_PID" ] && kill $BUS_PID 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $1"
+	[ -f "$TMP/daemon.log" ] && sed 's/^/  daemon: /' "$TMP/daemon.log"
+	exit 1
+}
+
+# Wait up to 5 s for a command to succeed
+wait_for() {
+	i=0
+	while ! "$@" >/dev/null 2>&1; do
+		i=$((i + 1))
+		[ $i -gt 50 ] && return 1
+		sleep 0.1
+	done
+}
+
+has_owner() {
+	dbus-send --session --print-reply --dest=org.freedesktop.DBus \
+		/org/freedesktop/DBus org.freedesktop.DBus.NameHasOwner \
+		string:$NAME | grep -q "boolean true"
+}
+
+# A FIFO as the card node, epoll refuses /dev/null
+mkfifo "$TMP/card0" || fail "no FIFO"
+
+dbus-daemon --session --fork --print-address=3 --print-pid=4 \
+	3>"$TMP/address" 4>"$TMP/pid" || fail "no dbus-daemon"
+BUS_PID=$(cat "$TMP/pid")
+DBUS_SESSION_BUS_ADDRESS=$(cat "$TMP/address")
+export DBUS_SESSION_BUS_ADDRESS
+
+"$DAEMON" -d "$TMP/card0" -D session >"$TMP/daemon.log" 2>&1 &
+DAEMON_PID=$!
+wait_for has_owner || fail "$NAME was not registered"
+
+dbus-send --session --print-reply --dest=$NAME $OBJECT \
+	$NAME.GetConnectors >"$TMP/connectors" || fail "GetConnectors failed"
+[ "$(grep -c 'string "Status"' "$TMP/connectors")" -eq 4 ] ||
+	fail "GetConnectors did not return 4 connectors"
+grep -q 'string "connected"' "$TMP/connectors" ||
+	fail "GetConnectors has no connected output"
+echo "ok GetConnectors"
+
+# Off and on again, the page flip events arrive on the card fd
+set_mode() {
+	dbus-send --session --print-reply --dest=$NAME $OBJECT \
+		$NAME.SetMode uint32:0 uint32:10001 \
+		uint16:$1 uint16:$2 uint32:$3 >/dev/null
+}
+set_mode 0 0 0 || fail "SetMode off failed"
+set_mode 3840 2160 60 || fail "SetMode 3840x2160 failed"
+grep -q "did not complete" "$TMP/daemon.log" &&
+	fail "SetMode completions were not handled"
+echo "ok SetMode"
+
+dbus-monitor --session \
+	"type='signal',interface='$NAME',member='ConnectorsChanged'" \
+	>"$TMP/signals" 2>&1 &
+MONITOR_PID=$!
+wait_for grep -q signal "$TMP/signals"
+kill -USR2 $DAEMON_PID
+kill -HUP $DAEMON_PID
+wait_for grep -q "member=ConnectorsChanged" "$TMP/signals" ||
+	fail "no ConnectorsChanged after a hotplug"
+wait_for grep -q "uint32 $HOTPLUG_ID" "$TMP/signals" ||
+	fail "ConnectorsChanged misses connector $HOTPLUG_ID"
+echo "ok ConnectorsChanged"
+
+kill -TERM $DAEMON_PID
+wait $DAEMON_PID || fail "the daemon did not exit cleanly"
+DAEMON_PID=
+echo "dbus-test passed"
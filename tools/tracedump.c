@@ -0,0 +1,141 @@
+/**
+ * @file tracedump.c
+ * @Brief  Decode a drmdaemon trace file into readable text
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-03-20
+ *
+ * Usage: tracedump <tracefile>
+ * Records are printed oldest first, torn or never written records are
+ * skipped.
+ */
+
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *const connection_names[] = {
+    "none", "connected", "disconnected", "unknown",
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Print the event specific arguments of a record
+ *
+ * @Param rec The record
+ */
+/* ---------------------------------------------------------------------------*/
+static void print_args(struct trace_record *rec)
+{
+	switch (rec->event) {
+	case TRACE_UEVENT: printf("probe=%u", rec->args[0]); break;
+	case TRACE_UEVENT_OVERFLOW: printf("dropped=%u", rec->args[0]); break;
+	case TRACE_RESCAN_START:
+		printf("pending=%u full=%u", rec->args[0], rec->args[1]);
+		break;
+	case TRACE_RESCAN_END: printf("duration=%uus", rec->args[0]); break;
+	case TRACE_CONNECTOR_ADDED:
+	case TRACE_CONNECTOR_STATUS:
+		printf("%s",
+		       rec->args[0] < 4 ? connection_names[rec->args[0]] : "?");
+		break;
+	case TRACE_CONNECTOR_CRTC: printf("crtc=%u", rec->args[0]); break;
+	case TRACE_CONNECTOR_MODES: printf("modes=%u", rec->args[0]); break;
+	case TRACE_CONNECTOR_MODE:
+		printf("%ux%u@%u", rec->args[0], rec->args[1], rec->args[2]);
+		break;
+	case TRACE_APPLY:
+		printf("outputs=%u %s %s",
+		       rec->args[0],
+		       rec->args[1] ? "atomic" : "legacy",
+		       rec->args[2] ? strerror(rec->args[2]) : "ok");
+		break;
+	default:
+		printf("%u %u %u", rec->args[0], rec->args[1], rec->args[2]);
+		break;
+	}
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Print a single record
+ *
+ * @Param rec The record
+ */
+/* ---------------------------------------------------------------------------*/
+static void print_record(struct trace_record *rec)
+{
+	printf("[%5llu.%06llu] card%u ",
+	       (unsigned long long)(rec->timestamp / 1000000000ULL),
+	       (unsigned long long)(rec->timestamp % 1000000000ULL) / 1000,
+	       rec->card);
+	if (rec->connector_id)
+		printf("conn %-4u ", rec->connector_id);
+	else
+		printf("          ");
+	if (rec->event < TRACE_EVENT_COUNT)
+		printf("%-18s ", trace_event_names[rec->event]);
+	else
+		printf("event-%-12u ", rec->event);
+	print_args(rec);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_header *hdr;
+	struct trace_record *rec;
+	struct stat st;
+	uint64_t pos, head, skipped = 0;
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <tracefile>\n", argv[0]);
+		return 1;
+	}
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (st.st_size < TRACE_HEADER_SIZE) {
+		fprintf(stderr, "%s: not a trace file\n", argv[1]);
+		return 1;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION ||
+	    hdr->record_size != sizeof(struct trace_record) ||
+	    TRACE_HEADER_SIZE + (uint64_t)hdr->nr_records * hdr->record_size >
+		st.st_size) {
+		fprintf(stderr, "%s: not a trace file or unknown version\n",
+			argv[1]);
+		return 1;
+	}
+
+	head = hdr->head;
+	pos = head > hdr->nr_records ? head - hdr->nr_records : 0;
+	for (; pos < head; pos++) {
+		rec = &TRACE_RECORDS(hdr)[pos % hdr->nr_records];
+		if (rec->seq != (uint32_t)(pos + 1)) {
+			skipped++;
+			continue;
+		}
+		print_record(rec);
+	}
+	fprintf(stderr,
+		"%llu record(s) written in total, %llu skipped\n",
+		(unsigned long long)head,
+		(unsigned long long)skipped);
+	munmap(hdr, st.st_size);
+	close(fd);
+	return 0;
+}
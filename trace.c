@@ -0,0 +1,158 @@
+/**
+ * @file trace.c
+ * @Brief  Compact binary trace in a memory-mapped circular file
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-03-20
+ */
+
+#include "trace.h"
+#include "debug.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct trace_header *_trace;
+static size_t _trace_size;
+static uint32_t _trace_mask;
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check if an existing trace file can be continued
+ *
+ * @Param hdr The mapped header
+ * @Param nr_records The requested number of records
+ *
+ * @Returns   1 if the header matches, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int trace_header_valid(struct trace_header *hdr, uint32_t nr_records)
+{
+	return hdr->magic == TRACE_MAGIC && hdr->version == TRACE_VERSION &&
+	       hdr->record_size == sizeof(struct trace_record) &&
+	       hdr->nr_records == nr_records;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open or create the trace file
+ * An existing trace with the same geometry is continued, otherwise the
+ * file is reinitialised.
+ *
+ * @Param filename The trace file
+ * @Param nr_records Number of records, rounded up to a power of two, at
+ * most TRACE_MAX_RECORDS
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int trace_open(const char *filename, uint32_t nr_records)
+{
+	struct trace_header *hdr;
+	struct stat st;
+	uint32_t size = 1;
+	int fd;
+
+	if (nr_records > TRACE_MAX_RECORDS) {
+		log_error("A trace takes at most %d records", TRACE_MAX_RECORDS);
+		return -1;
+	}
+	if (_trace) trace_close();
+	while (size < nr_records) size <<= 1;
+	_trace_size = TRACE_HEADER_SIZE + (size_t)size *
+						  sizeof(struct trace_record);
+
+	fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_error("Failed to open trace file %s", filename);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || (st.st_size != _trace_size &&
+				   ftruncate(fd, _trace_size) < 0)) {
+		log_error("Failed to size trace file %s", filename);
+		close(fd);
+		return -1;
+	}
+	hdr = mmap(NULL, _trace_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		   0);
+	/* The mapping keeps the file referenced */
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		log_error("Failed to map trace file %s", filename);
+		return -1;
+	}
+
+	if (st.st_size != _trace_size || !trace_header_valid(hdr, size)) {
+		memset(hdr, 0, _trace_size);
+		hdr->magic = TRACE_MAGIC;
+		hdr->version = TRACE_VERSION;
+		hdr->record_size = sizeof(struct trace_record);
+		hdr->nr_records = size;
+		log_info("Created trace %s with %u records", filename, size);
+	} else {
+		log_info("Continuing trace %s at record %llu",
+			 filename,
+			 (unsigned long long)hdr->head);
+	}
+	_trace_mask = size - 1;
+	__atomic_store_n(&_trace, hdr, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write out and unmap the trace file
+ */
+/* ---------------------------------------------------------------------------*/
+void trace_close()
+{
+	struct trace_header *hdr = _trace;
+
+	if (!hdr) return;
+	_trace = NULL;
+	msync(hdr, _trace_size, MS_SYNC);
+	munmap(hdr, _trace_size);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Append a record, safe to call from any thread
+ * Use the trace() macro, it skips the call when tracing is disabled.
+ *
+ * @Param event The event id
+ * @Param card The card minor number
+ * @Param connector_id The connector id, 0 if not connector specific
+ * @Param a0 Event specific argument
+ * @Param a1 Event specific argument
+ * @Param a2 Event specific argument
+ */
+/* ---------------------------------------------------------------------------*/
+void trace_record(uint16_t event, uint16_t card, uint32_t connector_id,
+		  uint32_t a0, uint32_t a1, uint32_t a2)
+{
+	struct trace_header *hdr = _trace;
+	struct trace_record *rec;
+	struct timespec ts;
+	uint64_t pos;
+
+	if (!hdr) return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pos = __atomic_fetch_add(&hdr->head, 1, __ATOMIC_RELAXED);
+	rec = &TRACE_RECORDS(hdr)[pos & _trace_mask];
+
+	/* Invalidate first, a crash halfway leaves a record the decoder
+	 * skips */
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec->timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->event = event;
+	rec->card = card;
+	rec->connector_id = connector_id;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	__atomic_store_n(&rec->seq, (uint32_t)(pos + 1), __ATOMIC_RELEASE);
+}
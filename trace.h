@@ -0,0 +1,175 @@
+/**
+ * @file trace.h
+ * @Brief  Compact binary trace in a memory-mapped circular file
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-03-20
+ *
+ * Every record has a fixed size, the file wraps around once all records
+ * are used so its size never grows. The records live in a shared mapping,
+ * what was written before a crash is still in the page cache and ends up
+ * in the file. tools/tracedump.c turns a trace file back into text.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x544d5244 /* "DRMT" in file byte order */
+#define TRACE_VERSION 1
+/* 2 MiB of records */
+#define TRACE_DEFAULT_RECORDS 65536
+/* 512 MiB of records */
+#define TRACE_MAX_RECORDS (1 << 24)
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Traced events, stored as a 16 bit id
+ * Append new events at the end, the ids are part of the file format.
+ */
+/* ---------------------------------------------------------------------------*/
+enum trace_event {
+	TRACE_NONE,
+	/* arg0: 1 if the connector needs a probe, connector 0 for a
+	 * full rescan */
+	TRACE_UEVENT,
+	/* arg0: dropped uevents */
+	TRACE_UEVENT_OVERFLOW,
+	/* arg0: pending connectors, arg1: 1 for a full rescan */
+	TRACE_RESCAN_START,
+	/* arg0: duration in us */
+	TRACE_RESCAN_END,
+	/* arg0: connector status */
+	TRACE_CONNECTOR_ADDED,
+	TRACE_CONNECTOR_REMOVED,
+	/* arg0: connector status */
+	TRACE_CONNECTOR_STATUS,
+	/* arg0: crtc id */
+	TRACE_CONNECTOR_CRTC,
+	/* arg0: number of modes */
+	TRACE_CONNECTOR_MODES,
+	/* arg0: hdisplay, arg1: vdisplay, arg2: vrefresh */
+	TRACE_CONNECTOR_MODE,
+	/* arg0: number of outputs, arg1: 1 for atomic, arg2: 0 if applied,
+	 * the errno otherwise */
+	TRACE_APPLY,
+	/* The CRTCs of the last atomic commit completed */
+	TRACE_APPLY_DONE,
+	TRACE_EVENT_COUNT,
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Lookup table for trace event names
+ */
+/* ---------------------------------------------------------------------------*/
+static const char *const trace_event_names[] = {
+    "none",
+    "uevent",
+    "uevent-overflow",
+    "rescan-start",
+    "rescan-end",
+    "connector-added",
+    "connector-removed",
+    "connector-status",
+    "connector-crtc",
+    "connector-modes",
+    "connector-mode",
+    "apply",
+    "apply-done",
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  One trace record, 32 bytes
+ */
+/* ---------------------------------------------------------------------------*/
+struct trace_record {
+	/* CLOCK_MONOTONIC in ns */
+	uint64_t timestamp;
+	/* Low 32 bits of the record position + 1, written last. A record
+	 * whose seq does not match its position is torn or stale */
+	uint32_t seq;
+	uint16_t event;
+	/* Card minor number */
+	uint16_t card;
+	uint32_t connector_id;
+	uint32_t args[3];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  File header, followed by nr_records records
+ */
+/* ---------------------------------------------------------------------------*/
+struct trace_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t nr_records;
+	uint32_t reserved;
+	/* Total number of records ever claimed, the next one goes to
+	 * head % nr_records */
+	uint64_t head;
+};
+
+/* Records start at this offset of the file */
+#define TRACE_HEADER_SIZE 64
+#define TRACE_RECORDS(hdr)                                                     \
+	((struct trace_record *)((char *)(hdr) + TRACE_HEADER_SIZE))
+
+/**< The active trace, NULL if tracing is disabled */
+extern struct trace_header *_trace;
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Record an event if tracing is enabled
+ * Only a pointer check when tracing is disabled.
+ */
+/* ---------------------------------------------------------------------------*/
+#define trace(event, card, connector, a0, a1, a2)                              \
+	do {                                                                   \
+		if (_trace)                                                    \
+			trace_record(event, card, connector, a0, a1, a2);      \
+	} while (0)
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open or create the trace file
+ * An existing trace with the same geometry is continued, otherwise the
+ * file is reinitialised.
+ *
+ * @Param filename The trace file
+ * @Param nr_records Number of records, rounded up to a power of two, at
+ * most TRACE_MAX_RECORDS
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int trace_open(const char *filename, uint32_t nr_records);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Write out and unmap the trace file
+ */
+/* ---------------------------------------------------------------------------*/
+void trace_close();
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Append a record, safe to call from any thread
+ * Use the trace() macro, it skips the call when tracing is disabled.
+ *
+ * @Param event The event id
+ * @Param card The card minor number
+ * @Param connector_id The connector id, 0 if not connector specific
+ * @Param a0 Event specific argument
+ * @Param a1 Event specific argument
+ * @Param a2 Event specific argument
+ */
+/* ---------------------------------------------------------------------------*/
+void trace_record(uint16_t event, uint16_t card, uint32_t connector_id,
+		  uint32_t a0, uint32_t a1, uint32_t a2);
+
+#endif
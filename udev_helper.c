@@ -14,30 +14,113 @@
  *
  * @Param udev Pointer to the udev instance
  * @Param subsystem name of the subsystem we want to monitor
+ * @Param rcvbuf Size of the socket receive buffer in bytes, 0 for the
+ * libudev default
  *
  * @Returns   A newly created monitor or NULL if it has failed
  */
 /* ---------------------------------------------------------------------------*/
-struct udev_monitor *setup_udev_monitor(struct udev *udev, char *subsystem)
+struct udev_monitor *setup_udev_monitor(struct udev *udev, char *subsystem,
+					int rcvbuf)
 {
 	struct udev_monitor *mon = NULL;
 	mon = udev_monitor_new_from_netlink(udev, "udev");
 	if (!mon) {
-		logger_log(LOG_LVL_ERROR, "Failed to create monitor");
+		log_error("Failed to create monitor");
 		return NULL;
 	}
 	if (udev_monitor_filter_add_match_subsystem_devtype(
 		mon, subsystem, NULL) < 0) {
-		logger_log(LOG_LVL_ERROR, "Failed to setup filter");
+		log_error("Failed to setup filter");
 		return NULL;
 	}
+	if (rcvbuf > 0 && udev_monitor_set_receive_buffer_size(mon, rcvbuf) < 0)
+		log_warning("Failed to set the monitor receive buffer to %d",
+			    rcvbuf);
 	if (udev_monitor_filter_update(mon) < 0) {
-		logger_log(LOG_LVL_ERROR, "Unable to update monitor");
+		log_error("Unable to update monitor");
 		return NULL;
 	}
 	if (udev_monitor_enable_receiving(mon) < 0) {
-		logger_log(LOG_LVL_ERROR, "Unable to enable receiving");
+		log_error("Unable to enable receiving");
 		return NULL;
 	}
 	return mon;
 }
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Enumerate the DRM cards (primary nodes) known to udev
+ *
+ * @Param udev Pointer to the udev instance
+ * @Param devnodes Array that receives the device nodes, e.g. /dev/dri/card0
+ * @Param max Number of entries in devnodes
+ *
+ * @Returns   The number of cards found, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int enumerate_drm_cards(struct udev *udev, char devnodes[][DEVNODE_LEN],
+			int max)
+{
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *entry;
+	struct udev_device *dev;
+	const char *devnode;
+	int count = 0;
+
+	enumerate = udev_enumerate_new(udev);
+	if (!enumerate) {
+		log_error("Failed to create enumerator");
+		return -1;
+	}
+	udev_enumerate_add_match_subsystem(enumerate, "drm");
+	udev_enumerate_add_match_sysname(enumerate, "card[0-9]*");
+	if (udev_enumerate_scan_devices(enumerate) < 0) {
+		log_error("Failed to scan drm devices");
+		udev_enumerate_unref(enumerate);
+		return -1;
+	}
+	udev_list_entry_foreach(entry,
+				udev_enumerate_get_list_entry(enumerate))
+	{
+		if (count == max) break;
+		dev = udev_device_new_from_syspath(
+		    udev, udev_list_entry_get_name(entry));
+		if (!dev) continue;
+		/* Connectors (card0-DP-1) match the sysname but have no node */
+		devnode = udev_device_get_devnode(dev);
+		if (devnode) {
+			snprintf(devnodes[count], DEVNODE_LEN, "%s", devnode);
+			count++;
+		}
+		udev_device_unref(dev);
+	}
+	udev_enumerate_unref(enumerate);
+	return count;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy the fields the daemon acts on out of a udev device
+ *
+ * @Param dev The received udev device
+ * @Param ev The uevent to fill in, received_us is left untouched
+ */
+/* ---------------------------------------------------------------------------*/
+void uevent_from_udev(struct udev_device *dev, struct uevent *ev)
+{
+	const char *val;
+
+	ev->seqnum = udev_device_get_seqnum(dev);
+	val = udev_device_get_action(dev);
+	snprintf(ev->action, sizeof(ev->action), "%s", val ? val : "");
+	val = udev_device_get_devnode(dev);
+	snprintf(ev->devnode, sizeof(ev->devnode), "%s", val ? val : "");
+	val = udev_device_get_property_value(dev, "HOTPLUG");
+	ev->hotplug = val ? atoi(val) : 0;
+	val = udev_device_get_property_value(dev, "CONNECTOR");
+	ev->connector_id = val ? strtoul(val, NULL, 10) : 0;
+	val = udev_device_get_property_value(dev, "PROPERTY");
+	ev->property_id = val ? strtoul(val, NULL, 10) : 0;
+	ev->replay_idx = 0;
+}
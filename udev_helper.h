@@ -6,12 +6,16 @@
  * @date 2017-01-18
  */
 
+#ifndef _UDEV_HELPER_H_
+#define _UDEV_HELPER_H_
+
 #include <stdio.h>
 #include <libudev.h>
 #include <sys/select.h>
 #include <stdlib.h>
 
 #include "debug.h"
+#include "uevent.h"
 
 
 /* ---------------------------------------------------------------------------*/
@@ -20,8 +24,37 @@
  *
  * @Param udev Pointer to the udev instance
  * @Param subsystem name of the subsystem we want to monitor
+ * @Param rcvbuf Size of the socket receive buffer in bytes, 0 for the
+ * libudev default
  *
  * @Returns   A newly created monitor or NULL if it has failed
  */
 /* ---------------------------------------------------------------------------*/
-struct udev_monitor *setup_udev_monitor(struct udev *udev, char *subsystem);
+struct udev_monitor *setup_udev_monitor(struct udev *udev, char *subsystem,
+					int rcvbuf);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Enumerate the DRM cards (primary nodes) known to udev
+ *
+ * @Param udev Pointer to the udev instance
+ * @Param devnodes Array that receives the device nodes, e.g. /dev/dri/card0
+ * @Param max Number of entries in devnodes
+ *
+ * @Returns   The number of cards found, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int enumerate_drm_cards(struct udev *udev, char devnodes[][DEVNODE_LEN],
+			int max);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Copy the fields the daemon acts on out of a udev device
+ *
+ * @Param dev The received udev device
+ * @Param ev The uevent to fill in, received_us is left untouched
+ */
+/* ---------------------------------------------------------------------------*/
+void uevent_from_udev(struct udev_device *dev, struct uevent *ev);
+
+#endif
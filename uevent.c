@@ -0,0 +1,105 @@
+/**
+ * @file uevent.c
+ * @Brief  Plain copy of the DRM uevent fields the daemon acts on
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-10
+ */
+
+#include "uevent.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Append a uevent to a recording
+ *
+ * @Param fp The recording
+ * @Param ev The uevent
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int uevent_write(FILE *fp, const struct uevent *ev)
+{
+	int len;
+
+	len = fprintf(fp,
+		      "T=%llu SEQNUM=%llu ACTION=%s DEVNAME=%s HOTPLUG=%d",
+		      (unsigned long long)ev->received_us,
+		      (unsigned long long)ev->seqnum,
+		      ev->action,
+		      ev->devnode,
+		      ev->hotplug);
+	if (ev->connector_id) fprintf(fp, " CONNECTOR=%u", ev->connector_id);
+	if (ev->property_id) fprintf(fp, " PROPERTY=%u", ev->property_id);
+	/* Uevents are rare, flush so a crash keeps the recording */
+	if (fputc('\n', fp) == EOF || fflush(fp) == EOF || len < 0) return -1;
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse a recorded uevent line, unknown keys are ignored
+ *
+ * @Param line The line
+ * @Param ev The parsed uevent
+ *
+ * @Returns   0 if successfull, -1 if the line holds no uevent
+ */
+/* ---------------------------------------------------------------------------*/
+int uevent_parse(const char *line, struct uevent *ev)
+{
+	char buf[UEVENT_LINE_LEN], *key, *val, *save = NULL;
+	int has_time = 0;
+
+	memset(ev, 0, sizeof(*ev));
+	snprintf(buf, sizeof(buf), "%s", line);
+	for (key = strtok_r(buf, " \t\n", &save); key;
+	     key = strtok_r(NULL, " \t\n", &save)) {
+		/* Comments run until the end of the line */
+		if (key[0] == '#') break;
+		val = strchr(key, '=');
+		if (!val) continue;
+		*val++ = '\0';
+		if (!strcmp(key, "T")) {
+			ev->received_us = strtoull(val, NULL, 10);
+			has_time = 1;
+		} else if (!strcmp(key, "SEQNUM")) {
+			ev->seqnum = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "ACTION")) {
+			snprintf(ev->action, sizeof(ev->action), "%s", val);
+		} else if (!strcmp(key, "DEVNAME")) {
+			snprintf(ev->devnode, sizeof(ev->devnode), "%s", val);
+		} else if (!strcmp(key, "HOTPLUG")) {
+			ev->hotplug = atoi(val);
+		} else if (!strcmp(key, "CONNECTOR")) {
+			ev->connector_id = strtoul(val, NULL, 10);
+		} else if (!strcmp(key, "PROPERTY")) {
+			ev->property_id = strtoul(val, NULL, 10);
+		}
+	}
+	return has_time && ev->devnode[0] ? 0 : -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the last SEQNUM the kernel handed out
+ * Every uevent with a SEQNUM up to this value was emitted before the
+ * call, so a scan that starts afterwards sees its change.
+ *
+ * @Returns   The SEQNUM, 0 if it could not be read
+ */
+/* ---------------------------------------------------------------------------*/
+uint64_t uevent_kernel_seqnum()
+{
+	unsigned long long seqnum = 0;
+	FILE *fp;
+
+	fp = fopen(UEVENT_SEQNUM_PATH, "r");
+	if (!fp) return 0;
+	if (fscanf(fp, "%llu", &seqnum) != 1) seqnum = 0;
+	fclose(fp);
+	return seqnum;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file uevent.h
+ * @Brief  Plain copy of the DRM uevent fields the daemon acts on
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-10
+ *
+ * Uevents are copied out of the udev_device as soon as they are received,
+ * so they can be queued, recorded to a file and replayed without libudev.
+ * A recorded uevent is one line of KEY=VALUE pairs:
+ * T=1234567 SEQNUM=2071 ACTION=change DEVNAME=/dev/dri/card0 HOTPLUG=1
+ * CONNECTOR=77 PROPERTY=5
+ */
+
+#ifndef _UEVENT_H_
+#define _UEVENT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Maximum length of a device node path */
+#define DEVNODE_LEN 64
+/* Maximum length of a recorded uevent line */
+#define UEVENT_LINE_LEN 256
+
+/* Last SEQNUM the kernel handed out */
+#define UEVENT_SEQNUM_PATH "/sys/kernel/uevent_seqnum"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A received DRM uevent
+ */
+/* ---------------------------------------------------------------------------*/
+struct uevent {
+	/* Monotonic time in us the uevent was read from the monitor */
+	uint64_t received_us;
+	uint64_t seqnum;
+	char action[16];
+	char devnode[DEVNODE_LEN];
+	int hotplug;
+	/* Values of the CONNECTOR and PROPERTY keys, 0 if absent */
+	uint32_t connector_id;
+	uint32_t property_id;
+	/* Position + 1 in a replayed recording, 0 for live uevents */
+	uint32_t replay_idx;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Append a uevent to a recording
+ *
+ * @Param fp The recording
+ * @Param ev The uevent
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int uevent_write(FILE *fp, const struct uevent *ev);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse a recorded uevent line, unknown keys are ignored
+ *
+ * @Param line The line
+ * @Param ev The parsed uevent
+ *
+ * @Returns   0 if successfull, -1 if the line holds no uevent
+ */
+/* ---------------------------------------------------------------------------*/
+int uevent_parse(const char *line, struct uevent *ev);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the last SEQNUM the kernel handed out
+ * Every uevent with a SEQNUM up to this value was emitted before the
+ * call, so a scan that starts afterwards sees its change.
+ *
+ * @Returns   The SEQNUM, 0 if it could not be read
+ */
+/* ---------------------------------------------------------------------------*/
+uint64_t uevent_kernel_seqnum();
+
+#endif
@@ -0,0 +1,387 @@
+/**
+ * @file uevent_netlink.c
+ * @Brief  Uevent receiver reading the udev netlink group directly
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-18
+ */
+
+#define _GNU_SOURCE
+#include "uevent_netlink.h"
+#include "debug.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Netlink group udevd forwards processed uevents to, 1 is the raw kernel
+ * group which udevd may not have handled yet */
+#define UDEV_MONITOR_UDEV 2
+
+/* Size of a single message buffer, the same as libudev */
+#define UEVENT_NETLINK_BUF_SIZE 8192
+
+/* Magic of the libudev message header, in network byte order on the wire */
+#define UDEV_MONITOR_MAGIC 0xfeedcafe
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Header udevd puts in front of the properties, see libudev-monitor.c
+ */
+/* ---------------------------------------------------------------------------*/
+struct udev_monitor_netlink_header {
+	char prefix[8];
+	uint32_t magic;
+	uint32_t header_size;
+	uint32_t properties_off;
+	uint32_t properties_len;
+	uint32_t filter_subsystem_hash;
+	uint32_t filter_devtype_hash;
+	uint32_t filter_tag_bloom_hi;
+	uint32_t filter_tag_bloom_lo;
+};
+
+struct uevent_netlink {
+	int fd;
+	char subsystem[32];
+	/* recvmmsg state, set up once in uevent_netlink_open */
+	struct mmsghdr msgs[UEVENT_NETLINK_BATCH];
+	struct iovec iov[UEVENT_NETLINK_BATCH];
+	struct sockaddr_nl addrs[UEVENT_NETLINK_BATCH];
+	char cmsgs[UEVENT_NETLINK_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+	char bufs[UEVENT_NETLINK_BATCH][UEVENT_NETLINK_BUF_SIZE];
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  MurmurHash2 with seed 0, the hash libudev puts in the header
+ *
+ * @Param str The string to hash
+ *
+ * @Returns   The hash
+ */
+/* ---------------------------------------------------------------------------*/
+static uint32_t string_hash32(const char *str)
+{
+	const uint32_t m = 0x5bd1e995;
+	const unsigned char *data = (const unsigned char *)str;
+	int len = strlen(str);
+	uint32_t h = len, k;
+
+	while (len >= 4) {
+		memcpy(&k, data, sizeof(k));
+		k *= m;
+		k ^= k >> 24;
+		k *= m;
+		h *= m;
+		h ^= k;
+		data += 4;
+		len -= 4;
+	}
+	switch (len) {
+	case 3: h ^= data[2] << 16;
+	case 2: h ^= data[1] << 8;
+	case 1:
+		h ^= data[0];
+		h *= m;
+	}
+	h ^= h >> 13;
+	h *= m;
+	h ^= h >> 15;
+	return h;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Attach a filter that only passes udev messages of one subsystem
+ * The kernel drops everything else before it is queued on the socket.
+ * Absolute loads in classic BPF read in network byte order, the same as
+ * udevd writes the magic and the hash.
+ *
+ * @Param fd The netlink socket
+ * @Param hash Hash of the subsystem
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int attach_filter(int fd, uint32_t hash)
+{
+	struct sock_filter code[] = {
+		/* Drop anything without the libudev magic */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			 offsetof(struct udev_monitor_netlink_header, magic)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, UDEV_MONITOR_MAGIC, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		/* Pass the whole message if the subsystem hash matches */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			 offsetof(struct udev_monitor_netlink_header,
+				  filter_subsystem_hash)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, hash, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+	    .len = sizeof(code) / sizeof(code[0]), .filter = code,
+	};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+			  sizeof(prog));
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Set the socket receive buffer
+ * SO_RCVBUFFORCE goes past net.core.rmem_max but needs CAP_NET_ADMIN.
+ *
+ * @Param fd The socket
+ * @Param size The size in bytes
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+static int set_rcvbuf(int fd, int size)
+{
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == 0)
+		return 0;
+	return setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open the udev netlink group filtered on a subsystem
+ *
+ * @Param subsystem The subsystem, e.g. "drm"
+ * @Param rcvbuf Size of the socket receive buffer in bytes, 0 for the
+ * system default
+ *
+ * @Returns   The receiver or NULL if failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct uevent_netlink *uevent_netlink_open(const char *subsystem, int rcvbuf)
+{
+	struct uevent_netlink *nl;
+	struct sockaddr_nl addr;
+	int on = 1, i;
+
+	nl = calloc(1, sizeof(*nl));
+	if (!nl) return NULL;
+	snprintf(nl->subsystem, sizeof(nl->subsystem), "%s", subsystem);
+	nl->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (nl->fd < 0) {
+		log_error("Failed to create uevent netlink socket");
+		goto err;
+	}
+	if (attach_filter(nl->fd, string_hash32(subsystem)) < 0) {
+		log_error("Failed to attach uevent filter");
+		goto err;
+	}
+	/* Credentials tell udevd apart from unprivileged senders */
+	if (setsockopt(nl->fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+		log_error("Failed to enable credentials on uevent socket");
+		goto err;
+	}
+	if (rcvbuf > 0 && set_rcvbuf(nl->fd, rcvbuf) < 0)
+		log_warning("Failed to set the uevent receive buffer to %d",
+			    rcvbuf);
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = UDEV_MONITOR_UDEV;
+	if (bind(nl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		log_error("Failed to bind uevent netlink socket");
+		goto err;
+	}
+
+	for (i = 0; i < UEVENT_NETLINK_BATCH; i++) {
+		nl->iov[i].iov_base = nl->bufs[i];
+		nl->iov[i].iov_len = sizeof(nl->bufs[i]);
+	}
+	return nl;
+err:
+	uevent_netlink_close(nl);
+	return NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the socket to poll
+ *
+ * @Param nl The receiver
+ *
+ * @Returns   The file descriptor
+ */
+/* ---------------------------------------------------------------------------*/
+int uevent_netlink_fd(const struct uevent_netlink *nl)
+{
+	return nl->fd;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Check that a message was multicast by a root process
+ *
+ * @Param msg The received message
+ *
+ * @Returns   1 if trusted, 0 otherwise
+ */
+/* ---------------------------------------------------------------------------*/
+static int trusted_sender(struct msghdr *msg)
+{
+	struct sockaddr_nl *addr = msg->msg_name;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	struct ucred *cred;
+
+	if (addr->nl_groups != UDEV_MONITOR_UDEV || addr->nl_pid == 0)
+		return 0;
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_CREDENTIALS)
+		return 0;
+	cred = (struct ucred *)CMSG_DATA(cmsg);
+	return cred->uid == 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Parse the properties of a udev message
+ * Only the keys the daemon acts on are copied, nothing is allocated.
+ *
+ * @Param nl The receiver
+ * @Param buf The message
+ * @Param len Length of the message
+ * @Param ev The parsed uevent
+ *
+ * @Returns   0 if successfull, -1 if the message is not a uevent of the
+ * subsystem
+ */
+/* ---------------------------------------------------------------------------*/
+static int parse_message(struct uevent_netlink *nl, const char *buf,
+			 size_t len, struct uevent *ev)
+{
+	const struct udev_monitor_netlink_header *hdr = (const void *)buf;
+	const char *key, *val, *end;
+	uint32_t off, plen;
+	int subsystem_ok = 0;
+
+	if (len < sizeof(*hdr) || memcmp(hdr->prefix, "libudev", 8) ||
+	    ntohl(hdr->magic) != UDEV_MONITOR_MAGIC)
+		return -1;
+	off = hdr->properties_off;
+	plen = hdr->properties_len;
+	if (off < sizeof(*hdr) || off > len || plen > len - off) return -1;
+	/* The properties are nul terminated strings, so the str functions
+	 * below stay inside the message */
+	end = buf + off + plen;
+	if (plen == 0 || end[-1] != '\0') return -1;
+
+	memset(ev, 0, sizeof(*ev));
+	for (key = buf + off; key < end; key += strlen(key) + 1) {
+		val = strchr(key, '=');
+		if (!val) continue;
+		val++;
+		switch (key[0]) {
+		case 'A':
+			if (!strncmp(key, "ACTION=", 7))
+				snprintf(ev->action, sizeof(ev->action), "%s",
+					 val);
+			break;
+		case 'C':
+			if (!strncmp(key, "CONNECTOR=", 10))
+				ev->connector_id = strtoul(val, NULL, 10);
+			break;
+		case 'D':
+			if (!strncmp(key, "DEVNAME=", 8))
+				snprintf(ev->devnode, sizeof(ev->devnode), "%s",
+					 val);
+			break;
+		case 'H':
+			if (!strncmp(key, "HOTPLUG=", 8)) ev->hotplug = atoi(val);
+			break;
+		case 'P':
+			if (!strncmp(key, "PROPERTY=", 9))
+				ev->property_id = strtoul(val, NULL, 10);
+			break;
+		case 'S':
+			if (!strncmp(key, "SEQNUM=", 7))
+				ev->seqnum = strtoull(val, NULL, 10);
+			else if (!strncmp(key, "SUBSYSTEM=", 10))
+				/* The hash in the filter may collide */
+				subsystem_ok = !strcmp(val, nl->subsystem);
+			break;
+		default: break;
+		}
+	}
+	return subsystem_ok && ev->devnode[0] ? 0 : -1;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the pending uevents, at most UEVENT_NETLINK_BATCH per call
+ * Messages that are not from udev or do not match the subsystem are
+ * skipped. received_us of the uevents is left to the caller.
+ *
+ * @Param nl The receiver
+ * @Param evs Array of at least UEVENT_NETLINK_BATCH uevents
+ * @Param nr_read Receives the number of messages read, including skipped
+ * ones, so the caller knows when the socket is drained
+ *
+ * @Returns   The number of uevents filled in, -1 if failed. errno is
+ * ENOBUFS if the socket overflowed and uevents were lost, the messages
+ * queued after the overflow can still be read.
+ */
+/* ---------------------------------------------------------------------------*/
+int uevent_netlink_receive(struct uevent_netlink *nl, struct uevent *evs,
+			   int *nr_read)
+{
+	struct msghdr *hdr;
+	int i, n, nr_events = 0;
+
+	*nr_read = 0;
+	for (i = 0; i < UEVENT_NETLINK_BATCH; i++) {
+		hdr = &nl->msgs[i].msg_hdr;
+		hdr->msg_name = &nl->addrs[i];
+		hdr->msg_namelen = sizeof(nl->addrs[i]);
+		hdr->msg_iov = &nl->iov[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_control = nl->cmsgs[i];
+		hdr->msg_controllen = sizeof(nl->cmsgs[i]);
+		hdr->msg_flags = 0;
+	}
+	n = recvmmsg(nl->fd, nl->msgs, UEVENT_NETLINK_BATCH, MSG_DONTWAIT,
+		     NULL);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR) return 0;
+		if (errno == ENOBUFS) return -1;
+		log_error("Failed to receive uevents: %s", strerror(errno));
+		return -1;
+	}
+	*nr_read = n;
+	for (i = 0; i < n; i++) {
+		hdr = &nl->msgs[i].msg_hdr;
+		if (hdr->msg_flags & MSG_TRUNC || !trusted_sender(hdr))
+			continue;
+		if (parse_message(nl, nl->bufs[i], nl->msgs[i].msg_len,
+				  &evs[nr_events]) == 0)
+			nr_events++;
+	}
+	return nr_events;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Close the receiver
+ *
+ * @Param nl The receiver
+ */
+/* ---------------------------------------------------------------------------*/
+void uevent_netlink_close(struct uevent_netlink *nl)
+{
+	if (!nl) return;
+	if (nl->fd >= 0) close(nl->fd);
+	free(nl);
+}
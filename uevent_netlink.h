@@ -0,0 +1,79 @@
+/**
+ * @file uevent_netlink.h
+ * @Brief  Uevent receiver reading the udev netlink group directly
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-04-18
+ *
+ * Alternative to the libudev monitor. A classic BPF filter on the libudev
+ * message header drops uevents of other subsystems in the kernel, so USB
+ * or block uevents never wake the daemon. Messages are drained in batches
+ * with recvmmsg into preallocated buffers and only the keys the daemon
+ * uses are parsed.
+ */
+
+#ifndef _UEVENT_NETLINK_H_
+#define _UEVENT_NETLINK_H_
+
+#include <stdint.h>
+
+#include "uevent.h"
+
+/* Messages read per recvmmsg call */
+#define UEVENT_NETLINK_BATCH 16
+
+struct uevent_netlink;
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Open the udev netlink group filtered on a subsystem
+ *
+ * @Param subsystem The subsystem, e.g. "drm"
+ * @Param rcvbuf Size of the socket receive buffer in bytes, 0 for the
+ * system default
+ *
+ * @Returns   The receiver or NULL if failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct uevent_netlink *uevent_netlink_open(const char *subsystem, int rcvbuf);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Get the socket to poll
+ *
+ * @Param nl The receiver
+ *
+ * @Returns   The file descriptor
+ */
+/* ---------------------------------------------------------------------------*/
+int uevent_netlink_fd(const struct uevent_netlink *nl);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Read the pending uevents, at most UEVENT_NETLINK_BATCH per call
+ * Messages that are not from udev or do not match the subsystem are
+ * skipped. received_us of the uevents is left to the caller.
+ *
+ * @Param nl The receiver
+ * @Param evs Array of at least UEVENT_NETLINK_BATCH uevents
+ * @Param nr_read Receives the number of messages read, including skipped
+ * ones, so the caller knows when the socket is drained
+ *
+ * @Returns   The number of uevents filled in, -1 if failed. errno is
+ * ENOBUFS if the socket overflowed and uevents were lost, the messages
+ * queued after the overflow can still be read.
+ */
+/* ---------------------------------------------------------------------------*/
+int uevent_netlink_receive(struct uevent_netlink *nl, struct uevent *evs,
+			   int *nr_read);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Close the receiver
+ *
+ * @Param nl The receiver
+ */
+/* ---------------------------------------------------------------------------*/
+void uevent_netlink_close(struct uevent_netlink *nl);
+
+#endif
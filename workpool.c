@@ -0,0 +1,159 @@
+/**
+ * @file workpool.c
+ * @Brief  Small fixed size worker thread pool
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-27
+ */
+
+#include "debug.h"
+#include "workpool.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  A queued job
+ */
+/* ---------------------------------------------------------------------------*/
+struct work_job {
+	void (*fn)(void *);
+	void *arg;
+};
+
+static void *worker_thread(void *data)
+{
+	struct workpool *pool = data;
+	struct work_job *job;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->stop && LIST_SIZE(pool->jobs) == 0)
+			pthread_cond_wait(&pool->job_cond, &pool->lock);
+		if (pool->stop) break;
+		list_remove_item(pool->jobs, LIST_HEAD(pool->jobs),
+				 (void **)&job);
+		pthread_mutex_unlock(&pool->lock);
+
+		job->fn(job->arg);
+		free(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a worker pool
+ *
+ * @Param nr_threads Number of worker threads
+ *
+ * @Returns   A newly allocated pool or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct workpool *workpool_create(int nr_threads)
+{
+	struct workpool *pool;
+	int i;
+
+	pool = malloc(sizeof(*pool));
+	if (!pool) {
+		log_error("Failed to allocate worker pool");
+		return NULL;
+	}
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pool->jobs = list_init(free);
+	pool->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!pool->jobs || !pool->threads) {
+		workpool_destroy(pool);
+		return NULL;
+	}
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, worker_thread,
+				   pool) != 0) {
+			log_error("Failed to create worker");
+			workpool_destroy(pool);
+			return NULL;
+		}
+		pool->nr_threads++;
+	}
+	return pool;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Stop the workers and free the pool
+ * Jobs that are still queued are not executed.
+ *
+ * @Param pool The pool
+ */
+/* ---------------------------------------------------------------------------*/
+void workpool_destroy(struct workpool *pool)
+{
+	int i;
+
+	if (!pool) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	if (pool->jobs) list_destroy(pool->jobs);
+	free(pool->threads);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->job_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Queue a job
+ *
+ * @Param pool The pool
+ * @Param fn The function to run on a worker
+ * @Param arg The argument for fn
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int workpool_submit(struct workpool *pool, void (*fn)(void *), void *arg)
+{
+	struct work_job *job = malloc(sizeof(*job));
+	if (!job) return -1;
+	job->fn = fn;
+	job->arg = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	if (list_insert_next(pool->jobs, LIST_TAIL(pool->jobs), job) < 0) {
+		pthread_mutex_unlock(&pool->lock);
+		free(job);
+		return -1;
+	}
+	pool->pending++;
+	pthread_cond_signal(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Wait until all submitted jobs have finished
+ *
+ * @Param pool The pool
+ */
+/* ---------------------------------------------------------------------------*/
+void workpool_wait(struct workpool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
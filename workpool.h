@@ -0,0 +1,79 @@
+/**
+ * @file workpool.h
+ * @Brief  Small fixed size worker thread pool
+ * @author Bram Vlerick
+ * @version 1.0
+ * @date 2017-02-27
+ */
+
+#ifndef _WORKPOOL_H_
+#define _WORKPOOL_H_
+
+#include <pthread.h>
+
+#include "list.h"
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Worker pool structure
+ */
+/* ---------------------------------------------------------------------------*/
+struct workpool {
+	pthread_t *threads;
+	int nr_threads;
+	/* Jobs waiting for a worker, protected by lock */
+	struct dlist *jobs;
+	/* Jobs submitted but not finished yet */
+	int pending;
+	int stop;
+	pthread_mutex_t lock;
+	/* Signalled when a job is queued or the pool stops */
+	pthread_cond_t job_cond;
+	/* Signalled when pending drops to zero */
+	pthread_cond_t done_cond;
+};
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Create a worker pool
+ *
+ * @Param nr_threads Number of worker threads
+ *
+ * @Returns   A newly allocated pool or NULL if it has failed
+ */
+/* ---------------------------------------------------------------------------*/
+struct workpool *workpool_create(int nr_threads);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Stop the workers and free the pool
+ * Jobs that are still queued are not executed.
+ *
+ * @Param pool The pool
+ */
+/* ---------------------------------------------------------------------------*/
+void workpool_destroy(struct workpool *pool);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Queue a job
+ *
+ * @Param pool The pool
+ * @Param fn The function to run on a worker
+ * @Param arg The argument for fn
+ *
+ * @Returns   0 if successfull, -1 if failed
+ */
+/* ---------------------------------------------------------------------------*/
+int workpool_submit(struct workpool *pool, void (*fn)(void *), void *arg);
+
+/* ---------------------------------------------------------------------------*/
+/**
+ * @Brief  Wait until all submitted jobs have finished
+ *
+ * @Param pool The pool
+ */
+/* ---------------------------------------------------------------------------*/
+void workpool_wait(struct workpool *pool);
+
+#endif